@@ -2623,6 +2623,14 @@ public:
 	 */
 	VImage convf(VImage mask, VOption *options = nullptr) const;
 
+	/**
+	 * Fft convolution operation.
+	 * @param mask Input matrix image.
+	 * @param options Set of options.
+	 * @return Output image.
+	 */
+	VImage convfft(VImage mask, VOption *options = nullptr) const;
+
 	/**
 	 * Int convolution operation.
 	 * @param mask Input matrix image.
@@ -699,6 +699,19 @@ VImage::convf(VImage mask, VOption *options) const
 	return out;
 }
 
+VImage
+VImage::convfft(VImage mask, VOption *options) const
+{
+	VImage out;
+
+	call("convfft", (options ? options : VImage::option())
+			->set("in", *this)
+			->set("out", &out)
+			->set("mask", mask));
+
+	return out;
+}
+
 VImage
 VImage::convi(VImage mask, VOption *options) const
 {
@@ -34,6 +34,8 @@
  * 	- rewrite as a class
  * 12/9/14
  * 	- oops, fix complex avg
+ * 19/10/26
+ * 	- use stats attached by vips_stats()
  */
 
 /*
@@ -109,6 +111,18 @@ vips_avg_build(VipsObject *object)
 	return 0;
 }
 
+/* vips_stats() has attached results to our input.
+ */
+static gboolean
+vips_avg_cached(VipsStatistic *statistic, VipsImage *stats, VipsImage *hist)
+{
+	VipsAvg *avg = (VipsAvg *) statistic;
+
+	avg->sum = *VIPS_MATRIX(stats, COL_SUM, 0);
+
+	return TRUE;
+}
+
 /* Start function: allocate space for a double in which we can accumulate the
  * sum for this thread.
  */
@@ -230,6 +244,7 @@ vips_avg_class_init(VipsAvgClass *class)
 	sclass->start = vips_avg_start;
 	sclass->scan = vips_avg_scan;
 	sclass->stop = vips_avg_stop;
+	sclass->cached = vips_avg_cached;
 
 	VIPS_ARG_DOUBLE(class, "out", 2,
 		_("Output"),
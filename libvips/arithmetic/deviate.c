@@ -31,6 +31,8 @@
  * 	- remove liboil
  * 6/11/11
  * 	- rewrite as a class
+ * 19/10/26
+ * 	- use stats attached by vips_stats()
  */
 
 /*
@@ -126,6 +128,20 @@ vips_deviate_build(VipsObject *object)
 	return 0;
 }
 
+/* vips_stats() has attached results to our input.
+ */
+static gboolean
+vips_deviate_cached(VipsStatistic *statistic,
+	VipsImage *stats, VipsImage *hist)
+{
+	VipsDeviate *deviate = (VipsDeviate *) statistic;
+
+	deviate->sum = *VIPS_MATRIX(stats, COL_SUM, 0);
+	deviate->sum2 = *VIPS_MATRIX(stats, COL_SUM2, 0);
+
+	return TRUE;
+}
+
 /* Start function: allocate space for an array in which we can accumulate the
  * sum and sum of squares for this thread.
  */
@@ -232,6 +248,7 @@ vips_deviate_class_init(VipsDeviateClass *class)
 	sclass->start = vips_deviate_start;
 	sclass->scan = vips_deviate_scan;
 	sclass->stop = vips_deviate_stop;
+	sclass->cached = vips_deviate_cached;
 
 	VIPS_ARG_DOUBLE(class, "out", 2,
 		_("Output"),
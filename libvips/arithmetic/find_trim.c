@@ -7,6 +7,9 @@
  * 	- only flatten if there is an alpha
  * 8/2/23
  *	- add @line_art
+ * 19/10/26
+ * 	- walk in from the edges and stop at the first object pixel, unless
+ * 	  the image is sequential
  */
 
 /*
@@ -69,11 +72,197 @@ typedef VipsOperationClass VipsFindTrimClass;
 
 G_DEFINE_TYPE(VipsFindTrim, vips_find_trim, VIPS_TYPE_OPERATION);
 
+/* Probe the mask in strips of this many lines, doubling up to the max.
+ */
+#define VIPS_FIND_TRIM_STRIP (16)
+#define VIPS_FIND_TRIM_STRIP_MAX (256)
+
+/* Walk in from one edge of @extent in the one-band uchar @region, looking
+ * for the first row (or column, if @columns is set) with a set pixel. Search
+ * from the bottom (or right) if @from_end is set.
+ *
+ * Return the number of clear lines before the first set one, or the height
+ * (or width) of @extent if every line is clear. -1 for error.
+ */
+static int
+vips_find_trim_search(VipsRegion *region, VipsRect *extent,
+	gboolean columns, gboolean from_end)
+{
+	int length = columns ? extent->width : extent->height;
+	int strip = VIPS_FIND_TRIM_STRIP;
+
+	int done;
+
+	done = 0;
+	while (done < length) {
+		int n = VIPS_MIN(strip, length - done);
+
+		VipsRect area;
+		int first;
+		int i, x, y;
+
+		/* @n lines, @done lines in from the edge.
+		 */
+		area = *extent;
+		if (columns) {
+			area.left = from_end
+				? VIPS_RECT_RIGHT(extent) - done - n
+				: extent->left + done;
+			area.width = n;
+		}
+		else {
+			area.top = from_end
+				? VIPS_RECT_BOTTOM(extent) - done - n
+				: extent->top + done;
+			area.height = n;
+		}
+
+		if (vips_region_prepare(region, &area))
+			return -1;
+
+		/* The first set line in this strip, counting from the edge.
+		 */
+		first = n;
+		if (columns)
+			for (y = 0; y < area.height && first > 0; y++) {
+				VipsPel *p = VIPS_REGION_ADDR(region,
+					area.left, area.top + y);
+
+				for (i = 0; i < first; i++)
+					if (p[from_end ? n - 1 - i : i]) {
+						first = i;
+						break;
+					}
+			}
+		else
+			for (i = 0; i < n && first == n; i++) {
+				VipsPel *p = VIPS_REGION_ADDR(region,
+					area.left,
+					area.top + (from_end ? n - 1 - i : i));
+
+				for (x = 0; x < area.width; x++)
+					if (p[x]) {
+						first = i;
+						break;
+					}
+			}
+
+		if (first < n)
+			return done + first;
+		done += n;
+
+		/* Margins are often wide, so take bigger steps as we go.
+		 */
+		strip = VIPS_MIN(strip * 2, VIPS_FIND_TRIM_STRIP_MAX);
+	}
+
+	return length;
+}
+
+/* Find the margins by reading in from each edge of the mask. We only compute
+ * the margins, plus a strip, plus the median border.
+ */
+static int
+vips_find_trim_borders(VipsImage *mask,
+	int *left, int *top, int *right, int *bottom)
+{
+	VipsRegion *region;
+	VipsRect extent;
+
+	if (!(region = vips_region_new(mask)))
+		return -1;
+
+	extent.left = 0;
+	extent.top = 0;
+	extent.width = mask->Xsize;
+	extent.height = mask->Ysize;
+	if ((*top = vips_find_trim_search(region, &extent, FALSE, FALSE)) < 0) {
+		g_object_unref(region);
+		return -1;
+	}
+
+	/* All background.
+	 */
+	if (*top == mask->Ysize) {
+		*left = mask->Xsize;
+		*right = mask->Xsize;
+		*bottom = mask->Ysize;
+		g_object_unref(region);
+		return 0;
+	}
+
+	if ((*bottom = vips_find_trim_search(region, &extent,
+			 FALSE, TRUE)) < 0) {
+		g_object_unref(region);
+		return -1;
+	}
+
+	/* The sides only need searching between the top and bottom
+	 * margins.
+	 */
+	extent.top = *top;
+	extent.height = mask->Ysize - *top - *bottom;
+	if ((*left = vips_find_trim_search(region, &extent,
+			 TRUE, FALSE)) < 0 ||
+		(*right = vips_find_trim_search(region, &extent,
+			 TRUE, TRUE)) < 0) {
+		g_object_unref(region);
+		return -1;
+	}
+
+	g_object_unref(region);
+
+	return 0;
+}
+
+/* Find the margins from the row and column sums of the mask. This computes
+ * the whole mask, but in a single pass, so we use it for sequential images.
+ */
+static int
+vips_find_trim_profile(VipsObject *object, VipsImage *mask,
+	int *left, int *top, int *right, int *bottom)
+{
+	VipsImage **t = (VipsImage **) vips_object_local_array(object, 12);
+
+	double d;
+
+	/* t[0] == column sums, t[1] == row sums.
+	 */
+	if (vips_project(mask, &t[0], &t[1], NULL))
+		return -1;
+
+	/* Search column sums in from left.
+	 */
+	if (vips_profile(t[0], &t[2], &t[3], NULL) ||
+		vips_avg(t[3], &d, NULL))
+		return -1;
+	*left = d;
+	if (vips_flip(t[0], &t[4], VIPS_DIRECTION_HORIZONTAL, NULL) ||
+		vips_profile(t[4], &t[5], &t[6], NULL) ||
+		vips_avg(t[6], &d, NULL))
+		return -1;
+	*right = d;
+
+	/* Search row sums in from top.
+	 */
+	if (vips_profile(t[1], &t[7], &t[8], NULL) ||
+		vips_avg(t[7], &d, NULL))
+		return -1;
+	*top = d;
+	if (vips_flip(t[1], &t[9], VIPS_DIRECTION_VERTICAL, NULL) ||
+		vips_profile(t[9], &t[10], &t[11], NULL) ||
+		vips_avg(t[10], &d, NULL))
+		return -1;
+	*bottom = d;
+
+	return 0;
+}
+
 static int
 vips_find_trim_build(VipsObject *object)
 {
 	VipsFindTrim *find_trim = (VipsFindTrim *) object;
-	VipsImage **t = (VipsImage **) vips_object_local_array(object, 20);
+	VipsImage **t = (VipsImage **) vips_object_local_array(object, 6);
 
 	VipsImage *in;
 	double *background;
@@ -81,10 +270,10 @@ vips_find_trim_build(VipsObject *object)
 	double *neg_bg;
 	double *ones;
 	int i;
-	double left;
-	double top;
-	double right;
-	double bottom;
+	int left;
+	int top;
+	int right;
+	int bottom;
 
 	if (VIPS_OBJECT_CLASS(vips_find_trim_parent_class)->build(object))
 		return -1;
@@ -135,36 +324,24 @@ vips_find_trim_build(VipsObject *object)
 		return -1;
 	in = t[5];
 
-	/* t[6] == column sums, t[7] == row sums.
+	/* A sequential image can't be read from the bottom up, so search the
+	 * whole mask in one pass.
 	 */
-	if (vips_project(in, &t[6], &t[7], NULL))
-		return -1;
-
-	/* t[8] == search column sums in from left.
-	 */
-	if (vips_profile(t[6], &t[8], &t[9], NULL) ||
-		vips_avg(t[9], &left, NULL))
-		return -1;
-	if (vips_flip(t[6], &t[10], VIPS_DIRECTION_HORIZONTAL, NULL) ||
-		vips_profile(t[10], &t[11], &t[12], NULL) ||
-		vips_avg(t[12], &right, NULL))
-		return -1;
-
-	/* t[8] == search column sums in from left.
-	 */
-	if (vips_profile(t[7], &t[13], &t[14], NULL) ||
-		vips_avg(t[13], &top, NULL))
-		return -1;
-	if (vips_flip(t[7], &t[15], VIPS_DIRECTION_VERTICAL, NULL) ||
-		vips_profile(t[15], &t[16], &t[17], NULL) ||
-		vips_avg(t[16], &bottom, NULL))
-		return -1;
+	if (vips_image_is_sequential(find_trim->in)) {
+		if (vips_find_trim_profile(object, in,
+				&left, &top, &right, &bottom))
+			return -1;
+	}
+	else {
+		if (vips_find_trim_borders(in, &left, &top, &right, &bottom))
+			return -1;
+	}
 
 	g_object_set(find_trim,
-		"left", (int) left,
-		"top", (int) top,
-		"width", (int) VIPS_MAX(0, (t[6]->Xsize - right) - left),
-		"height", (int) VIPS_MAX(0, (t[7]->Ysize - bottom) - top),
+		"left", left,
+		"top", top,
+		"width", VIPS_MAX(0, (in->Xsize - right) - left),
+		"height", VIPS_MAX(0, (in->Ysize - bottom) - top),
 		NULL);
 
 	return 0;
@@ -260,9 +437,11 @@ vips_find_trim_init(VipsFindTrim *find_trim)
  *
  * Any alpha is flattened out, then the image is median-filtered (unless
  * @line_art is set, see below). The absolute difference from @background is
- * computed and binarized according to @threshold. Row and column sums of
- * the absolute difference are calculated from this binary image and searched
- * for the first row or column in each direction to obtain the bounding box.
+ * computed and binarized according to @threshold. This binary image is
+ * searched in from each edge for the first row or column with an object
+ * pixel to obtain the bounding box. Only the margins are computed, unless
+ * @in is sequential, in which case the whole image is scanned in a single
+ * pass.
  *
  * If the image is entirely background, [method@Image.find_trim] returns
  * @width == 0 and @height == 0.
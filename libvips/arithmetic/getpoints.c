@@ -0,0 +1,414 @@
+/* read many points from an image
+ *
+ * 19/10/26
+ * 	- from getpoint.c
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define VIPS_DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+/* Points are grouped into tiles of this size. Each tile is a unit of work
+ * for the threadpool, so every input pixel is computed at most once per
+ * tile, whatever order the points come in.
+ */
+#define VIPS_GETPOINTS_TILE (128)
+
+typedef struct _VipsGetpoints {
+	VipsOperation parent_instance;
+
+	VipsImage *in;
+	VipsImage *points;
+	VipsInterpolate *interpolate;
+
+	VipsImage *out;
+
+	/* The coordinates, as a memory image of doubles.
+	 */
+	double *xy;
+	int n_points;
+
+	/* Point indexes sorted by tile: the points in tile i are
+	 * order[start[i]] .. order[start[i + 1] - 1].
+	 */
+	int tiles_across;
+	int n_tiles;
+	int *start;
+	int *order;
+
+	/* The next tile to allocate.
+	 */
+	int tile;
+
+	int window_size;
+	int window_offset;
+	VipsInterpolateMethod interpolate_fn;
+} VipsGetpoints;
+
+typedef VipsOperationClass VipsGetpointsClass;
+
+G_DEFINE_TYPE(VipsGetpoints, vips_getpoints, VIPS_TYPE_OPERATION);
+
+/* Per-thread state: the tile this thread is working on.
+ */
+typedef struct _VipsGetpointsThreadState {
+	VipsThreadState parent_object;
+
+	int tile;
+} VipsGetpointsThreadState;
+
+typedef struct _VipsGetpointsThreadStateClass {
+	VipsThreadStateClass parent_class;
+
+} VipsGetpointsThreadStateClass;
+
+G_DEFINE_TYPE(VipsGetpointsThreadState, vips_getpoints_thread_state,
+	VIPS_TYPE_THREAD_STATE);
+
+static void
+vips_getpoints_thread_state_class_init(VipsGetpointsThreadStateClass *class)
+{
+	VipsObjectClass *object_class = VIPS_OBJECT_CLASS(class);
+
+	object_class->nickname = "getpointsthreadstate";
+	object_class->description = _("per-thread state for getpoints");
+}
+
+static void
+vips_getpoints_thread_state_init(VipsGetpointsThreadState *state)
+{
+	state->tile = -1;
+}
+
+static VipsThreadState *
+vips_getpoints_thread_state_new(VipsImage *im, void *a)
+{
+	return VIPS_THREAD_STATE(vips_object_new(
+		vips_getpoints_thread_state_get_type(),
+		vips_thread_state_set, im, a));
+}
+
+static gboolean
+vips_getpoints_inside(VipsGetpoints *getpoints, double x, double y)
+{
+	/* Written to be FALSE for NaN.
+	 */
+	return x >= 0 &&
+		y >= 0 &&
+		x <= getpoints->in->Xsize - 1 &&
+		y <= getpoints->in->Ysize - 1;
+}
+
+/* Counting sort of point indexes by tile.
+ */
+static int
+vips_getpoints_sort(VipsGetpoints *getpoints)
+{
+	const int T = VIPS_GETPOINTS_TILE;
+
+	int *tile;
+	int *fill;
+	int i;
+
+	getpoints->tiles_across = VIPS_ROUND_UP(getpoints->in->Xsize, T) / T;
+	getpoints->n_tiles = getpoints->tiles_across *
+		(VIPS_ROUND_UP(getpoints->in->Ysize, T) / T);
+
+	if (!(getpoints->start =
+				VIPS_ARRAY(getpoints, getpoints->n_tiles + 1, int)) ||
+		!(getpoints->order =
+				VIPS_ARRAY(getpoints, getpoints->n_points, int)) ||
+		!(tile = VIPS_ARRAY(getpoints, getpoints->n_points, int)) ||
+		!(fill = VIPS_ARRAY(getpoints, getpoints->n_tiles, int)))
+		return -1;
+
+	memset(getpoints->start, 0, (getpoints->n_tiles + 1) * sizeof(int));
+	for (i = 0; i < getpoints->n_points; i++) {
+		double x = getpoints->xy[i * 2];
+		double y = getpoints->xy[i * 2 + 1];
+
+		if (vips_getpoints_inside(getpoints, x, y)) {
+			tile[i] = ((int) y / T) * getpoints->tiles_across +
+				(int) x / T;
+			getpoints->start[tile[i] + 1] += 1;
+		}
+		else
+			tile[i] = -1;
+	}
+
+	for (i = 0; i < getpoints->n_tiles; i++) {
+		getpoints->start[i + 1] += getpoints->start[i];
+		fill[i] = getpoints->start[i];
+	}
+
+	for (i = 0; i < getpoints->n_points; i++)
+		if (tile[i] >= 0)
+			getpoints->order[fill[tile[i]]++] = i;
+
+	return 0;
+}
+
+/* Run single-threaded: pick the next tile with some points in.
+ */
+static int
+vips_getpoints_allocate(VipsThreadState *state, void *a, gboolean *stop)
+{
+	VipsGetpointsThreadState *gstate = (VipsGetpointsThreadState *) state;
+	VipsGetpoints *getpoints = (VipsGetpoints *) a;
+	const int T = VIPS_GETPOINTS_TILE;
+
+	VipsRect image;
+	int tile;
+
+	while (getpoints->tile < getpoints->n_tiles &&
+		getpoints->start[getpoints->tile] ==
+			getpoints->start[getpoints->tile + 1])
+		getpoints->tile += 1;
+
+	if (getpoints->tile >= getpoints->n_tiles) {
+		*stop = TRUE;
+		return 0;
+	}
+
+	tile = getpoints->tile++;
+
+	/* The input has been embedded by window_offset + 1, so a point at x
+	 * needs embedded pixels from floor(x) + 1 to floor(x) + window_size.
+	 */
+	gstate->tile = tile;
+	state->pos.left = (tile % getpoints->tiles_across) * T + 1;
+	state->pos.top = (tile / getpoints->tiles_across) * T + 1;
+	state->pos.width = T + getpoints->window_size - 1;
+	state->pos.height = T + getpoints->window_size - 1;
+
+	image.left = 0;
+	image.top = 0;
+	image.width = state->im->Xsize;
+	image.height = state->im->Ysize;
+	vips_rect_intersectrect(&state->pos, &image, &state->pos);
+
+	return 0;
+}
+
+static int
+vips_getpoints_work(VipsThreadState *state, void *a)
+{
+	VipsGetpointsThreadState *gstate = (VipsGetpointsThreadState *) state;
+	VipsGetpoints *getpoints = (VipsGetpoints *) a;
+	const int bands = getpoints->out->Bands;
+	const int offset = getpoints->window_offset + 1;
+	const int *order = getpoints->order;
+
+	int i;
+
+	if (vips_region_prepare(state->reg, &state->pos))
+		return -1;
+
+	for (i = getpoints->start[gstate->tile];
+		 i < getpoints->start[gstate->tile + 1]; i++) {
+		int n = order[i];
+		double x = getpoints->xy[n * 2];
+		double y = getpoints->xy[n * 2 + 1];
+		double *q = (double *) getpoints->out->data + n * bands;
+
+		getpoints->interpolate_fn(getpoints->interpolate,
+			q, state->reg, x + offset, y + offset);
+	}
+
+	return 0;
+}
+
+static int
+vips_getpoints_build(VipsObject *object)
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(object);
+	VipsGetpoints *getpoints = (VipsGetpoints *) object;
+	VipsImage **t = (VipsImage **) vips_object_local_array(object, 5);
+
+	VipsImage *in;
+
+	if (VIPS_OBJECT_CLASS(vips_getpoints_parent_class)->build(object))
+		return -1;
+
+	if (vips_check_noncomplex(class->nickname, getpoints->in) ||
+		vips_check_bands(class->nickname, getpoints->points, 2))
+		return -1;
+
+	/* Coordinates to a memory array of doubles.
+	 */
+	if (vips_cast(getpoints->points, &t[0], VIPS_FORMAT_DOUBLE, NULL) ||
+		!(t[1] = vips_image_copy_memory(t[0])))
+		return -1;
+	getpoints->xy = (double *) t[1]->data;
+	getpoints->n_points = t[1]->Xsize * t[1]->Ysize;
+
+	getpoints->window_size =
+		vips_interpolate_get_window_size(getpoints->interpolate);
+	getpoints->window_offset =
+		vips_interpolate_get_window_offset(getpoints->interpolate);
+	getpoints->interpolate_fn =
+		vips_interpolate_get_method(getpoints->interpolate);
+
+	/* Decode and unpack to double, then add pixels around the edges for
+	 * the interpolator, as mapim does.
+	 */
+	if (vips_image_decode(getpoints->in, &t[2]) ||
+		vips_cast(t[2], &t[3], VIPS_FORMAT_DOUBLE, NULL) ||
+		vips_embed(t[3], &t[4],
+			getpoints->window_offset + 1, getpoints->window_offset + 1,
+			t[3]->Xsize + getpoints->window_size - 1 + 2,
+			t[3]->Ysize + getpoints->window_size - 1 + 2,
+			"extend", VIPS_EXTEND_COPY,
+			NULL))
+		return -1;
+	in = t[4];
+	vips_image_set_int(in, "hide-progress", 1);
+
+	g_object_set(object, "out", vips_image_new_memory(), NULL);
+	vips_image_init_fields(getpoints->out,
+		t[1]->Xsize, t[1]->Ysize, in->Bands,
+		VIPS_FORMAT_DOUBLE,
+		VIPS_CODING_NONE, VIPS_INTERPRETATION_MULTIBAND, 1.0, 1.0);
+	if (vips_image_write_prepare(getpoints->out))
+		return -1;
+	memset(getpoints->out->data, 0, VIPS_IMAGE_SIZEOF_IMAGE(getpoints->out));
+
+	if (vips_getpoints_sort(getpoints))
+		return -1;
+
+	if (vips_threadpool_run(in,
+			vips_getpoints_thread_state_new,
+			vips_getpoints_allocate,
+			vips_getpoints_work,
+			NULL,
+			getpoints))
+		return -1;
+
+	return 0;
+}
+
+static void
+vips_getpoints_class_init(VipsGetpointsClass *class)
+{
+	GObjectClass *gobject_class = (GObjectClass *) class;
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "getpoints";
+	object_class->description = _("read many points from an image");
+	object_class->build = vips_getpoints_build;
+
+	VIPS_ARG_IMAGE(class, "in", 1,
+		_("Input"),
+		_("Input image"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsGetpoints, in));
+
+	VIPS_ARG_IMAGE(class, "points", 2,
+		_("Points"),
+		_("Two-band image of x, y coordinates to read"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsGetpoints, points));
+
+	VIPS_ARG_IMAGE(class, "out", 3,
+		_("Output"),
+		_("Pixel values at each point"),
+		VIPS_ARGUMENT_REQUIRED_OUTPUT,
+		G_STRUCT_OFFSET(VipsGetpoints, out));
+
+	VIPS_ARG_INTERPOLATE(class, "interpolate", 4,
+		_("Interpolate"),
+		_("Interpolate pixels with this"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsGetpoints, interpolate));
+}
+
+static void
+vips_getpoints_init(VipsGetpoints *getpoints)
+{
+	getpoints->interpolate = vips_interpolate_new("nearest");
+}
+
+/**
+ * vips_getpoints: (method)
+ * @in: image to read from
+ * @points: two-band image of x, y coordinates
+ * @out: (out): output pixel values
+ * @...: `NULL`-terminated list of optional named arguments
+ *
+ * Read many pixels from an image in a single pass.
+ *
+ * @points is a two-band image holding x, y coordinates, for example a
+ * one-pixel-high image with a pixel for each point. @out is a double image
+ * the same size as @points with a band for each band in @in, holding the
+ * pixel value at each coordinate.
+ *
+ * The points are grouped by image tile and the tiles are computed in
+ * parallel, so each area of @in is only calculated once. This is much
+ * faster than calling [method@Image.getpoint] many times.
+ *
+ * Coordinates can be fractional. Pixels are read with @interpolate, which
+ * defaults to nearest. Points which fall outside @in are set to zero.
+ *
+ * ::: tip "Optional arguments"
+ *     * @interpolate: [class@Interpolate], interpolate pixels with this
+ *
+ * ::: seealso
+ *     [method@Image.getpoint], [method@Image.mapim].
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_getpoints(VipsImage *in, VipsImage *points, VipsImage **out, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, out);
+	result = vips_call_split("getpoints", ap, in, points, out);
+	va_end(ap);
+
+	return result;
+}
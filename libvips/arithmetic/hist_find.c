@@ -28,6 +28,9 @@
  * 	- unroll common cases
  * 1/2/21 erdmann
  * 	- use double for very large histograms
+ * 19/10/26
+ * 	- use a histogram attached by vips_stats()
+ * 	- spread uchar images over several copies of the bins
  */
 
 /*
@@ -68,12 +71,19 @@
 
 #include "statistic.h"
 
+/* uchar images are spread over this many copies of the bins in each thread.
+ * Consecutive pixels go to different copies, so a run of equal pixels
+ * doesn't make each increment wait for the one before.
+ */
+#define VIPS_HIST_FIND_COPIES (4)
+
 /* Accumulate a histogram in one of these.
  */
 typedef struct {
 	int n_bands;	/* Number of bands in output */
 	int band;		/* If one band in out, which band of input */
 	int size;		/* Number of bins for each band */
+	int copies;		/* Number of copies of the bins */
 	int mx;			/* Maximum value we have seen */
 	VipsPel **bins; /* double or uint bins */
 } Histogram;
@@ -107,11 +117,12 @@ G_DEFINE_TYPE(VipsHistFind, vips_hist_find, VIPS_TYPE_STATISTIC);
 /* Build a Histogram.
  */
 static Histogram *
-histogram_new(VipsHistFind *hist_find, int n_bands, int band, int size)
+histogram_new(VipsHistFind *hist_find,
+	int n_bands, int band, int size, int copies)
 {
 	/* We won't use all of this for uint accumulators.
 	 */
-	int n_bytes = size * sizeof(double);
+	int n_bytes = size * copies * sizeof(double);
 
 	Histogram *hist;
 	int i;
@@ -130,6 +141,7 @@ histogram_new(VipsHistFind *hist_find, int n_bands, int band, int size)
 	hist->n_bands = n_bands;
 	hist->band = band;
 	hist->size = size;
+	hist->copies = copies;
 	hist->mx = 0;
 
 	return hist;
@@ -208,6 +220,58 @@ vips_hist_find_build(VipsObject *object)
 	return 0;
 }
 
+/* vips_stats() has attached results to our input, perhaps with a histogram
+ * of all bands.
+ */
+static gboolean
+vips_hist_find_cached(VipsStatistic *statistic,
+	VipsImage *stats, VipsImage *hist)
+{
+	VipsHistFind *hist_find = (VipsHistFind *) statistic;
+	VipsImage *in = statistic->in;
+
+	int i, j;
+
+	if (!hist ||
+		hist_find->band != -1 ||
+		hist->Bands != in->Bands ||
+		hist->BandFmt !=
+			(hist_find->large ? VIPS_FORMAT_DOUBLE : VIPS_FORMAT_UINT) ||
+		vips_image_wio_input(hist))
+		return FALSE;
+
+	/* char and uchar are cast to uchar, so we have 256 bins.
+	 */
+	if (!(hist_find->hist = histogram_new(hist_find,
+			  in->Bands, -1,
+			  in->BandFmt == VIPS_FORMAT_UCHAR ||
+					  in->BandFmt == VIPS_FORMAT_CHAR
+				  ? 256
+				  : 65536,
+			  1)))
+		return FALSE;
+	hist_find->hist->mx = hist->Xsize - 1;
+
+#define UNINTERLEAVE(TYPE) \
+	G_STMT_START \
+	{ \
+		TYPE **bins = (TYPE **) hist_find->hist->bins; \
+		TYPE *p = (TYPE *) VIPS_IMAGE_ADDR(hist, 0, 0); \
+\
+		for (j = 0; j < hist->Xsize; j++) \
+			for (i = 0; i < hist->Bands; i++) \
+				bins[i][j] = *p++; \
+	} \
+	G_STMT_END
+
+	if (hist_find->large)
+		UNINTERLEAVE(double);
+	else
+		UNINTERLEAVE(unsigned int);
+
+	return TRUE;
+}
+
 /* Build a sub-hist, based on the main hist.
  */
 static void *
@@ -223,12 +287,17 @@ vips_hist_find_start(VipsStatistic *statistic)
 			hist_find->band,
 			statistic->ready->BandFmt == VIPS_FORMAT_UCHAR
 				? 256
-				: 65536);
+				: 65536,
+			1);
 
+	/* Several copies of the bins are only worth it for uchar. For
+	 * ushort they would no longer fit in L1.
+	 */
 	return (void *) histogram_new(hist_find,
 		hist_find->hist->n_bands,
 		hist_find->hist->band,
-		hist_find->hist->size);
+		hist_find->hist->size,
+		hist_find->hist->size == 256 ? VIPS_HIST_FIND_COPIES : 1);
 }
 
 /* Join a sub-hist onto the main hist.
@@ -240,7 +309,7 @@ vips_hist_find_stop(VipsStatistic *statistic, void *seq)
 	VipsHistFind *hist_find = (VipsHistFind *) statistic;
 	Histogram *hist = hist_find->hist;
 
-	int i, j;
+	int i, j, c;
 
 	g_assert(sub_hist->n_bands == hist->n_bands &&
 		sub_hist->size == hist->size);
@@ -256,8 +325,10 @@ vips_hist_find_stop(VipsStatistic *statistic, void *seq)
 		TYPE **sub_bins = (TYPE **) sub_hist->bins; \
 \
 		for (i = 0; i < hist->n_bands; i++) \
-			for (j = 0; j < hist->size; j++) \
-				main_bins[i][j] += sub_bins[i][j]; \
+			for (c = 0; c < sub_hist->copies; c++) \
+				for (j = 0; j < hist->size; j++) \
+					main_bins[i][j] += \
+						sub_bins[i][c * hist->size + j]; \
 	} \
 	G_STMT_END
 
@@ -291,18 +362,71 @@ vips_hist_find_stop(VipsStatistic *statistic, void *seq)
 	} \
 	G_STMT_END
 
-/* No need to track max for uchar images (it's always 255).
+/* Hist of all bands of a uchar image, four pixels at a time, each to its own
+ * copy of the bins.
  */
-#define UCSCANOP \
+#define UCSCAN(HIST_TYPE) \
 	G_STMT_START \
 	{ \
-		for (z = 0; z < nb; z++) { \
-			int v = p[z]; \
+		HIST_TYPE **bins = (HIST_TYPE **) hist->bins; \
+		unsigned char *p = (unsigned char *) in; \
 \
-			bins[z][v] += 1; \
+		int z; \
+\
+		for (i = 0; i + 4 <= n; i += 4) { \
+			for (z = 0; z < nb; z++) { \
+				HIST_TYPE *b = bins[z]; \
+\
+				b[p[z]] += 1; \
+				b[256 + p[nb + z]] += 1; \
+				b[512 + p[2 * nb + z]] += 1; \
+				b[768 + p[3 * nb + z]] += 1; \
+			} \
+\
+			p += 4 * nb; \
 		} \
 \
-		p += nb; \
+		for (; i < n; i++) { \
+			for (z = 0; z < nb; z++) \
+				bins[z][p[z]] += 1; \
+\
+			p += nb; \
+		} \
+	} \
+	G_STMT_END
+
+/* Hist of selected band of a uchar image, as above.
+ */
+#define UCSCAN1(HIST_TYPE) \
+	G_STMT_START \
+	{ \
+		HIST_TYPE *bins = (HIST_TYPE *) hist->bins[0]; \
+		unsigned char *p = (unsigned char *) in + hist->band; \
+\
+		for (i = 0; i + 4 <= n; i += 4) { \
+			int v0 = p[0]; \
+			int v1 = p[nb]; \
+			int v2 = p[2 * nb]; \
+			int v3 = p[3 * nb]; \
+\
+			mx = VIPS_MAX(mx, \
+				VIPS_MAX(VIPS_MAX(v0, v1), VIPS_MAX(v2, v3))); \
+\
+			bins[v0] += 1; \
+			bins[256 + v1] += 1; \
+			bins[512 + v2] += 1; \
+			bins[768 + v3] += 1; \
+\
+			p += 4 * nb; \
+		} \
+\
+		for (; i < n; i++) { \
+			int v = p[0]; \
+\
+			mx = VIPS_MAX(mx, v); \
+			bins[v] += 1; \
+			p += nb; \
+		} \
 	} \
 	G_STMT_END
 
@@ -355,9 +479,9 @@ vips_hist_find_scan(VipsStatistic *statistic, void *seq,
 		switch (statistic->ready->BandFmt) {
 		case VIPS_FORMAT_UCHAR:
 			if (hist_find->large)
-				SCAN(unsigned char, double, UCSCANOP);
+				UCSCAN(double);
 			else
-				SCAN(unsigned char, unsigned int, UCSCANOP);
+				UCSCAN(unsigned int);
 			mx = 255;
 			break;
 
@@ -375,9 +499,9 @@ vips_hist_find_scan(VipsStatistic *statistic, void *seq,
 		switch (statistic->ready->BandFmt) {
 		case VIPS_FORMAT_UCHAR:
 			if (hist_find->large)
-				SCAN1(unsigned char, double);
+				UCSCAN1(double);
 			else
-				SCAN1(unsigned char, unsigned int);
+				UCSCAN1(unsigned int);
 			break;
 
 		case VIPS_FORMAT_USHORT:
@@ -425,6 +549,7 @@ vips_hist_find_class_init(VipsHistFindClass *class)
 	sclass->start = vips_hist_find_start;
 	sclass->scan = vips_hist_find_scan;
 	sclass->stop = vips_hist_find_stop;
+	sclass->cached = vips_hist_find_cached;
 	sclass->format_table = vips_hist_find_format_table;
 
 	VIPS_ARG_IMAGE(class, "out", 100,
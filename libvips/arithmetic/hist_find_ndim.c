@@ -10,6 +10,9 @@
  * 	- redo as a class
  * 28/1/22 travisbell
  * 	- better arg checking
+ * 19/10/26
+ * 	- flat bin array, and a lookup table for the bin index
+ * 	- sparse per-thread histograms for large bin counts
  */
 
 /*
@@ -54,12 +57,29 @@
 
 struct _VipsHistFindNDim;
 
+/* Per-thread histograms with more than this many bins are sparse.
+ */
+#define VIPS_HIST_FIND_NDIM_SPARSE (1 << 20)
+
 /* Accumulate a histogram in one of these.
+ *
+ * Dense histograms are a flat array of bins, x varying fastest. Sparse
+ * histograms are an open-addressed hash table of (bin + 1, count) pairs,
+ * with a zero key for an empty slot.
  */
 typedef struct {
 	struct _VipsHistFindNDim *ndim;
 
-	unsigned int ***data;
+	unsigned int *data;
+
+	guint64 *keys;
+	unsigned int *counts;
+	gsize n_slots;
+	gsize n_used;
+
+	/* The slot we used last, since runs of equal pixels are common.
+	 */
+	gsize last;
 } Histogram;
 
 typedef struct _VipsHistFindNDim {
@@ -73,6 +93,14 @@ typedef struct _VipsHistFindNDim {
 	 */
 	int max_val;
 
+	/* Total number of bins.
+	 */
+	guint64 n_bins;
+
+	/* Pixel value to bin index.
+	 */
+	int *lut;
+
 	/* Main image histogram. Subhists accumulate to this.
 	 */
 	Histogram *hist;
@@ -87,48 +115,124 @@ typedef VipsStatisticClass VipsHistFindNDimClass;
 
 G_DEFINE_TYPE(VipsHistFindNDim, vips_hist_find_ndim, VIPS_TYPE_STATISTIC);
 
+static void
+histogram_free(Histogram *hist)
+{
+	VIPS_FREE(hist->data);
+	VIPS_FREE(hist->keys);
+	VIPS_FREE(hist->counts);
+	g_free(hist);
+}
+
 /* Build a Histogram.
  */
 static Histogram *
-histogram_new(VipsHistFindNDim *ndim)
+histogram_new(VipsHistFindNDim *ndim, gboolean sparse)
 {
-	VipsImage *in = VIPS_STATISTIC(ndim)->ready;
-	int bins = ndim->bins;
-
-	/* How many dimensions do we need to allocate?
-	 */
-	int ilimit = in->Bands > 2 ? bins : 1;
-	int jlimit = in->Bands > 1 ? bins : 1;
-
-	int i, j;
 	Histogram *hist;
 
-	if (!(hist = VIPS_NEW(ndim, Histogram)))
-		return NULL;
-
+	hist = g_new0(Histogram, 1);
 	hist->ndim = ndim;
 
-	if (!(hist->data = VIPS_ARRAY(ndim, bins, unsigned int **)))
+	if (sparse) {
+		hist->n_slots = 1024;
+		hist->keys = g_try_new0(guint64, hist->n_slots);
+		hist->counts = g_try_new0(unsigned int, hist->n_slots);
+	}
+	else
+		hist->data = g_try_new0(unsigned int, ndim->n_bins);
+
+	if (!hist->data &&
+		!(hist->keys && hist->counts)) {
+		vips_error(VIPS_OBJECT_GET_CLASS(ndim)->nickname,
+			"%s", _("out of memory"));
+		histogram_free(hist);
 		return NULL;
-	memset(hist->data, 0, bins * sizeof(unsigned int **));
-
-	for (i = 0; i < ilimit; i++) {
-		if (!(hist->data[i] =
-					VIPS_ARRAY(ndim, bins, unsigned int *)))
-			return NULL;
-		memset(hist->data[i], 0, bins * sizeof(unsigned int *));
-		for (j = 0; j < jlimit; j++) {
-			if (!(hist->data[i][j] =
-						VIPS_ARRAY(ndim, bins, unsigned int)))
-				return NULL;
-			memset(hist->data[i][j],
-				0, bins * sizeof(unsigned int));
-		}
 	}
 
 	return hist;
 }
 
+static guint64
+histogram_hash(guint64 key)
+{
+	/* Fibonacci hashing, take the top bits.
+	 */
+	return (key * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15)) >> 32;
+}
+
+/* Double the size of a sparse hist.
+ */
+static void
+histogram_grow(Histogram *hist)
+{
+	gsize n_slots = hist->n_slots * 2;
+	gsize mask = n_slots - 1;
+	guint64 *keys = g_new0(guint64, n_slots);
+	unsigned int *counts = g_new0(unsigned int, n_slots);
+
+	gsize i, j;
+
+	for (i = 0; i < hist->n_slots; i++)
+		if (hist->keys[i]) {
+			for (j = histogram_hash(hist->keys[i]) & mask;
+				 keys[j];
+				 j = (j + 1) & mask)
+				;
+
+			keys[j] = hist->keys[i];
+			counts[j] = hist->counts[i];
+		}
+
+	g_free(hist->keys);
+	g_free(hist->counts);
+	hist->keys = keys;
+	hist->counts = counts;
+	hist->n_slots = n_slots;
+	hist->last = 0;
+}
+
+static void
+histogram_sparse_add(Histogram *hist, guint64 bin)
+{
+	guint64 key = bin + 1;
+	gsize mask = hist->n_slots - 1;
+
+	gsize i;
+
+	if (hist->keys[hist->last] == key) {
+		hist->counts[hist->last] += 1;
+		return;
+	}
+
+	for (i = histogram_hash(key) & mask; hist->keys[i]; i = (i + 1) & mask)
+		if (hist->keys[i] == key) {
+			hist->counts[i] += 1;
+			hist->last = i;
+			return;
+		}
+
+	hist->keys[i] = key;
+	hist->counts[i] = 1;
+	hist->last = i;
+	hist->n_used += 1;
+
+	/* Keep the load factor under a half.
+	 */
+	if (hist->n_used * 2 > hist->n_slots)
+		histogram_grow(hist);
+}
+
+static void
+vips_hist_find_ndim_dispose(GObject *gobject)
+{
+	VipsHistFindNDim *ndim = (VipsHistFindNDim *) gobject;
+
+	VIPS_FREEF(histogram_free, ndim->hist);
+
+	G_OBJECT_CLASS(vips_hist_find_ndim_parent_class)->dispose(gobject);
+}
+
 static int
 vips_hist_find_ndim_build(VipsObject *object)
 {
@@ -136,6 +240,7 @@ vips_hist_find_ndim_build(VipsObject *object)
 	VipsHistFindNDim *ndim = (VipsHistFindNDim *) object;
 
 	unsigned int *obuffer;
+	guint64 plane;
 	int y, i, x, z;
 
 	g_object_set(object,
@@ -145,6 +250,8 @@ vips_hist_find_ndim_build(VipsObject *object)
 	if (statistic->in) {
 		VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(ndim);
 
+		double scale;
+
 		if (statistic->in->Bands > 3) {
 			vips_error(class->nickname,
 				"%s", _("image is not 1 - 3 bands"));
@@ -159,6 +266,18 @@ vips_hist_find_ndim_build(VipsObject *object)
 				_("bins out of range [1,%d]"), ndim->max_val);
 			return -1;
 		}
+
+		ndim->n_bins = 1;
+		for (i = 0; i < statistic->in->Bands; i++)
+			ndim->n_bins *= ndim->bins;
+
+		/* Divide once per pixel value, not once per pixel.
+		 */
+		if (!(ndim->lut = VIPS_ARRAY(object, ndim->max_val, int)))
+			return -1;
+		scale = (double) (ndim->max_val + 1) / ndim->bins;
+		for (i = 0; i < ndim->max_val; i++)
+			ndim->lut[i] = i / scale;
 	}
 
 	/* main hist made on first thread start.
@@ -181,10 +300,15 @@ vips_hist_find_ndim_build(VipsObject *object)
 			  VIPS_IMAGE_N_ELEMENTS(ndim->out), unsigned int)))
 		return -1;
 
+	/* The third axis becomes bands.
+	 */
+	plane = (guint64) ndim->out->Xsize * ndim->out->Ysize;
 	for (y = 0; y < ndim->out->Ysize; y++) {
+		unsigned int *row = ndim->hist->data + y * ndim->out->Xsize;
+
 		for (i = 0, x = 0; x < ndim->out->Xsize; x++)
 			for (z = 0; z < ndim->out->Bands; z++, i++)
-				obuffer[i] = ndim->hist->data[z][y][x];
+				obuffer[i] = row[z * plane + x];
 
 		if (vips_image_write_line(ndim->out, y, (VipsPel *) obuffer))
 			return -1;
@@ -200,10 +324,15 @@ vips_hist_find_ndim_start(VipsStatistic *statistic)
 
 	/* Make the main hist, if necessary.
 	 */
-	if (!ndim->hist)
-		ndim->hist = histogram_new(ndim);
+	if (!ndim->hist &&
+		!(ndim->hist = histogram_new(ndim, FALSE)))
+		return NULL;
 
-	return (void *) histogram_new(ndim);
+	/* Large per-thread hists are mostly empty, and would blow the cache
+	 * and the memory budget.
+	 */
+	return (void *) histogram_new(ndim,
+		ndim->n_bins > VIPS_HIST_FIND_NDIM_SPARSE);
 }
 
 /* Join a sub-hist onto the main hist.
@@ -215,20 +344,18 @@ vips_hist_find_ndim_stop(VipsStatistic *statistic, void *seq)
 	VipsHistFindNDim *ndim = (VipsHistFindNDim *) statistic;
 	Histogram *hist = ndim->hist;
 
-	int i, j, k;
+	gsize i;
 
-	for (i = 0; i < ndim->bins; i++)
-		for (j = 0; j < ndim->bins; j++)
-			for (k = 0; k < ndim->bins; k++)
-				if (hist->data[i] && hist->data[i][j]) {
-					hist->data[i][j][k] +=
-						sub_hist->data[i][j][k];
+	if (sub_hist->data)
+		for (i = 0; i < ndim->n_bins; i++)
+			hist->data[i] += sub_hist->data[i];
+	else
+		for (i = 0; i < sub_hist->n_slots; i++)
+			if (sub_hist->keys[i])
+				hist->data[sub_hist->keys[i] - 1] +=
+					sub_hist->counts[i];
 
-					/* Zap sub-hist to make sure we
-					 * can't add it again.
-					 */
-					sub_hist->data[i][j][k] = 0;
-				}
+	histogram_free(sub_hist);
 
 	return 0;
 }
@@ -237,11 +364,21 @@ vips_hist_find_ndim_stop(VipsStatistic *statistic, void *seq)
 	{ \
 		TYPE *p = (TYPE *) in; \
 \
-		for (i = 0, j = 0; j < n; j++) { \
-			for (k = 0; k < nb; k++, i++) \
-				index[k] = p[i] / scale; \
+		for (j = 0; j < n; j++) { \
+			guint64 bin; \
+\
+			bin = lut[p[0]]; \
+			if (nb > 1) \
+				bin += (guint64) lut[p[1]] * bins; \
+			if (nb > 2) \
+				bin += (guint64) lut[p[2]] * bins * bins; \
 \
-			hist->data[index[2]][index[1]][index[0]] += 1; \
+			if (hist->data) \
+				hist->data[bin] += 1; \
+			else \
+				histogram_sparse_add(hist, bin); \
+\
+			p += nb; \
 		} \
 	}
 
@@ -253,13 +390,10 @@ vips_hist_find_ndim_scan(VipsStatistic *statistic, void *seq,
 	VipsHistFindNDim *ndim = (VipsHistFindNDim *) statistic;
 	VipsImage *im = statistic->ready;
 	int nb = im->Bands;
-	double scale = (double) (ndim->max_val + 1) / ndim->bins;
-	int i, j, k;
-	int index[3];
+	int bins = ndim->bins;
+	int *lut = ndim->lut;
 
-	/* Fill these with dimensions, backwards.
-	 */
-	index[0] = index[1] = index[2] = 0;
+	int j;
 
 	switch (im->BandFmt) {
 	case VIPS_FORMAT_UCHAR:
@@ -297,6 +431,7 @@ vips_hist_find_ndim_class_init(VipsHistFindNDimClass *class)
 	VipsObjectClass *object_class = (VipsObjectClass *) class;
 	VipsStatisticClass *sclass = VIPS_STATISTIC_CLASS(class);
 
+	gobject_class->dispose = vips_hist_find_ndim_dispose;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
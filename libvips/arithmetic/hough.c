@@ -2,6 +2,8 @@
  *
  * 7/3/14
  * 	- from hist_find.c
+ * 19/10/26
+ * 	- sparse thread accumulators for large parameter spaces
  */
 
 /*
@@ -39,12 +41,26 @@
 #include <string.h>
 
 #include <vips/vips.h>
+#include <vips/internal.h>
 
 #include "statistic.h"
 #include "hough.h"
 
 G_DEFINE_ABSTRACT_TYPE(VipsHough, vips_hough, VIPS_TYPE_STATISTIC);
 
+static void
+vips_hough_finalize(GObject *gobject)
+{
+	VipsHough *hough = (VipsHough *) gobject;
+
+	int i;
+
+	for (i = 0; i < VIPS_HOUGH_SHARDS; i++)
+		g_mutex_clear(&hough->lock[i]);
+
+	G_OBJECT_CLASS(vips_hough_parent_class)->finalize(gobject);
+}
+
 static VipsImage *
 vips_hough_new_accumulator(VipsHough *hough)
 {
@@ -88,12 +104,69 @@ vips_hough_build(VipsObject *object)
 		"out", out,
 		NULL);
 
+	/* A dense accumulator per thread would need too much memory.
+	 */
+	if (VIPS_IMAGE_SIZEOF_IMAGE(out) > VIPS_HOUGH_DENSE_MAX) {
+		gsize n_elements = VIPS_IMAGE_N_PELS(out) * out->Bands;
+
+		hough->sparse = TRUE;
+		hough->shard_size = VIPS_MAX(1,
+			(n_elements + VIPS_HOUGH_SHARDS - 1) / VIPS_HOUGH_SHARDS);
+	}
+
 	if (VIPS_OBJECT_CLASS(vips_hough_parent_class)->build(object))
 		return -1;
 
 	return 0;
 }
 
+/* Add the buffered votes in a sparse accumulator to the output. Group them
+ * by shard first, so we take each lock once.
+ */
+void
+vips__hough_flush(VipsHoughAccumulator *accumulator)
+{
+	VipsHough *hough = accumulator->hough;
+	guint *data = (guint *) hough->out->data;
+
+	int start[VIPS_HOUGH_SHARDS + 1];
+	int end[VIPS_HOUGH_SHARDS];
+	int i, s;
+
+	memset(start, 0, sizeof(start));
+	for (i = 0; i < accumulator->n_votes; i++)
+		start[accumulator->votes[i] / hough->shard_size + 1] += 1;
+	for (s = 0; s < VIPS_HOUGH_SHARDS; s++) {
+		start[s + 1] += start[s];
+		end[s] = start[s];
+	}
+
+	for (i = 0; i < accumulator->n_votes; i++) {
+		gsize index = accumulator->votes[i];
+
+		accumulator->sorted[end[index / hough->shard_size]++] = index;
+	}
+
+	for (s = 0; s < VIPS_HOUGH_SHARDS; s++)
+		if (end[s] > start[s]) {
+			vips__worker_lock(&hough->lock[s]);
+			for (i = start[s]; i < end[s]; i++)
+				data[accumulator->sorted[i]] += 1;
+			g_mutex_unlock(&hough->lock[s]);
+		}
+
+	accumulator->n_votes = 0;
+}
+
+static void
+vips_hough_accumulator_free(VipsHoughAccumulator *accumulator)
+{
+	VIPS_UNREF(accumulator->image);
+	VIPS_FREE(accumulator->votes);
+	VIPS_FREE(accumulator->sorted);
+	g_free(accumulator);
+}
+
 /* Build a new accumulator.
  */
 static void *
@@ -101,10 +174,22 @@ vips_hough_start(VipsStatistic *statistic)
 {
 	VipsHough *hough = (VipsHough *) statistic;
 
-	VipsImage *accumulator;
+	VipsHoughAccumulator *accumulator;
 
-	if (!(accumulator = vips_hough_new_accumulator(hough)))
-		return NULL;
+	accumulator = g_new0(VipsHoughAccumulator, 1);
+	accumulator->hough = hough;
+
+	if (hough->sparse) {
+		accumulator->votes = g_new(gsize, VIPS_HOUGH_VOTES);
+		accumulator->sorted = g_new(gsize, VIPS_HOUGH_VOTES);
+	}
+	else {
+		if (!(accumulator->image = vips_hough_new_accumulator(hough))) {
+			vips_hough_accumulator_free(accumulator);
+			return NULL;
+		}
+		accumulator->data = (guint *) accumulator->image->data;
+	}
 
 	return (void *) accumulator;
 }
@@ -114,17 +199,21 @@ vips_hough_start(VipsStatistic *statistic)
 static int
 vips_hough_stop(VipsStatistic *statistic, void *seq)
 {
-	VipsImage *accumulator = (VipsImage *) seq;
+	VipsHoughAccumulator *accumulator = (VipsHoughAccumulator *) seq;
 	VipsHough *hough = (VipsHough *) statistic;
 
-	if (vips_draw_image(hough->out, accumulator, 0, 0,
-			"mode", VIPS_COMBINE_MODE_ADD,
-			NULL)) {
-		g_object_unref(accumulator);
-		return -1;
+	if (accumulator->image) {
+		if (vips_draw_image(hough->out, accumulator->image, 0, 0,
+				"mode", VIPS_COMBINE_MODE_ADD,
+				NULL)) {
+			vips_hough_accumulator_free(accumulator);
+			return -1;
+		}
 	}
+	else
+		vips__hough_flush(accumulator);
 
-	g_object_unref(accumulator);
+	vips_hough_accumulator_free(accumulator);
 
 	return 0;
 }
@@ -135,7 +224,7 @@ vips_hough_scan(VipsStatistic *statistic,
 {
 	VipsHough *hough = (VipsHough *) statistic;
 	VipsHoughClass *class = VIPS_HOUGH_GET_CLASS(hough);
-	VipsImage *accumulator = (VipsImage *) seq;
+	VipsHoughAccumulator *accumulator = (VipsHoughAccumulator *) seq;
 	VipsPel *p = (VipsPel *) in;
 
 	int i;
@@ -163,6 +252,7 @@ vips_hough_class_init(VipsHoughClass *class)
 	VipsObjectClass *object_class = (VipsObjectClass *) class;
 	VipsStatisticClass *sclass = VIPS_STATISTIC_CLASS(class);
 
+	gobject_class->finalize = vips_hough_finalize;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -185,4 +275,8 @@ vips_hough_class_init(VipsHoughClass *class)
 static void
 vips_hough_init(VipsHough *hough)
 {
+	int i;
+
+	for (i = 0; i < VIPS_HOUGH_SHARDS; i++)
+		g_mutex_init(&hough->lock[i]);
 }
@@ -53,13 +53,44 @@ extern "C" {
 	(G_TYPE_INSTANCE_GET_CLASS((obj), \
 		VIPS_TYPE_HOUGH, VipsHoughClass))
 
+/* Accumulators bigger than this many bytes are sparse.
+ */
+#define VIPS_HOUGH_DENSE_MAX (8 * 1024 * 1024)
+
+/* Number of votes a sparse accumulator buffers, and the number of locks on
+ * the output image.
+ */
+#define VIPS_HOUGH_VOTES (65536)
+#define VIPS_HOUGH_SHARDS (64)
+
 typedef struct _VipsHough VipsHough;
 typedef struct _VipsHoughClass VipsHoughClass;
 
+/* Each thread votes into one of these. A dense accumulator is a private
+ * image which is summed into the output at the end. A sparse accumulator
+ * buffers the element index of each vote, and adds them to the shared output
+ * in batches.
+ */
+typedef struct _VipsHoughAccumulator {
+	VipsHough *hough;
+
+	/* Dense accumulators vote into the data of this image.
+	 */
+	VipsImage *image;
+	guint *data;
+
+	/* Sparse accumulators buffer votes here. @sorted is the same votes
+	 * grouped by output shard.
+	 */
+	gsize *votes;
+	gsize *sorted;
+	int n_votes;
+} VipsHoughAccumulator;
+
 typedef int (*VipsHoughInitAccumulator)(VipsHough *hough,
 	VipsImage *accumulator);
 typedef void (*VipsHoughVote)(VipsHough *hough,
-	VipsImage *accumulator, int x, int y);
+	VipsHoughAccumulator *accumulator, int x, int y);
 
 struct _VipsHough {
 	VipsStatistic parent_instance;
@@ -67,6 +98,13 @@ struct _VipsHough {
 	/* Sum the thread accumulators to here.
 	 */
 	VipsImage *out;
+
+	/* Use sparse thread accumulators. The output is split into shards of
+	 * @shard_size elements, each with a lock.
+	 */
+	gboolean sparse;
+	gsize shard_size;
+	GMutex lock[VIPS_HOUGH_SHARDS];
 };
 
 struct _VipsHoughClass {
@@ -83,6 +121,25 @@ struct _VipsHoughClass {
 
 GType vips_hough_get_type(void);
 
+void vips__hough_flush(VipsHoughAccumulator *accumulator);
+
+/* Cast a vote for element @INDEX of the accumulator.
+ */
+#define VIPS_HOUGH_VOTE(ACCUMULATOR, INDEX) \
+	G_STMT_START \
+	{ \
+		VipsHoughAccumulator *acc = (ACCUMULATOR); \
+\
+		if (acc->data) \
+			acc->data[(INDEX)] += 1; \
+		else { \
+			acc->votes[acc->n_votes++] = (INDEX); \
+			if (acc->n_votes == VIPS_HOUGH_VOTES) \
+				vips__hough_flush(acc); \
+		} \
+	} \
+	G_STMT_END
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -4,6 +4,9 @@
  * 	- from hist_find.c
  * 1/2/18
  * 	- change width to 0 - 180
+ * 19/10/26
+ * 	- find the distances for a run of angles first, so the compiler can
+ * 	  vectorise it
  */
 
 /*
@@ -98,10 +101,15 @@ vips_hough_line_init_accumulator(VipsHough *hough, VipsImage *accumulator)
 	return 0;
 }
 
+/* Number of angles we find distances for at once.
+ */
+#define VIPS_HOUGH_LINE_RUN (256)
+
 /* Cast votes for all lines passing through x, y.
  */
 static void
-vips_hough_line_vote(VipsHough *hough, VipsImage *accumulator, int x, int y)
+vips_hough_line_vote(VipsHough *hough,
+	VipsHoughAccumulator *accumulator, int x, int y)
 {
 	VipsHoughLine *hough_line = (VipsHoughLine *) hough;
 	VipsStatistic *statistic = (VipsStatistic *) hough;
@@ -116,15 +124,27 @@ vips_hough_line_vote(VipsHough *hough, VipsImage *accumulator, int x, int y)
 	// size of hough space
 	int width = hough_line->width;
 	int height = hough_line->height;
-	guint *data = (guint *) accumulator->data;
+	const double *sin_table = hough_line->sin;
+	const double *cos_table = hough_line->sin + width / 2;
+
+	int ri[VIPS_HOUGH_LINE_RUN];
+
+	for (int i0 = 0; i0 < width; i0 += VIPS_HOUGH_LINE_RUN) {
+		int n = VIPS_MIN(VIPS_HOUGH_LINE_RUN, width - i0);
+
+		// no dependencies between angles, so this will vectorise
+		for (int i = 0; i < n; i++) {
+			double r = xd * cos_table[i0 + i] +
+				yd * sin_table[i0 + i];
 
-	for (int i = 0; i < width; i++) {
-		int i90 = i + width / 2;
-		double r = xd * hough_line->sin[i90] + yd * hough_line->sin[i];
-		int ri = (r + 1) * (height / 2.0);
+			ri[i] = (r + 1) * (height / 2.0);
+		}
 
-		g_assert(ri >= 0 && ri < height);
-		data[i + ri * width] += 1;
+		for (int i = 0; i < n; i++) {
+			g_assert(ri[i] >= 0 && ri[i] < height);
+			VIPS_HOUGH_VOTE(accumulator,
+				(gsize) ri[i] * width + i0 + i);
+		}
 	}
 }
 
@@ -25,6 +25,8 @@
  * 	- track and return top n values
  * 24/1/17
  * 	- sort equal values by y then x to make order more consistent
+ * 19/10/26
+ * 	- use stats attached by vips_stats()
  */
 
 /*
@@ -262,6 +264,27 @@ vips_max_build(VipsObject *object)
 	return 0;
 }
 
+/* vips_stats() has attached results to our input.
+ */
+static gboolean
+vips_max_cached(VipsStatistic *statistic, VipsImage *stats, VipsImage *hist)
+{
+	VipsMax *max = (VipsMax *) statistic;
+	double *row0 = VIPS_MATRIX(stats, 0, 0);
+
+	/* The stats matrix only has the single largest value, and it can be
+	 * NaN if the first pixel was.
+	 */
+	if (max->size != 1 ||
+		isnan(row0[COL_MAX]))
+		return FALSE;
+
+	vips_values_add(&max->values,
+		row0[COL_MAX], row0[COL_XMAX], row0[COL_YMAX]);
+
+	return TRUE;
+}
+
 /* New sequence value. Make a private VipsValues for this thread.
  */
 static void *
@@ -447,6 +470,7 @@ vips_max_class_init(VipsMaxClass *class)
 	sclass->start = vips_max_start;
 	sclass->scan = vips_max_scan;
 	sclass->stop = vips_max_stop;
+	sclass->cached = vips_max_cached;
 
 	VIPS_ARG_DOUBLE(class, "out", 1,
 		_("Output"),
@@ -25,6 +25,8 @@
  * 4/12/12
  * 	- from min.c
  * 	- track and return bottom n values
+ * 19/10/26
+ * 	- use stats attached by vips_stats()
  */
 
 /*
@@ -262,6 +264,27 @@ vips_min_build(VipsObject *object)
 	return 0;
 }
 
+/* vips_stats() has attached results to our input.
+ */
+static gboolean
+vips_min_cached(VipsStatistic *statistic, VipsImage *stats, VipsImage *hist)
+{
+	VipsMin *min = (VipsMin *) statistic;
+	double *row0 = VIPS_MATRIX(stats, 0, 0);
+
+	/* The stats matrix only has the single smallest value, and it can be
+	 * NaN if the first pixel was.
+	 */
+	if (min->size != 1 ||
+		isnan(row0[COL_MIN]))
+		return FALSE;
+
+	vips_values_add(&min->values,
+		row0[COL_MIN], row0[COL_XMIN], row0[COL_YMIN]);
+
+	return TRUE;
+}
+
 /* New sequence value. Make a private VipsValues for this thread.
  */
 static void *
@@ -447,6 +470,7 @@ vips_min_class_init(VipsMinClass *class)
 	sclass->start = vips_min_start;
 	sclass->scan = vips_min_scan;
 	sclass->stop = vips_min_stop;
+	sclass->cached = vips_min_cached;
 
 	VIPS_ARG_DOUBLE(class, "out", 1,
 		_("Output"),
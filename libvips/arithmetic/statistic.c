@@ -6,6 +6,9 @@
  *
  * 24/8/11
  * 	- from im_avg.c
+ * 19/10/26
+ * 	- add the stats cache, so subclasses can skip the scan if vips_stats()
+ * 	  has attached results to the image
  */
 
 /*
@@ -56,6 +59,108 @@
 
 G_DEFINE_ABSTRACT_TYPE(VipsStatistic, vips_statistic, VIPS_TYPE_OPERATION);
 
+/* The results vips_stats() attaches to an image.
+ */
+typedef struct _VipsStatisticCache {
+	VipsImage *stats;
+	VipsImage *hist;
+} VipsStatisticCache;
+
+/* Lock cache get and set with this.
+ */
+static GMutex vips_statistic_cache_lock;
+
+static void
+vips_statistic_cache_free(VipsStatisticCache *cache)
+{
+	VIPS_UNREF(cache->stats);
+	VIPS_UNREF(cache->hist);
+	g_free(cache);
+}
+
+/* The image has been modified, perhaps with a draw operation. Drop any
+ * stats.
+ */
+static void
+vips_statistic_cache_invalidate(VipsImage *image, void *user_data)
+{
+	g_mutex_lock(&vips_statistic_cache_lock);
+	g_object_set_data(G_OBJECT(image), "libvips-statistic-cache", NULL);
+	g_mutex_unlock(&vips_statistic_cache_lock);
+}
+
+/* Get any results vips_stats() attached to @image. @stats and @hist are new
+ * refs (@hist can be NULL), or FALSE for no results.
+ */
+gboolean
+vips__statistic_cache_get(VipsImage *image,
+	VipsImage **stats, VipsImage **hist)
+{
+	VipsStatisticCache *cache;
+
+	*stats = NULL;
+	*hist = NULL;
+
+	g_mutex_lock(&vips_statistic_cache_lock);
+	if ((cache = g_object_get_data(G_OBJECT(image),
+			 "libvips-statistic-cache"))) {
+		*stats = cache->stats;
+		g_object_ref(*stats);
+		if (cache->hist) {
+			*hist = cache->hist;
+			g_object_ref(*hist);
+		}
+	}
+	g_mutex_unlock(&vips_statistic_cache_lock);
+
+	return *stats != NULL;
+}
+
+/* Attach a stats matrix and (optionally) a histogram to @image. This is object
+ * data rather than metadata, since it must not be copied to other images.
+ */
+void
+vips__statistic_cache_set(VipsImage *image,
+	VipsImage *stats, VipsImage *hist)
+{
+	VipsStatisticCache *cache;
+
+	g_mutex_lock(&vips_statistic_cache_lock);
+
+	/* Don't replace a histogram with nothing.
+	 */
+	if (!hist &&
+		(cache = g_object_get_data(G_OBJECT(image),
+			 "libvips-statistic-cache")) &&
+		cache->hist) {
+		g_mutex_unlock(&vips_statistic_cache_lock);
+		return;
+	}
+
+	/* Connect to invalidate just once. The cache itself can come and go
+	 * many times on a long-lived image.
+	 */
+	if (!g_object_get_data(G_OBJECT(image), "libvips-statistic-handler")) {
+		gulong handler = g_signal_connect(image, "invalidate",
+			G_CALLBACK(vips_statistic_cache_invalidate), NULL);
+
+		g_object_set_data(G_OBJECT(image), "libvips-statistic-handler",
+			GUINT_TO_POINTER(handler));
+	}
+
+	cache = g_new0(VipsStatisticCache, 1);
+	cache->stats = stats;
+	g_object_ref(stats);
+	if (hist) {
+		cache->hist = hist;
+		g_object_ref(hist);
+	}
+	g_object_set_data_full(G_OBJECT(image), "libvips-statistic-cache",
+		cache, (GDestroyNotify) vips_statistic_cache_free);
+
+	g_mutex_unlock(&vips_statistic_cache_lock);
+}
+
 static void *
 vips_statistic_scan_start(VipsImage *in, void *a, void *b)
 {
@@ -124,6 +229,25 @@ vips_statistic_build(VipsObject *object)
 
 	statistic->ready = statistic->in;
 
+	/* If vips_stats() has attached results to this image, we may not
+	 * need to scan at all.
+	 */
+	if (sclass->cached) {
+		VipsImage *stats;
+		VipsImage *hist;
+
+		if (vips__statistic_cache_get(statistic->in, &stats, &hist)) {
+			gboolean cached;
+
+			cached = sclass->cached(statistic, stats, hist);
+			VIPS_UNREF(stats);
+			VIPS_UNREF(hist);
+
+			if (cached)
+				return 0;
+		}
+	}
+
 	if (vips_image_decode(statistic->ready, &t[0]))
 		return -1;
 	statistic->ready = t[0];
@@ -57,6 +57,8 @@ typedef void *(*VipsStatisticStartFn)(VipsStatistic *statistic);
 typedef int (*VipsStatisticScanFn)(VipsStatistic *statistic,
 	void *seq, int x, int y, void *p, int n);
 typedef int (*VipsStatisticStopFn)(VipsStatistic *statistic, void *seq);
+typedef gboolean (*VipsStatisticCachedFn)(VipsStatistic *statistic,
+	VipsImage *stats, VipsImage *hist);
 
 struct _VipsStatistic {
 	VipsOperation parent_instance;
@@ -91,10 +93,38 @@ struct _VipsStatisticClass {
 	/* For each input format, what output format. If NULL, no casting.
 	 */
 	const VipsBandFormat *format_table;
+
+	/* vips_stats() can attach its results to the input image. If they
+	 * are there, this is called with the stats matrix and the
+	 * histogram (which can be NULL). Return TRUE if it could make the
+	 * result from these, and the scan can be skipped.
+	 */
+	VipsStatisticCachedFn cached;
 };
 
 GType vips_statistic_get_type(void);
 
+/* Names for the columns of the vips_stats() matrix.
+ */
+enum {
+	COL_MIN = 0,
+	COL_MAX = 1,
+	COL_SUM = 2,
+	COL_SUM2 = 3,
+	COL_AVG = 4,
+	COL_SD = 5,
+	COL_XMIN = 6,
+	COL_YMIN = 7,
+	COL_XMAX = 8,
+	COL_YMAX = 9,
+	COL_LAST = 10
+};
+
+gboolean vips__statistic_cache_get(VipsImage *image,
+	VipsImage **stats, VipsImage **hist);
+void vips__statistic_cache_set(VipsImage *image,
+	VipsImage *stats, VipsImage *hist);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -27,6 +27,9 @@
  * 7/11/11
  * 	- redone as a class
  * 	- track maxpos / minpos too
+ * 19/10/26
+ * 	- add @histogram, @hist and @cache
+ * 	- branch-free inner loop for 8 and 16-bit images
  */
 
 /*
@@ -68,6 +71,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <limits.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -79,28 +84,79 @@ typedef struct _VipsStats {
 
 	VipsImage *out;
 
+	/* Also find the histogram, and write it here.
+	 */
+	gboolean histogram;
+	VipsImage *hist;
+
+	/* Attach the results to the input image.
+	 */
+	gboolean cache;
+
 	gboolean set; /* FALSE means no value yet */
+
+	/* The histogram we accumulate, n_bins per band, band after band.
+	 * The bins are double for "large" images, uint otherwise, like
+	 * vips_hist_find().
+	 */
+	gboolean large;
+	int n_bins;
+	int mx;
+	VipsPel *bins;
 } VipsStats;
 
 typedef VipsStatisticClass VipsStatsClass;
 
 G_DEFINE_TYPE(VipsStats, vips_stats, VIPS_TYPE_STATISTIC);
 
-/* Names for our columns.
+/* Make the histogram output image from the accumulated bins.
  */
-enum {
-	COL_MIN = 0,
-	COL_MAX = 1,
-	COL_SUM = 2,
-	COL_SUM2 = 3,
-	COL_AVG = 4,
-	COL_SD = 5,
-	COL_XMIN = 6,
-	COL_YMIN = 7,
-	COL_XMAX = 8,
-	COL_YMAX = 9,
-	COL_LAST = 10
-};
+static int
+vips_stats_build_hist(VipsStats *stats)
+{
+	VipsStatistic *statistic = VIPS_STATISTIC(stats);
+	int bands = vips_image_get_bands(statistic->in);
+
+	VipsImage *hist;
+	VipsPel *obuffer;
+
+	hist = vips_image_new_memory();
+	g_object_set(stats, "hist", hist, NULL);
+	vips_image_init_fields(hist,
+		stats->mx + 1, 1, bands,
+		stats->large ? VIPS_FORMAT_DOUBLE : VIPS_FORMAT_UINT,
+		VIPS_CODING_NONE, VIPS_INTERPRETATION_HISTOGRAM, 1.0, 1.0);
+
+	/* Interleave for output.
+	 */
+	if (!(obuffer = VIPS_ARRAY(stats,
+			  VIPS_IMAGE_SIZEOF_LINE(hist), VipsPel)))
+		return -1;
+
+#define INTERLEAVE(TYPE) \
+	G_STMT_START \
+	{ \
+		TYPE *bins = (TYPE *) stats->bins; \
+\
+		TYPE *q; \
+		int i, j; \
+\
+		for (q = (TYPE *) obuffer, j = 0; j < hist->Xsize; j++) \
+			for (i = 0; i < bands; i++) \
+				*q++ = bins[i * stats->n_bins + j]; \
+	} \
+	G_STMT_END
+
+	if (stats->large)
+		INTERLEAVE(double);
+	else
+		INTERLEAVE(unsigned int);
+
+	if (vips_image_write_line(hist, 0, obuffer))
+		return -1;
+
+	return 0;
+}
 
 static int
 vips_stats_build(VipsObject *object)
@@ -122,11 +178,41 @@ vips_stats_build(VipsObject *object)
 		g_object_set(object,
 			"out", vips_image_new_matrix(COL_LAST, bands + 1),
 			NULL);
+
+		/* Bin like vips_hist_find(): char and uchar go to 256 bins,
+		 * everything else is cast to ushort.
+		 */
+		if (stats->histogram) {
+			VipsBandFormat format =
+				vips_image_get_format(statistic->in);
+			gboolean uchar = format == VIPS_FORMAT_UCHAR ||
+				format == VIPS_FORMAT_CHAR;
+
+			stats->large = (guint64) statistic->in->Xsize *
+					(guint64) statistic->in->Ysize >=
+				((guint64) 1 << 32);
+			stats->n_bins = uchar ? 256 : 65536;
+			stats->mx = uchar ? 255 : 0;
+			if (!(stats->bins = VIPS_ARRAY(object,
+					  (size_t) bands * stats->n_bins *
+						  sizeof(double),
+					  VipsPel)))
+				return -1;
+			memset(stats->bins, 0,
+				(size_t) bands * stats->n_bins * sizeof(double));
+		}
 	}
 
 	if (VIPS_OBJECT_CLASS(vips_stats_parent_class)->build(object))
 		return -1;
 
+	/* This can be set already if we were built from the cache.
+	 */
+	if (stats->histogram &&
+		!stats->hist &&
+		vips_stats_build_hist(stats))
+		return -1;
+
 	pels = (gint64) vips_image_get_width(statistic->in) *
 		vips_image_get_height(statistic->in);
 	vals = pels * vips_image_get_bands(statistic->in);
@@ -171,9 +257,43 @@ vips_stats_build(VipsObject *object)
 			(row0[COL_SUM] * row0[COL_SUM] / vals)) /
 		(vals - 1));
 
+	if (stats->cache)
+		vips__statistic_cache_set(statistic->in, stats->out, stats->hist);
+
 	return 0;
 }
 
+/* Make a result from stats attached to the image by an earlier
+ * vips_stats().
+ */
+static gboolean
+vips_stats_cached(VipsStatistic *statistic, VipsImage *out, VipsImage *hist)
+{
+	VipsStats *stats = (VipsStats *) statistic;
+	int bands = vips_image_get_bands(statistic->in);
+
+	int b, i;
+
+	if (stats->histogram && !hist)
+		return FALSE;
+
+	for (b = 0; b < bands; b++) {
+		double *p = VIPS_MATRIX(out, 0, b + 1);
+		double *q = VIPS_MATRIX(stats->out, 0, b + 1);
+
+		for (i = 0; i < COL_LAST; i++)
+			q[i] = p[i];
+	}
+	stats->set = TRUE;
+
+	if (stats->histogram) {
+		g_object_ref(hist);
+		g_object_set(stats, "hist", hist, NULL);
+	}
+
+	return TRUE;
+}
+
 /* Stop function. Add these little stats to the main set of stats.
  */
 static int
@@ -183,15 +303,34 @@ vips_stats_stop(VipsStatistic *statistic, void *seq)
 	VipsStats *global = (VipsStats *) statistic;
 	VipsStats *local = (VipsStats *) seq;
 
-	int b;
+	int b, i;
+
+	if (local->bins) {
+		int n = bands * global->n_bins;
+
+		if (global->large) {
+			double *p = (double *) local->bins;
+			double *q = (double *) global->bins;
+
+			for (i = 0; i < n; i++)
+				q[i] += p[i];
+		}
+		else {
+			unsigned int *p = (unsigned int *) local->bins;
+			unsigned int *q = (unsigned int *) global->bins;
+
+			for (i = 0; i < n; i++)
+				q[i] += p[i];
+		}
+
+		global->mx = VIPS_MAX(global->mx, local->mx);
+	}
 
 	if (local->set && !global->set) {
 		for (b = 0; b < bands; b++) {
 			double *p = VIPS_MATRIX(local->out, 0, b + 1);
 			double *q = VIPS_MATRIX(global->out, 0, b + 1);
 
-			int i;
-
 			for (i = 0; i < COL_LAST; i++)
 				q[i] = p[i];
 		}
@@ -221,6 +360,7 @@ vips_stats_stop(VipsStatistic *statistic, void *seq)
 	}
 
 	VIPS_FREEF(g_object_unref, local->out);
+	VIPS_FREE(local->bins);
 	VIPS_FREEF(g_free, seq);
 
 	return 0;
@@ -231,17 +371,24 @@ vips_stats_stop(VipsStatistic *statistic, void *seq)
 static void *
 vips_stats_start(VipsStatistic *statistic)
 {
+	VipsStats *global = (VipsStats *) statistic;
 	int bands = vips_image_get_bands(statistic->in);
 
 	VipsStats *stats;
 
-	stats = g_new(VipsStats, 1);
+	stats = g_new0(VipsStats, 1);
 	if (!(stats->out = vips_image_new_matrix(COL_LAST, bands + 1))) {
 		g_free(stats);
 		return NULL;
 	}
 	stats->set = FALSE;
 
+	if (global->bins) {
+		stats->mx = global->mx;
+		stats->bins = g_malloc0((size_t) bands * global->n_bins *
+			(global->large ? sizeof(double) : sizeof(unsigned int)));
+	}
+
 	return (void *) stats;
 }
 
@@ -311,6 +458,101 @@ vips_stats_start(VipsStatistic *statistic)
 		local->set = TRUE; \
 	}
 
+/* For 8 and 16-bit images we can sum exactly in 64-bit ints, and without
+ * branches, so the compiler can vectorise the loop. Go back for the position
+ * of the extrema only if they improve on the ones we have.
+ */
+#define LOOPI(TYPE) \
+	{ \
+		for (b = 0; b < bands; b++) { \
+			TYPE *p = ((TYPE *) in) + b; \
+			double *q = VIPS_MATRIX(local->out, 0, b + 1); \
+			TYPE small, big; \
+			gint64 sum, sum2; \
+\
+			small = p[0]; \
+			big = p[0]; \
+			sum = 0; \
+			sum2 = 0; \
+\
+			for (i = 0; i < n; i++) { \
+				TYPE value = p[i * bands]; \
+\
+				sum += value; \
+				sum2 += (gint64) value * value; \
+				small = VIPS_MIN(small, value); \
+				big = VIPS_MAX(big, value); \
+			} \
+\
+			if (!local->set || \
+				small < q[COL_MIN]) { \
+				for (i = 0; p[i * bands] != small; i++) \
+					; \
+				q[COL_MIN] = small; \
+				q[COL_XMIN] = x + i; \
+				q[COL_YMIN] = y; \
+			} \
+\
+			if (!local->set || \
+				big > q[COL_MAX]) { \
+				for (i = 0; p[i * bands] != big; i++) \
+					; \
+				q[COL_MAX] = big; \
+				q[COL_XMAX] = x + i; \
+				q[COL_YMAX] = y; \
+			} \
+\
+			if (local->set) { \
+				q[COL_SUM] += sum; \
+				q[COL_SUM2] += sum2; \
+			} \
+			else { \
+				q[COL_SUM] = sum; \
+				q[COL_SUM2] = sum2; \
+			} \
+		} \
+\
+		local->set = TRUE; \
+	}
+
+/* Add a line to the histogram. IDX turns a pixel into a bin index, with the
+ * same clipping as vips_cast().
+ */
+#define HIST(TYPE, HIST_TYPE, IDX) \
+	{ \
+		TYPE *p = (TYPE *) in; \
+		HIST_TYPE *bins = (HIST_TYPE *) local->bins; \
+		int mx = local->mx; \
+\
+		for (i = 0; i < n; i++) { \
+			for (b = 0; b < bands; b++) { \
+				int v = IDX(p[b]); \
+\
+				mx = VIPS_MAX(mx, v); \
+				bins[b * global->n_bins + v] += 1; \
+			} \
+\
+			p += bands; \
+		} \
+\
+		local->mx = mx; \
+	}
+
+#define IDX_UCHAR(V) ((unsigned char) (V))
+#define IDX_CHAR(V) ((unsigned char) VIPS_CLIP(0, (V), UCHAR_MAX))
+#define IDX_USHORT(V) ((unsigned short) (V))
+#define IDX_SHORT(V) ((unsigned short) VIPS_CLIP(0, (V), USHRT_MAX))
+#define IDX_OTHER(V) \
+	((unsigned short) VIPS_CLIP(0, (double) (V), USHRT_MAX))
+
+#define HIST_SWITCH(TYPE, IDX) \
+	{ \
+		if (global->large) \
+			HIST(TYPE, double, IDX) \
+		else \
+			HIST(TYPE, unsigned int, IDX) \
+	}
+
 /* As above, but for float/double types where we have to avoid NaN.
  */
 #define LOOPF(TYPE) \
@@ -383,22 +625,23 @@ vips_stats_scan(VipsStatistic *statistic, void *seq,
 	int x, int y, void *in, int n)
 {
 	const int bands = vips_image_get_bands(statistic->in);
+	VipsStats *global = (VipsStats *) statistic;
 	VipsStats *local = (VipsStats *) seq;
 
 	int b, i;
 
 	switch (vips_image_get_format(statistic->in)) {
 	case VIPS_FORMAT_UCHAR:
-		LOOP(unsigned char);
+		LOOPI(unsigned char);
 		break;
 	case VIPS_FORMAT_CHAR:
-		LOOP(signed char);
+		LOOPI(signed char);
 		break;
 	case VIPS_FORMAT_USHORT:
-		LOOP(unsigned short);
+		LOOPI(unsigned short);
 		break;
 	case VIPS_FORMAT_SHORT:
-		LOOP(signed short);
+		LOOPI(signed short);
 		break;
 	case VIPS_FORMAT_UINT:
 		LOOP(unsigned int);
@@ -417,6 +660,39 @@ vips_stats_scan(VipsStatistic *statistic, void *seq,
 		g_assert_not_reached();
 	}
 
+	/* The line is in cache, so histogram it in the same pass.
+	 */
+	if (local->bins)
+		switch (vips_image_get_format(statistic->in)) {
+		case VIPS_FORMAT_UCHAR:
+			HIST_SWITCH(unsigned char, IDX_UCHAR);
+			break;
+		case VIPS_FORMAT_CHAR:
+			HIST_SWITCH(signed char, IDX_CHAR);
+			break;
+		case VIPS_FORMAT_USHORT:
+			HIST_SWITCH(unsigned short, IDX_USHORT);
+			break;
+		case VIPS_FORMAT_SHORT:
+			HIST_SWITCH(signed short, IDX_SHORT);
+			break;
+		case VIPS_FORMAT_UINT:
+			HIST_SWITCH(unsigned int, IDX_OTHER);
+			break;
+		case VIPS_FORMAT_INT:
+			HIST_SWITCH(signed int, IDX_OTHER);
+			break;
+		case VIPS_FORMAT_FLOAT:
+			HIST_SWITCH(float, IDX_OTHER);
+			break;
+		case VIPS_FORMAT_DOUBLE:
+			HIST_SWITCH(double, IDX_OTHER);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
 	return 0;
 }
 
@@ -437,12 +713,33 @@ vips_stats_class_init(VipsStatsClass *class)
 	sclass->start = vips_stats_start;
 	sclass->scan = vips_stats_scan;
 	sclass->stop = vips_stats_stop;
+	sclass->cached = vips_stats_cached;
 
 	VIPS_ARG_IMAGE(class, "out", 100,
 		_("Output"),
 		_("Output array of statistics"),
 		VIPS_ARGUMENT_REQUIRED_OUTPUT,
 		G_STRUCT_OFFSET(VipsStats, out));
+
+	VIPS_ARG_BOOL(class, "histogram", 110,
+		_("Histogram"),
+		_("Also find the histogram"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsStats, histogram),
+		FALSE);
+
+	VIPS_ARG_IMAGE(class, "hist", 111,
+		_("Hist"),
+		_("Output histogram"),
+		VIPS_ARGUMENT_OPTIONAL_OUTPUT,
+		G_STRUCT_OFFSET(VipsStats, hist));
+
+	VIPS_ARG_BOOL(class, "cache", 112,
+		_("Cache"),
+		_("Attach the results to the input image"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsStats, cache),
+		FALSE);
 }
 
 static void
@@ -470,6 +767,22 @@ vips_stats_init(VipsStats *stats)
  * If there is more than one maxima or minima, one of them will be chosen at
  * random.
  *
+ * Set @histogram to also find the histogram of @in in the same pass, and
+ * return it in @hist. It is binned exactly as [method@Image.hist_find] bins
+ * all bands.
+ *
+ * Set @cache to attach the results to @in. Later calls to
+ * [method@Image.stats], [method@Image.avg], [method@Image.deviate],
+ * [method@Image.min], [method@Image.max] and (if @histogram was set)
+ * [method@Image.hist_find] on @in will then return immediately, without
+ * computing @in again. The results are dropped if @in is modified, for
+ * example by a draw operation.
+ *
+ * ::: tip "Optional arguments"
+ *     * @histogram: `gboolean`, also find the histogram
+ *     * @hist: [class@Image], output, the histogram
+ *     * @cache: `gboolean`, attach the results to @in
+ *
  * ::: seealso
  *     [method@Image.avg], [method@Image.min].
  *
@@ -8,6 +8,10 @@
  *	- much faster with large arrays
  * 29/1/24
  *	- render and don't forward pixels for complete subregions
+ * 19/10/26
+ *	- keep the last input region in the sequence, so we can forward
+ *	  pixels again
+ *	- minimise finished rows in order, rather than scanning every input
  */
 
 /*
@@ -74,16 +78,69 @@ typedef struct _VipsArrayjoin {
 	VipsRect *rects;
 	gboolean *minimised;
 
+	/* Rows above this have all been minimised.
+	 */
+	int minimised_rows;
+
 } VipsArrayjoin;
 
+/* The input array can be huge, so rather than a region for every input, each
+ * sequence keeps a region on the last input it used.
+ */
+typedef struct _VipsArrayjoinSequence {
+	VipsRegion *ir;
+	int i;
+} VipsArrayjoinSequence;
+
 typedef VipsConversionClass VipsArrayjoinClass;
 
 G_DEFINE_TYPE(VipsArrayjoin, vips_arrayjoin, VIPS_TYPE_CONVERSION);
 
+static int
+vips_arrayjoin_stop(void *vseq, void *a, void *b)
+{
+	VipsArrayjoinSequence *seq = (VipsArrayjoinSequence *) vseq;
+
+	VIPS_UNREF(seq->ir);
+	g_free(seq);
+
+	return 0;
+}
+
+static void *
+vips_arrayjoin_start(VipsImage *out, void *a, void *b)
+{
+	VipsArrayjoinSequence *seq;
+
+	if (!(seq = VIPS_NEW(NULL, VipsArrayjoinSequence)))
+		return NULL;
+	seq->ir = NULL;
+	seq->i = -1;
+
+	return seq;
+}
+
+/* Get a region on input i, reusing the sequence region if we can.
+ */
+static VipsRegion *
+vips_arrayjoin_region(VipsArrayjoinSequence *seq, VipsImage **in, int i)
+{
+	if (seq->i != i) {
+		VIPS_UNREF(seq->ir);
+		seq->i = -1;
+		if (!(seq->ir = vips_region_new(in[i])))
+			return NULL;
+		seq->i = i;
+	}
+
+	return seq->ir;
+}
+
 static int
 vips_arrayjoin_gen(VipsRegion *out_region,
-	void *seq, void *a, void *b, gboolean *stop)
+	void *vseq, void *a, void *b, gboolean *stop)
 {
+	VipsArrayjoinSequence *seq = (VipsArrayjoinSequence *) vseq;
 	VipsImage **in = (VipsImage **) a;
 	VipsArrayjoin *join = (VipsArrayjoin *) b;
 	VipsConversion *conversion = VIPS_CONVERSION(join);
@@ -111,28 +168,17 @@ vips_arrayjoin_gen(VipsRegion *out_region,
 	vips_array_image_get(join->in, &n);
 
 	/* Does this rect fit completely within one of our inputs? We can just
-	 * forward the request.
+	 * forward the request. The sequence keeps reg alive until out_region
+	 * is next used, so we can attach to it rather than copying.
 	 */
-	if (width == 1 && height == 1) {
-		VipsRect need;
-
+	if (width == 1 &&
+		height == 1) {
 		i = VIPS_MIN(n - 1, left + top * join->across);
 
-		/* The part of in[i] we need.
-		 */
-		need = out_region->valid;
-		need.left -= join->rects[i].left;
-		need.top -= join->rects[i].top;
-
-		/* And render into out_region. We can't just forward a pointer since
-		 * we are about to unref reg.
-		 */
-		reg = vips_region_new(in[i]);
-		if (vips_region_prepare_to(reg, out_region, &need, r->left, r->top)) {
-			g_object_unref(reg);
+		if (!(reg = vips_arrayjoin_region(seq, in, i)) ||
+			vips__insert_just_one(out_region, reg,
+				join->rects[i].left, join->rects[i].top))
 			return -1;
-		}
-		g_object_unref(reg);
 	}
 	else {
 		/* Output requires more than one input. Paste all touching
@@ -140,19 +186,23 @@ vips_arrayjoin_gen(VipsRegion *out_region,
 		 */
 		int x, y;
 
+		i = -1;
 		for (y = 0; y < height; y++)
 			for (x = 0; x < width; x++) {
-				i = VIPS_MIN(n - 1, x + left + (y + top) * join->across);
-
-				reg = vips_region_new(in[i]);
-
-				if (vips__insert_paste_region(out_region, reg,
-						&join->rects[i])) {
-					g_object_unref(reg);
+				int j = VIPS_MIN(n - 1,
+					x + left + (y + top) * join->across);
+
+				/* Cells past the end of the array are all
+				 * covered by the stretched final image.
+				 */
+				if (j == i)
+					continue;
+				i = j;
+
+				if (!(reg = vips_arrayjoin_region(seq, in, i)) ||
+					vips__insert_paste_region(out_region, reg,
+						&join->rects[i]))
 					return -1;
-				}
-
-				g_object_unref(reg);
 			}
 	}
 
@@ -161,19 +211,41 @@ vips_arrayjoin_gen(VipsRegion *out_region,
 	 * descriptors on large image arrays.
 	 *
 	 * minimise_all is quite expensive, so only trigger once for each input.
+	 * Inputs finish a row at a time, so we only need to test the next
+	 * unfinished row.
 	 *
-	 * We don't lock for minimised[], but it's harmless.
+	 * We don't lock for minimised[] or minimised_rows, but it's harmless:
+	 * a race can only make us test a row again.
 	 */
-	if (vips_image_is_sequential(conversion->out))
-		for (i = 0; i < n; i++) {
-			int bottom_edge = VIPS_RECT_BOTTOM(&join->rects[i]);
-
-			if (!join->minimised[i] &&
-				r->top > bottom_edge + 1024) {
-				join->minimised[i] = TRUE;
-				vips_image_minimise_all(in[i]);
-			}
+	if (vips_image_is_sequential(conversion->out)) {
+		int row;
+
+		for (row = join->minimised_rows; row < join->down; row++) {
+			int first = row * join->across;
+			int last = VIPS_MIN(n, first + join->across);
+
+			int bottom_edge;
+
+			/* Images in a row can have different heights, so
+			 * wait for the tallest.
+			 */
+			bottom_edge = 0;
+			for (i = first; i < last; i++)
+				bottom_edge = VIPS_MAX(bottom_edge,
+					VIPS_RECT_BOTTOM(&join->rects[i]));
+
+			if (r->top <= bottom_edge + 1024)
+				break;
+
+			for (i = first; i < last; i++)
+				if (!join->minimised[i]) {
+					join->minimised[i] = TRUE;
+					vips_image_minimise_all(in[i]);
+				}
+
+			join->minimised_rows = row + 1;
 		}
+	}
 
 	return 0;
 }
@@ -366,7 +438,8 @@ vips_arrayjoin_build(VipsObject *object)
 	 * much quicker to make them on demand.
 	 */
 	if (vips_image_generate(conversion->out,
-			NULL, vips_arrayjoin_gen, NULL, size, join))
+			vips_arrayjoin_start, vips_arrayjoin_gen, vips_arrayjoin_stop,
+			size, join))
 		return -1;
 
 	return 0;
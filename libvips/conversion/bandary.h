@@ -113,6 +113,11 @@ GType vips_bandary_get_type(void);
 
 int vips_bandary_copy(VipsBandary *bandary);
 
+void vips_bandary_shuffle_hwy(VipsPel *q, int out_bands, VipsPel **p,
+	const int *bands, const int *band, int width, int sizeof_element);
+void vips_bandmean_hwy(VipsPel *q, VipsPel *p, int bands, int width,
+	int sizeof_element);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -0,0 +1,361 @@
+/* 19/10/26
+ * 	- initial implementation, from bandjoin.c, extract.c and bandmean.c
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+
+	Band shuffles for 8- and 16-bit images with up to four bands, the
+	common case for adding and removing alpha and for splitting planes.
+
+	Each output band comes from one band of one input. We load each
+	input a vector of pixels at a time with LoadInterleaved, which splits
+	it into one vector per band, and write the output bands back with
+	StoreInterleaved. Inputs with several bands in the output are loaded
+	once per band, but the second load always hits cache.
+
+	bandmean is the same load, followed by a sum and a divide.
+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/debug.h>
+#include <vips/internal.h>
+
+#include "bandary.h"
+
+#ifdef HAVE_HWY
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "libvips/conversion/bandary_hwy.cpp"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+namespace HWY_NAMESPACE {
+
+using namespace hwy::HWY_NAMESPACE;
+
+using DI32 = ScalableTag<int32_t>;
+using DF32 = ScalableTag<float>;
+constexpr DI32 di32;
+constexpr DF32 df32;
+
+/* Load band @band of a vector of @bands-band pixels starting at pixel x.
+ */
+template <class D, typename T>
+HWY_INLINE HWY_ATTR Vec<D>
+LoadBand(D d, const T *HWY_RESTRICT p, int32_t bands, int32_t band,
+	int32_t x)
+{
+	Vec<D> v0, v1, v2, v3;
+
+	switch (bands) {
+	case 2:
+		LoadInterleaved2(d, p + x * 2, v0, v1);
+		return band == 0 ? v0 : v1;
+
+	case 3:
+		LoadInterleaved3(d, p + x * 3, v0, v1, v2);
+		return band == 0 ? v0 : band == 1 ? v1 : v2;
+
+	case 4:
+		LoadInterleaved4(d, p + x * 4, v0, v1, v2, v3);
+		return band == 0 ? v0 : band == 1 ? v1 : band == 2 ? v2 : v3;
+
+	default:
+		return LoadU(d, p + x);
+	}
+}
+
+template <typename T, int OB>
+HWY_INLINE HWY_ATTR void
+ShuffleRow(T *HWY_RESTRICT q, VipsPel **p, const int32_t *HWY_RESTRICT bands,
+	const int32_t *HWY_RESTRICT band, int32_t width)
+{
+	const ScalableTag<T> d;
+	const int32_t N = Lanes(d);
+
+	const T *p0 = (const T *) p[0];
+	const T *p1 = (const T *) p[OB > 1 ? 1 : 0];
+	const T *p2 = (const T *) p[OB > 2 ? 2 : 0];
+	const T *p3 = (const T *) p[OB > 3 ? 3 : 0];
+
+	int32_t x = 0;
+	for (; x + N <= width; x += N) {
+		auto v0 = LoadBand(d, p0, bands[0], band[0], x);
+
+		if (OB == 1)
+			StoreU(v0, d, q + x);
+		else if (OB == 2) {
+			auto v1 = LoadBand(d, p1, bands[1], band[1], x);
+
+			StoreInterleaved2(v0, v1, d, q + x * 2);
+		}
+		else if (OB == 3) {
+			auto v1 = LoadBand(d, p1, bands[1], band[1], x);
+			auto v2 = LoadBand(d, p2, bands[2], band[2], x);
+
+			StoreInterleaved3(v0, v1, v2, d, q + x * 3);
+		}
+		else {
+			auto v1 = LoadBand(d, p1, bands[1], band[1], x);
+			auto v2 = LoadBand(d, p2, bands[2], band[2], x);
+			auto v3 = LoadBand(d, p3, bands[3], band[3], x);
+
+			StoreInterleaved4(v0, v1, v2, v3, d, q + x * 4);
+		}
+	}
+
+	/* `width` was not a multiple of the vector length `N`;
+	 * proceed pixel by pixel.
+	 */
+	for (; x < width; x++) {
+		for (int32_t b = 0; b < OB; b++)
+			q[x * OB + b] = ((const T *) p[b])[x * bands[b] + band[b]];
+	}
+}
+
+template <typename T>
+HWY_INLINE HWY_ATTR void
+Shuffle(VipsPel *HWY_RESTRICT q, int32_t out_bands, VipsPel **p,
+	const int32_t *HWY_RESTRICT bands, const int32_t *HWY_RESTRICT band,
+	int32_t width)
+{
+	switch (out_bands) {
+	case 1:
+		ShuffleRow<T, 1>((T *) q, p, bands, band, width);
+		break;
+
+	case 2:
+		ShuffleRow<T, 2>((T *) q, p, bands, band, width);
+		break;
+
+	case 3:
+		ShuffleRow<T, 3>((T *) q, p, bands, band, width);
+		break;
+
+	case 4:
+		ShuffleRow<T, 4>((T *) q, p, bands, band, width);
+		break;
+
+	default:
+		break;
+	}
+}
+
+HWY_ATTR void
+vips_bandary_shuffle_hwy(VipsPel *HWY_RESTRICT q, int32_t out_bands,
+	VipsPel **p, const int32_t *HWY_RESTRICT bands,
+	const int32_t *HWY_RESTRICT band, int32_t width, int32_t sizeof_element)
+{
+#if HWY_TARGET != HWY_SCALAR
+	if (sizeof_element == 2)
+		Shuffle<uint16_t>(q, out_bands, p, bands, band, width);
+	else
+		Shuffle<uint8_t>(q, out_bands, p, bands, band, width);
+#endif
+}
+
+/* Sum of the bands of a vector of pixels.
+ */
+template <class D, typename T>
+HWY_INLINE HWY_ATTR void
+LoadSum(D d, const T *HWY_RESTRICT p, int32_t bands, int32_t x,
+	Vec<Repartition<MakeWide<T>, D>> &lo,
+	Vec<Repartition<MakeWide<T>, D>> &hi)
+{
+	const Repartition<MakeWide<T>, D> dw;
+	const Half<D> dh;
+
+	Vec<D> v0, v1, v2, v3;
+
+	switch (bands) {
+	case 2:
+		LoadInterleaved2(d, p + x * 2, v0, v1);
+		lo = Add(PromoteTo(dw, LowerHalf(dh, v0)),
+			PromoteTo(dw, LowerHalf(dh, v1)));
+		hi = Add(PromoteTo(dw, UpperHalf(dh, v0)),
+			PromoteTo(dw, UpperHalf(dh, v1)));
+		break;
+
+	case 3:
+		LoadInterleaved3(d, p + x * 3, v0, v1, v2);
+		lo = Add(Add(PromoteTo(dw, LowerHalf(dh, v0)),
+					 PromoteTo(dw, LowerHalf(dh, v1))),
+			PromoteTo(dw, LowerHalf(dh, v2)));
+		hi = Add(Add(PromoteTo(dw, UpperHalf(dh, v0)),
+					 PromoteTo(dw, UpperHalf(dh, v1))),
+			PromoteTo(dw, UpperHalf(dh, v2)));
+		break;
+
+	default:
+		LoadInterleaved4(d, p + x * 4, v0, v1, v2, v3);
+		lo = Add(Add(PromoteTo(dw, LowerHalf(dh, v0)),
+					 PromoteTo(dw, LowerHalf(dh, v1))),
+			Add(PromoteTo(dw, LowerHalf(dh, v2)),
+				PromoteTo(dw, LowerHalf(dh, v3))));
+		hi = Add(Add(PromoteTo(dw, UpperHalf(dh, v0)),
+					 PromoteTo(dw, UpperHalf(dh, v1))),
+			Add(PromoteTo(dw, UpperHalf(dh, v2)),
+				PromoteTo(dw, UpperHalf(dh, v3))));
+		break;
+	}
+}
+
+/* Divide 16-bit sums of up to four uchar bands. Dividing by three is a
+ * multiply-high, which is exact for sums this small.
+ */
+HWY_INLINE HWY_ATTR Vec<ScalableTag<uint16_t>>
+DivideSum(Vec<ScalableTag<uint16_t>> sum, int32_t bands)
+{
+	const ScalableTag<uint16_t> d;
+
+	sum = Add(sum, Set(d, bands / 2));
+	if (bands == 2)
+		return ShiftRight<1>(sum);
+	else if (bands == 3)
+		return MulHigh(sum, Set(d, 21846));
+	else
+		return ShiftRight<2>(sum);
+}
+
+/* Divide 32-bit sums of up to four ushort bands. The sums are small enough
+ * to be exact in float, and the division is correctly rounded, so the
+ * truncated quotient matches integer division.
+ */
+HWY_INLINE HWY_ATTR Vec<ScalableTag<uint32_t>>
+DivideSum(Vec<ScalableTag<uint32_t>> sum, int32_t bands)
+{
+	const ScalableTag<uint32_t> d;
+
+	sum = Add(sum, Set(d, bands / 2));
+	auto f = Div(ConvertTo(df32, BitCast(di32, sum)),
+		Set(df32, (float) bands));
+
+	return BitCast(d, ConvertTo(di32, f));
+}
+
+/* Back to the input width. The means always fit, so go via signed types
+ * for the widest choice of demotions.
+ */
+template <class D>
+HWY_INLINE HWY_ATTR Vec<D>
+Narrow(D d, Vec<ScalableTag<uint16_t>> v)
+{
+	return DemoteTo(d, BitCast(ScalableTag<int16_t>(), v));
+}
+
+template <class D>
+HWY_INLINE HWY_ATTR Vec<D>
+Narrow(D d, Vec<ScalableTag<uint32_t>> v)
+{
+	return DemoteTo(d, BitCast(di32, v));
+}
+
+template <typename T>
+HWY_INLINE HWY_ATTR void
+MeanRow(T *HWY_RESTRICT q, const T *HWY_RESTRICT p, int32_t bands,
+	int32_t width)
+{
+	const ScalableTag<T> d;
+	const Half<ScalableTag<T>> dh;
+	const int32_t N = Lanes(d);
+
+	int32_t x = 0;
+	for (; x + N <= width; x += N) {
+		Vec<Repartition<MakeWide<T>, ScalableTag<T>>> lo, hi;
+
+		LoadSum(d, p, bands, x, lo, hi);
+		lo = DivideSum(lo, bands);
+		hi = DivideSum(hi, bands);
+		StoreU(Combine(d, Narrow(dh, hi), Narrow(dh, lo)), d, q + x);
+	}
+
+	/* `width` was not a multiple of the vector length `N`;
+	 * proceed pixel by pixel.
+	 */
+	for (; x < width; x++) {
+		uint32_t sum = 0;
+
+		for (int32_t b = 0; b < bands; b++)
+			sum += p[x * bands + b];
+		q[x] = (sum + bands / 2) / bands;
+	}
+}
+
+HWY_ATTR void
+vips_bandmean_hwy(VipsPel *HWY_RESTRICT q, VipsPel *HWY_RESTRICT p,
+	int32_t bands, int32_t width, int32_t sizeof_element)
+{
+#if HWY_TARGET != HWY_SCALAR
+	if (sizeof_element == 2)
+		MeanRow<uint16_t>((uint16_t *) q, (uint16_t *) p, bands, width);
+	else
+		MeanRow<uint8_t>(q, p, bands, width);
+#endif
+}
+
+} /*namespace HWY_NAMESPACE*/
+
+#if HWY_ONCE
+HWY_EXPORT(vips_bandary_shuffle_hwy);
+HWY_EXPORT(vips_bandmean_hwy);
+
+void
+vips_bandary_shuffle_hwy(VipsPel *q, int out_bands, VipsPel **p,
+	const int *bands, const int *band, int width, int sizeof_element)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_bandary_shuffle_hwy)(q, out_bands, p,
+		bands, band, width, sizeof_element);
+	/* clang-format on */
+}
+
+void
+vips_bandmean_hwy(VipsPel *q, VipsPel *p, int bands, int width,
+	int sizeof_element)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_bandmean_hwy)(q, p, bands, width,
+		sizeof_element);
+	/* clang-format on */
+}
+#endif /*HWY_ONCE*/
+
+#endif /*HAVE_HWY*/
@@ -26,6 +26,8 @@
  * 	- rewrite as a class
  * 7/11/15
  * 	- added bandjoin_const
+ * 19/10/26
+ * 	- add a highway path for 8 and 16-bit images with up to 4 bands
  */
 
 /*
@@ -70,6 +72,7 @@
 #include <math.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/internal.h>
 #include <vips/debug.h>
 
@@ -81,6 +84,14 @@ typedef struct _VipsBandjoin {
 	/* The input images.
 	 */
 	VipsArrayImage *in;
+
+	/* For the highway path, the input, the number of bands in that input,
+	 * and the band within it, for each output band.
+	 */
+	gboolean hwy;
+	int source[4];
+	int bands[4];
+	int band[4];
 } VipsBandjoin;
 
 typedef VipsBandaryClass VipsBandjoinClass;
@@ -101,6 +112,23 @@ vips_bandjoin_buffer(VipsBandarySequence *seq,
 
 	int i;
 
+#ifdef HAVE_HWY
+	VipsBandjoin *bandjoin = (VipsBandjoin *) bandary;
+
+	if (bandjoin->hwy) {
+		VipsPel *src[4];
+
+		for (i = 0; i < conversion->out->Bands; i++)
+			src[i] = p[bandjoin->source[i]];
+
+		vips_bandary_shuffle_hwy(q, conversion->out->Bands, src,
+			bandjoin->bands, bandjoin->band, width,
+			VIPS_IMAGE_SIZEOF_ELEMENT(conversion->out));
+
+		return;
+	}
+#endif /*HAVE_HWY*/
+
 	/* Loop for each input image. Scattered write is faster than
 	 * scattered read.
 	 */
@@ -176,6 +204,28 @@ vips_bandjoin_build(VipsObject *object)
 	if (VIPS_OBJECT_CLASS(vips_bandjoin_parent_class)->build(object))
 		return -1;
 
+#ifdef HAVE_HWY
+	/* 8 and 16-bit joins of up to 4 bands, eg. RGB plus alpha, are pure
+	 * shuffles.
+	 */
+	if (vips_vector_isenabled() &&
+		bandary->out_bands <= 4 &&
+		VIPS_IMAGE_SIZEOF_ELEMENT(bandary->ready[0]) <= 2) {
+		int i, b, k;
+
+		k = 0;
+		for (i = 0; i < bandary->n; i++)
+			for (b = 0; b < bandary->ready[i]->Bands && k < 4; b++) {
+				bandjoin->source[k] = i;
+				bandjoin->bands[k] = bandary->ready[i]->Bands;
+				bandjoin->band[k] = b;
+				k += 1;
+			}
+
+		bandjoin->hwy = k == bandary->out_bands;
+	}
+#endif /*HAVE_HWY*/
+
 	return 0;
 }
 
@@ -9,6 +9,9 @@
  * 	- get rid of the complex case, just double the width
  * 19/11/11
  * 	- redo as a class
+ * 19/10/26
+ * 	- add a highway path for 8 and 16-bit unsigned images with up to 4
+ * 	  bands
  */
 
 /*
@@ -52,6 +55,7 @@
 #include <math.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 
 #include "bandary.h"
 
@@ -60,6 +64,10 @@ typedef struct _VipsBandmean {
 
 	VipsImage *in;
 
+	/* Use the highway path.
+	 */
+	gboolean hwy;
+
 } VipsBandmean;
 
 typedef VipsBandaryClass VipsBandmeanClass;
@@ -134,6 +142,14 @@ vips_bandmean_buffer(VipsBandarySequence *seq,
 
 	int i, j;
 
+#ifdef HAVE_HWY
+	if (((VipsBandmean *) bandary)->hwy) {
+		vips_bandmean_hwy(out, in[0], bands, width,
+			VIPS_IMAGE_SIZEOF_ELEMENT(im));
+		return;
+	}
+#endif /*HAVE_HWY*/
+
 	switch (vips_image_get_format(im)) {
 	case VIPS_FORMAT_CHAR:
 		SILOOP(signed char, int);
@@ -189,6 +205,13 @@ vips_bandmean_build(VipsObject *object)
 	if (VIPS_OBJECT_CLASS(vips_bandmean_parent_class)->build(object))
 		return -1;
 
+#ifdef HAVE_HWY
+	bandmean->hwy = vips_vector_isenabled() &&
+		bandary->ready[0]->Bands <= 4 &&
+		(bandary->ready[0]->BandFmt == VIPS_FORMAT_UCHAR ||
+			bandary->ready[0]->BandFmt == VIPS_FORMAT_USHORT);
+#endif /*HAVE_HWY*/
+
 	return 0;
 }
 
@@ -15,6 +15,13 @@
  *	- do our own subimage positioning
  * 8/5/19
  * 	- revise in/out/dest-in/dest-out to make smoother alpha
+ * 19/10/26
+ * 	- add a highway row path for 8 and 16-bit GA and RGBA with the
+ * 	  over, source, dest-over and add modes
+ * 	- classify overlays into transparent, opaque and partial runs, and
+ * 	  only blend where we must
+ * 	- find the inputs for each tile with a VipsRectIndex, and make input
+ * 	  regions on demand
  */
 
 /*
@@ -67,6 +74,7 @@
 #endif
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/internal.h>
 #include <vips/debug.h>
 
@@ -88,6 +96,56 @@
 typedef float v4f __attribute__((vector_size(4 * sizeof(float)), aligned(16)));
 #endif /*HAVE_VECTOR_ARITH*/
 
+/* We remember where overlays are transparent in cells of this many pixels
+ * square.
+ */
+#define VIPS_COMPOSITE_CELL (64)
+
+/* Classify this many pixels of an overlay before deciding whether it's
+ * worth classifying at all.
+ */
+#define VIPS_COMPOSITE_SAMPLE (256 * 1024)
+
+/* Lines with more runs than this are treated as a single partial run.
+ */
+#define VIPS_COMPOSITE_MAX_RUNS (64)
+
+/* The alpha class of a run of pixels.
+ */
+typedef enum {
+	VIPS_COMPOSITE_TRANSPARENT,
+	VIPS_COMPOSITE_OPAQUE,
+	VIPS_COMPOSITE_PARTIAL
+} VipsCompositeAlpha;
+
+/* A run of pixels on a line, all with the same alpha class. Runs are in
+ * order, and the last run on a line ends at the image width.
+ */
+typedef struct {
+	int end;
+	VipsCompositeAlpha alpha;
+} VipsCompositeRun;
+
+/* What we've learned about an overlay. Each request classifies the pixels
+ * it fetches, and this is a summary shared between threads. It's only
+ * updated with atomics.
+ */
+typedef struct {
+	/* A flag for each cell, set once we've seen that the whole cell is
+	 * transparent. We can then skip the overlay without fetching it.
+	 */
+	int cells_across;
+	int cells_down;
+	int *transparent;
+
+	/* Pixels we've classified, and how many of those were partially
+	 * transparent. If most are partial, we set dense and stop classifying.
+	 */
+	int n_pixels;
+	int n_partial;
+	int dense;
+} VipsCompositeCoverage;
+
 typedef struct _VipsCompositeBase {
 	VipsConversion parent_instance;
 
@@ -120,6 +178,11 @@ typedef struct _VipsCompositeBase {
 	 */
 	VipsRect *subimages;
 
+	/* An index over subimages, so we can find the inputs for a region
+	 * without searching them all.
+	 */
+	VipsRectIndex *index;
+
 	/* The number of non-alpha bands we are blending.
 	 */
 	int bands;
@@ -134,6 +197,21 @@ typedef struct _VipsCompositeBase {
 	 */
 	gboolean skippable;
 
+	/* TRUE if we can use the highway row path.
+	 */
+	gboolean row_path;
+
+	/* TRUE if we classify the overlays into runs of transparent, opaque
+	 * and partial pixels, and only blend the partial ones. We need
+	 * skippable modes for this.
+	 */
+	gboolean sparse;
+
+	/* In sparse mode, what we know about each input image. Image 0, the
+	 * background, is never classified.
+	 */
+	VipsCompositeCoverage *coverage;
+
 } VipsCompositeBase;
 
 typedef VipsConversionClass VipsCompositeBaseClass;
@@ -150,6 +228,12 @@ vips_composite_base_dispose(GObject *gobject)
 {
 	VipsCompositeBase *composite = (VipsCompositeBase *) gobject;
 
+	if (composite->coverage) {
+		for (int i = 0; i < composite->in->area.n; i++)
+			VIPS_FREE(composite->coverage[i].transparent);
+		VIPS_FREE(composite->coverage);
+	}
+
 	if (composite->in) {
 		vips_area_unref((VipsArea *) composite->in);
 		composite->in = NULL;
@@ -159,10 +243,24 @@ vips_composite_base_dispose(GObject *gobject)
 		composite->mode = NULL;
 	}
 	VIPS_FREE(composite->subimages);
+	VIPS_FREEF(vips_rect_index_free, composite->index);
 
 	G_OBJECT_CLASS(vips_composite_base_parent_class)->dispose(gobject);
 }
 
+/* Our position in the runs for an overlay, as we move along an output line.
+ */
+typedef struct {
+	/* The current run. Runs are relative to the left edge of the request.
+	 */
+	VipsCompositeRun *run;
+	int left;
+
+	/* The alpha class at the current position.
+	 */
+	VipsCompositeAlpha alpha;
+} VipsCompositeCursor;
+
 /* Our sequence value.
  */
 typedef struct {
@@ -176,8 +274,14 @@ typedef struct {
 
 	VipsCompositeBase *composite;
 
+	/* The input images.
+	 */
+	VipsImage **in;
+	int n_input;
+
 	/* Full set of input regions, each made on the corresponding input
-	 * image.
+	 * image. There can be many thousands of inputs, so we make these on
+	 * demand.
 	 */
 	VipsRegion **input_regions;
 
@@ -200,6 +304,27 @@ typedef struct {
 	 */
 	VipsPel **p;
 
+	/* For each enabled image, the mode we blend it with.
+	 */
+	int *mode;
+
+	/* For each enabled image, the start of the line we are compositing.
+	 */
+	VipsPel **line;
+
+	/* In sparse mode, the modes for the layers we blend for a span, and
+	 * our position in the runs for each enabled image.
+	 */
+	int *span_mode;
+	VipsCompositeCursor *cursor;
+
+	/* In sparse mode, the runs for each line of each enabled overlay in
+	 * the current request, and the index of the first run for each line.
+	 * Overlay i line y starts at line_start[i * height + y].
+	 */
+	GArray *runs;
+	GArray *line_start;
+
 } VipsCompositeSequence;
 
 #ifdef HAVE_VECTOR_ARITH
@@ -243,19 +368,27 @@ vips_composite_stop(void *vseq, void *a, void *b)
 	VipsCompositeSequence *seq = (VipsCompositeSequence *) vseq;
 
 	if (seq->input_regions) {
-		for (int i = 0; seq->input_regions[i]; i++)
+		for (int i = 0; i < seq->n_input; i++)
 			VIPS_UNREF(seq->input_regions[i]);
 		VIPS_FREE(seq->input_regions);
 	}
 
 	if (seq->composite_regions) {
-		for (int i = 0; seq->composite_regions[i]; i++)
+		for (int i = 0; i < seq->n_input; i++)
 			VIPS_UNREF(seq->composite_regions[i]);
 		VIPS_FREE(seq->composite_regions);
 	}
 
 	VIPS_FREE(seq->enabled);
 	VIPS_FREE(seq->p);
+	VIPS_FREE(seq->mode);
+	VIPS_FREE(seq->line);
+	VIPS_FREE(seq->span_mode);
+	VIPS_FREE(seq->cursor);
+	if (seq->runs)
+		g_array_free(seq->runs, TRUE);
+	if (seq->line_start)
+		g_array_free(seq->line_start, TRUE);
 
 #ifdef HAVE_VECTOR_ARITH
 	VIPS_FREEF(vips_free_aligned, seq);
@@ -286,14 +419,24 @@ vips_composite_start(VipsImage *out, void *a, void *b)
 		return NULL;
 
 	seq->composite = composite;
+	seq->in = in;
+	seq->n_input = 0;
 	seq->input_regions = NULL;
+	seq->composite_regions = NULL;
 	seq->enabled = NULL;
 	seq->p = NULL;
+	seq->mode = NULL;
+	seq->line = NULL;
+	seq->span_mode = NULL;
+	seq->cursor = NULL;
+	seq->runs = NULL;
+	seq->line_start = NULL;
 
 	/* How many images?
 	 */
 	for (n = 0; in[n]; n++)
 		;
+	seq->n_input = n;
 
 	/* Allocate space for region array.
 	 */
@@ -314,23 +457,32 @@ vips_composite_start(VipsImage *out, void *a, void *b)
 
 	seq->enabled = VIPS_ARRAY(NULL, n, int);
 	seq->p = VIPS_ARRAY(NULL, n, VipsPel *);
+	seq->mode = VIPS_ARRAY(NULL, n, int);
+	seq->line = VIPS_ARRAY(NULL, n, VipsPel *);
+	seq->span_mode = VIPS_ARRAY(NULL, n, int);
+	seq->cursor = VIPS_ARRAY(NULL, n, VipsCompositeCursor);
+	if (composite->sparse) {
+		seq->runs = g_array_new(FALSE, FALSE, sizeof(VipsCompositeRun));
+		seq->line_start = g_array_new(FALSE, FALSE, sizeof(int));
+	}
 	if (!seq->enabled ||
-		!seq->p) {
+		!seq->p ||
+		!seq->mode ||
+		!seq->line ||
+		!seq->span_mode ||
+		!seq->cursor) {
 		vips_composite_stop(seq, NULL, NULL);
 		return NULL;
 	}
 
-	/* Create a set of regions.
+	/* We always need the background. Other regions are made on demand.
 	 */
-	for (i = 0; i < n; i++) {
-		seq->input_regions[i] = vips_region_new(in[i]);
-		seq->composite_regions[i] = vips_region_new(in[0]);
-
-		if (!seq->input_regions[i] ||
-			!seq->composite_regions[i]) {
-			vips_composite_stop(seq, NULL, NULL);
-			return NULL;
-		}
+	seq->input_regions[0] = vips_region_new(in[0]);
+	seq->composite_regions[0] = vips_region_new(in[0]);
+	if (!seq->input_regions[0] ||
+		!seq->composite_regions[0]) {
+		vips_composite_stop(seq, NULL, NULL);
+		return NULL;
 	}
 
 #ifdef HAVE_VECTOR_ARITH
@@ -441,20 +593,33 @@ vips_composite_base_max_band(VipsCompositeBase *composite, double *max_band)
 /* Find the subset of our input images which intersect this region. If we are
  * not in skippable mode, we must enable all layers.
  */
-static void
+static int
 vips_composite_base_select(VipsCompositeSequence *seq, VipsRect *r)
 {
 	VipsCompositeBase *composite = seq->composite;
-	int n = composite->in->area.n;
 
-	seq->n = 0;
-	for (int i = 0; i < n; i++)
-		if (!composite->skippable ||
-			vips_rect_overlapsrect(r,
-				&composite->subimages[i])) {
-			seq->enabled[seq->n] = i;
-			seq->n += 1;
-		}
+	if (composite->skippable)
+		seq->n = vips_rect_index_query(composite->index, r, seq->enabled);
+	else {
+		for (int i = 0; i < seq->n_input; i++)
+			seq->enabled[i] = i;
+		seq->n = seq->n_input;
+	}
+
+	/* Make any regions we've not needed before.
+	 */
+	for (int i = 0; i < seq->n; i++) {
+		int j = seq->enabled[i];
+
+		if (!seq->input_regions[j] &&
+			!(seq->input_regions[j] = vips_region_new(seq->in[j])))
+			return -1;
+		if (!seq->composite_regions[j] &&
+			!(seq->composite_regions[j] = vips_region_new(seq->in[0])))
+			return -1;
+	}
+
+	return 0;
 }
 
 /* Cairo naming conventions:
@@ -948,15 +1113,13 @@ vips_composite_base_blend3(VipsCompositeSequence *seq,
  */
 template <typename T, gint64 min_T, gint64 max_T>
 static void
-vips_combine_pixels(VipsCompositeSequence *seq, VipsPel *q)
+vips_combine_pixels(VipsCompositeSequence *seq,
+	int n, VipsPel **p, int *mode, VipsPel *q)
 {
 	VipsCompositeBase *composite = seq->composite;
-	VipsBlendMode *mode = (VipsBlendMode *) composite->mode->area.data;
-	int n_mode = composite->mode->area.n;
-	int n = seq->n;
 	int bands = composite->bands;
 	T *restrict tq = (T *restrict) q;
-	T **restrict tp = (T * *restrict) seq->p;
+	T **restrict tp = (T * *restrict) p;
 
 	double B[MAX_BANDS + 1] = { 0.0 };
 	double aB;
@@ -971,12 +1134,9 @@ vips_combine_pixels(VipsCompositeSequence *seq, VipsPel *q)
 		for (int b = 0; b < bands; b++)
 			B[b] *= aB;
 
-	for (int i = 1; i < n; i++) {
-		int j = seq->enabled[i];
-		VipsBlendMode m = n_mode == 1 ? mode[0] : mode[j - 1];
-
-		vips_composite_base_blend<T>(composite, m, B, tp[i]);
-	}
+	for (int i = 1; i < n; i++)
+		vips_composite_base_blend<T>(composite,
+			(VipsBlendMode) mode[i], B, tp[i]);
 
 	/* Unpremultiply, if necessary.
 	 */
@@ -1013,14 +1173,12 @@ vips_combine_pixels(VipsCompositeSequence *seq, VipsPel *q)
  */
 template <typename T, gint64 min_T, gint64 max_T>
 static void
-vips_combine_pixels3(VipsCompositeSequence *seq, VipsPel *q)
+vips_combine_pixels3(VipsCompositeSequence *seq,
+	int n, VipsPel **p, int *mode, VipsPel *q)
 {
 	VipsCompositeBase *composite = seq->composite;
-	VipsBlendMode *mode = (VipsBlendMode *) composite->mode->area.data;
-	int n_mode = composite->mode->area.n;
-	int n = seq->n;
 	T *restrict tq = (T *restrict) q;
-	T **restrict tp = (T * *restrict) seq->p;
+	T **restrict tp = (T * *restrict) p;
 
 	v4f B;
 	float aB;
@@ -1040,12 +1198,9 @@ vips_combine_pixels3(VipsCompositeSequence *seq, VipsPel *q)
 		B[3] = aB;
 	}
 
-	for (int i = 1; i < n; i++) {
-		int j = seq->enabled[i];
-		VipsBlendMode m = n_mode == 1 ? mode[0] : mode[j - 1];
-
-		vips_composite_base_blend3<T>(seq, m, B, tp[i]);
-	}
+	for (int i = 1; i < n; i++)
+		vips_composite_base_blend3<T>(seq,
+			(VipsBlendMode) mode[i], B, tp[i]);
 
 	/* Unpremultiply, if necessary.
 	 */
@@ -1079,21 +1234,494 @@ vips_combine_pixels3(VipsCompositeSequence *seq, VipsPel *q)
 }
 #endif /*HAVE_VECTOR_ARITH*/
 
+/* Blend a span of width pixels for a stack of n layers. p[0] is the base,
+ * and mode[i] is the mode for layer i. We update p[] as we go.
+ */
+static void
+vips_composite_base_blend_span(VipsCompositeSequence *seq,
+	int n, VipsPel **p, int *mode, VipsPel *q, int width)
+{
+	VipsCompositeBase *composite = seq->composite;
+	VipsImage *im = seq->input_regions[0]->im;
+	int ps = VIPS_IMAGE_SIZEOF_PEL(im);
+
+#ifdef HAVE_HWY
+	if (composite->row_path) {
+		vips_composite_row_hwy(q, p, n, mode, width,
+			composite->bands + 1, VIPS_IMAGE_SIZEOF_ELEMENT(im),
+			composite->premultiplied);
+		return;
+	}
+#endif /*HAVE_HWY*/
+
+	for (int x = 0; x < width; x++) {
+		switch (im->BandFmt) {
+		case VIPS_FORMAT_UCHAR:
+#ifdef HAVE_VECTOR_ARITH
+			if (composite->bands == 3)
+				vips_combine_pixels3<unsigned char,
+					0, UCHAR_MAX>(seq, n, p, mode, q);
+			else
+#endif
+				vips_combine_pixels<unsigned char,
+					0, UCHAR_MAX>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_CHAR:
+			vips_combine_pixels<signed char,
+				SCHAR_MIN, SCHAR_MAX>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_USHORT:
+#ifdef HAVE_VECTOR_ARITH
+			if (composite->bands == 3)
+				vips_combine_pixels3<unsigned short,
+					0, USHRT_MAX>(seq, n, p, mode, q);
+			else
+#endif
+				vips_combine_pixels<unsigned short,
+					0, USHRT_MAX>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_SHORT:
+			vips_combine_pixels<signed short,
+				SHRT_MIN, SHRT_MAX>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_UINT:
+			vips_combine_pixels<unsigned int,
+				0, UINT_MAX>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_INT:
+			vips_combine_pixels<signed int,
+				INT_MIN, INT_MAX>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_FLOAT:
+#ifdef HAVE_VECTOR_ARITH
+			if (composite->bands == 3)
+				vips_combine_pixels3<float,
+					0, USHRT_MAX>(seq, n, p, mode, q);
+			else
+#endif
+				vips_combine_pixels<float,
+					0, 0>(seq, n, p, mode, q);
+			break;
+
+		case VIPS_FORMAT_DOUBLE:
+			vips_combine_pixels<double,
+				0, 0>(seq, n, p, mode, q);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		for (int i = 0; i < n; i++)
+			p[i] += ps;
+		q += ps;
+	}
+}
+
+/* Classify a line of an overlay into runs of transparent, opaque and
+ * partially transparent pixels, and append them to @runs.
+ */
+template <typename T>
+static void
+vips_composite_base_line_runs(VipsCompositeBase *composite,
+	GArray *runs, VipsPel *p, int width)
+{
+	T *restrict tp = (T *restrict) p;
+	int bands = composite->bands;
+	T max_alpha = composite->max_band[bands];
+	int start = runs->len;
+
+	for (int x = 0; x < width; x++) {
+		VipsCompositeAlpha alpha;
+
+		if (tp[bands] == max_alpha)
+			alpha = VIPS_COMPOSITE_OPAQUE;
+		else if (tp[bands] <= 0) {
+			/* Premultiplied pixels are only transparent if the
+			 * colour is zero too.
+			 */
+			alpha = VIPS_COMPOSITE_TRANSPARENT;
+			if (composite->premultiplied)
+				for (int b = 0; b < bands; b++)
+					if (tp[b] != 0) {
+						alpha = VIPS_COMPOSITE_PARTIAL;
+						break;
+					}
+		}
+		else
+			alpha = VIPS_COMPOSITE_PARTIAL;
+
+		if ((int) runs->len > start &&
+			g_array_index(runs, VipsCompositeRun,
+				runs->len - 1)
+					.alpha == alpha)
+			g_array_index(runs, VipsCompositeRun,
+				runs->len - 1)
+				.end = x + 1;
+		else {
+			VipsCompositeRun run = { x + 1, alpha };
+
+			g_array_append_val(runs, run);
+		}
+
+		tp += bands + 1;
+	}
+
+	/* Very fragmented lines aren't worth tracking ... just blend
+	 * them.
+	 */
+	if (runs->len - start > VIPS_COMPOSITE_MAX_RUNS) {
+		VipsCompositeRun run = { width, VIPS_COMPOSITE_PARTIAL };
+
+		g_array_set_size(runs, start);
+		g_array_append_val(runs, run);
+	}
+}
+
+/* Classify a line of pixels, in any format.
+ */
+static void
+vips_composite_base_runs(VipsCompositeBase *composite, VipsBandFormat format,
+	GArray *runs, VipsPel *p, int width)
+{
+	switch (format) {
+	case VIPS_FORMAT_UCHAR:
+		vips_composite_base_line_runs<unsigned char>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_CHAR:
+		vips_composite_base_line_runs<signed char>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_USHORT:
+		vips_composite_base_line_runs<unsigned short>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_SHORT:
+		vips_composite_base_line_runs<signed short>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_UINT:
+		vips_composite_base_line_runs<unsigned int>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_INT:
+		vips_composite_base_line_runs<signed int>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_FLOAT:
+		vips_composite_base_line_runs<float>(composite,
+			runs, p, width);
+		break;
+
+	case VIPS_FORMAT_DOUBLE:
+		vips_composite_base_line_runs<double>(composite,
+			runs, p, width);
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* The part of image j that output rect r touches, in image j coordinates.
+ */
+static void
+vips_composite_base_hit(VipsCompositeBase *composite, int j,
+	VipsRect *r, VipsRect *hit)
+{
+	VipsRect *subimage = &composite->subimages[j];
+
+	vips_rect_intersectrect(r, subimage, hit);
+	hit->left -= subimage->left;
+	hit->top -= subimage->top;
+}
+
+/* TRUE if we've already seen that image j is transparent everywhere inside
+ * output rect r.
+ */
+static gboolean
+vips_composite_base_known_transparent(VipsCompositeBase *composite, int j,
+	VipsRect *r)
+{
+	VipsCompositeCoverage *coverage = &composite->coverage[j];
+
+	VipsRect hit;
+
+	vips_composite_base_hit(composite, j, r, &hit);
+	if (vips_rect_isempty(&hit))
+		return TRUE;
+
+	for (int cy = hit.top / VIPS_COMPOSITE_CELL;
+		 cy <= (VIPS_RECT_BOTTOM(&hit) - 1) / VIPS_COMPOSITE_CELL; cy++)
+		for (int cx = hit.left / VIPS_COMPOSITE_CELL;
+			 cx <= (VIPS_RECT_RIGHT(&hit) - 1) / VIPS_COMPOSITE_CELL; cx++)
+			if (!g_atomic_int_get(&coverage->transparent[
+					cy * coverage->cells_across + cx]))
+				return FALSE;
+
+	return TRUE;
+}
+
+/* Image j is transparent everywhere inside output rect r. Mark all the
+ * cells r covers completely.
+ */
+static void
+vips_composite_base_mark_transparent(VipsCompositeBase *composite, int j,
+	VipsRect *r)
+{
+	VipsCompositeCoverage *coverage = &composite->coverage[j];
+	VipsRect *subimage = &composite->subimages[j];
+
+	VipsRect hit;
+	int right, bottom;
+
+	vips_composite_base_hit(composite, j, r, &hit);
+	if (vips_rect_isempty(&hit))
+		return;
+
+	/* Cells on the right and bottom edges can be smaller than the rest.
+	 */
+	right = VIPS_RECT_RIGHT(&hit) == subimage->width
+		? coverage->cells_across
+		: VIPS_RECT_RIGHT(&hit) / VIPS_COMPOSITE_CELL;
+	bottom = VIPS_RECT_BOTTOM(&hit) == subimage->height
+		? coverage->cells_down
+		: VIPS_RECT_BOTTOM(&hit) / VIPS_COMPOSITE_CELL;
+
+	for (int cy = VIPS_ROUND_UP(hit.top, VIPS_COMPOSITE_CELL) /
+			VIPS_COMPOSITE_CELL;
+		 cy < bottom; cy++)
+		for (int cx = VIPS_ROUND_UP(hit.left, VIPS_COMPOSITE_CELL) /
+				VIPS_COMPOSITE_CELL;
+			 cx < right; cx++)
+			g_atomic_int_set(&coverage->transparent[
+				cy * coverage->cells_across + cx], TRUE);
+}
+
+/* Add to the sample of pixels we've classified for an overlay. Once we've
+ * seen enough, give up on overlays which are mostly partial, since
+ * classifying them costs more than it saves.
+ */
+static void
+vips_composite_base_sample(VipsCompositeBase *composite, int j,
+	int n_pixels, int n_partial)
+{
+	VipsCompositeCoverage *coverage = &composite->coverage[j];
+
+	int total;
+	int partial;
+
+	if (g_atomic_int_get(&coverage->n_pixels) >= VIPS_COMPOSITE_SAMPLE)
+		return;
+
+	partial = g_atomic_int_add(&coverage->n_partial, n_partial) + n_partial;
+	total = g_atomic_int_add(&coverage->n_pixels, n_pixels) + n_pixels;
+	if (total >= VIPS_COMPOSITE_SAMPLE &&
+		partial > total / 4 * 3) {
+		g_info("composite: overlay %d is mostly partial, "
+			   "no longer classifying it", j);
+		g_atomic_int_set(&coverage->dense, TRUE);
+	}
+}
+
+/* Classify the pixels we've fetched for each overlay in r into runs. Drop
+ * overlays which turn out to be transparent everywhere in r, and remember
+ * that for next time.
+ */
+static void
+vips_composite_base_classify(VipsCompositeSequence *seq, VipsRect *r)
+{
+	VipsCompositeBase *composite = seq->composite;
+	VipsBandFormat format = seq->input_regions[0]->im->BandFmt;
+
+	int n;
+
+	g_array_set_size(seq->runs, 0);
+	g_array_set_size(seq->line_start, seq->n * r->height);
+
+	n = 1;
+	for (int i = 1; i < seq->n; i++) {
+		int j = seq->enabled[i];
+		VipsCompositeCoverage *coverage = &composite->coverage[j];
+		VipsRegion *region = seq->composite_regions[j];
+		gboolean dense = g_atomic_int_get(&coverage->dense);
+		int first = seq->runs->len;
+
+		gboolean transparent;
+		int n_partial;
+
+		transparent = TRUE;
+		n_partial = 0;
+		for (int y = 0; y < r->height; y++) {
+			int start = seq->runs->len;
+
+			g_array_index(seq->line_start, int, n * r->height + y) = start;
+
+			if (dense) {
+				VipsCompositeRun run = { r->width, VIPS_COMPOSITE_PARTIAL };
+
+				g_array_append_val(seq->runs, run);
+				transparent = FALSE;
+				continue;
+			}
+
+			vips_composite_base_runs(composite, format, seq->runs,
+				VIPS_REGION_ADDR(region, r->left, r->top + y), r->width);
+
+			for (int k = start, x = 0; k < (int) seq->runs->len; k++) {
+				VipsCompositeRun *run =
+					&g_array_index(seq->runs, VipsCompositeRun, k);
+
+				if (run->alpha != VIPS_COMPOSITE_TRANSPARENT)
+					transparent = FALSE;
+				if (run->alpha == VIPS_COMPOSITE_PARTIAL)
+					n_partial += run->end - x;
+				x = run->end;
+			}
+		}
+
+		if (!dense)
+			vips_composite_base_sample(composite, j,
+				r->width * r->height, n_partial);
+
+		if (transparent) {
+			vips_composite_base_mark_transparent(composite, j, r);
+			g_array_set_size(seq->runs, first);
+		}
+		else {
+			seq->enabled[n] = j;
+			n += 1;
+		}
+	}
+
+	seq->n = n;
+}
+
+/* The alpha class of layer i at output x, and the x where that class ends.
+ */
+static VipsCompositeAlpha
+vips_composite_cursor_alpha(VipsCompositeCursor *cursor, int x, int *end)
+{
+	while (cursor->left + cursor->run->end <= x)
+		cursor->run++;
+	*end = cursor->left + cursor->run->end;
+
+	return cursor->run->alpha;
+}
+
+/* Composite line y of r, splitting it into spans where the set of layers
+ * we need is constant. We can copy spans where only one layer is visible,
+ * and blend just the layers which matter everywhere else.
+ */
+static void
+vips_composite_base_sparse_line(VipsCompositeSequence *seq,
+	VipsRect *r, int y, VipsPel *q)
+{
+	int ps = VIPS_IMAGE_SIZEOF_PEL(seq->input_regions[0]->im);
+
+	for (int i = 1; i < seq->n; i++) {
+		VipsCompositeCursor *cursor = &seq->cursor[i];
+		int start = g_array_index(seq->line_start, int,
+			i * r->height + y - r->top);
+
+		cursor->left = r->left;
+		cursor->run = &g_array_index(seq->runs, VipsCompositeRun, start);
+	}
+
+	for (int x = r->left; x < VIPS_RECT_RIGHT(r);) {
+		int end = VIPS_RECT_RIGHT(r);
+		int bottom = 0;
+		int n;
+
+		/* Anything under an opaque OVER is hidden, so the highest of
+		 * these becomes the bottom of the stack.
+		 */
+		for (int i = 1; i < seq->n; i++) {
+			VipsCompositeCursor *cursor = &seq->cursor[i];
+			int layer_end;
+
+			cursor->alpha = vips_composite_cursor_alpha(cursor,
+				x, &layer_end);
+			end = VIPS_MIN(end, layer_end);
+
+			if (cursor->alpha == VIPS_COMPOSITE_OPAQUE &&
+				seq->mode[i] == VIPS_BLEND_MODE_OVER)
+				bottom = i;
+		}
+
+		/* Transparent layers above that have no effect, since we
+		 * only come here for skippable modes.
+		 */
+		n = 0;
+		for (int i = bottom; i < seq->n; i++)
+			if (i == bottom ||
+				seq->cursor[i].alpha != VIPS_COMPOSITE_TRANSPARENT) {
+				seq->p[n] = seq->line[i] + (x - r->left) * ps;
+				seq->span_mode[n] = seq->mode[i];
+				n += 1;
+			}
+
+		/* Unpremultiplied blending zeros the colour of pixels with
+		 * zero alpha, so we can only copy the base if it's
+		 * premultiplied. An opaque overlay is always safe to copy.
+		 */
+		if (n == 1 &&
+			(bottom > 0 || seq->composite->premultiplied))
+			memcpy(q + (x - r->left) * ps, seq->p[0], (end - x) * ps);
+		else
+			vips_composite_base_blend_span(seq, n, seq->p,
+				seq->span_mode, q + (x - r->left) * ps, end - x);
+
+		x = end;
+	}
+}
+
 static int
 vips_composite_base_gen(VipsRegion *output_region,
 	void *vseq, void *a, void *b, gboolean *stop)
 {
 	VipsCompositeSequence *seq = (VipsCompositeSequence *) vseq;
 	VipsCompositeBase *composite = (VipsCompositeBase *) b;
+	VipsBlendMode *mode = (VipsBlendMode *) composite->mode->area.data;
+	int n_mode = composite->mode->area.n;
 	VipsRect *r = &output_region->valid;
-	int ps = VIPS_IMAGE_SIZEOF_PEL(output_region->im);
 
 	VIPS_DEBUG_MSG("vips_composite_base_gen: at %d x %d, size %d x %d\n",
 		r->left, r->top, r->width, r->height);
 
 	/* Find the subset of our input images which intersect this region.
 	 */
-	vips_composite_base_select(seq, r);
+	if (vips_composite_base_select(seq, r))
+		return -1;
+
+	/* In sparse mode, we can also drop any layers we've already seen are
+	 * completely transparent in this region.
+	 */
+	if (composite->sparse) {
+		int n;
+
+		n = 1;
+		for (int i = 1; i < seq->n; i++)
+			if (!vips_composite_base_known_transparent(composite,
+					seq->enabled[i], r)) {
+				seq->enabled[n] = seq->enabled[i];
+				n += 1;
+			}
+		seq->n = n;
+	}
 
 	VIPS_DEBUG_MSG("  selected %d images\n", seq->n);
 
@@ -1162,6 +1790,14 @@ vips_composite_base_gen(VipsRegion *output_region,
 		}
 	}
 
+	/* Classify the overlay pixels we've just fetched.
+	 */
+	if (composite->sparse)
+		vips_composite_base_classify(seq, r);
+
+	for (int i = 1; i < seq->n; i++)
+		seq->mode[i] = n_mode == 1 ? mode[0] : mode[seq->enabled[i] - 1];
+
 	VIPS_GATE_START("vips_composite_base_gen: work");
 
 	for (int y = 0; y < r->height; y++) {
@@ -1170,79 +1806,19 @@ vips_composite_base_gen(VipsRegion *output_region,
 		for (int i = 0; i < seq->n; i++) {
 			int j = seq->enabled[i];
 
-			seq->p[i] = VIPS_REGION_ADDR(seq->composite_regions[j],
+			seq->line[i] = VIPS_REGION_ADDR(seq->composite_regions[j],
 				r->left, r->top + y);
 		}
 		q = VIPS_REGION_ADDR(output_region, r->left, r->top + y);
 
-		for (int x = 0; x < r->width; x++) {
-			switch (seq->input_regions[0]->im->BandFmt) {
-			case VIPS_FORMAT_UCHAR:
-#ifdef HAVE_VECTOR_ARITH
-				if (composite->bands == 3)
-					vips_combine_pixels3<unsigned char,
-						0, UCHAR_MAX>(seq, q);
-				else
-#endif
-					vips_combine_pixels<unsigned char,
-						0, UCHAR_MAX>(seq, q);
-				break;
-
-			case VIPS_FORMAT_CHAR:
-				vips_combine_pixels<signed char,
-					SCHAR_MIN, SCHAR_MAX>(seq, q);
-				break;
-
-			case VIPS_FORMAT_USHORT:
-#ifdef HAVE_VECTOR_ARITH
-				if (composite->bands == 3)
-					vips_combine_pixels3<unsigned short,
-						0, USHRT_MAX>(seq, q);
-				else
-#endif
-					vips_combine_pixels<unsigned short,
-						0, USHRT_MAX>(seq, q);
-				break;
-
-			case VIPS_FORMAT_SHORT:
-				vips_combine_pixels<signed short,
-					SHRT_MIN, SHRT_MAX>(seq, q);
-				break;
-
-			case VIPS_FORMAT_UINT:
-				vips_combine_pixels<unsigned int,
-					0, UINT_MAX>(seq, q);
-				break;
-
-			case VIPS_FORMAT_INT:
-				vips_combine_pixels<signed int,
-					INT_MIN, INT_MAX>(seq, q);
-				break;
-
-			case VIPS_FORMAT_FLOAT:
-#ifdef HAVE_VECTOR_ARITH
-				if (composite->bands == 3)
-					vips_combine_pixels3<float,
-						0, USHRT_MAX>(seq, q);
-				else
-#endif
-					vips_combine_pixels<float,
-						0, 0>(seq, q);
-				break;
-
-			case VIPS_FORMAT_DOUBLE:
-				vips_combine_pixels<double,
-					0, 0>(seq, q);
-				break;
-
-			default:
-				g_assert_not_reached();
-				return -1;
-			}
-
+		if (composite->sparse)
+			vips_composite_base_sparse_line(seq, r, r->top + y, q);
+		else {
 			for (int i = 0; i < seq->n; i++)
-				seq->p[i] += ps;
-			q += ps;
+				seq->p[i] = seq->line[i];
+
+			vips_composite_base_blend_span(seq, seq->n, seq->p,
+				seq->mode, q, r->width);
 		}
 	}
 
@@ -1276,6 +1852,47 @@ vips_composite_mode_skippable(VipsBlendMode mode)
 	}
 }
 
+#ifdef HAVE_HWY
+/* The highway row path handles the common 8- and 16-bit GA and RGBA cases
+ * with the simple modes, where every band has the full range of the format.
+ */
+static gboolean
+vips_composite_base_row_path(VipsCompositeBase *composite,
+	VipsBandFormat format)
+{
+	VipsBlendMode *mode = (VipsBlendMode *) composite->mode->area.data;
+
+	double max;
+
+	if (!vips_vector_isenabled())
+		return FALSE;
+
+	if (composite->bands != 1 &&
+		composite->bands != 3)
+		return FALSE;
+
+	if (format == VIPS_FORMAT_UCHAR)
+		max = UCHAR_MAX;
+	else if (format == VIPS_FORMAT_USHORT)
+		max = USHRT_MAX;
+	else
+		return FALSE;
+
+	for (int b = 0; b <= composite->bands; b++)
+		if (composite->max_band[b] != max)
+			return FALSE;
+
+	for (int i = 0; i < composite->mode->area.n; i++)
+		if (mode[i] != VIPS_BLEND_MODE_OVER &&
+			mode[i] != VIPS_BLEND_MODE_SOURCE &&
+			mode[i] != VIPS_BLEND_MODE_DEST_OVER &&
+			mode[i] != VIPS_BLEND_MODE_ADD)
+			return FALSE;
+
+	return TRUE;
+}
+#endif /*HAVE_HWY*/
+
 static int
 vips_composite_base_build(VipsObject *object)
 {
@@ -1347,6 +1964,9 @@ vips_composite_base_build(VipsObject *object)
 				composite->y_offset[i - 1];
 		}
 
+	if (!(composite->index = vips_rect_index_new(composite->subimages, n)))
+		return -1;
+
 	decode = (VipsImage **) vips_object_local_array(object, n);
 	for (int i = 0; i < n; i++)
 		if (vips_image_decode(in[i], &decode[i]))
@@ -1447,6 +2067,39 @@ vips_composite_base_build(VipsObject *object)
 		return -1;
 	in = format;
 
+#ifdef HAVE_HWY
+	composite->row_path =
+		vips_composite_base_row_path(composite, in[0]->BandFmt);
+#endif /*HAVE_HWY*/
+
+	/* Overlays such as text and logos are mostly transparent or opaque.
+	 * With skippable modes, we can classify the overlay pixels we fetch
+	 * and copy rather than blend the transparent and opaque runs. We
+	 * stop classifying overlays which turn out to be mostly partial.
+	 */
+	composite->sparse = composite->skippable && n > 1;
+	if (composite->sparse) {
+		if (!(composite->coverage =
+					VIPS_ARRAY(NULL, n, VipsCompositeCoverage)))
+			return -1;
+		memset(composite->coverage, 0,
+			n * sizeof(VipsCompositeCoverage));
+
+		for (int i = 1; i < n; i++) {
+			VipsCompositeCoverage *coverage = &composite->coverage[i];
+			int n_cells;
+
+			coverage->cells_across = VIPS_ROUND_UP(in[i]->Xsize,
+				VIPS_COMPOSITE_CELL) / VIPS_COMPOSITE_CELL;
+			coverage->cells_down = VIPS_ROUND_UP(in[i]->Ysize,
+				VIPS_COMPOSITE_CELL) / VIPS_COMPOSITE_CELL;
+			n_cells = coverage->cells_across * coverage->cells_down;
+			if (!(coverage->transparent = VIPS_ARRAY(NULL, n_cells, int)))
+				return -1;
+			memset(coverage->transparent, 0, n_cells * sizeof(int));
+		}
+	}
+
 	/* We want locality, so that we only prepare a few subimages each
 	 * time.
 	 */
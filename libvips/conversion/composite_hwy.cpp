@@ -0,0 +1,281 @@
+/* 19/10/26
+ * 	- initial implementation, from composite.cpp
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+
+	A row path for the common composite case: 8- or 16-bit GA or RGBA
+	images, blended with OVER, SOURCE, DEST_OVER or ADD.
+
+	The generic path in composite.cpp works one pixel at a time and
+	switches on the mode for every pixel. Here we composite a whole row
+	of the layer stack at once, many pixels per vector. The pixels stay
+	interleaved: each float lane holds one band, and we get the alpha
+	for each pixel by broadcasting within the pixel. All four modes are
+	then a single multiply-add applied to every lane, colour and alpha
+	alike.
+
+	We accumulate in 32-bit float lanes. A 16-bit fixed point
+	accumulator is not precise enough once we unpremultiply
+	low-alpha pixels, and 32-bit float needs no emulated division.
+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/debug.h>
+#include <vips/internal.h>
+
+#include "pconversion.h"
+
+#ifdef HAVE_HWY
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "libvips/conversion/composite_hwy.cpp"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+namespace HWY_NAMESPACE {
+
+using namespace hwy::HWY_NAMESPACE;
+
+using DI32 = ScalableTag<int32_t>;
+using DF32 = ScalableTag<float>;
+constexpr DI32 di32;
+constexpr DF32 df32;
+
+/* Each lane set to the alpha of the pixel it belongs to. Pixels are 2 or
+ * 4 floats, so they never straddle a 128-bit block.
+ */
+template <int C>
+HWY_INLINE HWY_ATTR Vec<DF32>
+Alpha(Vec<DF32> v)
+{
+	return C == 4 ? Broadcast<3>(v) : DupOdd(v);
+}
+
+/* Load N band elements and scale to 0 - 1.
+ */
+template <typename T>
+HWY_INLINE HWY_ATTR Vec<DF32>
+LoadScaled(const T *HWY_RESTRICT p, Vec<DF32> v_scale)
+{
+	const Rebind<T, DI32> dt;
+
+	return Mul(ConvertTo(df32, PromoteTo(di32, LoadU(dt, p))), v_scale);
+}
+
+/* Blend a new pixel A into the accumulator B. With premultiplied values,
+ * all these modes treat alpha like any other band, except that ADD
+ * saturates alpha at 1.
+ */
+HWY_INLINE HWY_ATTR Vec<DF32>
+Blend(int32_t mode, Vec<DF32> A, Vec<DF32> aA, Vec<DF32> B, Vec<DF32> aB,
+	Mask<DF32> is_alpha)
+{
+	const auto one = Set(df32, 1.0f);
+
+	switch (mode) {
+	case VIPS_BLEND_MODE_SOURCE:
+		return A;
+
+	case VIPS_BLEND_MODE_OVER:
+		return MulAdd(Sub(one, aA), B, A);
+
+	case VIPS_BLEND_MODE_DEST_OVER:
+		return MulAdd(Sub(one, aB), A, B);
+
+	case VIPS_BLEND_MODE_ADD:
+		B = Add(A, B);
+		return IfThenElse(is_alpha, Min(B, one), B);
+
+	default:
+		return B;
+	}
+}
+
+template <typename T, int C>
+HWY_INLINE HWY_ATTR void
+CompositeRow(T *HWY_RESTRICT q, VipsPel **p, int32_t n,
+	const int32_t *HWY_RESTRICT mode, int32_t width, float max,
+	bool premultiplied)
+{
+	const Rebind<T, DI32> dt;
+	const int32_t N = Lanes(df32);
+	const int32_t ne = width * C;
+
+	const auto v_scale = Set(df32, 1.0f / max);
+	const auto v_max = Set(df32, max);
+	const auto zero = Zero(df32);
+	const auto is_alpha = RebindMask(df32,
+		Eq(And(Iota(di32, 0), Set(di32, C - 1)), Set(di32, C - 1)));
+
+	/* N is always a multiple of C, so each vector holds whole pixels.
+	 */
+	int32_t x = 0;
+	for (; x + N <= ne; x += N) {
+		auto B = LoadScaled((const T *) p[0] + x, v_scale);
+		auto aB = Alpha<C>(B);
+		if (!premultiplied)
+			B = IfThenElse(is_alpha, B, Mul(B, aB));
+
+		for (int32_t i = 1; i < n; i++) {
+			auto A = LoadScaled((const T *) p[i] + x, v_scale);
+			auto aA = Alpha<C>(A);
+			if (!premultiplied)
+				A = IfThenElse(is_alpha, A, Mul(A, aA));
+
+			B = Blend(mode[i], A, aA, B, aB, is_alpha);
+			aB = Alpha<C>(B);
+		}
+
+		if (!premultiplied)
+			B = IfThenElse(is_alpha, B,
+				IfThenElseZero(Gt(aB, zero), Div(B, aB)));
+
+		/* Scale back and clip. The float -> int conversion truncates,
+		 * like the generic path.
+		 */
+		B = Min(Max(Mul(B, v_max), zero), v_max);
+		StoreU(DemoteTo(dt, ConvertTo(di32, B)), dt, q + x);
+	}
+
+	/* `ne` was not a multiple of the vector length `N`;
+	 * proceed pixel by pixel.
+	 */
+	for (; x < ne; x += C) {
+		float B[C];
+		float aB;
+
+		for (int32_t b = 0; b < C; b++)
+			B[b] = ((const T *) p[0])[x + b] / max;
+		aB = B[C - 1];
+		if (!premultiplied)
+			for (int32_t b = 0; b < C - 1; b++)
+				B[b] *= aB;
+
+		for (int32_t i = 1; i < n; i++) {
+			float A[C];
+			float aA;
+
+			for (int32_t b = 0; b < C; b++)
+				A[b] = ((const T *) p[i])[x + b] / max;
+			aA = A[C - 1];
+			if (!premultiplied)
+				for (int32_t b = 0; b < C - 1; b++)
+					A[b] *= aA;
+
+			for (int32_t b = 0; b < C; b++)
+				switch (mode[i]) {
+				case VIPS_BLEND_MODE_SOURCE:
+					B[b] = A[b];
+					break;
+
+				case VIPS_BLEND_MODE_OVER:
+					B[b] = A[b] + (1 - aA) * B[b];
+					break;
+
+				case VIPS_BLEND_MODE_DEST_OVER:
+					B[b] = B[b] + (1 - aB) * A[b];
+					break;
+
+				case VIPS_BLEND_MODE_ADD:
+					B[b] = A[b] + B[b];
+					break;
+
+				default:
+					break;
+				}
+
+			if (mode[i] == VIPS_BLEND_MODE_ADD)
+				B[C - 1] = VIPS_MIN(1, B[C - 1]);
+			aB = B[C - 1];
+		}
+
+		if (!premultiplied)
+			for (int32_t b = 0; b < C - 1; b++)
+				B[b] = aB > 0 ? B[b] / aB : 0;
+
+		for (int32_t b = 0; b < C; b++)
+			q[x + b] = VIPS_CLIP(0, B[b] * max, max);
+	}
+}
+
+HWY_ATTR void
+vips_composite_row_hwy(VipsPel *HWY_RESTRICT q, VipsPel **p, int32_t n,
+	const int32_t *HWY_RESTRICT mode, int32_t width, int32_t channels,
+	int32_t sizeof_element, int32_t premultiplied)
+{
+#if HWY_TARGET != HWY_SCALAR
+	if (sizeof_element == 2) {
+		if (channels == 4)
+			CompositeRow<uint16_t, 4>((uint16_t *) q, p, n, mode,
+				width, USHRT_MAX, premultiplied);
+		else
+			CompositeRow<uint16_t, 2>((uint16_t *) q, p, n, mode,
+				width, USHRT_MAX, premultiplied);
+	}
+	else {
+		if (channels == 4)
+			CompositeRow<uint8_t, 4>(q, p, n, mode,
+				width, UCHAR_MAX, premultiplied);
+		else
+			CompositeRow<uint8_t, 2>(q, p, n, mode,
+				width, UCHAR_MAX, premultiplied);
+	}
+#endif
+}
+
+} /*namespace HWY_NAMESPACE*/
+
+#if HWY_ONCE
+HWY_EXPORT(vips_composite_row_hwy);
+
+void
+vips_composite_row_hwy(VipsPel *q, VipsPel **p, int n, const int *mode,
+	int width, int channels, int sizeof_element, gboolean premultiplied)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_composite_row_hwy)(q, p, n, mode,
+		width, channels, sizeof_element, premultiplied);
+	/* clang-format on */
+}
+#endif /*HWY_ONCE*/
+
+#endif /*HAVE_HWY*/
@@ -37,6 +37,9 @@
  * 	- gtkdoc
  * 26/10/11
  * 	- redone as a class
+ * 19/10/26
+ * 	- add a highway path for extract_band on 8 and 16-bit images with up
+ * 	  to 4 bands
  */
 
 /*
@@ -80,6 +83,7 @@
 #include <stdlib.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/internal.h>
 #include <vips/debug.h>
 
@@ -342,6 +346,13 @@ typedef struct _VipsExtractBand {
 
 	int band;
 	int n;
+
+	/* For the highway path, the number of input bands and the input band
+	 * for each output band.
+	 */
+	gboolean hwy;
+	int bands[4];
+	int from[4];
 } VipsExtractBand;
 
 typedef VipsBandaryClass VipsExtractBandClass;
@@ -364,6 +375,17 @@ vips_extract_band_buffer(VipsBandarySequence *seq,
 	VipsPel *restrict q;
 	int x, z;
 
+#ifdef HAVE_HWY
+	if (extract->hwy) {
+		VipsPel *src[4] = { in[0], in[0], in[0], in[0] };
+
+		vips_bandary_shuffle_hwy(out, extract->n, src,
+			extract->bands, extract->from, width, es);
+
+		return;
+	}
+#endif /*HAVE_HWY*/
+
 	p = in[0] + extract->band * es;
 	q = out;
 	if (ops == 1) {
@@ -413,6 +435,24 @@ vips_extract_band_build(VipsObject *object)
 	if (VIPS_OBJECT_CLASS(vips_extract_band_parent_class)->build(object))
 		return -1;
 
+#ifdef HAVE_HWY
+	/* Taking up to 4 bands from an 8 or 16-bit image of up to 4 bands, eg.
+	 * dropping alpha, is a pure shuffle.
+	 */
+	if (vips_vector_isenabled() &&
+		bandary->ready[0]->Bands <= 4 &&
+		VIPS_IMAGE_SIZEOF_ELEMENT(bandary->ready[0]) <= 2) {
+		int b;
+
+		for (b = 0; b < extract->n; b++) {
+			extract->bands[b] = bandary->ready[0]->Bands;
+			extract->from[b] = extract->band + b;
+		}
+
+		extract->hwy = TRUE;
+	}
+#endif /*HAVE_HWY*/
+
 	return 0;
 }
 
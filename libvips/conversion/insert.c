@@ -30,6 +30,8 @@
  * 	- add expand, bg options
  * 5/11/21
  * 	- add minimise for seq pipelines
+ * 19/10/26
+ * 	- don't paint the background under areas main covers
  */
 
 /*
@@ -115,9 +117,12 @@ typedef VipsConversionClass VipsInsertClass;
 
 G_DEFINE_TYPE(VipsInsert, vips_insert, VIPS_TYPE_CONVERSION);
 
-/* Trivial case: we just need pels from one of the inputs.
+/* Trivial case: we just need pels from one of the inputs. out_region is
+ * attached to ir, so ir must stay alive until out_region is next used.
+ *
+ * Also used by vips_arrayjoin.
  */
-static int
+int
 vips__insert_just_one(VipsRegion *out_region, VipsRegion *ir, int x, int y)
 {
 	VipsRect need;
@@ -205,10 +210,11 @@ vips_insert_gen(VipsRegion *out_region,
 	}
 	else {
 		/* Output requires both (or neither) input. If it is not
-		 * entirely inside both the main and the sub, then there is
-		 * going to be some background.
+		 * entirely inside the main image, then there is going to be
+		 * some background.
 		 */
-		vips_region_paint_pel(out_region, r, insert->ink);
+		if (!vips_rect_includesrect(&insert->rimage[0], r))
+			vips_region_paint_pel(out_region, r, insert->ink);
 
 		/* Paste the background first.
 		 */
@@ -66,6 +66,9 @@ typedef struct _VipsConversionClass {
 
 GType vips_conversion_get_type(void);
 
+void vips_composite_row_hwy(VipsPel *q, VipsPel **p, int n, const int *mode,
+	int width, int channels, int sizeof_element, gboolean premultiplied);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -25,6 +25,8 @@
  * 	- deprecate @trace, @access now seq is much simpler
  * 6/9/21
  * 	- don't set "persistent", it can cause huge memory use
+ * 19/10/26
+ * 	- don't make cancellation sticky, other pipelines can share us
  */
 
 /*
@@ -92,7 +94,8 @@ typedef struct _VipsSequential {
 	int y_pos;
 
 	/* If one thread gets an error, we must stop all threads, otherwise we
-	 * can stall and never wake.
+	 * can stall and never wake. Cancellation only stops the cancelled
+	 * pipeline, so it isn't recorded here.
 	 */
 	int error;
 } VipsSequential;
@@ -156,7 +159,8 @@ vips_sequential_generate(VipsRegion *out_region,
 			area.width = 1;
 			area.height = VIPS_MIN(sequential->tile_height, r->top - area.top);
 			if (vips_region_prepare(ir, &area)) {
-				sequential->error = -1;
+				if (!vips__cancellable_check_current())
+					sequential->error = -1;
 				g_mutex_unlock(&sequential->lock);
 				return -1;
 			}
@@ -171,7 +175,8 @@ vips_sequential_generate(VipsRegion *out_region,
 	 */
 	if (vips_region_prepare(ir, r) ||
 		vips_region_region(out_region, ir, r, r->left, r->top)) {
-		sequential->error = -1;
+		if (!vips__cancellable_check_current())
+			sequential->error = -1;
 		g_mutex_unlock(&sequential->lock);
 		return -1;
 	}
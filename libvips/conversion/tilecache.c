@@ -35,6 +35,14 @@
  * 	- terminate on tile calc error
  * 7/3/17
  * 	- remove "access" on linecache, use the base class instead
+ * 19/10/26
+ * 	- split the cache into lock-striped shards, and wait on single tiles
+ * 	  rather than on the whole cache
+ * 	- keep the tile count and recycle order for the whole cache, so
+ * 	  max_tiles and LRU reuse are exact
+ * 	- add "max_spill", write evicted tiles to a temp file
+ * 	- do spill I/O with pread()/pwrite() once the shard lock is released
+ * 	- a cancelled pipeline puts its tile back, rather than blacking it out
  */
 
 /*
@@ -77,6 +85,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /*HAVE_UNISTD_H*/
+#ifdef HAVE_IO_H
+#include <io.h>
+#endif /*HAVE_IO_H*/
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -96,13 +111,86 @@ typedef enum VipsTileState {
 	VIPS_TILE_STATE_PEND
 } VipsTileState;
 
+/* The hash table is split into shards, each with a lock. Tiles are spread
+ * over shards by position, so threads working on different parts of an
+ * image rarely meet on a lock. The tile count and the recycle queue are
+ * for the whole cache, so max_tiles is a global limit and we always reuse
+ * the least recently used tile.
+ */
+#define VIPS_BLOCK_CACHE_MAX_SHARDS (16)
+
+/* Don't shard below this many tiles per shard, there's little to gain.
+ */
+#define VIPS_BLOCK_CACHE_SHARD_TILES (16)
+
+typedef struct _VipsBlockCacheShard {
+	GMutex lock;	   /* Lock everything here */
+	GHashTable *tiles; /* Tiles, hashed by coordinates */
+} VipsBlockCacheShard;
+
+/* A tile which has been written to the spill file.
+ */
+typedef struct _VipsSpillEntry {
+	VipsRect pos; /* Hash key, as for VipsTile */
+	int slot;	  /* Position in file, in units of tile_size */
+	GList link;	  /* Our node in the LRU queue */
+} VipsSpillEntry;
+
+/* Tiles evicted from memory can be written to a temp file and read back on
+ * a hit. All tiles are the same size, so the file is a set of fixed-size
+ * slots.
+ *
+ * The lock only covers the bookkeeping. Reads and writes claim a slot,
+ * drop the lock for the I/O, then lock again to publish or free the slot.
+ */
+typedef struct _VipsBlockCacheSpill {
+	GMutex lock;
+
+	/* Bumped by drop_all, so I/O which started before a drop doesn't
+	 * publish or free slots in the new file.
+	 */
+	guint generation;
+
+	int fd; /* -1 until the first tile is spilled */
+	size_t tile_size;
+	int max_slots;
+
+	int n_slots;  /* Slots used in file so far */
+	GArray *free; /* Stack of free slots */
+
+	GHashTable *entries; /* VipsSpillEntry, hashed by coordinates */
+	GQueue *lru;		 /* Oldest spilled tile at the head */
+} VipsBlockCacheSpill;
+
+/* Spill I/O that vips_tile_find() sets up under the shard lock, to be done
+ * once the lock has been released.
+ */
+typedef struct _VipsSpillIO {
+	/* A copy of the pixels of an evicted tile, or NULL.
+	 */
+	VipsRect write_pos;
+	VipsPel *write_buf;
+	size_t write_length;
+
+	/* The slot the found tile is read back from, or -1.
+	 */
+	int read_slot;
+	guint read_generation;
+} VipsSpillIO;
+
 /* A tile in our cache.
  */
 typedef struct _VipsTile {
 	struct _VipsBlockCache *cache;
+	VipsBlockCacheShard *shard;
 
 	VipsTileState state;
 
+	/* Signalled when the tile goes from CALC to DATA. Only threads which
+	 * need this tile wait on it.
+	 */
+	GCond done;
+
 	VipsRegion *region; /* Region with private mem for data */
 
 	/* We count how many threads are relying on this tile. This tile can't
@@ -110,6 +198,13 @@ typedef struct _VipsTile {
 	 */
 	int ref_count;
 
+	/* Our node in the recycle queue, if ref_count is zero. Tiles are only
+	 * moved while they are off the queue, so pos and shard can be read
+	 * with just the recycle lock.
+	 */
+	GList recycle_link;
+	gboolean recycled;
+
 	/* Tile position. Just use left/top to calculate a hash. This is the
 	 * key for the hash table. Don't use region->valid in case the region
 	 * pointer is NULL.
@@ -129,10 +224,29 @@ typedef struct _VipsBlockCache {
 	gboolean threaded;
 	gboolean persistent;
 
-	GMutex lock;	   /* Lock everything here */
-	GCond new_tile;	   /* A new tile is ready */
-	GHashTable *tiles; /* Tiles, hashed by coordinates */
-	GQueue *recycle;   /* Queue of unreffed tiles to reuse */
+	/* Held during the whole of _gen in non-threaded mode, so only one
+	 * thread at a time can calculate tiles. Also guards max_tiles changes
+	 * in linecache.
+	 */
+	GMutex lock;
+
+	int n_shards;
+	VipsBlockCacheShard *shards;
+
+	/* Tiles in all shards.
+	 */
+	int n_tiles;
+
+	/* Unreffed tiles we can reuse, oldest first. Take this after any shard
+	 * lock, never before.
+	 */
+	GMutex recycle_lock;
+	GQueue recycle;
+
+	/* Write evicted tiles to disk, up to this many bytes.
+	 */
+	guint64 max_spill;
+	VipsBlockCacheSpill *spill;
 } VipsBlockCache;
 
 typedef VipsConversionClass VipsBlockCacheClass;
@@ -142,14 +256,310 @@ G_DEFINE_ABSTRACT_TYPE(VipsBlockCache, vips_block_cache,
 
 #define VIPS_TYPE_BLOCK_CACHE (vips_block_cache_get_type())
 
+static void
+vips_block_cache_spill_remove(VipsBlockCacheSpill *spill,
+	VipsSpillEntry *entry)
+{
+	g_hash_table_remove(spill->entries, &entry->pos);
+	g_queue_unlink(spill->lru, &entry->link);
+	g_array_append_val(spill->free, entry->slot);
+	g_free(entry);
+}
+
+/* Drop all spilled tiles and shrink the file.
+ */
+static void
+vips_block_cache_spill_drop_all(VipsBlockCacheSpill *spill)
+{
+	VipsSpillEntry *entry;
+
+	g_mutex_lock(&spill->lock);
+
+	while ((entry = (VipsSpillEntry *) g_queue_peek_head(spill->lru)))
+		vips_block_cache_spill_remove(spill, entry);
+	g_array_set_size(spill->free, 0);
+	spill->n_slots = 0;
+	spill->generation += 1;
+	if (spill->fd != -1 &&
+		vips__ftruncate(spill->fd, 0))
+		vips_error_clear();
+
+	g_mutex_unlock(&spill->lock);
+}
+
+static void
+vips_block_cache_spill_free(VipsBlockCacheSpill *spill)
+{
+	vips_block_cache_spill_drop_all(spill);
+
+	if (spill->fd != -1)
+		vips_tracked_close(spill->fd);
+	VIPS_FREEF(g_hash_table_destroy, spill->entries);
+	VIPS_FREEF(g_queue_free, spill->lru);
+	VIPS_FREEF(g_array_unref, spill->free);
+	g_mutex_clear(&spill->lock);
+	g_free(spill);
+}
+
+/* Open the spill file. It's unlinked straight away, so it vanishes when we
+ * close it, or if we crash.
+ */
+static int
+vips_block_cache_spill_open(VipsBlockCacheSpill *spill)
+{
+	char *filename;
+
+	if (!(filename = vips__temp_name("%s.spill")))
+		return -1;
+	if ((spill->fd = vips__open_image_write(filename, TRUE)) < 0) {
+		g_free(filename);
+		return -1;
+	}
+	(void) g_unlink(filename);
+	g_free(filename);
+
+	return 0;
+}
+
+static int
+vips_block_cache_spill_pwrite(VipsBlockCacheSpill *spill,
+	const VipsPel *buf, size_t length, gint64 offset)
+{
+#ifdef HAVE_PWRITE
+	while (length > 0) {
+		gint64 bytes_written = pwrite(spill->fd, buf, length, offset);
+
+		if (bytes_written < 0 &&
+			errno == EINTR)
+			continue;
+		if (bytes_written <= 0)
+			return -1;
+
+		buf += bytes_written;
+		offset += bytes_written;
+		length -= bytes_written;
+	}
+
+	return 0;
+#else  /*!HAVE_PWRITE*/
+	int result;
+
+	/* No pwrite(), so the seek and write must be atomic.
+	 */
+	g_mutex_lock(&spill->lock);
+	result = vips__seek(spill->fd, offset, SEEK_SET) < 0 ||
+		vips__write(spill->fd, buf, length);
+	g_mutex_unlock(&spill->lock);
+	vips_error_clear();
+
+	return result ? -1 : 0;
+#endif /*HAVE_PWRITE*/
+}
+
+static int
+vips_block_cache_spill_pread(VipsBlockCacheSpill *spill,
+	VipsPel *buf, size_t length, gint64 offset)
+{
+#ifdef HAVE_PREAD
+	while (length > 0) {
+		gint64 bytes_read = pread(spill->fd, buf, length, offset);
+
+		if (bytes_read < 0 &&
+			errno == EINTR)
+			continue;
+		if (bytes_read <= 0)
+			return -1;
+
+		buf += bytes_read;
+		offset += bytes_read;
+		length -= bytes_read;
+	}
+
+	return 0;
+#else  /*!HAVE_PREAD*/
+	int result;
+
+	g_mutex_lock(&spill->lock);
+	result = vips__seek(spill->fd, offset, SEEK_SET) < 0 ? -1 : 0;
+	while (!result &&
+		length > 0) {
+		gint64 bytes_read = read(spill->fd, buf, length);
+
+		if (bytes_read <= 0)
+			result = -1;
+		else {
+			buf += bytes_read;
+			length -= bytes_read;
+		}
+	}
+	g_mutex_unlock(&spill->lock);
+	vips_error_clear();
+
+	return result;
+#endif /*HAVE_PREAD*/
+}
+
+/* Write the pixels of a DATA tile that's been reused to the spill file. This
+ * is best effort: if the write fails, the tile is just recalculated later.
+ * Call with no locks held.
+ */
+static void
+vips_block_cache_spill_write(VipsBlockCacheSpill *spill,
+	VipsRect *pos, const VipsPel *buf, size_t length)
+{
+	VipsSpillEntry *entry;
+	guint generation;
+	int slot;
+	int result;
+
+	g_assert(length <= spill->tile_size);
+
+	g_mutex_lock(&spill->lock);
+
+	if (spill->fd == -1 &&
+		spill->max_slots > 0 &&
+		vips_block_cache_spill_open(spill)) {
+		/* No temp file, so no spill.
+		 */
+		g_warning("%s", vips_error_buffer());
+		vips_error_clear();
+		spill->max_slots = 0;
+	}
+
+	/* File full? Drop the oldest spilled tile. If every slot is being
+	 * read or written, just skip this tile.
+	 */
+	if (spill->max_slots > 0 &&
+		spill->free->len == 0 &&
+		spill->n_slots >= spill->max_slots &&
+		!g_queue_is_empty(spill->lru))
+		vips_block_cache_spill_remove(spill,
+			(VipsSpillEntry *) g_queue_peek_head(spill->lru));
+
+	if (spill->free->len > 0) {
+		slot = g_array_index(spill->free, int, spill->free->len - 1);
+		g_array_set_size(spill->free, spill->free->len - 1);
+	}
+	else if (spill->n_slots < spill->max_slots)
+		slot = spill->n_slots++;
+	else {
+		g_mutex_unlock(&spill->lock);
+		return;
+	}
+	generation = spill->generation;
+
+	g_mutex_unlock(&spill->lock);
+
+	result = vips_block_cache_spill_pwrite(spill,
+		buf, length, (gint64) slot * spill->tile_size);
+
+	g_mutex_lock(&spill->lock);
+
+	/* The file was dropped while we were writing, our slot has gone.
+	 */
+	if (generation != spill->generation) {
+		g_mutex_unlock(&spill->lock);
+		return;
+	}
+
+	/* Another thread might have recalculated and spilled this tile
+	 * while our write was in flight.
+	 */
+	if (result ||
+		g_hash_table_lookup(spill->entries, pos)) {
+		g_array_append_val(spill->free, slot);
+		g_mutex_unlock(&spill->lock);
+		return;
+	}
+
+	entry = g_new(VipsSpillEntry, 1);
+	entry->pos = *pos;
+	entry->slot = slot;
+	entry->link.data = entry;
+	entry->link.prev = NULL;
+	entry->link.next = NULL;
+	g_hash_table_insert(spill->entries, &entry->pos, entry);
+	g_queue_push_tail_link(spill->lru, &entry->link);
+
+	VIPS_DEBUG_MSG_RED("vips_block_cache_spill_write: %d x %d to slot %d\n",
+		pos->left, pos->top, slot);
+
+	g_mutex_unlock(&spill->lock);
+}
+
+/* If a tile has been spilled, claim its slot for a read and remove it from
+ * the file. Call with the shard locked.
+ */
+static gboolean
+vips_block_cache_spill_take(VipsBlockCacheSpill *spill, VipsRect *pos,
+	int *slot, guint *generation)
+{
+	VipsSpillEntry *entry;
+
+	g_mutex_lock(&spill->lock);
+
+	if (!(entry = g_hash_table_lookup(spill->entries, pos))) {
+		g_mutex_unlock(&spill->lock);
+		return FALSE;
+	}
+
+	*slot = entry->slot;
+	*generation = spill->generation;
+
+	/* Keep the slot out of the free list until the read is done.
+	 */
+	g_hash_table_remove(spill->entries, &entry->pos);
+	g_queue_unlink(spill->lru, &entry->link);
+	g_free(entry);
+
+	g_mutex_unlock(&spill->lock);
+
+	return TRUE;
+}
+
+/* Read a slot claimed by vips_block_cache_spill_take() back into a region,
+ * and free the slot. TRUE if the region now holds valid pixels. Call with no
+ * locks held.
+ */
+static gboolean
+vips_block_cache_spill_read(VipsBlockCacheSpill *spill,
+	int slot, guint generation, VipsRegion *region)
+{
+	size_t length = VIPS_REGION_LSKIP(region) * region->valid.height;
+
+	int result;
+
+	result = vips_block_cache_spill_pread(spill,
+		VIPS_REGION_ADDR_TOPLEFT(region), length,
+		(gint64) slot * spill->tile_size);
+
+	VIPS_DEBUG_MSG_RED("vips_block_cache_spill_read: %d x %d from slot %d\n",
+		region->valid.left, region->valid.top, slot);
+
+	g_mutex_lock(&spill->lock);
+	if (generation == spill->generation)
+		g_array_append_val(spill->free, slot);
+	else
+		/* The file was dropped while we were reading, so the pixels
+		 * may be junk.
+		 */
+		result = -1;
+	g_mutex_unlock(&spill->lock);
+
+	return !result;
+}
+
 static void
 vips_block_cache_drop_all(VipsBlockCache *cache)
 {
+	int i;
+
 	/* FIXME this is a disaster if active threads are working on tiles. We
 	 * should have something to block new requests, and only dispose once
 	 * all tiles are unreffed.
 	 */
-	g_hash_table_remove_all(cache->tiles);
+	for (i = 0; i < cache->n_shards; i++)
+		g_hash_table_remove_all(cache->shards[i].tiles);
 }
 
 static void
@@ -158,7 +568,7 @@ vips_block_cache_finalize(GObject *gobject)
 	VipsBlockCache *cache = (VipsBlockCache *) gobject;
 
 	g_mutex_clear(&cache->lock);
-	g_cond_clear(&cache->new_tile);
+	g_mutex_clear(&cache->recycle_lock);
 
 	G_OBJECT_CLASS(vips_block_cache_parent_class)->finalize(gobject);
 }
@@ -168,30 +578,62 @@ vips_block_cache_dispose(GObject *gobject)
 {
 	VipsBlockCache *cache = (VipsBlockCache *) gobject;
 
+	int i;
+
 	vips_block_cache_drop_all(cache);
 
-	if (cache->tiles)
-		g_assert(g_hash_table_size(cache->tiles) == 0);
-	VIPS_FREEF(g_hash_table_destroy, cache->tiles);
-	VIPS_FREEF(g_queue_free, cache->recycle);
+	for (i = 0; i < cache->n_shards; i++) {
+		VipsBlockCacheShard *shard = &cache->shards[i];
+
+		g_assert(g_hash_table_size(shard->tiles) == 0);
+		VIPS_FREEF(g_hash_table_destroy, shard->tiles);
+		g_mutex_clear(&shard->lock);
+	}
+	VIPS_FREE(cache->shards);
+	cache->n_shards = 0;
+	VIPS_FREEF(vips_block_cache_spill_free, cache->spill);
 
 	G_OBJECT_CLASS(vips_block_cache_parent_class)->dispose(gobject);
 }
 
-static int
-vips_tile_move(VipsTile *tile, int x, int y)
+/* Add an unreffed tile to the end of the recycle queue. The tile's shard
+ * must be locked.
+ */
+static void
+vips_tile_recycle(VipsTile *tile)
 {
-	/* We are changing x/y and therefore the hash value. We must unlink
-	 * from the old hash position and relink at the new place.
-	 */
-	g_hash_table_steal(tile->cache->tiles, &tile->pos);
+	VipsBlockCache *cache = tile->cache;
 
+	g_mutex_lock(&cache->recycle_lock);
+	g_queue_push_tail_link(&cache->recycle, &tile->recycle_link);
+	tile->recycled = TRUE;
+	g_mutex_unlock(&cache->recycle_lock);
+}
+
+static void
+vips_tile_unrecycle(VipsTile *tile)
+{
+	VipsBlockCache *cache = tile->cache;
+
+	g_mutex_lock(&cache->recycle_lock);
+	g_queue_unlink(&cache->recycle, &tile->recycle_link);
+	tile->recycled = FALSE;
+	g_mutex_unlock(&cache->recycle_lock);
+}
+
+/* Put a tile taken by vips_tile_take() at a new position. @shard must be
+ * locked.
+ */
+static int
+vips_tile_move(VipsTile *tile, VipsBlockCacheShard *shard, int x, int y)
+{
+	tile->shard = shard;
 	tile->pos.left = x;
 	tile->pos.top = y;
 	tile->pos.width = tile->cache->tile_width;
 	tile->pos.height = tile->cache->tile_height;
 
-	g_hash_table_insert(tile->cache->tiles, &tile->pos, tile);
+	g_hash_table_insert(shard->tiles, &tile->pos, tile);
 
 	if (vips_region_buffer(tile->region, &tile->pos))
 		return -1;
@@ -204,7 +646,7 @@ vips_tile_move(VipsTile *tile, int x, int y)
 }
 
 static VipsTile *
-vips_tile_new(VipsBlockCache *cache, int x, int y)
+vips_tile_new(VipsBlockCache *cache, VipsBlockCacheShard *shard, int x, int y)
 {
 	VipsTile *tile;
 
@@ -212,25 +654,34 @@ vips_tile_new(VipsBlockCache *cache, int x, int y)
 		return NULL;
 
 	tile->cache = cache;
+	tile->shard = shard;
 	tile->state = VIPS_TILE_STATE_PEND;
+	g_cond_init(&tile->done);
 	tile->ref_count = 0;
 	tile->region = NULL;
 	tile->pos.left = x;
 	tile->pos.top = y;
 	tile->pos.width = cache->tile_width;
 	tile->pos.height = cache->tile_height;
-	g_hash_table_insert(cache->tiles, &tile->pos, tile);
-	g_queue_push_tail(tile->cache->recycle, tile);
+	tile->recycle_link.data = tile;
+	tile->recycle_link.prev = NULL;
+	tile->recycle_link.next = NULL;
+	tile->recycled = FALSE;
+
+	g_atomic_int_inc(&cache->n_tiles);
+	g_hash_table_insert(shard->tiles, &tile->pos, tile);
+
+	vips_tile_recycle(tile);
 
 	if (!(tile->region = vips_region_new(cache->in))) {
-		g_hash_table_remove(cache->tiles, &tile->pos);
+		g_hash_table_remove(shard->tiles, &tile->pos);
 		return NULL;
 	}
 
 	vips__region_no_ownership(tile->region);
 
 	if (vips_region_buffer(tile->region, &tile->pos)) {
-		g_hash_table_remove(cache->tiles, &tile->pos);
+		g_hash_table_remove(shard->tiles, &tile->pos);
 		return NULL;
 	}
 
@@ -240,7 +691,8 @@ vips_tile_new(VipsBlockCache *cache, int x, int y)
 /* Do we have a tile in the cache?
  */
 static VipsTile *
-vips_tile_search(VipsBlockCache *cache, int x, int y)
+vips_tile_search(VipsBlockCache *cache, VipsBlockCacheShard *shard,
+	int x, int y)
 {
 	VipsRect pos;
 	VipsTile *tile;
@@ -249,93 +701,209 @@ vips_tile_search(VipsBlockCache *cache, int x, int y)
 	pos.top = y;
 	pos.width = cache->tile_width;
 	pos.height = cache->tile_height;
-	tile = (VipsTile *) g_hash_table_lookup(cache->tiles, &pos);
+	tile = (VipsTile *) g_hash_table_lookup(shard->tiles, &pos);
 
 	return tile;
 }
 
-static void
-vips_tile_find_is_topper(gpointer element, gpointer user_data)
+/* Lock the shard of a tile on the recycle queue. @shard is already locked,
+ * and we must not block on a second shard lock, so we only try.
+ */
+static gboolean
+vips_tile_trylock(VipsTile *tile, VipsBlockCacheShard *shard)
 {
-	VipsTile *this = (VipsTile *) element;
-	VipsTile **best = (VipsTile **) user_data;
-
-	if (!*best ||
-		this->pos.top < (*best)->pos.top)
-		*best = this;
+	return tile->shard == shard ||
+		g_mutex_trylock(&tile->shard->lock);
 }
 
-/* Search the recycle list for the topmost tile.
+/* Take the tile to reuse off the recycle queue, and out of its shard. We
+ * reuse the oldest tile, or for sequential access the topmost. @shard must
+ * be locked.
+ *
+ * If the shard of the tile we want is busy, take the oldest tile we can
+ * lock. NULL if there are no tiles we can reuse.
  */
 static VipsTile *
-vips_tile_find_topmost(GQueue *recycle)
+vips_tile_take(VipsBlockCache *cache, VipsBlockCacheShard *shard)
 {
 	VipsTile *tile;
+	GList *p;
+
+	g_mutex_lock(&cache->recycle_lock);
 
 	tile = NULL;
-	g_queue_foreach(recycle, vips_tile_find_is_topper, &tile);
+	if (cache->access == VIPS_ACCESS_RANDOM)
+		tile = g_queue_peek_head(&cache->recycle);
+	else
+		/* This is slower :( We have to search the recycle
+		 * queue.
+		 */
+		for (p = cache->recycle.head; p; p = p->next) {
+			VipsTile *this = (VipsTile *) p->data;
+
+			if (!tile ||
+				this->pos.top < tile->pos.top)
+				tile = this;
+		}
+
+	if (tile &&
+		!vips_tile_trylock(tile, shard)) {
+		VipsTile *busy = tile;
+
+		tile = NULL;
+		for (p = cache->recycle.head; p; p = p->next) {
+			VipsTile *this = (VipsTile *) p->data;
+
+			if (this->shard != busy->shard &&
+				vips_tile_trylock(this, shard)) {
+				tile = this;
+				break;
+			}
+		}
+	}
+
+	if (tile) {
+		g_queue_unlink(&cache->recycle, &tile->recycle_link);
+		tile->recycled = FALSE;
+	}
+
+	g_mutex_unlock(&cache->recycle_lock);
+
+	if (tile) {
+		g_hash_table_steal(tile->shard->tiles, &tile->pos);
+		if (tile->shard != shard)
+			g_mutex_unlock(&tile->shard->lock);
+		tile->shard = NULL;
+	}
+
+	return tile;
+}
+
+/* The shard a tile position belongs to. Mix x and y, since linecache tiles
+ * all have left == 0.
+ */
+static VipsBlockCacheShard *
+vips_tile_shard(VipsBlockCache *cache, int x, int y)
+{
+	guint hash;
+
+	hash = (guint) (x / cache->tile_width) * 73856093U ^
+		(guint) (y / cache->tile_height) * 19349663U;
+
+	return &cache->shards[hash % cache->n_shards];
+}
+
+/* A new or reused tile has no pixels yet. We might have spilled them
+ * earlier, in which case mark the tile CALC and read it back once the shard
+ * is unlocked.
+ */
+static VipsTile *
+vips_tile_unspill(VipsBlockCache *cache, VipsTile *tile, VipsSpillIO *io)
+{
+	if (cache->spill &&
+		vips_block_cache_spill_take(cache->spill, &tile->pos,
+			&io->read_slot, &io->read_generation))
+		tile->state = VIPS_TILE_STATE_CALC;
 
 	return tile;
 }
 
+/* Do any spill I/O that vips_tile_find() set up. Call with no locks held.
+ */
+static void
+vips_tile_spill_io(VipsBlockCache *cache, VipsTile *tile, VipsSpillIO *io)
+{
+	if (io->write_buf) {
+		vips_block_cache_spill_write(cache->spill,
+			&io->write_pos, io->write_buf, io->write_length);
+		VIPS_FREE(io->write_buf);
+	}
+
+	if (tile &&
+		io->read_slot != -1) {
+		gboolean hit = vips_block_cache_spill_read(cache->spill,
+			io->read_slot, io->read_generation, tile->region);
+
+		g_mutex_lock(&tile->shard->lock);
+		tile->state = hit ? VIPS_TILE_STATE_DATA : VIPS_TILE_STATE_PEND;
+		g_cond_broadcast(&tile->done);
+		g_mutex_unlock(&tile->shard->lock);
+	}
+}
+
 /* Find existing tile, make a new tile, or if we have a full set of tiles,
- * reuse one.
+ * reuse one. The shard must be locked. Any spill I/O is left in @io, see
+ * vips_tile_spill_io().
  */
 static VipsTile *
-vips_tile_find(VipsBlockCache *cache, int x, int y)
+vips_tile_find(VipsBlockCache *cache, VipsBlockCacheShard *shard,
+	int x, int y, VipsSpillIO *io)
 {
+	int max_tiles;
 	VipsTile *tile;
 
 	/* In cache already?
 	 */
-	if ((tile = vips_tile_search(cache, x, y))) {
+	if ((tile = vips_tile_search(cache, shard, x, y))) {
 		VIPS_DEBUG_MSG_RED(
 			"vips_tile_find: tile %d x %d in cache\n", x, y);
 		return tile;
 	}
 
-	/* VipsBlockCache not full?
+	/* Cache not full?
 	 */
-	if (cache->max_tiles == -1 ||
-		g_hash_table_size(cache->tiles) < cache->max_tiles) {
+	max_tiles = g_atomic_int_get(&cache->max_tiles);
+	if (max_tiles == -1 ||
+		g_atomic_int_get(&cache->n_tiles) < max_tiles) {
 		VIPS_DEBUG_MSG_RED(
 			"vips_tile_find: making new tile at %d x %d\n", x, y);
-		if (!(tile = vips_tile_new(cache, x, y)))
+		if (!(tile = vips_tile_new(cache, shard, x, y)))
 			return NULL;
 
-		return tile;
+		return vips_tile_unspill(cache, tile, io);
 	}
 
-	/* Reuse an old one, if there are any. We just peek the tile pointer,
-	 * it is removed from the recycle list later on _ref.
+	/* Reuse an old one, if there are any. It's no longer in any shard or
+	 * on the recycle queue, so no one else can see it.
 	 */
-	if (cache->recycle) {
-		if (cache->access == VIPS_ACCESS_RANDOM)
-			tile = g_queue_peek_head(cache->recycle);
-		else
-			/* This is slower :( We have to search the recycle
-			 * queue.
-			 */
-			tile = vips_tile_find_topmost(cache->recycle);
-	}
-
-	if (!tile) {
+	if (!(tile = vips_tile_take(cache, shard))) {
 		/* There are no tiles we can reuse -- we have to make another
 		 * for now. They will get culled down again next time around.
 		 */
-		if (!(tile = vips_tile_new(cache, x, y)))
+		if (!(tile = vips_tile_new(cache, shard, x, y)))
 			return NULL;
 
-		return tile;
+		return vips_tile_unspill(cache, tile, io);
 	}
 
 	VIPS_DEBUG_MSG_RED("vips_tile_find: reusing tile %d x %d\n",
 		tile->pos.left, tile->pos.top);
 
-	if (vips_tile_move(tile, x, y))
+	/* Take a copy of the pixels we are about to lose. A memcpy() is cheap
+	 * next to the write, which is done once the shard is unlocked.
+	 */
+	if (cache->spill &&
+		tile->state == VIPS_TILE_STATE_DATA) {
+		VipsRegion *region = tile->region;
+
+		io->write_pos = tile->pos;
+		io->write_length = VIPS_REGION_LSKIP(region) * region->valid.height;
+		if ((io->write_buf = VIPS_ARRAY(NULL, io->write_length, VipsPel)))
+			memcpy(io->write_buf,
+				VIPS_REGION_ADDR_TOPLEFT(region), io->write_length);
+		else
+			vips_error_clear();
+	}
+
+	/* On error, the tile is left in this shard with no pixels. Put it
+	 * back for reuse.
+	 */
+	if (vips_tile_move(tile, shard, x, y)) {
+		vips_tile_recycle(tile);
 		return NULL;
+	}
 
-	return tile;
+	return vips_tile_unspill(cache, tile, io);
 }
 
 static gboolean
@@ -349,16 +917,25 @@ vips_tile_unlocked(gpointer key, gpointer value, gpointer user_data)
 static void
 vips_block_cache_minimise(VipsImage *image, VipsBlockCache *cache)
 {
+	int i;
+
 	VIPS_DEBUG_MSG("vips_block_cache_minimise:\n");
 
-	g_mutex_lock(&cache->lock);
+	for (i = 0; i < cache->n_shards; i++) {
+		VipsBlockCacheShard *shard = &cache->shards[i];
 
-	/* We can't drop tiles that are in use.
-	 */
-	g_hash_table_foreach_remove(cache->tiles,
-		vips_tile_unlocked, NULL);
+		g_mutex_lock(&shard->lock);
+
+		/* We can't drop tiles that are in use.
+		 */
+		g_hash_table_foreach_remove(shard->tiles,
+			vips_tile_unlocked, NULL);
+
+		g_mutex_unlock(&shard->lock);
+	}
 
-	g_mutex_unlock(&cache->lock);
+	if (cache->spill)
+		vips_block_cache_spill_drop_all(cache->spill);
 }
 
 static int
@@ -463,24 +1040,82 @@ vips_rect_equal(VipsRect *a, VipsRect *b)
 static void
 vips_tile_destroy(VipsTile *tile)
 {
-	VipsBlockCache *cache = tile->cache;
-
 	VIPS_DEBUG_MSG_RED("vips_tile_destroy: tile %d, %d (%p)\n",
 		tile->pos.left, tile->pos.top, tile);
 
 	/* 0 ref tiles should be on the recycle list.
 	 */
 	g_assert(tile->ref_count == 0);
-	g_assert(g_queue_find(tile->cache->recycle, tile));
-	g_queue_remove(cache->recycle, tile);
+	g_assert(tile->recycled);
+
+	vips_tile_unrecycle(tile);
+
+	g_atomic_int_add(&tile->cache->n_tiles, -1);
 
 	tile->cache = NULL;
+	tile->shard = NULL;
 
 	VIPS_UNREF(tile->region);
+	g_cond_clear(&tile->done);
 
 	g_free(tile);
 }
 
+/* Make the shards. Call this from subclass _build once max_tiles is known.
+ */
+static void
+vips_block_cache_shards_new(VipsBlockCache *cache)
+{
+	int i;
+
+	g_assert(!cache->shards);
+
+	/* Small caches, like most linecaches, keep a single shard.
+	 */
+	if (cache->max_tiles == -1)
+		cache->n_shards = VIPS_BLOCK_CACHE_MAX_SHARDS;
+	else
+		cache->n_shards = VIPS_CLIP(1,
+			cache->max_tiles / VIPS_BLOCK_CACHE_SHARD_TILES,
+			VIPS_BLOCK_CACHE_MAX_SHARDS);
+
+	cache->shards = VIPS_ARRAY(NULL, cache->n_shards, VipsBlockCacheShard);
+	for (i = 0; i < cache->n_shards; i++) {
+		VipsBlockCacheShard *shard = &cache->shards[i];
+
+		g_mutex_init(&shard->lock);
+		shard->tiles = g_hash_table_new_full(
+			(GHashFunc) vips_rect_hash,
+			(GEqualFunc) vips_rect_equal,
+			NULL,
+			(GDestroyNotify) vips_tile_destroy);
+	}
+
+	VIPS_DEBUG_MSG("vips_block_cache_shards_new: %d shards\n",
+		cache->n_shards);
+
+	if (cache->max_spill > 0) {
+		VipsBlockCacheSpill *spill = g_new0(VipsBlockCacheSpill, 1);
+
+		g_mutex_init(&spill->lock);
+		spill->fd = -1;
+		spill->tile_size = (size_t) cache->tile_width *
+			cache->tile_height * VIPS_IMAGE_SIZEOF_PEL(cache->in);
+		spill->max_slots =
+			VIPS_MIN(G_MAXINT, cache->max_spill / spill->tile_size);
+		spill->free = g_array_new(FALSE, FALSE, sizeof(int));
+		spill->entries = g_hash_table_new(
+			(GHashFunc) vips_rect_hash,
+			(GEqualFunc) vips_rect_equal);
+		spill->lru = g_queue_new();
+
+		cache->spill = spill;
+
+		VIPS_DEBUG_MSG("vips_block_cache_shards_new: spill %d tiles\n",
+			spill->max_slots);
+	}
+}
+
 static void
 vips_block_cache_init(VipsBlockCache *cache)
 {
@@ -492,13 +1127,11 @@ vips_block_cache_init(VipsBlockCache *cache)
 	cache->persistent = FALSE;
 
 	g_mutex_init(&cache->lock);
-	g_cond_init(&cache->new_tile);
-	cache->tiles = g_hash_table_new_full(
-		(GHashFunc) vips_rect_hash,
-		(GEqualFunc) vips_rect_equal,
-		NULL,
-		(GDestroyNotify) vips_tile_destroy);
-	cache->recycle = g_queue_new();
+	cache->n_shards = 0;
+	cache->shards = NULL;
+	cache->n_tiles = 0;
+	g_mutex_init(&cache->recycle_lock);
+	g_queue_init(&cache->recycle);
 }
 
 typedef struct _VipsTileCache {
@@ -510,6 +1143,8 @@ typedef VipsBlockCacheClass VipsTileCacheClass;
 
 G_DEFINE_TYPE(VipsTileCache, vips_tile_cache, VIPS_TYPE_BLOCK_CACHE);
 
+/* The tile's shard must be locked.
+ */
 static void
 vips_tile_unref(VipsTile *tile)
 {
@@ -521,12 +1156,14 @@ vips_tile_unref(VipsTile *tile)
 		/* Place at the end of the recycle queue. We pop from the
 		 * front when selecting an unused tile for reuse.
 		 */
-		g_assert(!g_queue_find(tile->cache->recycle, tile));
+		g_assert(!tile->recycled);
 
-		g_queue_push_tail(tile->cache->recycle, tile);
+		vips_tile_recycle(tile);
 	}
 }
 
+/* The tile's shard must be locked.
+ */
 static void
 vips_tile_ref(VipsTile *tile)
 {
@@ -534,11 +1171,10 @@ vips_tile_ref(VipsTile *tile)
 
 	g_assert(tile->ref_count > 0);
 
-	if (tile->ref_count == 1) {
-		g_assert(g_queue_find(tile->cache->recycle, tile));
-
-		g_queue_remove(tile->cache->recycle, tile);
-	}
+	/* Tiles taken for reuse are already off the queue.
+	 */
+	if (tile->recycled)
+		vips_tile_unrecycle(tile);
 }
 
 static void
@@ -546,8 +1182,14 @@ vips_tile_cache_unref(GSList *work)
 {
 	GSList *p;
 
-	for (p = work; p; p = p->next)
-		vips_tile_unref((VipsTile *) p->data);
+	for (p = work; p; p = p->next) {
+		VipsTile *tile = (VipsTile *) p->data;
+		VipsBlockCacheShard *shard = tile->shard;
+
+		g_mutex_lock(&shard->lock);
+		vips_tile_unref(tile);
+		g_mutex_unlock(&shard->lock);
+	}
 
 	g_slist_free(work);
 }
@@ -574,13 +1216,31 @@ vips_tile_cache_ref(VipsBlockCache *cache, VipsRect *r)
 	work = NULL;
 	for (y = ys; y < VIPS_RECT_BOTTOM(r); y += th)
 		for (x = xs; x < VIPS_RECT_RIGHT(r); x += tw) {
-			if (!(tile = vips_tile_find(cache, x, y))) {
+			VipsBlockCacheShard *shard = vips_tile_shard(cache, x, y);
+
+			VipsSpillIO io = { 0 };
+
+			io.read_slot = -1;
+
+			VIPS_GATE_START("vips_tile_cache_ref: wait");
+
+			vips__worker_lock(&shard->lock);
+
+			VIPS_GATE_STOP("vips_tile_cache_ref: wait");
+
+			if (!(tile = vips_tile_find(cache, shard, x, y, &io))) {
+				g_mutex_unlock(&shard->lock);
+				vips_tile_spill_io(cache, NULL, &io);
 				vips_tile_cache_unref(work);
 				return NULL;
 			}
 
 			vips_tile_ref(tile);
 
+			g_mutex_unlock(&shard->lock);
+
+			vips_tile_spill_io(cache, tile, &io);
+
 			/* We must append, since we want to keep tile ordering
 			 * for sequential sources.
 			 */
@@ -617,17 +1277,23 @@ vips_tile_cache_gen(VipsRegion *out_region,
 	VipsRect *r = &out_region->valid;
 
 	VipsTile *tile;
+	VipsTileState state;
 	GSList *work;
 	GSList *p;
 	int result;
 
 	result = 0;
 
-	VIPS_GATE_START("vips_tile_cache_gen: wait1");
+	/* In non-threaded mode, only one thread at a time may be in here.
+	 * Threaded caches just lock shards as they touch them.
+	 */
+	if (!cache->threaded) {
+		VIPS_GATE_START("vips_tile_cache_gen: wait1");
 
-	vips__worker_lock(&cache->lock);
+		vips__worker_lock(&cache->lock);
 
-	VIPS_GATE_STOP("vips_tile_cache_gen: wait1");
+		VIPS_GATE_STOP("vips_tile_cache_gen: wait1");
+	}
 
 	VIPS_DEBUG_MSG_RED(
 		"vips_tile_cache_gen: "
@@ -639,127 +1305,141 @@ vips_tile_cache_gen(VipsRegion *out_region,
 	work = vips_tile_cache_ref(cache, r);
 
 	while (work) {
-		/* Search for data tiles: easy, we can just paste those in.
+		/* Find the first tile we can make progress with. DATA tiles
+		 * can be pasted straight in. We claim the first PEND tile we
+		 * find and calculate it. We don't claim all PEND tiles since
+		 * after the first, more DATA tiles might have been made
+		 * available by other threads and we want to get them out of
+		 * the way as soon as we can.
 		 */
-		for (;;) {
-			for (p = work; p; p = p->next) {
-				tile = (VipsTile *) p->data;
+		tile = NULL;
+		state = VIPS_TILE_STATE_CALC;
+		for (p = work; p; p = p->next) {
+			VipsTile *this = (VipsTile *) p->data;
 
-				if (tile->state == VIPS_TILE_STATE_DATA)
-					break;
-			}
+			vips__worker_lock(&this->shard->lock);
+			state = this->state;
+			if (state == VIPS_TILE_STATE_PEND)
+				this->state = VIPS_TILE_STATE_CALC;
+			g_mutex_unlock(&this->shard->lock);
 
-			if (!p)
+			if (state != VIPS_TILE_STATE_CALC) {
+				tile = this;
 				break;
+			}
+		}
 
-			VIPS_DEBUG_MSG_RED(
-				"vips_tile_cache_gen: pasting %p\n",
-				tile);
+		/* There are no PEND or DATA tiles, we must need tiles some
+		 * other thread is currently calculating.
+		 *
+		 * We need all of them, so block until the first is done.
+		 * Only threads waiting for this tile are woken.
+		 */
+		if (!tile) {
+			tile = (VipsTile *) work->data;
 
-			vips_tile_paste(tile, out_region);
+			VIPS_DEBUG_MSG_RED("vips_tile_cache_gen: waiting\n");
 
-			/* We're done with this tile.
-			 */
-			work = g_slist_remove(work, tile);
-			vips_tile_unref(tile);
+			VIPS_GATE_START("vips_tile_cache_gen: wait3");
+
+			vips__worker_lock(&tile->shard->lock);
+			while (tile->state == VIPS_TILE_STATE_CALC)
+				vips__worker_cond_wait(&tile->done, &tile->shard->lock);
+			g_mutex_unlock(&tile->shard->lock);
+
+			VIPS_GATE_STOP("vips_tile_cache_gen: wait3");
+
+			VIPS_DEBUG_MSG("vips_tile_cache_gen: awake!\n");
+
+			continue;
 		}
 
-		/* Calculate the first PEND tile we find on the work list. We
-		 * don't calculate all PEND tiles since after the first, more
-		 * DATA tiles might heve been made available by other threads
-		 * and we want to get them out of the way as soon as we can.
-		 */
-		for (p = work; p; p = p->next) {
-			tile = (VipsTile *) p->data;
+		if (state == VIPS_TILE_STATE_PEND) {
+			gboolean cancelled;
 
-			if (tile->state == VIPS_TILE_STATE_PEND) {
-				tile->state = VIPS_TILE_STATE_CALC;
+			VIPS_DEBUG_MSG_RED(
+				"vips_tile_cache_gen: calc of %p\n",
+				tile);
 
+			/* Don't compute if we've seen an error
+			 * previously.
+			 */
+			if (!result)
+				result = vips_region_prepare_to(in,
+					tile->region,
+					&tile->pos,
+					tile->pos.left, tile->pos.top);
+
+			/* If our pipeline has been cancelled, the
+			 * tile is fine, we just didn't finish it. The
+			 * cache can be shared with other pipelines, so
+			 * put it back for them to calculate.
+			 */
+			cancelled = result &&
+				vips__cancellable_check_current();
+
+			/* If there was an error calculating this
+			 * tile, black it out and terminate
+			 * calculation. We have to stop so we can
+			 * support things like --fail on jpegload.
+			 *
+			 * Don't return early, we'd deadlock.
+			 */
+			if (result &&
+				!cancelled) {
 				VIPS_DEBUG_MSG_RED(
-					"vips_tile_cache_gen: calc of %p\n",
+					"vips_tile_cache_gen: error on tile %p\n",
 					tile);
 
-				/* In threaded mode, we let other threads run
-				 * while we calc this tile. In non-threaded
-				 * mode, we keep the lock and make 'em wait.
-				 */
-				if (cache->threaded)
-					g_mutex_unlock(&cache->lock);
-
-				/* Don't compute if we've seen an error
-				 * previously.
-				 */
-				if (!result)
-					result = vips_region_prepare_to(in,
-						tile->region,
-						&tile->pos,
-						tile->pos.left, tile->pos.top);
-
-				if (cache->threaded) {
-					VIPS_GATE_START("vips_tile_cache_gen: wait2");
-
-					g_mutex_lock(&cache->lock);
-
-					VIPS_GATE_STOP("vips_tile_cache_gen: wait2");
-				}
-
-				/* If there was an error calculating this
-				 * tile, black it out and terminate
-				 * calculation. We have to stop so we can
-				 * support things like --fail on jpegload.
-				 *
-				 * Don't return early, we'd deadlock.
-				 */
-				if (result) {
-					VIPS_DEBUG_MSG_RED(
-						"vips_tile_cache_gen: error on tile %p\n",
-						tile);
-
-					g_warning("error in tile %d x %d",
-						tile->pos.left, tile->pos.top);
-
-					vips_region_black(tile->region);
-
-					*stop = TRUE;
-				}
-
-				tile->state = VIPS_TILE_STATE_DATA;
-
-				/* Let everyone know there's a new DATA tile.
-				 * They need to all check their work lists.
-				 */
-				g_cond_broadcast(&cache->new_tile);
+				g_warning("error in tile %d x %d",
+					tile->pos.left, tile->pos.top);
 
-				break;
+				vips_region_black(tile->region);
+
+				*stop = TRUE;
 			}
-		}
 
-		/* There are no PEND or DATA tiles, we must need a tile some
-		 * other thread is currently calculating.
-		 *
-		 * We must block until the CALC tiles we need are done.
-		 */
-		if (!p &&
-			work) {
-			for (p = work; p; p = p->next) {
-				tile = (VipsTile *) p->data;
+			/* Let anyone waiting for this tile know it's ready,
+			 * or that they must calculate it themselves.
+			 */
+			g_mutex_lock(&tile->shard->lock);
+			tile->state = cancelled
+				? VIPS_TILE_STATE_PEND
+				: VIPS_TILE_STATE_DATA;
+			g_cond_broadcast(&tile->done);
+			g_mutex_unlock(&tile->shard->lock);
 
-				g_assert(tile->state == VIPS_TILE_STATE_CALC);
-			}
+			if (cancelled) {
+				work = g_slist_remove(work, tile);
 
-			VIPS_DEBUG_MSG_RED("vips_tile_cache_gen: waiting\n");
+				g_mutex_lock(&tile->shard->lock);
+				vips_tile_unref(tile);
+				g_mutex_unlock(&tile->shard->lock);
 
-			VIPS_GATE_START("vips_tile_cache_gen: wait3");
+				continue;
+			}
+		}
 
-			vips__worker_cond_wait(&cache->new_tile, &cache->lock);
+		/* We hold a ref, so this DATA tile can't be moved or
+		 * recycled while we paste from it.
+		 */
+		VIPS_DEBUG_MSG_RED(
+			"vips_tile_cache_gen: pasting %p\n",
+			tile);
 
-			VIPS_GATE_STOP("vips_tile_cache_gen: wait3");
+		vips_tile_paste(tile, out_region);
 
-			VIPS_DEBUG_MSG("vips_tile_cache_gen: awake!\n");
-		}
+		/* We're done with this tile.
+		 */
+		work = g_slist_remove(work, tile);
+
+		g_mutex_lock(&tile->shard->lock);
+		vips_tile_unref(tile);
+		g_mutex_unlock(&tile->shard->lock);
 	}
 
-	g_mutex_unlock(&cache->lock);
+	if (!cache->threaded)
+		g_mutex_unlock(&cache->lock);
 
 	return result;
 }
@@ -788,6 +1468,8 @@ vips_tile_cache_build(VipsObject *object)
 	vips_image_set_int(conversion->out,
 		VIPS_META_TILE_HEIGHT, block_cache->tile_height);
 
+	vips_block_cache_shards_new(block_cache);
+
 	if (vips_image_generate(conversion->out,
 			vips_start_one, vips_tile_cache_gen, vips_stop_one,
 			block_cache->in, cache))
@@ -824,6 +1506,13 @@ vips_tile_cache_class_init(VipsTileCacheClass *class)
 		VIPS_ARGUMENT_OPTIONAL_INPUT,
 		G_STRUCT_OFFSET(VipsBlockCache, max_tiles),
 		-1, 1000000, 1000);
+
+	VIPS_ARG_UINT64(class, "max_spill", 9,
+		_("Max spill"),
+		_("Write evicted tiles to disk, up to this many bytes"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsBlockCache, max_spill),
+		0, G_MAXUINT64, 0);
 }
 
 static void
@@ -862,6 +1551,15 @@ vips_tile_cache_init(VipsTileCache *cache)
  * Normally the cache is dropped when computation finishes. Set @persistent to
  * `TRUE` to keep the cache between computations.
  *
+ * Set @max_spill to a number of bytes to write tiles to a temporary file
+ * as they are evicted from memory. They are read back, rather than
+ * recalculated, if they are needed again. The file is made in the same
+ * place as [ctor@Image.new_temp_file] makes files, and the oldest tiles
+ * are dropped when it reaches @max_spill bytes. This is useful when
+ * upstream is slow, for example a PDF or SVG render, and access is
+ * random. The spill file is dropped along with the cache, unless
+ * @persistent is set.
+ *
  * ::: tip "Optional arguments"
  *     * @tile_width: `gint`, width of tiles in cache
  *     * @tile_height: `gint`, height of tiles in cache
@@ -869,6 +1567,8 @@ vips_tile_cache_init(VipsTileCache *cache)
  *     * @access: [enum@Access], hint expected access pattern
  *     * @threaded: `gboolean`, allow many threads
  *     * @persistent: `gboolean`, don't drop cache at end of computation
+ *     * @max_spill: `guint64`, spill evicted tiles to disk, up to this many
+ *       bytes
  *
  * ::: seealso
  *     [method@Image.linecache].
@@ -913,8 +1613,8 @@ vips_line_cache_gen(VipsRegion *out_region,
 	 */
 	if (out_region->valid.height >
 		block_cache->max_tiles * block_cache->tile_height) {
-		block_cache->max_tiles = // FIXME: Invalidates operation cache
-			1 + (out_region->valid.height / block_cache->tile_height);
+		g_atomic_int_set(&block_cache->max_tiles, // FIXME: Invalidates operation cache
+			1 + (out_region->valid.height / block_cache->tile_height));
 		VIPS_DEBUG_MSG("vips_line_cache_gen: bumped max_tiles to %d\n",
 			block_cache->max_tiles);
 	}
@@ -980,6 +1680,8 @@ vips_line_cache_build(VipsObject *object)
 			VIPS_DEMAND_STYLE_THINSTRIP, block_cache->in, NULL))
 		return -1;
 
+	vips_block_cache_shards_new(block_cache);
+
 	if (vips_image_generate(conversion->out,
 			vips_start_one, vips_line_cache_gen, vips_stop_one,
 			block_cache->in, cache))
@@ -5,6 +5,8 @@
  * 8/5/17
  * 	- default to float ... int will often lose precision and should not be
  * 	  the default
+ * 19/10/26
+ * 	- use convfft for large float masks
  */
 
 /*
@@ -46,6 +48,11 @@
 
 #include "pconvolution.h"
 
+/* Float masks with at least this many non-zero elements are convolved via
+ * the FFT.
+ */
+#define VIPS_CONV_FFT_THRESHOLD (1024)
+
 typedef struct {
 	VipsConvolution parent_instance;
 
@@ -58,6 +65,32 @@ typedef VipsConvolutionClass VipsConvClass;
 
 G_DEFINE_TYPE(VipsConv, vips_conv, VIPS_TYPE_CONVOLUTION);
 
+#ifdef HAVE_FFTW
+/* convf skips zero mask elements, so it's the number of non-zero elements
+ * that sets the cost of direct convolution.
+ */
+static gboolean
+vips_conv_use_fft(VipsImage *in, VipsImage *M)
+{
+	const int n = M->Xsize * M->Ysize;
+	double *coeff = VIPS_MATRIX(M, 0, 0);
+
+	int nnz;
+	int i;
+
+	if (vips_band_format_iscomplex(in->BandFmt) ||
+		n < VIPS_CONV_FFT_THRESHOLD)
+		return FALSE;
+
+	nnz = 0;
+	for (i = 0; i < n; i++)
+		if (coeff[i] != 0.0)
+			nnz += 1;
+
+	return nnz >= VIPS_CONV_FFT_THRESHOLD;
+}
+#endif /*HAVE_FFTW*/
+
 static int
 vips_conv_build(VipsObject *object)
 {
@@ -87,6 +120,15 @@ vips_conv_build(VipsObject *object)
 
 	switch (conv->precision) {
 	case VIPS_PRECISION_FLOAT:
+#ifdef HAVE_FFTW
+		if (vips_conv_use_fft(in, convolution->M)) {
+			if (vips_convfft(in, &t[1], convolution->M, NULL) ||
+				vips_image_write(t[1], convolution->out))
+				return -1;
+			break;
+		}
+#endif /*HAVE_FFTW*/
+
 		if (vips_convf(in, &t[1], convolution->M, NULL) ||
 			vips_image_write(t[1], convolution->out))
 			return -1;
@@ -183,6 +225,10 @@ vips_conv_init(VipsConv *conv)
  * [enum@Vips.BandFormat.DOUBLE], in which case @out is also
  * [enum@Vips.BandFormat.DOUBLE].
  *
+ * For [enum@Vips.Precision.FLOAT], masks with 1024 or more non-zero
+ * elements are convolved via the FFT, see [method@Image.convfft]. This is
+ * much faster for large masks.
+ *
  * If @precision is [enum@Vips.Precision.INTEGER], then elements of @mask
  * are converted to integers before convolution, using `rint()`,
  * and the output image always has the same [enum@BandFormat] as the input
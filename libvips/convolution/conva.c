@@ -9,6 +9,10 @@
  *      - from im_aconvsep()
  * 10/7/16
  * 	- redone as a class
+ * 19/10/26
+ * 	- add a vector path for uchar images, based on prefix sums
+ * 	- use a signed accumulator for unsigned images, so negative lobes
+ * 	  clip correctly
  */
 
 /*
@@ -95,6 +99,7 @@ $ vips im_max abs.v
 #include <math.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/debug.h>
 #include <vips/internal.h>
 
@@ -782,6 +787,13 @@ typedef struct {
 	 * types.
 	 */
 	void *sum;
+
+	/* Prefix sums for the vector path, and the number of ints we have
+	 * allocated. Plus the vline factors, packed for the vector path.
+	 */
+	int *prefix;
+	int n_prefix;
+	int *factor;
 } VipsConvaSeq;
 
 /* Free a sequence value.
@@ -792,6 +804,7 @@ vips_conva_stop(void *vseq, void *a, void *b)
 	VipsConvaSeq *seq = (VipsConvaSeq *) vseq;
 
 	VIPS_UNREF(seq->ir);
+	VIPS_FREE(seq->prefix);
 
 	return 0;
 }
@@ -817,12 +830,15 @@ vips_conva_start(VipsImage *out, void *a, void *b)
 
 	seq->start = VIPS_ARRAY(out, conva->n_velement, int);
 	seq->end = VIPS_ARRAY(out, conva->n_velement, int);
+	seq->factor = VIPS_ARRAY(out, conva->n_velement, int);
 
 	if (vips_band_format_isint(out->BandFmt))
 		seq->sum = VIPS_ARRAY(out, conva->n_velement, int);
 	else
 		seq->sum = VIPS_ARRAY(out, conva->n_velement, double);
 	seq->last_stride = -1;
+	seq->prefix = NULL;
+	seq->n_prefix = 0;
 
 	return seq;
 }
@@ -978,9 +994,100 @@ vips_conva_hgenerate(VipsRegion *out_region,
 	return 0;
 }
 
+#ifdef HAVE_HWY
+/* Make sure we have space for at least n prefix sums.
+ */
+static int
+vips_conva_prefix_alloc(VipsConvaSeq *seq, int n)
+{
+	if (n > seq->n_prefix) {
+		VIPS_FREE(seq->prefix);
+		if (!(seq->prefix = VIPS_ARRAY(NULL, n, int)))
+			return -1;
+		seq->n_prefix = n;
+	}
+
+	return 0;
+}
+
+/* The horizontal vector path. Each input scanline becomes a prefix sum with
+ * stride bands, then each hline is a single subtraction.
+ */
+static int
+vips_conva_horizontal_uchar_vector_gen(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsConvaSeq *seq = (VipsConvaSeq *) vseq;
+	VipsImage *in = (VipsImage *) a;
+	VipsConva *conva = (VipsConva *) b;
+
+	VipsRegion *ir = seq->ir;
+	const int n_hline = conva->n_hline;
+	const int bands = in->Bands;
+	VipsImage *iM = conva->iM;
+	VipsRect *r = &out_region->valid;
+	const int ne = r->width * bands;
+
+	VipsRect s;
+	int x, y, z;
+	int sz;
+
+	s = *r;
+	s.width += iM->Xsize - 1;
+	if (vips_region_prepare(ir, &s))
+		return -1;
+
+	/* Plus one pixel of zeros at the start.
+	 */
+	sz = s.width * bands;
+	if (vips_conva_prefix_alloc(seq, sz + bands))
+		return -1;
+
+	if (seq->last_stride != bands) {
+		seq->last_stride = bands;
+
+		for (z = 0; z < n_hline; z++) {
+			seq->start[z] = conva->hline[z].start * bands;
+			seq->end[z] = conva->hline[z].end * bands;
+		}
+	}
+
+	VIPS_GATE_START("vips_conva_horizontal_uchar_vector_gen: work");
+
+	for (y = 0; y < r->height; y++) {
+		VipsPel *p = VIPS_REGION_ADDR(ir, s.left, s.top + y);
+
+		/* Unsigned, so that overflow wraps. The differences we take
+		 * will still be correct.
+		 */
+		unsigned int *prefix = (unsigned int *) seq->prefix;
+
+		for (x = 0; x < bands; x++)
+			prefix[x] = 0;
+		for (x = 0; x < sz; x++)
+			prefix[x + bands] = prefix[x] + p[x];
+
+		vips_conva_hlines_uchar_hwy(
+			VIPS_REGION_ADDR(out_region, r->left, r->top + y),
+			seq->prefix, ne,
+			n_hline, seq->start, seq->end,
+			VIPS_IMAGE_SIZEOF_ELEMENT(out_region->im));
+	}
+
+	VIPS_GATE_STOP("vips_conva_horizontal_uchar_vector_gen: work");
+
+	VIPS_COUNT_PIXELS(out_region,
+		"vips_conva_horizontal_uchar_vector_gen");
+
+	return 0;
+}
+#endif /*HAVE_HWY*/
+
 static int
 vips_conva_horizontal(VipsConva *conva, VipsImage *in, VipsImage **out)
 {
+	VipsGenerateFn gen;
+
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(conva);
 
 	/* Prepare output. Consider a 7x7 mask and a 7x7 image -- the output
@@ -1010,9 +1117,20 @@ vips_conva_horizontal(VipsConva *conva, VipsImage *in, VipsImage **out)
 			? VIPS_FORMAT_SHORT
 			: VIPS_FORMAT_INT;
 
+	/* For uchar input, try to use the vector path.
+	 */
+#ifdef HAVE_HWY
+	if (in->BandFmt == VIPS_FORMAT_UCHAR &&
+		vips_vector_isenabled()) {
+		gen = vips_conva_horizontal_uchar_vector_gen;
+		g_info("conva: using vector path");
+	}
+	else
+#endif /*HAVE_HWY*/
+		gen = vips_conva_hgenerate;
+
 	if (vips_image_generate(*out,
-			vips_conva_start, vips_conva_hgenerate, vips_conva_stop,
-			in, conva))
+			vips_conva_start, gen, vips_conva_stop, in, conva))
 		return -1;
 
 	return 0;
@@ -1164,10 +1282,10 @@ vips_conva_vgenerate(VipsRegion *out_region,
 	switch (convolution->in->BandFmt) {
 	case VIPS_FORMAT_UCHAR:
 		if (conva->max_line < 256)
-			VCONV(unsigned int,
+			VCONV(signed int,
 				unsigned short, unsigned char, CLIP_UCHAR);
 		else
-			VCONV(unsigned int,
+			VCONV(signed int,
 				unsigned int, unsigned char, CLIP_UCHAR);
 		break;
 
@@ -1182,10 +1300,10 @@ vips_conva_vgenerate(VipsRegion *out_region,
 
 	case VIPS_FORMAT_USHORT:
 		if (conva->max_line < 256)
-			VCONV(unsigned int,
+			VCONV(signed int,
 				unsigned short, unsigned short, CLIP_USHORT);
 		else
-			VCONV(unsigned int,
+			VCONV(signed int,
 				unsigned int, unsigned short, CLIP_USHORT);
 		break;
 
@@ -1227,9 +1345,99 @@ vips_conva_vgenerate(VipsRegion *out_region,
 	return 0;
 }
 
+#ifdef HAVE_HWY
+#define VPREFIX(IN) \
+	G_STMT_START \
+	{ \
+		for (y = 0; y < s.height; y++) { \
+			IN *p = (IN *) VIPS_REGION_ADDR(ir, s.left, s.top + y); \
+			unsigned int *p0 = (unsigned int *) seq->prefix + \
+				y * n_hline * ne; \
+			unsigned int *p1 = p0 + n_hline * ne; \
+\
+			for (z = 0; z < n_hline; z++) \
+				for (x = 0; x < ne; x++) \
+					p1[z * ne + x] = p0[z * ne + x] + \
+						p[x * n_hline + z]; \
+		} \
+	} \
+	G_STMT_END
+
+/* The vertical vector path. We make a prefix sum down each column of each
+ * hline, then process many columns at once. The prefix is planar, so the
+ * columns for each hline are adjacent in memory.
+ */
+static int
+vips_conva_vertical_uchar_vector_gen(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsConvaSeq *seq = (VipsConvaSeq *) vseq;
+	VipsImage *in = (VipsImage *) a;
+	VipsConva *conva = (VipsConva *) b;
+
+	VipsRegion *ir = seq->ir;
+	const int n_hline = conva->n_hline;
+	const int n_vline = conva->n_vline;
+	VipsImage *iM = conva->iM;
+	VipsRect *r = &out_region->valid;
+	const int ne = VIPS_REGION_N_ELEMENTS(out_region);
+
+	VipsRect s;
+	int x, y, z;
+
+	s = *r;
+	s.height += iM->Ysize - 1;
+	if (vips_region_prepare(ir, &s))
+		return -1;
+
+	/* Plus one row of zeros at the top.
+	 */
+	if (vips_conva_prefix_alloc(seq, (s.height + 1) * n_hline * ne))
+		return -1;
+
+	if (seq->last_stride != ne) {
+		seq->last_stride = ne;
+
+		for (z = 0; z < n_vline; z++) {
+			int band = conva->vline[z].band;
+
+			seq->start[z] =
+				(conva->vline[z].start * n_hline + band) * ne;
+			seq->end[z] =
+				(conva->vline[z].end * n_hline + band) * ne;
+			seq->factor[z] = conva->vline[z].factor;
+		}
+	}
+
+	VIPS_GATE_START("vips_conva_vertical_uchar_vector_gen: work");
+
+	memset(seq->prefix, 0, n_hline * ne * sizeof(int));
+	if (in->BandFmt == VIPS_FORMAT_USHORT)
+		VPREFIX(unsigned short);
+	else
+		VPREFIX(unsigned int);
+
+	for (y = 0; y < r->height; y++)
+		vips_conva_boxes_uchar_hwy(
+			VIPS_REGION_ADDR(out_region, r->left, r->top + y),
+			seq->prefix + y * n_hline * ne, ne,
+			n_vline, seq->start, seq->end, seq->factor,
+			conva->rounding, conva->divisor, conva->offset);
+
+	VIPS_GATE_STOP("vips_conva_vertical_uchar_vector_gen: work");
+
+	VIPS_COUNT_PIXELS(out_region,
+		"vips_conva_vertical_uchar_vector_gen");
+
+	return 0;
+}
+#endif /*HAVE_HWY*/
+
 static int
 vips_conva_vertical(VipsConva *conva, VipsImage *in, VipsImage **out)
 {
+	VipsGenerateFn gen;
+
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(conva);
 	VipsConvolution *convolution = (VipsConvolution *) conva;
 
@@ -1250,9 +1458,21 @@ vips_conva_vertical(VipsConva *conva, VipsImage *in, VipsImage **out)
 	(*out)->Bands = convolution->in->Bands;
 	(*out)->BandFmt = convolution->in->BandFmt;
 
+	/* For uchar output, try to use the vector path.
+	 */
+#ifdef HAVE_HWY
+	if (convolution->in->BandFmt == VIPS_FORMAT_UCHAR &&
+		conva->divisor != 0 &&
+		vips_vector_isenabled()) {
+		gen = vips_conva_vertical_uchar_vector_gen;
+		g_info("conva: using vector path");
+	}
+	else
+#endif /*HAVE_HWY*/
+		gen = vips_conva_vgenerate;
+
 	if (vips_image_generate(*out,
-			vips_conva_start, vips_conva_vgenerate, vips_conva_stop,
-			in, conva))
+			vips_conva_start, gen, vips_conva_stop, in, conva))
 		return -1;
 
 	return 0;
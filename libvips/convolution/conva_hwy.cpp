@@ -0,0 +1,236 @@
+/* 19/10/26
+ * 	- initial implementation, from convi_hwy.cpp
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+
+	The box-filter convolutions (conva and convasep) spend their time
+	summing runs of pixels. Here we work from a prefix (cumulative) sum
+	instead, so the sum of any run is a single subtraction:
+
+		sum(start .. end - 1) == prefix[end] - prefix[start]
+
+	and we can vectorise across many output elements at once, since
+	each output element is independent. The caller builds the prefix
+	array, running along a scanline for the horizontal passes and down
+	columns (one prefix row per input row) for the vertical passes.
+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/debug.h>
+#include <vips/internal.h>
+
+#include "pconvolution.h"
+
+#ifdef HAVE_HWY
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "libvips/convolution/conva_hwy.cpp"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+namespace HWY_NAMESPACE {
+
+using namespace hwy::HWY_NAMESPACE;
+
+using DI32 = ScalableTag<int32_t>;
+using DF32 = ScalableTag<float>;
+constexpr Rebind<uint8_t, DI32> du8x32;
+constexpr Rebind<uint16_t, DI32> du16x32;
+constexpr Rebind<uint32_t, DI32> du32;
+constexpr DI32 di32;
+constexpr DF32 df32;
+
+/* C-style integer division (truncate towards zero) by a positive constant.
+ *
+ * There's no integer divide in SIMD, so estimate with a float reciprocal,
+ * then fix up the quotient with the remainder. The estimate is within one
+ * of the true quotient for quotients below 2^22, which is far outside the
+ * range we clip to.
+ */
+HWY_INLINE HWY_ATTR Vec<DI32>
+DivTrunc(Vec<DI32> num, Vec<DI32> v_divisor, Vec<DF32> v_recip)
+{
+	const auto zero = Zero(di32);
+	const auto one = Set(di32, 1);
+	const auto negative = Lt(num, zero);
+	const auto a = Abs(num);
+
+	auto q = ConvertTo(di32, Mul(ConvertTo(df32, a), v_recip));
+	auto rem = Sub(a, Mul(q, v_divisor));
+	q = IfThenElse(Lt(rem, zero), Sub(q, one), q);
+	rem = Sub(a, Mul(q, v_divisor));
+	q = IfThenElse(Lt(rem, v_divisor), q, Add(q, one));
+
+	return IfThenElse(negative, Neg(q), q);
+}
+
+HWY_ATTR void
+vips_conva_boxes_uchar_hwy(VipsPel *HWY_RESTRICT pout,
+	const int32_t *HWY_RESTRICT prefix, int32_t ne,
+	int32_t n_box, const int32_t *HWY_RESTRICT start,
+	const int32_t *HWY_RESTRICT end, const int32_t *HWY_RESTRICT factor,
+	int32_t rounding, int32_t divisor, int32_t offset)
+{
+#if HWY_TARGET != HWY_SCALAR
+	const int32_t N = Lanes(di32);
+
+	/* Fold the sign of the divisor into the numerator, so we only
+	 * need to divide by positive numbers.
+	 */
+	const int32_t sign = divisor < 0 ? -1 : 1;
+	const int32_t abs_divisor = divisor * sign;
+
+	const auto v_rounding = Set(di32, rounding);
+	const auto v_sign = Set(di32, sign);
+	const auto v_divisor = Set(di32, abs_divisor);
+	const auto v_recip = Set(df32, 1.0f / abs_divisor);
+	const auto v_offset = Set(di32, offset);
+
+	int32_t x = 0;
+	for (; x + N <= ne; x += N) {
+		const int32_t *HWY_RESTRICT p = prefix + x;
+
+		auto sum = Zero(di32);
+		for (int32_t z = 0; z < n_box; z++) {
+			auto run = Sub(LoadU(di32, p + end[z]),
+				LoadU(di32, p + start[z]));
+
+			sum = Add(sum, Mul(run, Set(di32, factor[z])));
+		}
+
+		sum = Mul(Add(sum, v_rounding), v_sign);
+		sum = Add(DivTrunc(sum, v_divisor, v_recip), v_offset);
+
+		/* The final 32->8 conversion. DemoteTo() saturates, so this
+		 * is also our clip to 0 - 255.
+		 */
+		StoreU(DemoteTo(du8x32, sum), du8x32, pout + x);
+	}
+
+	/* `ne` was not a multiple of the vector length `N`;
+	 * proceed one by one.
+	 */
+	for (; x < ne; ++x) {
+		const int32_t *HWY_RESTRICT p = prefix + x;
+
+		int32_t sum = 0;
+		for (int32_t z = 0; z < n_box; z++)
+			sum += factor[z] * (p[end[z]] - p[start[z]]);
+
+		sum = (sum + rounding) / divisor + offset;
+		pout[x] = VIPS_CLIP(0, sum, UCHAR_MAX);
+	}
+#endif
+}
+
+HWY_ATTR void
+vips_conva_hlines_uchar_hwy(VipsPel *HWY_RESTRICT pout,
+	const int32_t *HWY_RESTRICT prefix, int32_t ne,
+	int32_t n_hline, const int32_t *HWY_RESTRICT start,
+	const int32_t *HWY_RESTRICT end, int32_t sizeof_element)
+{
+#if HWY_TARGET != HWY_SCALAR
+	const int32_t N = Lanes(di32);
+
+	/* The hlines for an element are adjacent bands in the output, so
+	 * vectorise across the hlines and gather the prefix values.
+	 */
+	for (int32_t x = 0; x < ne; x++) {
+		const int32_t *HWY_RESTRICT p = prefix + x;
+
+		int32_t z = 0;
+		for (; z + N <= n_hline; z += N) {
+			auto run = Sub(
+				GatherIndex(di32, p, LoadU(di32, end + z)),
+				GatherIndex(di32, p, LoadU(di32, start + z)));
+
+			if (sizeof_element == 2)
+				StoreU(DemoteTo(du16x32, run), du16x32,
+					(uint16_t *) pout + z);
+			else
+				StoreU(BitCast(du32, run), du32,
+					(uint32_t *) pout + z);
+		}
+
+		for (; z < n_hline; z++) {
+			int32_t run = p[end[z]] - p[start[z]];
+
+			if (sizeof_element == 2)
+				((uint16_t *) pout)[z] = run;
+			else
+				((uint32_t *) pout)[z] = run;
+		}
+
+		pout += n_hline * sizeof_element;
+	}
+#endif
+}
+
+} /*namespace HWY_NAMESPACE*/
+
+#if HWY_ONCE
+HWY_EXPORT(vips_conva_boxes_uchar_hwy);
+HWY_EXPORT(vips_conva_hlines_uchar_hwy);
+
+void
+vips_conva_boxes_uchar_hwy(VipsPel *pout, const int *prefix, int ne,
+	int n_box, const int *start, const int *end, const int *factor,
+	int rounding, int divisor, int offset)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_conva_boxes_uchar_hwy)(pout, prefix, ne,
+		n_box, start, end, factor, rounding, divisor, offset);
+	/* clang-format on */
+}
+
+void
+vips_conva_hlines_uchar_hwy(VipsPel *pout, const int *prefix, int ne,
+	int n_hline, const int *start, const int *end, int sizeof_element)
+{
+	/* clang-format off */
+	HWY_DYNAMIC_DISPATCH(vips_conva_hlines_uchar_hwy)(pout, prefix, ne,
+		n_hline, start, end, sizeof_element);
+	/* clang-format on */
+}
+#endif /*HWY_ONCE*/
+
+#endif /*HAVE_HWY*/
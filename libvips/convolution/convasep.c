@@ -9,6 +9,8 @@
  *      - from im_conv()
  * 5/7/16
  * 	- redone as a class
+ * 19/10/26
+ * 	- add a vector path for uchar images, based on prefix sums
  */
 
 /*
@@ -78,11 +80,13 @@
 #include <glib/gi18n-lib.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <math.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
 #include <vips/debug.h>
 #include <vips/internal.h>
 
@@ -350,6 +354,12 @@ typedef struct {
 	double *dsum;
 
 	int last_stride; /* Avoid recalcing offsets, if we can */
+
+	/* Prefix sums for the vector path, and the number of ints we have
+	 * allocated.
+	 */
+	int *prefix;
+	int n_prefix;
 } VipsConvasepSeq;
 
 /* Free a sequence value.
@@ -364,6 +374,7 @@ vips_convasep_stop(void *vseq, void *a, void *b)
 	VIPS_FREE(seq->end);
 	VIPS_FREE(seq->isum);
 	VIPS_FREE(seq->dsum);
+	VIPS_FREE(seq->prefix);
 
 	return 0;
 }
@@ -394,6 +405,8 @@ vips_convasep_start(VipsImage *out, void *a, void *b)
 	else
 		seq->dsum = VIPS_ARRAY(NULL, convasep->n_lines, double);
 	seq->last_stride = -1;
+	seq->prefix = NULL;
+	seq->n_prefix = 0;
 
 	if (!seq->ir ||
 		!seq->start ||
@@ -812,6 +825,161 @@ vips_convasep_generate_vertical(VipsRegion *out_region,
 	return 0;
 }
 
+#ifdef HAVE_HWY
+/* Make sure we have space for at least n prefix sums.
+ */
+static int
+vips_convasep_prefix_alloc(VipsConvasepSeq *seq, int n)
+{
+	if (n > seq->n_prefix) {
+		VIPS_FREE(seq->prefix);
+		if (!(seq->prefix = VIPS_ARRAY(NULL, n, int)))
+			return -1;
+		seq->n_prefix = n;
+	}
+
+	return 0;
+}
+
+/* The horizontal vector path. Each input scanline becomes a prefix sum with
+ * stride bands, then each line in the mask is a single subtraction.
+ */
+static int
+vips_convasep_horizontal_uchar_vector_gen(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsConvasepSeq *seq = (VipsConvasepSeq *) vseq;
+	VipsImage *in = (VipsImage *) a;
+	VipsConvasep *convasep = (VipsConvasep *) b;
+
+	VipsRegion *ir = seq->ir;
+	const int n_lines = convasep->n_lines;
+	const int bands = in->Bands;
+	VipsRect *r = &out_region->valid;
+	const int ne = r->width * bands;
+
+	VipsRect s;
+	int x, y, z;
+	int sz;
+
+	s = *r;
+	s.width += convasep->width - 1;
+	if (vips_region_prepare(ir, &s))
+		return -1;
+
+	/* Plus one pixel of zeros at the start.
+	 */
+	sz = s.width * bands;
+	if (vips_convasep_prefix_alloc(seq, sz + bands))
+		return -1;
+
+	if (seq->last_stride != bands) {
+		seq->last_stride = bands;
+
+		for (z = 0; z < n_lines; z++) {
+			seq->start[z] = convasep->start[z] * bands;
+			seq->end[z] = convasep->end[z] * bands;
+		}
+	}
+
+	VIPS_GATE_START("vips_convasep_horizontal_uchar_vector_gen: work");
+
+	for (y = 0; y < r->height; y++) {
+		VipsPel *p = VIPS_REGION_ADDR(ir, s.left, s.top + y);
+
+		/* Unsigned, so that overflow wraps. The differences we take
+		 * will still be correct.
+		 */
+		unsigned int *prefix = (unsigned int *) seq->prefix;
+
+		for (x = 0; x < bands; x++)
+			prefix[x] = 0;
+		for (x = 0; x < sz; x++)
+			prefix[x + bands] = prefix[x] + p[x];
+
+		/* Don't add offset ... we only want to do that once, do it on
+		 * the vertical pass.
+		 */
+		vips_conva_boxes_uchar_hwy(
+			VIPS_REGION_ADDR(out_region, r->left, r->top + y),
+			seq->prefix, ne,
+			n_lines, seq->start, seq->end, convasep->factor,
+			convasep->rounding, convasep->divisor, 0);
+	}
+
+	VIPS_GATE_STOP("vips_convasep_horizontal_uchar_vector_gen: work");
+
+	VIPS_COUNT_PIXELS(out_region,
+		"vips_convasep_horizontal_uchar_vector_gen");
+
+	return 0;
+}
+
+/* The vertical vector path. We make a prefix sum down each column, one
+ * prefix row per input row, then process many columns at once.
+ */
+static int
+vips_convasep_vertical_uchar_vector_gen(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsConvasepSeq *seq = (VipsConvasepSeq *) vseq;
+	VipsConvasep *convasep = (VipsConvasep *) b;
+
+	VipsRegion *ir = seq->ir;
+	const int n_lines = convasep->n_lines;
+	VipsRect *r = &out_region->valid;
+	const int ne = VIPS_REGION_N_ELEMENTS(out_region);
+
+	VipsRect s;
+	int x, y, z;
+
+	s = *r;
+	s.height += convasep->width - 1;
+	if (vips_region_prepare(ir, &s))
+		return -1;
+
+	/* Plus one row of zeros at the top.
+	 */
+	if (vips_convasep_prefix_alloc(seq, (s.height + 1) * ne))
+		return -1;
+
+	if (seq->last_stride != ne) {
+		seq->last_stride = ne;
+
+		for (z = 0; z < n_lines; z++) {
+			seq->start[z] = convasep->start[z] * ne;
+			seq->end[z] = convasep->end[z] * ne;
+		}
+	}
+
+	VIPS_GATE_START("vips_convasep_vertical_uchar_vector_gen: work");
+
+	memset(seq->prefix, 0, ne * sizeof(int));
+	for (y = 0; y < s.height; y++) {
+		VipsPel *p = VIPS_REGION_ADDR(ir, s.left, s.top + y);
+		unsigned int *p0 = (unsigned int *) seq->prefix + y * ne;
+		unsigned int *p1 = p0 + ne;
+
+		for (x = 0; x < ne; x++)
+			p1[x] = p0[x] + p[x];
+	}
+
+	for (y = 0; y < r->height; y++)
+		vips_conva_boxes_uchar_hwy(
+			VIPS_REGION_ADDR(out_region, r->left, r->top + y),
+			seq->prefix + y * ne, ne,
+			n_lines, seq->start, seq->end, convasep->factor,
+			convasep->rounding, convasep->divisor, convasep->offset);
+
+	VIPS_GATE_STOP("vips_convasep_vertical_uchar_vector_gen: work");
+
+	VIPS_COUNT_PIXELS(out_region,
+		"vips_convasep_vertical_uchar_vector_gen");
+
+	return 0;
+}
+#endif /*HAVE_HWY*/
+
 static int
 vips_convasep_pass(VipsConvasep *convasep,
 	VipsImage *in, VipsImage **out, VipsDirection direction)
@@ -841,6 +1009,18 @@ vips_convasep_pass(VipsConvasep *convasep,
 		return -1;
 	}
 
+	/* For uchar input, try to use the vector path.
+	 */
+#ifdef HAVE_HWY
+	if (in->BandFmt == VIPS_FORMAT_UCHAR &&
+		vips_vector_isenabled()) {
+		gen = direction == VIPS_DIRECTION_HORIZONTAL
+			? vips_convasep_horizontal_uchar_vector_gen
+			: vips_convasep_vertical_uchar_vector_gen;
+		g_info("convasep: using vector path");
+	}
+#endif /*HAVE_HWY*/
+
 	if (vips_image_generate(*out,
 			vips_convasep_start, gen, vips_convasep_stop, in, convasep))
 		return -1;
@@ -0,0 +1,732 @@
+/* convfft ... convolution via the FFT
+ *
+ * 19/10/26
+ * 	- from convf.c
+ * 	- bound the plan cache, free plans on shutdown
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+
+	This is overlap-save convolution. The output is cut into blocks, and
+	each block is made by transforming a slightly larger area of the
+	input, multiplying by the transformed mask, and transforming back.
+	The circular wraparound only damages the edges of the result, and we
+	size the input area so that those pixels fall outside the block.
+
+	Cost per output pixel is roughly log(fft_size), rather than the
+	number of mask elements, so this wins for large masks.
+
+	Plans are cached by size and shared between all threads and all
+	convfft operations, since planning is slow and must be locked. We keep
+	up to VIPS_CONVFFT_MAX_PLANS plans which are not in use, and drop the
+	least recently used one beyond that.
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+#include "pconvolution.h"
+
+#ifdef HAVE_FFTW
+
+#include <fftw3.h>
+
+/* Keep at most this many plans which no convfft is using.
+ */
+#define VIPS_CONVFFT_MAX_PLANS (16)
+
+/* A pair of plans for a size of FFT.
+ */
+typedef struct _VipsConvfftPlan {
+	gint64 key;
+
+	/* Number of convfft using this plan, and when it was last asked for.
+	 */
+	int ref_count;
+	gint64 time;
+
+	fftw_plan forward;
+	fftw_plan inverse;
+} VipsConvfftPlan;
+
+/* All the plans we have made, indexed by size, and a clock for LRU.
+ * Protected by vips__fft_lock.
+ */
+static GHashTable *vips_convfft_plans = NULL;
+static gint64 vips_convfft_time = 0;
+
+typedef struct {
+	VipsConvolution parent_instance;
+
+	/* The size of the FFT we do for each block, and the number of valid
+	 * output pixels each block makes.
+	 */
+	int fft_width;
+	int fft_height;
+	int block_width;
+	int block_height;
+
+	/* The transformed mask, fft_height x (fft_width / 2 + 1) complex.
+	 * It's already normalised, and has scale baked in.
+	 */
+	fftw_complex *kernel;
+
+	/* Shared with other convfft, we hold a ref.
+	 */
+	VipsConvfftPlan *plan;
+} VipsConvfft;
+
+typedef VipsConvolutionClass VipsConvfftClass;
+
+G_DEFINE_TYPE(VipsConvfft, vips_convfft, VIPS_TYPE_CONVOLUTION);
+
+/* Must be called with vips__fft_lock held.
+ */
+static void
+vips_convfft_plan_free(VipsConvfftPlan *plan)
+{
+	fftw_destroy_plan(plan->forward);
+	fftw_destroy_plan(plan->inverse);
+	g_free(plan);
+}
+
+static gboolean
+vips_convfft_plan_free_cb(void *key, void *value, void *user_data)
+{
+	vips_convfft_plan_free((VipsConvfftPlan *) value);
+
+	return TRUE;
+}
+
+/* Drop unused plans, oldest first, until we are within the limit. Must be
+ * called with vips__fft_lock held.
+ */
+static void
+vips_convfft_plan_trim(void)
+{
+	while (g_hash_table_size(vips_convfft_plans) > VIPS_CONVFFT_MAX_PLANS) {
+		GHashTableIter iter;
+		VipsConvfftPlan *plan;
+		VipsConvfftPlan *oldest;
+
+		oldest = NULL;
+		g_hash_table_iter_init(&iter, vips_convfft_plans);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &plan))
+			if (plan->ref_count == 0 &&
+				(!oldest ||
+					plan->time < oldest->time))
+				oldest = plan;
+
+		/* Everything is in use.
+		 */
+		if (!oldest)
+			break;
+
+		g_hash_table_remove(vips_convfft_plans, &oldest->key);
+		vips_convfft_plan_free(oldest);
+	}
+}
+
+/* Get the plans for a size, making them if necessary. Unref with
+ * vips_convfft_plan_unref().
+ */
+static VipsConvfftPlan *
+vips_convfft_plan_get(int width, int height)
+{
+	gint64 key = ((gint64) width << 32) | height;
+
+	VipsConvfftPlan *plan;
+
+	g_mutex_lock(&vips__fft_lock);
+
+	if (!vips_convfft_plans)
+		vips_convfft_plans = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+	if (!(plan = g_hash_table_lookup(vips_convfft_plans, &key))) {
+		const int half_width = width / 2 + 1;
+
+		double *real;
+		fftw_complex *complex;
+
+		/* The planner needs scratch arrays. fftw_malloc() gives us
+		 * the alignment the new-array execute functions expect, so
+		 * we can use these plans with any fftw_malloc()ed buffers.
+		 */
+		real = fftw_malloc(sizeof(double) * width * height);
+		complex = fftw_malloc(sizeof(fftw_complex) * half_width * height);
+		plan = g_new0(VipsConvfftPlan, 1);
+		plan->key = key;
+		if (real &&
+			complex) {
+			plan->forward = fftw_plan_dft_r2c_2d(height, width,
+				real, complex, FFTW_MEASURE);
+			plan->inverse = fftw_plan_dft_c2r_2d(height, width,
+				complex, real, FFTW_MEASURE);
+		}
+		if (real)
+			fftw_free(real);
+		if (complex)
+			fftw_free(complex);
+
+		if (!plan->forward ||
+			!plan->inverse) {
+			if (plan->forward)
+				fftw_destroy_plan(plan->forward);
+			if (plan->inverse)
+				fftw_destroy_plan(plan->inverse);
+			g_free(plan);
+			g_mutex_unlock(&vips__fft_lock);
+			vips_error("convfft",
+				"%s", _("unable to create transform plan"));
+			return NULL;
+		}
+
+		g_hash_table_insert(vips_convfft_plans, &plan->key, plan);
+	}
+
+	plan->ref_count += 1;
+	plan->time = vips_convfft_time++;
+
+	g_mutex_unlock(&vips__fft_lock);
+
+	return plan;
+}
+
+static void
+vips_convfft_plan_unref(VipsConvfftPlan *plan)
+{
+	g_mutex_lock(&vips__fft_lock);
+
+	g_assert(plan->ref_count > 0);
+
+	plan->ref_count -= 1;
+	vips_convfft_plan_trim();
+
+	g_mutex_unlock(&vips__fft_lock);
+}
+
+/* Find a fast FFT size: the smallest 2^a 3^b 5^c 7^d which is >= n.
+ */
+static int
+vips_convfft_good_size(int n)
+{
+	int size;
+
+	for (size = VIPS_MAX(n, 1);; size++) {
+		int m;
+
+		m = size;
+		while (m % 2 == 0)
+			m /= 2;
+		while (m % 3 == 0)
+			m /= 3;
+		while (m % 5 == 0)
+			m /= 5;
+		while (m % 7 == 0)
+			m /= 7;
+
+		if (m == 1)
+			return size;
+	}
+}
+
+/* Our sequence value.
+ */
+typedef struct {
+	VipsConvfft *convfft;
+	VipsRegion *ir; /* Input region */
+
+	/* Per-thread FFT buffers.
+	 */
+	double *real;
+	fftw_complex *complex;
+} VipsConvfftSequence;
+
+/* Free a sequence value.
+ */
+static int
+vips_convfft_stop(void *vseq, void *a, void *b)
+{
+	VipsConvfftSequence *seq = (VipsConvfftSequence *) vseq;
+
+	VIPS_UNREF(seq->ir);
+	VIPS_FREEF(fftw_free, seq->real);
+	VIPS_FREEF(fftw_free, seq->complex);
+
+	return 0;
+}
+
+/* Convolution start function.
+ */
+static void *
+vips_convfft_start(VipsImage *out, void *a, void *b)
+{
+	VipsImage *in = (VipsImage *) a;
+	VipsConvfft *convfft = (VipsConvfft *) b;
+	const int half_width = convfft->fft_width / 2 + 1;
+
+	VipsConvfftSequence *seq;
+
+	if (!(seq = VIPS_NEW(out, VipsConvfftSequence)))
+		return NULL;
+
+	seq->convfft = convfft;
+	seq->ir = vips_region_new(in);
+	seq->real = fftw_malloc(sizeof(double) *
+		convfft->fft_width * convfft->fft_height);
+	seq->complex = fftw_malloc(sizeof(fftw_complex) *
+		half_width * convfft->fft_height);
+	if (!seq->ir ||
+		!seq->real ||
+		!seq->complex) {
+		vips_convfft_stop(seq, in, convfft);
+		return NULL;
+	}
+
+	return (void *) seq;
+}
+
+/* Copy band b of an area of the input into the real buffer, zero-padding
+ * out to the FFT size.
+ */
+#define LOAD(TYPE) \
+	{ \
+		for (y = 0; y < area->height; y++) { \
+			TYPE *p = b + (TYPE *) VIPS_REGION_ADDR(ir, \
+							  area->left, area->top + y); \
+			double *q = seq->real + y * fft_width; \
+\
+			for (x = 0; x < area->width; x++) { \
+				q[x] = *p; \
+				p += bands; \
+			} \
+		} \
+	}
+
+static void
+vips_convfft_load(VipsConvfftSequence *seq, VipsRect *area, int b)
+{
+	VipsConvfft *convfft = seq->convfft;
+	VipsRegion *ir = seq->ir;
+	const int fft_width = convfft->fft_width;
+	const int bands = ir->im->Bands;
+
+	int x, y;
+
+	memset(seq->real, 0, sizeof(double) * fft_width * convfft->fft_height);
+
+	switch (ir->im->BandFmt) {
+	case VIPS_FORMAT_UCHAR:
+		LOAD(unsigned char);
+		break;
+
+	case VIPS_FORMAT_CHAR:
+		LOAD(signed char);
+		break;
+
+	case VIPS_FORMAT_USHORT:
+		LOAD(unsigned short);
+		break;
+
+	case VIPS_FORMAT_SHORT:
+		LOAD(signed short);
+		break;
+
+	case VIPS_FORMAT_UINT:
+		LOAD(unsigned int);
+		break;
+
+	case VIPS_FORMAT_INT:
+		LOAD(signed int);
+		break;
+
+	case VIPS_FORMAT_FLOAT:
+		LOAD(float);
+		break;
+
+	case VIPS_FORMAT_DOUBLE:
+		LOAD(double);
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* Write the valid part of the inverse transform to band b of the output.
+ */
+#define SAVE(TYPE) \
+	{ \
+		for (y = 0; y < block->height; y++) { \
+			double *p = seq->real + y * fft_width; \
+			TYPE *q = b + (TYPE *) VIPS_REGION_ADDR(out_region, \
+							  block->left, block->top + y); \
+\
+			for (x = 0; x < block->width; x++) { \
+				*q = p[x] + offset; \
+				q += bands; \
+			} \
+		} \
+	}
+
+static void
+vips_convfft_save(VipsConvfftSequence *seq,
+	VipsRegion *out_region, VipsRect *block, int b)
+{
+	VipsConvfft *convfft = seq->convfft;
+	VipsConvolution *convolution = (VipsConvolution *) convfft;
+	double offset = vips_image_get_offset(convolution->M);
+	const int fft_width = convfft->fft_width;
+	const int bands = out_region->im->Bands;
+
+	int x, y;
+
+	if (out_region->im->BandFmt == VIPS_FORMAT_DOUBLE)
+		SAVE(double)
+	else
+		SAVE(float)
+}
+
+/* Convolve!
+ */
+static int
+vips_convfft_gen(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsConvfftSequence *seq = (VipsConvfftSequence *) vseq;
+	VipsConvfft *convfft = (VipsConvfft *) b;
+	VipsConvolution *convolution = (VipsConvolution *) convfft;
+	VipsImage *M = convolution->M;
+	VipsImage *in = (VipsImage *) a;
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &out_region->valid;
+	const int half_width = convfft->fft_width / 2 + 1;
+	const int n_complex = half_width * convfft->fft_height;
+
+	VipsRect s;
+	int bx, by;
+	int i, k;
+
+	/* Prepare the section of the input image we need. A little larger
+	 * than the section of the output image we are producing.
+	 */
+	s = *r;
+	s.width += M->Xsize - 1;
+	s.height += M->Ysize - 1;
+	if (vips_region_prepare(ir, &s))
+		return -1;
+
+	VIPS_GATE_START("vips_convfft_gen: work");
+
+	for (by = r->top; by < VIPS_RECT_BOTTOM(r); by += convfft->block_height)
+		for (bx = r->left; bx < VIPS_RECT_RIGHT(r);
+			 bx += convfft->block_width) {
+			VipsRect block;
+			VipsRect area;
+
+			/* The output pixels we make, and the input area we need
+			 * for them.
+			 */
+			block.left = bx;
+			block.top = by;
+			block.width = convfft->block_width;
+			block.height = convfft->block_height;
+			vips_rect_intersectrect(&block, r, &block);
+
+			area = block;
+			area.width += M->Xsize - 1;
+			area.height += M->Ysize - 1;
+
+			for (i = 0; i < in->Bands; i++) {
+				vips_convfft_load(seq, &area, i);
+
+				fftw_execute_dft_r2c(convfft->plan->forward,
+					seq->real, seq->complex);
+
+				for (k = 0; k < n_complex; k++) {
+					double *p = seq->complex[k];
+					double *q = convfft->kernel[k];
+					double re = p[0] * q[0] - p[1] * q[1];
+					double im = p[0] * q[1] + p[1] * q[0];
+
+					p[0] = re;
+					p[1] = im;
+				}
+
+				fftw_execute_dft_c2r(convfft->plan->inverse,
+					seq->complex, seq->real);
+
+				vips_convfft_save(seq, out_region, &block, i);
+			}
+		}
+
+	VIPS_GATE_STOP("vips_convfft_gen: work");
+
+	VIPS_COUNT_PIXELS(out_region, "vips_convfft_gen");
+
+	return 0;
+}
+
+/* Transform the mask. We want a correlation, like convf, so the mask is
+ * reflected about the origin. Then the valid part of each inverse transform
+ * is the top-left block_width x block_height pixels.
+ */
+static int
+vips_convfft_kernel(VipsConvfft *convfft)
+{
+	VipsConvolution *convolution = (VipsConvolution *) convfft;
+	VipsImage *M = convolution->M;
+	const int fft_width = convfft->fft_width;
+	const int fft_height = convfft->fft_height;
+	const int half_width = fft_width / 2 + 1;
+
+	/* Normalise the inverse transform and remove the mask scale in
+	 * one go.
+	 */
+	double scale = vips_image_get_scale(M) * fft_width * fft_height;
+
+	double *real;
+	int x, y;
+
+	if (!(real = fftw_malloc(sizeof(double) * fft_width * fft_height)) ||
+		!(convfft->kernel = fftw_malloc(sizeof(fftw_complex) *
+			  half_width * fft_height))) {
+		VIPS_FREEF(fftw_free, real);
+		vips_error("convfft", "%s", _("out of memory"));
+		return -1;
+	}
+
+	memset(real, 0, sizeof(double) * fft_width * fft_height);
+	for (y = 0; y < M->Ysize; y++)
+		for (x = 0; x < M->Xsize; x++) {
+			int kx = (fft_width - x) % fft_width;
+			int ky = (fft_height - y) % fft_height;
+
+			real[ky * fft_width + kx] = *VIPS_MATRIX(M, x, y) / scale;
+		}
+
+	fftw_execute_dft_r2c(convfft->plan->forward, real, convfft->kernel);
+
+	fftw_free(real);
+
+	return 0;
+}
+
+static int
+vips_convfft_build(VipsObject *object)
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(object);
+	VipsConvolution *convolution = (VipsConvolution *) object;
+	VipsConvfft *convfft = (VipsConvfft *) object;
+	VipsImage **t = (VipsImage **) vips_object_local_array(object, 4);
+
+	VipsImage *in;
+	VipsImage *M;
+
+	if (VIPS_OBJECT_CLASS(vips_convfft_parent_class)->build(object))
+		return -1;
+
+	M = convolution->M;
+	in = convolution->in;
+
+	if (vips_check_uncoded(class->nickname, in) ||
+		vips_check_noncomplex(class->nickname, in))
+		return -1;
+
+	/* Aim for a block at least as large as a tile, so each output tile
+	 * needs only one transform. The FFT must be large enough to hold the
+	 * block plus the mask margin.
+	 */
+	convfft->fft_width = vips_convfft_good_size(
+		VIPS_MAX(vips__tile_width, M->Xsize) + M->Xsize - 1);
+	convfft->fft_height = vips_convfft_good_size(
+		VIPS_MAX(vips__tile_height, M->Ysize) + M->Ysize - 1);
+
+	/* No point going much beyond the size of the image.
+	 */
+	convfft->fft_width = VIPS_MIN(convfft->fft_width,
+		vips_convfft_good_size(in->Xsize + 2 * (M->Xsize - 1)));
+	convfft->fft_height = VIPS_MIN(convfft->fft_height,
+		vips_convfft_good_size(in->Ysize + 2 * (M->Ysize - 1)));
+
+	convfft->block_width = convfft->fft_width - M->Xsize + 1;
+	convfft->block_height = convfft->fft_height - M->Ysize + 1;
+
+#ifdef DEBUG
+	printf("vips_convfft_build: fft %d x %d, block %d x %d\n",
+		convfft->fft_width, convfft->fft_height,
+		convfft->block_width, convfft->block_height);
+#endif /*DEBUG*/
+
+	if (!(convfft->plan = vips_convfft_plan_get(
+			  convfft->fft_width, convfft->fft_height)) ||
+		vips_convfft_kernel(convfft))
+		return -1;
+
+	if (vips_embed(in, &t[0],
+			M->Xsize / 2, M->Ysize / 2,
+			in->Xsize + M->Xsize - 1, in->Ysize + M->Ysize - 1,
+			"extend", VIPS_EXTEND_COPY,
+			NULL))
+		return -1;
+	in = t[0];
+
+	g_object_set(convfft, "out", vips_image_new(), NULL);
+	if (vips_image_pipelinev(convolution->out,
+			VIPS_DEMAND_STYLE_SMALLTILE, in, NULL))
+		return -1;
+
+	/* Prepare output. Consider a 7x7 mask and a 7x7 image -- the output
+	 * would be 1x1.
+	 */
+	if (in->BandFmt != VIPS_FORMAT_DOUBLE)
+		convolution->out->BandFmt = VIPS_FORMAT_FLOAT;
+	convolution->out->Xsize -= M->Xsize - 1;
+	convolution->out->Ysize -= M->Ysize - 1;
+
+	if (vips_image_generate(convolution->out,
+			vips_convfft_start, vips_convfft_gen, vips_convfft_stop,
+			in, convfft))
+		return -1;
+
+	convolution->out->Xoffset = -M->Xsize / 2;
+	convolution->out->Yoffset = -M->Ysize / 2;
+
+	return 0;
+}
+
+static void
+vips_convfft_finalize(GObject *gobject)
+{
+	VipsConvfft *convfft = (VipsConvfft *) gobject;
+
+	VIPS_FREEF(fftw_free, convfft->kernel);
+	VIPS_FREEF(vips_convfft_plan_unref, convfft->plan);
+
+	G_OBJECT_CLASS(vips_convfft_parent_class)->finalize(gobject);
+}
+
+static void
+vips_convfft_class_init(VipsConvfftClass *class)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(class);
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+
+	gobject_class->finalize = vips_convfft_finalize;
+
+	object_class->nickname = "convfft";
+	object_class->description = _("FFT convolution operation");
+	object_class->build = vips_convfft_build;
+}
+
+static void
+vips_convfft_init(VipsConvfft *convfft)
+{
+}
+
+#endif /*HAVE_FFTW*/
+
+/* Free all cached plans. Called from vips_shutdown().
+ */
+void
+vips__convfft_shutdown(void)
+{
+#ifdef HAVE_FFTW
+	g_mutex_lock(&vips__fft_lock);
+
+	if (vips_convfft_plans) {
+		g_hash_table_foreach_remove(vips_convfft_plans,
+			vips_convfft_plan_free_cb, NULL);
+		VIPS_FREEF(g_hash_table_destroy, vips_convfft_plans);
+	}
+
+	g_mutex_unlock(&vips__fft_lock);
+#endif /*HAVE_FFTW*/
+}
+
+/**
+ * vips_convfft: (method)
+ * @in: input image
+ * @out: (out): output image
+ * @mask: convolve with this mask
+ * @...: `NULL`-terminated list of optional named arguments
+ *
+ * FFT convolution. This is a low-level operation, see [method@Image.conv]
+ * for something more convenient.
+ *
+ * Perform a convolution of @in with @mask.
+ * Each output pixel is
+ * calculated as sigma[i]{pixel[i] * mask[i]} / scale + offset, where scale
+ * and offset are part of @mask.
+ *
+ * The image is processed in blocks with overlap-save convolution, so the
+ * cost per pixel depends on the log of the mask size rather than the number
+ * of mask elements. This is much faster than [method@Image.convf] for large
+ * masks, and gives the same result, to within rounding.
+ *
+ * The output image
+ * is always [enum@Vips.BandFormat.FLOAT] unless @in is
+ * [enum@Vips.BandFormat.DOUBLE], in which case @out is also
+ * [enum@Vips.BandFormat.DOUBLE]. Complex images are not supported.
+ *
+ * VIPS uses the fftw Fourier Transform library. If this library was not
+ * available when VIPS was configured, this function will fail.
+ *
+ * ::: seealso
+ *     [method@Image.conv], [method@Image.convf].
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+vips_convfft(VipsImage *in, VipsImage **out, VipsImage *mask, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, mask);
+	result = vips_call_split("convfft", ap, in, out, mask);
+	va_end(ap);
+
+	return result;
+}
@@ -75,6 +75,12 @@ void vips_convi_uchar_hwy(VipsRegion *out_region, VipsRegion *ir, VipsRect *r,
 	int ne, int nnz, int offset, const int *restrict offsets,
 	const short *restrict mant, int exp);
 
+void vips_conva_boxes_uchar_hwy(VipsPel *pout, const int *prefix, int ne,
+	int n_box, const int *start, const int *end, const int *factor,
+	int rounding, int divisor, int offset);
+void vips_conva_hlines_uchar_hwy(VipsPel *pout, const int *prefix, int ne,
+	int n_hline, const int *start, const int *end, int sizeof_element);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
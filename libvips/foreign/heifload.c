@@ -28,6 +28,8 @@
  * 	- add @unlimited
  * 13/03/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 19/10/26
+ * 	- check for kill on each line
  */
 
 /*
@@ -940,6 +942,9 @@ vips_foreign_load_heif_generate(VipsRegion *out_region,
 
 	g_assert(r->height == 1);
 
+	if (vips_image_iskilled(out_region->im))
+		return -1;
+
 	if (vips_foreign_load_heif_set_page(heif, page, heif->thumbnail))
 		return -1;
 
@@ -16,6 +16,8 @@
  * 	- add >8 bit support
  * 22/10/11
  *      - improve rules for 16-bit write [johntrunc]
+ * 19/10/26
+ * 	- check for kill before encoding each page
  */
 
 /*
@@ -468,10 +470,11 @@ vips_foreign_save_heif_write_block(VipsRegion *region, VipsRect *area,
 			return -1;
 
 		/* Did we just write the final line? Write as a new page
-		 * into the output.
+		 * into the output. Encoding is slow, so check for kill first.
 		 */
 		if (line == heif->page_height - 1)
-			if (vips_foreign_save_heif_write_page(heif, page))
+			if (vips_image_iskilled(region->im) ||
+				vips_foreign_save_heif_write_page(heif, page))
 				return -1;
 	}
 
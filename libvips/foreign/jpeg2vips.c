@@ -114,6 +114,8 @@
  * 	- add fail_on support
  * 2/8/22
  *      - add "unlimited"
+ * 19/10/26
+ * 	- check for kill before each strip
  */
 
 /*
@@ -834,6 +836,14 @@ read_jpeg_generate(VipsRegion *out_region,
 		return -1;
 	}
 
+	/* Stop before we decode any of this strip, so the read position
+	 * stays valid for anyone else using this loader.
+	 */
+	if (vips_image_iskilled(out_region->im)) {
+		VIPS_GATE_STOP("read_jpeg_generate: work");
+		return -1;
+	}
+
 	/* Here for longjmp() from vips__new_error_exit() during
 	 * jpeg_read_scanlines().
 	 */
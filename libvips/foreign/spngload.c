@@ -8,6 +8,8 @@
  *	-  add "unlimited" flag to png load
  * 3/2/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 19/10/26
+ * 	- check for kill before each strip
  */
 
 /*
@@ -530,6 +532,12 @@ vips_foreign_load_png_generate(VipsRegion *out_region,
 		return -1;
 	}
 
+	/* Stop before we decode any of this strip, so y_pos stays valid for
+	 * anyone else using this loader.
+	 */
+	if (vips_image_iskilled(out_region->im))
+		return -1;
+
 	for (y = 0; y < r->height; y++) {
 		/* libspng returns EOI when successfully reading the
 		 * final line of input.
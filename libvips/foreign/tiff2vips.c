@@ -213,6 +213,8 @@
  *  - fix demand hinting
  * 3/2/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 19/10/26
+ * 	- check for kill before each strip and row of tiles
  */
 
 /*
@@ -2428,6 +2430,9 @@ rtiff_fill_region_unaligned(VipsRegion *out,
 	while (y < r->height) {
 		VipsRect tile, page, hit;
 
+		if (vips_image_iskilled(out->im))
+			return -1;
+
 		/* Not necessary, but it stops static analyzers complaining
 		 * about a used-before-set.
 		 */
@@ -2792,6 +2797,14 @@ rtiff_stripwise_generate(VipsRegion *out_region,
 
 		VipsRect image, page, strip, hit;
 
+		/* y_pos only moves on after each strip, so we can stop
+		 * between strips.
+		 */
+		if (vips_image_iskilled(out)) {
+			VIPS_GATE_STOP("rtiff_stripwise_generate: work");
+			return -1;
+		}
+
 		/* Our four (including the output region) rects, all in
 		 * output image coordinates.
 		 */
@@ -100,6 +100,8 @@
  *	- add restart_interval
  * 21/10/21 usualuse
  *	- raise single-chunk limit on APP to 65533
+ * 19/10/26
+ * 	- check for kill before each strip
  */
 
 /*
@@ -516,6 +518,9 @@ write_jpeg_block(VipsRegion *region, VipsRect *area, void *a)
 {
 	Write *write = (Write *) a;
 
+	if (vips_image_iskilled(region->im))
+		return -1;
+
 	for (int y = 0; y < area->height; y++)
 		write->row_pointer[y] = (JSAMPROW)
 			VIPS_REGION_ADDR(region, area->left, area->top + y);
@@ -206,6 +206,8 @@
  * 	- switch to terget API for output
  * 24/9/23
  *  - add threaded write of tiled JPEG and JP2K
+ * 19/10/26
+ * 	- check for kill as strips arrive
  */
 
 /*
@@ -2272,6 +2274,9 @@ wtiff_write_lines(Wtiff *wtiff, VipsRegion *region, VipsRect *lines)
 		if (vips_rect_isempty(&target))
 			break;
 
+		if (vips_image_iskilled(wtiff->ready))
+			return -1;
+
 		/* And copy those pixels in.
 		 *
 		 * FIXME: If the strip fits inside the region we've just
@@ -89,6 +89,8 @@
  * 	- add exif read/write
  * 3/2/23 MathemanFlo
  * 	- add bits per sample metadata
+ * 19/10/26
+ * 	- check for kill before each strip
  */
 
 /*
@@ -724,6 +726,12 @@ png2vips_generate(VipsRegion *out_region,
 		return -1;
 	}
 
+	/* Stop before we decode any of this strip, so y_pos stays valid for
+	 * anyone else using this loader.
+	 */
+	if (vips_image_iskilled(out_region->im))
+		return -1;
+
 	for (y = 0; y < r->height; y++) {
 		png_bytep q = (png_bytep) VIPS_REGION_ADDR(out_region, 0, r->top + y);
 
@@ -958,6 +966,9 @@ write_png_block(VipsRegion *region, VipsRect *area, void *a)
 	g_assert(area->width == region->im->Xsize);
 	g_assert(area->top + area->height <= region->im->Ysize);
 
+	if (vips_image_iskilled(region->im))
+		return -1;
+
 	/* Catch PNG errors.
 	 */
 	if (setjmp(png_jmpbuf(write->pPng)))
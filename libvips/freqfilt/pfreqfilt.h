@@ -35,10 +35,6 @@
 extern "C" {
 #endif /*__cplusplus*/
 
-/* All fftw3 calls except execute() need to be locked.
- */
-extern GMutex vips__fft_lock;
-
 #define VIPS_TYPE_FREQFILT (vips_freqfilt_get_type())
 #define VIPS_FREQFILT(obj) \
 	(G_TYPE_CHECK_INSTANCE_CAST((obj), \
@@ -27,6 +27,8 @@
  * 	  current value
  * 	- scale result by 255, not 256, to avoid overflow
  * 	- off by 1 fix for odd window widths
+ * 19/10/26
+ * 	- use local_stats.c, so updates no longer depend on window size
  */
 
 /*
@@ -68,6 +70,8 @@
 #include <vips/vips.h>
 #include <vips/internal.h>
 
+#include "phistogram.h"
+
 typedef struct _VipsHistLocal {
 	VipsOperation parent_instance;
 
@@ -92,24 +96,16 @@ typedef struct {
 
 	/* A 256-element hist for every band.
 	 */
-	unsigned int **hist;
+	VipsLocalStats *stats;
 } VipsHistLocalSequence;
 
 static int
 vips_hist_local_stop(void *vseq, void *a, void *b)
 {
 	VipsHistLocalSequence *seq = (VipsHistLocalSequence *) vseq;
-	VipsImage *in = (VipsImage *) a;
 
 	VIPS_UNREF(seq->ir);
-	if (seq->hist &&
-		in) {
-		int i;
-
-		for (i = 0; i < in->Bands; i++)
-			VIPS_FREE(seq->hist[i]);
-	}
-	VIPS_FREE(seq->hist);
+	VIPS_FREEF(vips__local_stats_free, seq->stats);
 	VIPS_FREE(seq);
 
 	return 0;
@@ -119,27 +115,21 @@ static void *
 vips_hist_local_start(VipsImage *out, void *a, void *b)
 {
 	VipsImage *in = (VipsImage *) a;
+	VipsHistLocal *local = (VipsHistLocal *) b;
 	VipsHistLocalSequence *seq;
 
-	int i;
-
 	if (!(seq = VIPS_NEW(NULL, VipsHistLocalSequence)))
 		return NULL;
 	seq->ir = NULL;
-	seq->hist = NULL;
+	seq->stats = NULL;
 
 	if (!(seq->ir = vips_region_new(in)) ||
-		!(seq->hist = VIPS_ARRAY(NULL, in->Bands, unsigned int *))) {
+		!(seq->stats = vips__local_stats_new(local->width, local->height,
+			  in->Bands, FALSE, TRUE))) {
 		vips_hist_local_stop(seq, NULL, NULL);
 		return NULL;
 	}
 
-	for (i = 0; i < in->Bands; i++)
-		if (!(seq->hist[i] = VIPS_ARRAY(NULL, 256, unsigned int))) {
-			vips_hist_local_stop(seq, NULL, NULL);
-			return NULL;
-		}
-
 	return seq;
 }
 
@@ -148,6 +138,7 @@ vips_hist_local_generate(VipsRegion *out_region,
 	void *vseq, void *a, void *b, gboolean *stop)
 {
 	VipsHistLocalSequence *seq = (VipsHistLocalSequence *) vseq;
+	VipsLocalStats *stats = seq->stats;
 	VipsImage *in = (VipsImage *) a;
 	const VipsHistLocal *local = (VipsHistLocal *) b;
 	VipsRect *r = &out_region->valid;
@@ -155,7 +146,7 @@ vips_hist_local_generate(VipsRegion *out_region,
 	const int max_slope = local->max_slope;
 
 	VipsRect irect;
-	int y;
+	int sx, y;
 	int lsk;
 	int centre; /* Offset to move to centre of window */
 
@@ -163,115 +154,100 @@ vips_hist_local_generate(VipsRegion *out_region,
 	 */
 	irect.left = r->left;
 	irect.top = r->top;
-	irect.width = r->width + local->width;
-	irect.height = r->height + local->height;
+	irect.width = r->width + local->width - 1;
+	irect.height = r->height + local->height - 1;
 	if (vips_region_prepare(seq->ir, &irect))
 		return -1;
 
 	lsk = VIPS_REGION_LSKIP(seq->ir);
 	centre = lsk * (local->height / 2) + bands * (local->width / 2);
 
-	for (y = 0; y < r->height; y++) {
-		/* Get input and output pointers for this line.
-		 */
-		VipsPel *restrict p =
-			VIPS_REGION_ADDR(seq->ir, r->left, r->top + y);
-		VipsPel *restrict q =
-			VIPS_REGION_ADDR(out_region, r->left, r->top + y);
-
-		VipsPel *restrict p1;
-		int x, i, j, b;
-
-		/* Find histogram for the start of this line.
-		 */
-		for (b = 0; b < bands; b++)
-			memset(seq->hist[b], 0, 256 * sizeof(unsigned int));
-		p1 = p;
-		for (j = 0; j < local->height; j++) {
-			for (i = 0, x = 0; x < local->width; x++)
-				for (b = 0; b < bands; b++, i++)
-					seq->hist[b][p1[i]] += 1;
-
-			p1 += lsk;
-		}
+	for (sx = 0; sx < r->width; sx += VIPS_LOCAL_STATS_STRIPE) {
+		int sw = VIPS_MIN(VIPS_LOCAL_STATS_STRIPE, r->width - sx);
+		VipsPel *p = VIPS_REGION_ADDR(seq->ir, r->left + sx, r->top);
+
+		vips__local_stats_init(stats, p, lsk, sw);
 
-		/* Loop for output pels.
-		 */
-		for (x = 0; x < r->width; x++) {
-			for (b = 0; b < bands; b++) {
-				/* Sum histogram up to current pel.
-				 */
-				unsigned int *restrict hist = seq->hist[b];
-				const int target = p[centre + b];
+		for (y = 0; y < r->height; y++) {
+			VipsPel *restrict q = VIPS_REGION_ADDR(out_region,
+				r->left + sx, r->top + y);
 
-				int sum;
+			int x, i, b;
 
-				sum = 0;
+			if (y > 0) {
+				vips__local_stats_down(stats, p, lsk);
+				p += lsk;
+			}
+			vips__local_stats_start_line(stats);
+
+			/* Loop for output pels.
+			 */
+			for (x = 0; x < sw; x++) {
+				for (b = 0; b < bands; b++) {
+					/* Sum histogram up to current pel.
+					 */
+					unsigned int *restrict hist =
+						stats->hist + b * 256;
+					const int target = p[centre + x * bands + b];
 
-				/* For CLAHE we need to limit the height of the
-				 * hist to limit the amount we boost the
-				 * contrast by.
-				 */
-				if (max_slope > 0) {
-					int sum_over;
+					int sum;
 
-					sum_over = 0;
+					sum = 0;
 
-					/* Must be <= target, since a cum hist
-					 * always includes the current element.
+					/* For CLAHE we need to limit the height of the
+					 * hist to limit the amount we boost the
+					 * contrast by.
 					 */
-					for (i = 0; i <= target; i++) {
-						if (hist[i] > max_slope) {
-							sum_over += hist[i] -
-								max_slope;
-							sum += max_slope;
+					if (max_slope > 0) {
+						int sum_over;
+
+						sum_over = 0;
+
+						/* Must be <= target, since a cum hist
+						 * always includes the current element.
+						 */
+						for (i = 0; i <= target; i++) {
+							if (hist[i] > max_slope) {
+								sum_over += hist[i] -
+									max_slope;
+								sum += max_slope;
+							}
+							else
+								sum += hist[i];
 						}
-						else
-							sum += hist[i];
-					}
 
-					for (; i < 256; i++) {
-						if (hist[i] > max_slope)
-							sum_over += hist[i] -
-								max_slope;
+						for (; i < 256; i++) {
+							if (hist[i] > max_slope)
+								sum_over += hist[i] -
+									max_slope;
+						}
+
+						/* The extra clipped off bit from the
+						 * top of the hist is spread over all
+						 * bins equally, then summed to target.
+						 */
+						sum += (target + 1) * sum_over / 256;
+					}
+					else {
+						sum = 0;
+						for (i = 0; i <= target; i++)
+							sum += hist[i];
 					}
 
-					/* The extra clipped off bit from the
-					 * top of the hist is spread over all
-					 * bins equally, then summed to target.
+					/* This can't overflow, even in
+					 * contrast-limited mode.
+					 *
+					 * Scale by 255, not 256, or we'll get
+					 * overflow.
 					 */
-					sum += (target + 1) * sum_over / 256;
-				}
-				else {
-					sum = 0;
-					for (i = 0; i <= target; i++)
-						sum += hist[i];
+					q[b] = 255 * sum /
+						(local->width * local->height);
 				}
 
-				/* This can't overflow, even in
-				 * contrast-limited mode.
-				 *
-				 * Scale by 255, not 256, or we'll get
-				 * overflow.
-				 */
-				q[b] = 255 * sum /
-					(local->width * local->height);
-
-				/* Adapt histogram -- remove the pels from
-				 * the left hand column, add in pels for a
-				 * new right-hand column.
-				 */
-				p1 = p + b;
-				for (j = 0; j < local->height; j++) {
-					hist[p1[0]] -= 1;
-					hist[p1[bands * local->width]] += 1;
-
-					p1 += lsk;
-				}
-			}
+				vips__local_stats_right(stats, x);
 
-			p += bands;
-			q += bands;
+				q += bands;
+			}
 		}
 	}
 
@@ -0,0 +1,297 @@
+/* running statistics for a window sliding over an image
+ *
+ * 19/10/26
+ * 	- from stdif.c and hist_local.c
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+
+	Local statistics operations, like stdif and hist_local, need the
+	sum, sum of squares or histogram of a window around every pixel.
+
+	We keep stats for every column of the area under a stripe of output.
+	Moving down a line is a single add and subtract per column, and moving
+	the window right is an add and subtract of a pair of column stats, so
+	the cost per pixel does not depend on the window size. The inner loops
+	run across bands or histogram bins, and will vectorise.
+
+	Use it like this:
+
+		for each stripe of VIPS_LOCAL_STATS_STRIPE output pixels
+			vips__local_stats_init(stats, p, lsk, n_pixels)
+			for each line
+				if not the first line
+					vips__local_stats_down(stats, p, lsk)
+					p += lsk
+				vips__local_stats_start_line(stats)
+				for each pixel x
+					use stats->sum etc.
+					vips__local_stats_right(stats, x)
+
+	where p points to the top-left of the window for the first pixel in
+	the stripe.
+
+ */
+
+/*
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+#include "phistogram.h"
+
+void
+vips__local_stats_free(VipsLocalStats *stats)
+{
+	VIPS_FREE(stats->column_sum);
+	VIPS_FREE(stats->column_sum2);
+	VIPS_FREE(stats->column_hist);
+	VIPS_FREE(stats->start_sum);
+	VIPS_FREE(stats->start_sum2);
+	VIPS_FREE(stats->start_hist);
+	VIPS_FREE(stats->sum);
+	VIPS_FREE(stats->sum2);
+	VIPS_FREE(stats->hist);
+	VIPS_FREE(stats);
+}
+
+/* Make a set of local stats for a window of width x height on an image with
+ * bands. Free with vips__local_stats_free().
+ */
+VipsLocalStats *
+vips__local_stats_new(int width, int height, int bands,
+	gboolean do_moments, gboolean do_hist)
+{
+	const int n_elements = (VIPS_LOCAL_STATS_STRIPE + width - 1) * bands;
+
+	VipsLocalStats *stats;
+
+	if (!(stats = VIPS_NEW(NULL, VipsLocalStats)))
+		return NULL;
+	memset(stats, 0, sizeof(VipsLocalStats));
+	stats->width = width;
+	stats->height = height;
+	stats->bands = bands;
+	stats->do_moments = do_moments;
+	stats->do_hist = do_hist;
+
+	if (do_moments &&
+		(!(stats->column_sum =
+				 VIPS_ARRAY(NULL, n_elements, unsigned int)) ||
+			!(stats->column_sum2 =
+					VIPS_ARRAY(NULL, n_elements, unsigned int)) ||
+			!(stats->start_sum = VIPS_ARRAY(NULL, bands, gint64)) ||
+			!(stats->start_sum2 = VIPS_ARRAY(NULL, bands, gint64)) ||
+			!(stats->sum = VIPS_ARRAY(NULL, bands, gint64)) ||
+			!(stats->sum2 = VIPS_ARRAY(NULL, bands, gint64)))) {
+		vips__local_stats_free(stats);
+		return NULL;
+	}
+
+	if (do_hist &&
+		(!(stats->column_hist =
+				 VIPS_ARRAY(NULL, n_elements * 256, unsigned int)) ||
+			!(stats->start_hist =
+					VIPS_ARRAY(NULL, bands * 256, unsigned int)) ||
+			!(stats->hist = VIPS_ARRAY(NULL, bands * 256, unsigned int)))) {
+		vips__local_stats_free(stats);
+		return NULL;
+	}
+
+	return stats;
+}
+
+/* Add or remove a line of elements to the column stats.
+ */
+static void
+vips_local_stats_line(VipsLocalStats *stats, VipsPel *restrict p, int sign)
+{
+	const int n_elements = stats->n_elements;
+
+	if (stats->do_moments) {
+		unsigned int *restrict sum = stats->column_sum;
+		unsigned int *restrict sum2 = stats->column_sum2;
+
+		for (int i = 0; i < n_elements; i++) {
+			unsigned int t = p[i];
+
+			sum[i] += sign * t;
+			sum2[i] += sign * t * t;
+		}
+	}
+
+	if (stats->do_hist) {
+		unsigned int *restrict hist = stats->column_hist;
+
+		for (int i = 0; i < n_elements; i++)
+			hist[i * 256 + p[i]] += sign;
+	}
+}
+
+/* Add or remove the first width pixels of a line to the line start window.
+ */
+static void
+vips_local_stats_line_start(VipsLocalStats *stats,
+	VipsPel *restrict p, int sign)
+{
+	const int bands = stats->bands;
+	const int ne = stats->width * bands;
+
+	if (stats->do_moments)
+		for (int i = 0; i < ne; i += bands)
+			for (int b = 0; b < bands; b++) {
+				gint64 t = p[i + b];
+
+				stats->start_sum[b] += sign * t;
+				stats->start_sum2[b] += sign * t * t;
+			}
+
+	if (stats->do_hist)
+		for (int i = 0; i < ne; i += bands)
+			for (int b = 0; b < bands; b++)
+				stats->start_hist[b * 256 + p[i + b]] += sign;
+}
+
+/* Start a stripe of n_pixels output pixels. p is the top-left of the window
+ * for the first pixel, lsk the line skip in bytes.
+ */
+void
+vips__local_stats_init(VipsLocalStats *stats,
+	VipsPel *p, int lsk, int n_pixels)
+{
+	const int bands = stats->bands;
+
+	g_assert(n_pixels <= VIPS_LOCAL_STATS_STRIPE);
+
+	stats->n_elements = (n_pixels + stats->width - 1) * bands;
+
+	if (stats->do_moments) {
+		memset(stats->column_sum, 0,
+			stats->n_elements * sizeof(unsigned int));
+		memset(stats->column_sum2, 0,
+			stats->n_elements * sizeof(unsigned int));
+		memset(stats->start_sum, 0, bands * sizeof(gint64));
+		memset(stats->start_sum2, 0, bands * sizeof(gint64));
+	}
+
+	if (stats->do_hist) {
+		memset(stats->column_hist, 0,
+			stats->n_elements * 256 * sizeof(unsigned int));
+		memset(stats->start_hist, 0, bands * 256 * sizeof(unsigned int));
+	}
+
+	for (int y = 0; y < stats->height; y++) {
+		vips_local_stats_line(stats, p + y * lsk, 1);
+		vips_local_stats_line_start(stats, p + y * lsk, 1);
+	}
+}
+
+/* Move down a line. p is the top-left of the window for the first pixel on
+ * the line we are leaving.
+ */
+void
+vips__local_stats_down(VipsLocalStats *stats, VipsPel *p, int lsk)
+{
+	VipsPel *p2 = p + stats->height * lsk;
+
+	vips_local_stats_line(stats, p, -1);
+	vips_local_stats_line(stats, p2, 1);
+	vips_local_stats_line_start(stats, p, -1);
+	vips_local_stats_line_start(stats, p2, 1);
+}
+
+/* Set the window stats for the first pixel on the line.
+ */
+void
+vips__local_stats_start_line(VipsLocalStats *stats)
+{
+	const int bands = stats->bands;
+
+	if (stats->do_moments) {
+		memcpy(stats->sum, stats->start_sum, bands * sizeof(gint64));
+		memcpy(stats->sum2, stats->start_sum2, bands * sizeof(gint64));
+	}
+
+	if (stats->do_hist)
+		memcpy(stats->hist, stats->start_hist,
+			bands * 256 * sizeof(unsigned int));
+}
+
+/* Move the window from pixel x to pixel x + 1.
+ */
+void
+vips__local_stats_right(VipsLocalStats *stats, int x)
+{
+	const int bands = stats->bands;
+	const int e1 = x * bands;
+	const int e2 = (x + stats->width) * bands;
+
+	/* We can be called for the final pixel in a stripe, when there's no
+	 * column to move to.
+	 */
+	if (e2 >= stats->n_elements)
+		return;
+
+	if (stats->do_moments) {
+		unsigned int *restrict c1 = stats->column_sum + e1;
+		unsigned int *restrict c2 = stats->column_sum + e2;
+		unsigned int *restrict d1 = stats->column_sum2 + e1;
+		unsigned int *restrict d2 = stats->column_sum2 + e2;
+
+		for (int b = 0; b < bands; b++) {
+			stats->sum[b] += (gint64) c2[b] - c1[b];
+			stats->sum2[b] += (gint64) d2[b] - d1[b];
+		}
+	}
+
+	if (stats->do_hist) {
+		for (int b = 0; b < bands; b++) {
+			unsigned int *restrict hist = stats->hist + b * 256;
+			unsigned int *restrict c1 =
+				stats->column_hist + (e1 + b) * 256;
+			unsigned int *restrict c2 =
+				stats->column_hist + (e2 + b) * 256;
+
+			for (int i = 0; i < 256; i++)
+				hist[i] += c2[i] - c1[i];
+		}
+	}
+}
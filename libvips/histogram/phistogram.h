@@ -89,6 +89,55 @@ typedef struct _VipsHistogramClass {
 
 GType vips_histogram_get_type(void);
 
+/* Local stats are computed in vertical stripes of the output this many
+ * pixels across.
+ */
+#define VIPS_LOCAL_STATS_STRIPE (128)
+
+/* Running statistics for a window sliding over a uchar region, see
+ * local_stats.c.
+ */
+typedef struct _VipsLocalStats {
+	int width;
+	int height;
+	int bands;
+
+	/* What we keep: sum and sum of squares, and a 256-bin histogram.
+	 */
+	gboolean do_moments;
+	gboolean do_hist;
+
+	/* Elements across the current stripe.
+	 */
+	int n_elements;
+
+	/* Stats for every column of elements in the stripe, so bands
+	 * interleave.
+	 */
+	unsigned int *column_sum;
+	unsigned int *column_sum2;
+	unsigned int *column_hist;
+
+	/* Stats for the window at the start of the current line, and the
+	 * current window position, one per band.
+	 */
+	gint64 *start_sum;
+	gint64 *start_sum2;
+	unsigned int *start_hist;
+	gint64 *sum;
+	gint64 *sum2;
+	unsigned int *hist;
+} VipsLocalStats;
+
+VipsLocalStats *vips__local_stats_new(int width, int height, int bands,
+	gboolean do_moments, gboolean do_hist);
+void vips__local_stats_free(VipsLocalStats *stats);
+void vips__local_stats_init(VipsLocalStats *stats,
+	VipsPel *p, int lsk, int n_pixels);
+void vips__local_stats_down(VipsLocalStats *stats, VipsPel *p, int lsk);
+void vips__local_stats_start_line(VipsLocalStats *stats);
+void vips__local_stats_right(VipsLocalStats *stats, int x);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
@@ -24,6 +24,11 @@
  * 10/8/13
  * 	- wrapped as a class using hist_local.c
  * 	- many bands
+ * 19/10/26
+ * 	- use local_stats.c, so cost no longer depends on window size
+ * 	- remove band limit
+ * 	- fix centre pixel for multi-band images, and window size for
+ * 	  non-square windows
  */
 
 /*
@@ -66,6 +71,8 @@
 #include <vips/vips.h>
 #include <vips/internal.h>
 
+#include "phistogram.h"
+
 typedef struct _VipsStdif {
 	VipsOperation parent_instance;
 
@@ -86,123 +93,127 @@ typedef VipsOperationClass VipsStdifClass;
 
 G_DEFINE_TYPE(VipsStdif, vips_stdif, VIPS_TYPE_OPERATION);
 
-/* How ugly and stupid.
+/* Our sequence value: the region this sequence is using, and local stats.
  */
-#define MAX_BANDS (100)
+typedef struct {
+	VipsRegion *ir;
+	VipsLocalStats *stats;
+} VipsStdifSequence;
+
+static int
+vips_stdif_stop(void *vseq, void *a, void *b)
+{
+	VipsStdifSequence *seq = (VipsStdifSequence *) vseq;
+
+	VIPS_UNREF(seq->ir);
+	VIPS_FREEF(vips__local_stats_free, seq->stats);
+	VIPS_FREE(seq);
+
+	return 0;
+}
+
+static void *
+vips_stdif_start(VipsImage *out, void *a, void *b)
+{
+	VipsImage *in = (VipsImage *) a;
+	VipsStdif *stdif = (VipsStdif *) b;
+	VipsStdifSequence *seq;
+
+	if (!(seq = VIPS_NEW(NULL, VipsStdifSequence)))
+		return NULL;
+	seq->ir = NULL;
+	seq->stats = NULL;
+
+	if (!(seq->ir = vips_region_new(in)) ||
+		!(seq->stats = vips__local_stats_new(stdif->width, stdif->height,
+			  in->Bands, TRUE, FALSE))) {
+		vips_stdif_stop(seq, NULL, NULL);
+		return NULL;
+	}
+
+	return seq;
+}
 
 static int
 vips_stdif_generate(VipsRegion *out_region,
 	void *vseq, void *a, void *b, gboolean *stop)
 {
+	VipsStdifSequence *seq = (VipsStdifSequence *) vseq;
 	VipsRect *r = &out_region->valid;
-	VipsRegion *ir = (VipsRegion *) vseq;
+	VipsRegion *ir = seq->ir;
+	VipsLocalStats *stats = seq->stats;
 	VipsImage *in = (VipsImage *) a;
 	VipsStdif *stdif = (VipsStdif *) b;
 	int bands = in->Bands;
-	int npel = stdif->width * stdif->width;
+	int npel = stdif->width * stdif->height;
+
+	double f1 = stdif->a * stdif->m0;
+	double f2 = 1.0 - stdif->a;
+	double f3 = stdif->b * stdif->s0;
 
 	VipsRect irect;
-	int y;
+	int sx, y;
 	int lsk;
 	int centre; /* Offset to move to centre of window */
 
 	/* What part of ir do we need?
 	 */
-	irect.left = out_region->valid.left;
-	irect.top = out_region->valid.top;
-	irect.width = out_region->valid.width + stdif->width;
-	irect.height = out_region->valid.height + stdif->height;
+	irect.left = r->left;
+	irect.top = r->top;
+	irect.width = r->width + stdif->width - 1;
+	irect.height = r->height + stdif->height - 1;
 	if (vips_region_prepare(ir, &irect))
 		return -1;
 
 	lsk = VIPS_REGION_LSKIP(ir);
-	centre = lsk * (stdif->height / 2) + stdif->width / 2;
-
-	for (y = 0; y < r->height; y++) {
-		/* Get input and output pointers for this line.
-		 */
-		VipsPel *p = VIPS_REGION_ADDR(ir, r->left, r->top + y);
-		VipsPel *q = VIPS_REGION_ADDR(out_region, r->left, r->top + y);
-
-		double f1 = stdif->a * stdif->m0;
-		double f2 = 1.0 - stdif->a;
-		double f3 = stdif->b * stdif->s0;
-
-		VipsPel *p1;
-		int x, i, j, b;
-
-		/* We will get int overflow for windows larger than about 256
-		 * x 256, sadly.
-		 */
-		unsigned int sum[MAX_BANDS];
-		unsigned int sum2[MAX_BANDS];
-
-		/* Find sum, sum of squares for the start of this line.
-		 */
-		for (b = 0; b < bands; b++) {
-			memset(sum, 0, bands * sizeof(unsigned int));
-			memset(sum2, 0, bands * sizeof(unsigned int));
-		}
-		p1 = p;
-		for (j = 0; j < stdif->height; j++) {
-			i = 0;
-			for (x = 0; x < stdif->width; x++) {
-				for (b = 0; b < bands; b++) {
-					int t = p1[i++];
+	centre = lsk * (stdif->height / 2) + bands * (stdif->width / 2);
 
-					sum[b] += t;
-					sum2[b] += t * t;
-				}
-			}
+	for (sx = 0; sx < r->width; sx += VIPS_LOCAL_STATS_STRIPE) {
+		int sw = VIPS_MIN(VIPS_LOCAL_STATS_STRIPE, r->width - sx);
+		VipsPel *p = VIPS_REGION_ADDR(ir, r->left + sx, r->top);
 
-			p1 += lsk;
-		}
+		vips__local_stats_init(stats, p, lsk, sw);
 
-		/* Loop for output pels.
-		 */
-		for (x = 0; x < r->width; x++) {
-			for (b = 0; b < bands; b++) {
-				/* Find stats.
-				 */
-				double mean = (double) sum[b] / npel;
-				double var = (double) sum2[b] / npel -
-					(mean * mean);
-				double sig = sqrt(var);
-
-				/* Transform.
-				 */
-				double res = f1 + f2 * mean +
-					((double) p[centre] - mean) *
-						(f3 / (stdif->s0 + stdif->b * sig));
-
-				/* And write.
-				 */
-				if (res < 0.0)
-					*q++ = 0;
-				else if (res >= 256.0)
-					*q++ = 255;
-				else
-					*q++ = res + 0.5;
-
-				/* Adapt sums - remove the pels from the left
-				 * hand column, add in pels for a new
-				 * right-hand column.
-				 */
-				p1 = p;
-				for (j = 0; j < stdif->height; j++) {
-					int t1 = p1[0];
-					int t2 = p1[bands * stdif->width];
-
-					sum[b] -= t1;
-					sum2[b] -= t1 * t1;
-
-					sum[b] += t2;
-					sum2[b] += t2 * t2;
-
-					p1 += lsk;
+		for (y = 0; y < r->height; y++) {
+			VipsPel *q = VIPS_REGION_ADDR(out_region,
+				r->left + sx, r->top + y);
+
+			int x, b;
+
+			if (y > 0) {
+				vips__local_stats_down(stats, p, lsk);
+				p += lsk;
+			}
+			vips__local_stats_start_line(stats);
+
+			/* Loop for output pels.
+			 */
+			for (x = 0; x < sw; x++) {
+				for (b = 0; b < bands; b++) {
+					/* Find stats.
+					 */
+					double mean = (double) stats->sum[b] / npel;
+					double var = (double) stats->sum2[b] / npel -
+						(mean * mean);
+					double sig = sqrt(var);
+
+					/* Transform.
+					 */
+					double res = f1 + f2 * mean +
+						((double) p[centre + x * bands + b] - mean) *
+							(f3 / (stdif->s0 + stdif->b * sig));
+
+					/* And write.
+					 */
+					if (res < 0.0)
+						*q++ = 0;
+					else if (res >= 256.0)
+						*q++ = 255;
+					else
+						*q++ = res + 0.5;
 				}
 
-				p += 1;
+				vips__local_stats_right(stats, x);
 			}
 		}
 	}
@@ -236,10 +247,6 @@ vips_stdif_build(VipsObject *object)
 		vips_error(class->nickname, "%s", _("window too large"));
 		return -1;
 	}
-	if (in->Bands > MAX_BANDS) {
-		vips_error(class->nickname, "%s", _("too many bands"));
-		return -1;
-	}
 
 	/* Expand the input.
 	 */
@@ -263,9 +270,9 @@ vips_stdif_build(VipsObject *object)
 	stdif->out->Ysize -= stdif->height - 1;
 
 	if (vips_image_generate(stdif->out,
-			vips_start_one,
+			vips_stdif_start,
 			vips_stdif_generate,
-			vips_stop_one,
+			vips_stdif_stop,
 			in, stdif))
 		return -1;
 
@@ -302,7 +309,7 @@ vips_stdif_class_init(VipsStdifClass *class)
 		VIPS_ARGUMENT_REQUIRED_OUTPUT,
 		G_STRUCT_OFFSET(VipsStdif, out));
 
-	/* Windows larger than 256x256 will overflow sum2, see above.
+	/* Windows larger than 256x256 used to overflow sum2.
 	 */
 	VIPS_ARG_INT(class, "width", 4,
 		_("Width"),
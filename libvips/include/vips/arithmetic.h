@@ -551,6 +551,9 @@ VIPS_API
 int vips_getpoint(VipsImage *in, double **vector, int *n, int x, int y, ...)
 	G_GNUC_NULL_TERMINATED;
 VIPS_API
+int vips_getpoints(VipsImage *in, VipsImage *points, VipsImage **out, ...)
+	G_GNUC_NULL_TERMINATED;
+VIPS_API
 int vips_hist_find(VipsImage *in, VipsImage **out, ...)
 	G_GNUC_NULL_TERMINATED;
 VIPS_API
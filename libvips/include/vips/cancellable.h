@@ -0,0 +1,103 @@
+/* Cancel running pipelines, or give them a deadline.
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+#ifndef VIPS_CANCELLABLE_H
+#define VIPS_CANCELLABLE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <vips/object.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#define VIPS_TYPE_CANCELLABLE (vips_cancellable_get_type())
+#define VIPS_CANCELLABLE(obj) \
+	(G_TYPE_CHECK_INSTANCE_CAST((obj), \
+		VIPS_TYPE_CANCELLABLE, VipsCancellable))
+#define VIPS_CANCELLABLE_CLASS(klass) \
+	(G_TYPE_CHECK_CLASS_CAST((klass), \
+		VIPS_TYPE_CANCELLABLE, VipsCancellableClass))
+#define VIPS_IS_CANCELLABLE(obj) \
+	(G_TYPE_CHECK_INSTANCE_TYPE((obj), VIPS_TYPE_CANCELLABLE))
+#define VIPS_IS_CANCELLABLE_CLASS(klass) \
+	(G_TYPE_CHECK_CLASS_TYPE((klass), VIPS_TYPE_CANCELLABLE))
+#define VIPS_CANCELLABLE_GET_CLASS(obj) \
+	(G_TYPE_INSTANCE_GET_CLASS((obj), \
+		VIPS_TYPE_CANCELLABLE, VipsCancellableClass))
+
+typedef struct _VipsCancellable {
+	VipsObject parent_object;
+
+	/*< private >*/
+
+	/* Set once we've been cancelled, or our deadline has passed.
+	 */
+	int cancelled; // (atomic)
+
+	/* Monotonic time in microseconds, or 0 for no deadline.
+	 */
+	GMutex lock;
+	gint64 deadline;
+
+} VipsCancellable;
+
+typedef struct _VipsCancellableClass {
+	VipsObjectClass parent_class;
+
+} VipsCancellableClass;
+
+VIPS_API
+GType vips_cancellable_get_type(void);
+
+VIPS_API
+VipsCancellable *vips_cancellable_new(void);
+VIPS_API
+void vips_cancellable_cancel(VipsCancellable *cancellable);
+VIPS_API
+void vips_cancellable_set_deadline(VipsCancellable *cancellable,
+	gint64 deadline);
+VIPS_API
+void vips_cancellable_set_timeout(VipsCancellable *cancellable,
+	double timeout);
+VIPS_API
+gboolean vips_cancellable_is_cancelled(VipsCancellable *cancellable);
+
+VIPS_API
+void vips_cancellable_set_current(VipsCancellable *cancellable);
+VIPS_API
+VipsCancellable *vips_cancellable_get_current(void);
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*VIPS_CANCELLABLE_H*/
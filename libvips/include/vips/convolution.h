@@ -52,6 +52,9 @@ VIPS_API
 int vips_convf(VipsImage *in, VipsImage **out, VipsImage *mask, ...)
 	G_GNUC_NULL_TERMINATED;
 VIPS_API
+int vips_convfft(VipsImage *in, VipsImage **out, VipsImage *mask, ...)
+	G_GNUC_NULL_TERMINATED;
+VIPS_API
 int vips_convi(VipsImage *in, VipsImage **out, VipsImage *mask, ...)
 	G_GNUC_NULL_TERMINATED;
 VIPS_API
@@ -57,6 +57,10 @@ int vips_sink_screen(VipsImage *in, VipsImage *out, VipsImage *mask,
 	int tile_width, int tile_height, int max_tiles,
 	int priority,
 	VipsSinkNotify notify_fn, void *a);
+VIPS_API
+int vips_sink_screen_set_focus(VipsImage *out, VipsRect *focus);
+VIPS_API
+void vips_sink_screen_set_workers(int n_workers);
 
 VIPS_API
 int vips_sink_memory(VipsImage *im);
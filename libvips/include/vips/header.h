@@ -178,6 +178,14 @@ extern "C" {
  */
 #define VIPS_META_CONCURRENCY "concurrency"
 
+/**
+ * VIPS_META_PRIORITY:
+ *
+ * If set, the scheduling weight for threadpools computing this image when
+ * workers are shared, see [func@threadpool_set_shared_workers].
+ */
+#define VIPS_META_PRIORITY "vips-priority"
+
 /**
  * VIPS_META_TILE_WIDTH
  *
@@ -247,6 +255,8 @@ gboolean vips_image_get_orientation_swap(VipsImage *image);
 VIPS_API
 int vips_image_get_concurrency(VipsImage *image, int default_concurrency);
 VIPS_API
+int vips_image_get_priority(VipsImage *image);
+VIPS_API
 int vips_image_get_tile_width(VipsImage *image);
 VIPS_API
 int vips_image_get_tile_height(VipsImage *image);
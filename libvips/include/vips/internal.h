@@ -168,11 +168,33 @@ VIPS_API void vips__worker_lock(GMutex *mutex);
 VIPS_API void vips__worker_cond_wait(GCond *cond, GMutex *mutex);
 gboolean vips__worker_exit(void);
 
+gboolean vips__cancellable_check(VipsCancellable *cancellable);
+gboolean vips__cancellable_check_current(void);
+
+/* Time a generate call. start and stop must pair up, even on error.
+ */
+typedef struct _VipsMetricsFrame {
+	gint64 *total; /* Generate time so far for this thread */
+	gint64 before; /* Value of total when we started */
+	gint64 start;
+} VipsMetricsFrame;
+
+typedef struct _VipsMetricsOperation VipsMetricsOperation;
+
+void vips__metrics_init(void);
+void vips__metrics_build(VipsOperation *operation);
+void vips__metrics_cache(VipsOperation *operation, gboolean hit);
+void vips__metrics_generate_start(VipsMetricsFrame *frame);
+void vips__metrics_generate_stop(VipsMetricsFrame *frame,
+	VipsRegion *region, int result);
+void vips__metrics_queue_wait(gint64 usec);
+
 void vips__cache_init(void);
 
 int vips__print_renders(void);
 int vips__type_leak(void);
 int vips__object_leak(void);
+int vips__object_build_finish(VipsObject *object);
 
 #ifdef HAVE_OPENSLIDE
 int vips__openslideconnection_leak(void);
@@ -208,6 +230,9 @@ int vips_remapfilerw(VipsImage *image);
 
 void vips__buffer_init(void);
 void vips__buffer_shutdown(void);
+void vips__buffer_pool_shutdown(void);
+size_t vips__buffer_pool_get_idle(void);
+void vips__buffer_idle(void);
 
 void vips__copy_4byte(int swap, unsigned char *to, unsigned char *from);
 void vips__copy_2byte(gboolean swap, unsigned char *to, unsigned char *from);
@@ -238,6 +263,12 @@ int vips__image_meta_copy(VipsImage *dst, const VipsImage *src);
 
 extern GMutex vips__global_lock;
 
+/* All fftw3 calls except execute() need to be locked.
+ */
+extern GMutex vips__fft_lock;
+
+void vips__convfft_shutdown(void);
+
 int vips_image_written(VipsImage *image);
 
 /* Defined in `vips.h`, unless building with `-Ddeprecated=false`
@@ -286,6 +317,7 @@ void vips__draw_circle_direct(VipsImage *image, int cx, int cy, int r,
 	VipsDrawScanline draw_scanline, void *client);
 
 int vips__insert_paste_region(VipsRegion *out, VipsRegion *in, VipsRect *pos);
+int vips__insert_just_one(VipsRegion *out, VipsRegion *in, int x, int y);
 
 /* Register base vips interpolators, called during startup.
  */
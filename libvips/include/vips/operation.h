@@ -107,6 +107,11 @@ GType vips_operation_get_type(void);
 VIPS_API
 VipsOperationFlags vips_operation_get_flags(VipsOperation *operation);
 VIPS_API
+void vips_operation_set_cancellable(VipsOperation *operation,
+	VipsCancellable *cancellable);
+VIPS_API
+VipsCancellable *vips_operation_get_cancellable(VipsOperation *operation);
+VIPS_API
 void vips_operation_class_print_usage(VipsOperationClass *operation_class);
 VIPS_API
 void vips_operation_invalidate(VipsOperation *operation);
@@ -158,6 +163,14 @@ VIPS_API
 void vips_cache_set_dump(gboolean dump);
 VIPS_API
 void vips_cache_set_trace(gboolean trace);
+VIPS_API
+int vips_cache_set_dir(const char *dir);
+VIPS_API
+char *vips_cache_get_dir(void);
+VIPS_API
+void vips_cache_set_max_disc(guint64 max_disc);
+VIPS_API
+guint64 vips_cache_get_max_disc(void);
 
 /* Part of threadpool, really, but we want these in a header that gets scanned
  * for our typelib.
@@ -73,6 +73,13 @@ void vips_window_print(VipsWindow *window);
 typedef struct {
 	GHashTable *hash; /* VipsImage -> VipsBufferCache* */
 	GThread *thread;  /* Just for sanity checking */
+
+	/* A few pixel areas from the buffer pool kept for this thread, see
+	 * VIPS_BUFFER_POOL_MAGAZINE in buffer.c.
+	 */
+	int n_magazine;
+	VipsPel *magazine[4];
+	size_t magazine_size[4];
 } VipsBufferThread;
 
 /* Per-image buffer cache. This keeps a list of "done" VipsBuffer that this
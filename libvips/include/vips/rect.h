@@ -73,6 +73,16 @@ VipsRect *vips_rect_dup(const VipsRect *r);
 VIPS_API
 void vips_rect_normalise(VipsRect *r);
 
+typedef struct _VipsRectIndex VipsRectIndex;
+
+VIPS_API
+VipsRectIndex *vips_rect_index_new(const VipsRect *rects, int n);
+VIPS_API
+void vips_rect_index_free(VipsRectIndex *index);
+VIPS_API
+int vips_rect_index_query(const VipsRectIndex *index, const VipsRect *r,
+	int *hits);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
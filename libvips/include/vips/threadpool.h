@@ -145,6 +145,19 @@ VIPS_API
 void vips_get_tile_size(VipsImage *im,
 	int *tile_width, int *tile_height, int *n_lines);
 
+VIPS_API
+void vips_threadpool_set_max_mem(size_t max_mem);
+VIPS_API
+size_t vips_threadpool_get_max_mem(void);
+VIPS_API
+size_t vips_threadpool_get_reserved_mem(void);
+VIPS_API
+int vips_threadpool_get_admitted(int *waited, int *shrunk);
+VIPS_API
+void vips_threadpool_set_shared_workers(int n_workers);
+VIPS_API
+int vips_threadpool_get_shared_workers(void);
+
 #ifdef __cplusplus
 }
 #endif /*__cplusplus*/
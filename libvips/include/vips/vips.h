@@ -119,6 +119,8 @@ extern "C" {
 #include <vips/semaphore.h>
 #include <vips/thread.h>
 #include <vips/threadpool.h>
+#include <vips/cancellable.h>
+#include <vips/metrics.h>
 #include <vips/header.h>
 #include <vips/operation.h>
 #include <vips/foreign.h>
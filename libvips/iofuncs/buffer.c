@@ -25,6 +25,11 @@
  * 	  buffers don't clog up the system
  * 13/10/16
  * 	- better solution: don't keep a buffercache for non-workers
+ * 19/10/26
+ * 	- allocate pixels from a global size-classed pool
+ * 	- count idle pool memory, and trim the depot on alloc too
+ * 	- trim the depot from a background thread, and hand magazines back
+ * 	  when workers wait
  */
 
 /*
@@ -85,6 +90,67 @@ static GSList *vips__buffer_cache_all = NULL;
  */
 static const int buffer_cache_max_reserve = 2;
 
+/* Pixel memory comes from a process-wide pool, so pipelines made one after
+ * another can reuse each other's memory. Areas are rounded up to a size
+ * class, four classes per power of two, from 4kb to 64mb. Larger areas
+ * are not pooled.
+ */
+#define VIPS_BUFFER_POOL_MIN_SHIFT (12)
+#define VIPS_BUFFER_POOL_MAX_SHIFT (26)
+#define VIPS_BUFFER_POOL_STEPS (4)
+#define VIPS_BUFFER_POOL_N_CLASSES \
+	((VIPS_BUFFER_POOL_MAX_SHIFT - VIPS_BUFFER_POOL_MIN_SHIFT) * \
+			VIPS_BUFFER_POOL_STEPS + \
+		1)
+
+/* Each worker keeps this many areas of its own, the magazine, and the
+ * rest go to the shared depot. Only smaller areas go in the magazine,
+ * since it's only handed back when the worker exits or has to wait, see
+ * vips__buffer_idle().
+ */
+#define VIPS_BUFFER_POOL_MAGAZINE (4)
+#define VIPS_BUFFER_POOL_MAGAZINE_MAX (1024 * 1024)
+
+/* Areas unused in the depot for this long are freed (in microseconds).
+ * Set with VIPS_BUFFER_POOL_IDLE, in seconds.
+ */
+static gint64 vips_buffer_pool_idle = 2 * G_USEC_PER_SEC;
+
+/* An area waiting in the depot.
+ */
+typedef struct _VipsBufferPoolItem {
+	VipsPel *buf;
+	gint64 time;
+} VipsBufferPoolItem;
+
+/* The depot. Each class is a queue with the most recently returned area at
+ * the head.
+ */
+static GMutex vips_buffer_pool_lock;
+static GQueue vips_buffer_pool_depot[VIPS_BUFFER_POOL_N_CLASSES];
+static size_t vips_buffer_pool_size = 0;
+static size_t vips_buffer_pool_max = 100 * 1024 * 1024;
+
+/* Bytes held in worker magazines. Workers update this without the pool
+ * lock.
+ */
+static gsize vips_buffer_pool_magazine_size = 0;
+
+/* A background thread frees depot areas as they expire, so memory goes
+ * back even if nothing else is allocated. It runs while there's anything
+ * in the depot. Signal the cond to wake it, it's also signalled when the
+ * trimmer stops. All under the pool lock.
+ */
+static GCond vips_buffer_pool_cond;
+static GThread *vips_buffer_pool_trimmer = NULL;
+static gboolean vips_buffer_pool_trimming = FALSE;
+static gboolean vips_buffer_pool_closing = FALSE;
+
+/* Stats for vips_buffer_dump_all().
+ */
+static int vips_buffer_pool_hits = 0;
+static int vips_buffer_pool_misses = 0;
+
 /* Workers have a BufferThread (and BufferCache) in a GPrivate they have
  * exclusive access to.
  */
@@ -152,6 +218,249 @@ vips_buffer_dump(VipsBuffer *buffer, size_t *reserve, size_t *alive)
 }
 #endif /*DEBUG*/
 
+/* The size class for an area of @size bytes, or -1 if it's too large to
+ * pool.
+ */
+static int
+vips_buffer_pool_class(size_t size)
+{
+	int p;
+	int step;
+	int k;
+
+	if (size <= (1 << VIPS_BUFFER_POOL_MIN_SHIFT))
+		return 0;
+
+	/* 2^p <= size - 1 < 2^(p + 1).
+	 */
+	p = g_bit_storage(size - 1) - 1;
+	step = ((size - ((size_t) 1 << p)) * VIPS_BUFFER_POOL_STEPS +
+			   ((size_t) 1 << p) - 1) >>
+		p;
+	if (step >= VIPS_BUFFER_POOL_STEPS) {
+		p += 1;
+		step = 0;
+	}
+
+	k = (p - VIPS_BUFFER_POOL_MIN_SHIFT) * VIPS_BUFFER_POOL_STEPS + step;
+
+	return k < VIPS_BUFFER_POOL_N_CLASSES ? k : -1;
+}
+
+static size_t
+vips_buffer_pool_class_size(int k)
+{
+	size_t base = (size_t) 1
+		<< (VIPS_BUFFER_POOL_MIN_SHIFT + k / VIPS_BUFFER_POOL_STEPS);
+
+	return base + base * (k % VIPS_BUFFER_POOL_STEPS) /
+		VIPS_BUFFER_POOL_STEPS;
+}
+
+/* Free depot areas which have been idle for a while. Call with the pool
+ * lock held.
+ */
+static void
+vips_buffer_pool_trim(gint64 now)
+{
+	int k;
+
+	for (k = 0; k < VIPS_BUFFER_POOL_N_CLASSES; k++) {
+		GQueue *queue = &vips_buffer_pool_depot[k];
+		VipsBufferPoolItem *item;
+
+		while ((item = g_queue_peek_tail(queue)) &&
+			now - item->time > vips_buffer_pool_idle) {
+			g_queue_pop_tail(queue);
+			vips_tracked_aligned_free(item->buf);
+			vips_buffer_pool_size -= vips_buffer_pool_class_size(k);
+			g_free(item);
+		}
+	}
+}
+
+/* The time the oldest area in the depot was returned, or -1 if the depot
+ * is empty. Call with the pool lock held.
+ */
+static gint64
+vips_buffer_pool_oldest(void)
+{
+	gint64 oldest;
+	int k;
+
+	oldest = -1;
+	for (k = 0; k < VIPS_BUFFER_POOL_N_CLASSES; k++) {
+		VipsBufferPoolItem *item;
+
+		if ((item = g_queue_peek_tail(&vips_buffer_pool_depot[k])) &&
+			(oldest < 0 ||
+				item->time < oldest))
+			oldest = item->time;
+	}
+
+	return oldest;
+}
+
+/* Sleep until the oldest area in the depot expires, trim, and repeat.
+ * Stop when the depot is empty or on shutdown.
+ */
+static void *
+vips_buffer_pool_trimmer_main(void *data)
+{
+	gint64 oldest;
+
+	g_mutex_lock(&vips_buffer_pool_lock);
+
+	while (!vips_buffer_pool_closing &&
+		(oldest = vips_buffer_pool_oldest()) >= 0) {
+		g_cond_wait_until(&vips_buffer_pool_cond, &vips_buffer_pool_lock,
+			oldest + vips_buffer_pool_idle + 1);
+		vips_buffer_pool_trim(g_get_monotonic_time());
+	}
+
+	vips_buffer_pool_trimming = FALSE;
+	g_cond_broadcast(&vips_buffer_pool_cond);
+
+	g_mutex_unlock(&vips_buffer_pool_lock);
+
+	return NULL;
+}
+
+/* Start the trimmer, if it's not running. Call with the pool lock held.
+ */
+static void
+vips_buffer_pool_trimmer_start(void)
+{
+	if (vips_buffer_pool_trimming ||
+		vips_buffer_pool_closing)
+		return;
+
+	/* The last trimmer has stopped, but the thread may not have quite
+	 * exited. The join won't need the lock.
+	 */
+	VIPS_FREEF(g_thread_join, vips_buffer_pool_trimmer);
+
+	if ((vips_buffer_pool_trimmer = vips_g_thread_new("bufferpool",
+			 vips_buffer_pool_trimmer_main, NULL)))
+		vips_buffer_pool_trimming = TRUE;
+}
+
+/* Get an area of at least @size bytes. @bsize is set to the real size.
+ */
+static VipsPel *
+vips_buffer_pool_alloc(VipsBufferThread *buffer_thread,
+	size_t size, size_t *bsize)
+{
+	int k = vips_buffer_pool_class(size);
+
+	VipsPel *buf;
+	VipsBufferPoolItem *item;
+	gint64 now;
+	int i;
+
+	if (k < 0) {
+		*bsize = size;
+		return vips_tracked_aligned_alloc(size, 64);
+	}
+
+	*bsize = vips_buffer_pool_class_size(k);
+
+	if (buffer_thread)
+		for (i = 0; i < buffer_thread->n_magazine; i++)
+			if (buffer_thread->magazine_size[i] == *bsize) {
+				int last = buffer_thread->n_magazine - 1;
+
+				buf = buffer_thread->magazine[i];
+				buffer_thread->magazine[i] =
+					buffer_thread->magazine[last];
+				buffer_thread->magazine_size[i] =
+					buffer_thread->magazine_size[last];
+				buffer_thread->n_magazine -= 1;
+				g_atomic_pointer_add(&vips_buffer_pool_magazine_size,
+					-(gssize) *bsize);
+
+				return buf;
+			}
+
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(&vips_buffer_pool_lock);
+
+	/* Trim here as well as on free, so a pool which only takes areas
+	 * still lets go of idle ones.
+	 */
+	vips_buffer_pool_trim(now);
+
+	if ((item = g_queue_pop_head(&vips_buffer_pool_depot[k]))) {
+		vips_buffer_pool_size -= *bsize;
+		vips_buffer_pool_hits += 1;
+	}
+	else
+		vips_buffer_pool_misses += 1;
+	g_mutex_unlock(&vips_buffer_pool_lock);
+
+	if (item) {
+		buf = item->buf;
+		g_free(item);
+
+		return buf;
+	}
+
+	return vips_tracked_aligned_alloc(*bsize, 64);
+}
+
+/* Return an area to the pool, or free it.
+ */
+static void
+vips_buffer_pool_free(VipsBufferThread *buffer_thread,
+	VipsPel *buf, size_t bsize)
+{
+	int k = vips_buffer_pool_class(bsize);
+
+	gint64 now;
+
+	if (k < 0 ||
+		vips_buffer_pool_class_size(k) != bsize) {
+		vips_tracked_aligned_free(buf);
+		return;
+	}
+
+	if (buffer_thread &&
+		bsize <= VIPS_BUFFER_POOL_MAGAZINE_MAX &&
+		buffer_thread->n_magazine < VIPS_BUFFER_POOL_MAGAZINE) {
+		buffer_thread->magazine[buffer_thread->n_magazine] = buf;
+		buffer_thread->magazine_size[buffer_thread->n_magazine] = bsize;
+		buffer_thread->n_magazine += 1;
+		g_atomic_pointer_add(&vips_buffer_pool_magazine_size, bsize);
+
+		return;
+	}
+
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(&vips_buffer_pool_lock);
+
+	vips_buffer_pool_trim(now);
+
+	if (!vips_buffer_pool_closing &&
+		vips_buffer_pool_size + bsize <= vips_buffer_pool_max) {
+		VipsBufferPoolItem *item = g_new(VipsBufferPoolItem, 1);
+
+		item->buf = buf;
+		item->time = now;
+		g_queue_push_head(&vips_buffer_pool_depot[k], item);
+		vips_buffer_pool_size += bsize;
+		buf = NULL;
+
+		vips_buffer_pool_trimmer_start();
+	}
+
+	g_mutex_unlock(&vips_buffer_pool_lock);
+
+	if (buf)
+		vips_tracked_aligned_free(buf);
+}
+
 #ifdef DEBUG_CREATE
 static void *
 vips_buffer_cache_dump(VipsBufferCache *cache, void *a, void *b)
@@ -170,6 +479,12 @@ vips_buffer_cache_dump(VipsBufferCache *cache, void *a, void *b)
 void
 vips_buffer_dump_all(void)
 {
+	g_mutex_lock(&vips_buffer_pool_lock);
+	printf("buffer pool: %.3g MB in depot, %d hits, %d misses\n",
+		vips_buffer_pool_size / (1024 * 1024.0),
+		vips_buffer_pool_hits, vips_buffer_pool_misses);
+	g_mutex_unlock(&vips_buffer_pool_lock);
+
 #ifdef DEBUG
 	if (vips__buffer_all) {
 		size_t reserve;
@@ -200,7 +515,14 @@ vips_buffer_dump_all(void)
 static void
 vips_buffer_free(VipsBuffer *buffer)
 {
-	VIPS_FREEF(vips_tracked_aligned_free, buffer->buf);
+	/* Don't use buffer_thread_get(), we can be called while the
+	 * VipsBufferThread is being freed and must not make a new one.
+	 */
+	if (buffer->buf) {
+		vips_buffer_pool_free(g_private_get(&buffer_thread_key),
+			buffer->buf, buffer->bsize);
+		buffer->buf = NULL;
+	}
 	buffer->bsize = 0;
 	g_free(buffer);
 
@@ -218,10 +540,27 @@ vips_buffer_free(VipsBuffer *buffer)
 #endif /*DEBUG_VERBOSE*/
 }
 
+/* Hand the magazine back to the depot, where the trimmer can see it.
+ */
+static void
+buffer_thread_flush(VipsBufferThread *buffer_thread)
+{
+	while (buffer_thread->n_magazine > 0) {
+		buffer_thread->n_magazine -= 1;
+		g_atomic_pointer_add(&vips_buffer_pool_magazine_size,
+			-(gssize) buffer_thread->magazine_size[buffer_thread->n_magazine]);
+		vips_buffer_pool_free(NULL,
+			buffer_thread->magazine[buffer_thread->n_magazine],
+			buffer_thread->magazine_size[buffer_thread->n_magazine]);
+	}
+}
+
 static void
 buffer_thread_free(VipsBufferThread *buffer_thread)
 {
 	VIPS_FREEF(g_hash_table_destroy, buffer_thread->hash);
+	buffer_thread_flush(buffer_thread);
+
 	VIPS_FREE(buffer_thread);
 }
 
@@ -306,6 +645,7 @@ buffer_thread_new(void)
 		g_direct_hash, g_direct_equal,
 		NULL, (GDestroyNotify) buffer_cache_free);
 	buffer_thread->thread = g_thread_self();
+	buffer_thread->n_magazine = 0;
 
 	return buffer_thread;
 }
@@ -469,7 +809,6 @@ buffer_move(VipsBuffer *buffer, VipsRect *area)
 {
 	VipsImage *im = buffer->im;
 	size_t new_bsize;
-	size_t align;
 
 	g_assert(buffer->ref_count == 1);
 
@@ -482,22 +821,24 @@ buffer_move(VipsBuffer *buffer, VipsRect *area)
 		area->width * area->height;
 
 	/* Need to pad buffer size to be aligned-up to
-	 * 64 bytes for the highway paths.
+	 * 64 bytes for the highway paths. Pool areas are always 64-byte
+	 * aligned.
 	 */
 #ifdef HAVE_HWY
-	if (im->BandFmt == VIPS_FORMAT_UCHAR) {
+	if (im->BandFmt == VIPS_FORMAT_UCHAR)
 		new_bsize += /*HWY_ALIGNMENT*/ 64 - 1;
-		align = /*HWY_ALIGNMENT*/ 64;
-	}
-	else
 #endif /*HAVE_HWY*/
-		align = 16;
 
 	if (buffer->bsize < new_bsize ||
 		!buffer->buf) {
-		buffer->bsize = new_bsize;
-		VIPS_FREEF(vips_tracked_aligned_free, buffer->buf);
-		if (!(buffer->buf = vips_tracked_aligned_alloc(buffer->bsize, align)))
+		VipsBufferThread *buffer_thread = buffer_thread_get();
+
+		if (buffer->buf)
+			vips_buffer_pool_free(buffer_thread,
+				buffer->buf, buffer->bsize);
+		buffer->bsize = 0;
+		if (!(buffer->buf = vips_buffer_pool_alloc(buffer_thread,
+				  new_bsize, &buffer->bsize)))
 			return -1;
 	}
 
@@ -674,6 +1015,12 @@ buffer_thread_destroy_notify(gpointer data)
 void
 vips__buffer_init(void)
 {
+	const char *idle;
+
+	if ((idle = g_getenv("VIPS_BUFFER_POOL_IDLE")))
+		vips_buffer_pool_idle =
+			VIPS_MAX(0, g_ascii_strtod(idle, NULL)) * G_USEC_PER_SEC;
+
 	if (buffer_cache_max_reserve < 1)
 		printf("vips__buffer_init: buffer reserve disabled\n");
 
@@ -686,6 +1033,54 @@ vips__buffer_init(void)
 #endif /*DEBUG_CREATE*/
 }
 
+/* The number of bytes of idle pixel memory in the pool. This is part of
+ * vips_tracked_get_mem(), but it's not in use, and the pool trims it itself.
+ */
+size_t
+vips__buffer_pool_get_idle(void)
+{
+	size_t idle;
+
+	g_mutex_lock(&vips_buffer_pool_lock);
+	idle = vips_buffer_pool_size;
+	g_mutex_unlock(&vips_buffer_pool_lock);
+
+	return idle + (size_t) g_atomic_pointer_get(&vips_buffer_pool_magazine_size);
+}
+
+/* Stop the trimmer and free everything in the depot. This is called
+ * during vips_shutdown, after worker threads have returned their
+ * magazines. Areas returned after this are freed immediately.
+ */
+void
+vips__buffer_pool_shutdown(void)
+{
+	g_mutex_lock(&vips_buffer_pool_lock);
+
+	vips_buffer_pool_closing = TRUE;
+	g_cond_broadcast(&vips_buffer_pool_cond);
+	while (vips_buffer_pool_trimming)
+		g_cond_wait(&vips_buffer_pool_cond, &vips_buffer_pool_lock);
+
+	vips_buffer_pool_trim(G_MAXINT64);
+
+	g_mutex_unlock(&vips_buffer_pool_lock);
+
+	VIPS_FREEF(g_thread_join, vips_buffer_pool_trimmer);
+}
+
+/* This thread is about to wait, perhaps for a long time. Hand any pooled
+ * areas it's holding back to the depot, so they can be shared or trimmed.
+ */
+void
+vips__buffer_idle(void)
+{
+	VipsBufferThread *buffer_thread;
+
+	if ((buffer_thread = g_private_get(&buffer_thread_key)))
+		buffer_thread_flush(buffer_thread);
+}
+
 void
 vips__buffer_shutdown(void)
 {
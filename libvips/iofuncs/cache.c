@@ -6,6 +6,11 @@
  * 	- add a lock so we can run operations from many threads
  * 28/11/19 [MaxKellermann]
  * 	- make invalidate advisory rather than immediate
+ * 19/10/26
+ * 	- add an optional persistent tier, see vips_cache_set_dir()
+ * 	- write persistent results through as they are computed
+ * 	- count hits and misses for vips_metrics_write()
+ * 	- don't count idle buffer pool memory against max_mem
  */
 
 /*
@@ -63,6 +68,7 @@
 #include <unistd.h>
 #endif /*HAVE_UNISTD_H*/
 #include <ctype.h>
+#include <errno.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -93,6 +99,12 @@ static int vips_cache_max_files = 100;
  */
 static size_t vips_cache_max_mem = 100 * 1024 * 1024;
 
+/* The directory we keep the persistent tier in, or NULL for no persistent
+ * tier, and how large we let it grow ... default 1gb.
+ */
+static char *vips_cache_dir = NULL;
+static guint64 vips_cache_max_disc = 1024 * 1024 * 1024;
+
 /* Hold a ref to all "recent" operations.
  */
 static GHashTable *vips_cache_table = NULL;
@@ -537,7 +549,6 @@ vips_operation_equal(VipsOperation *a, VipsOperation *b)
 	return FALSE;
 }
 
-#ifdef DEBUG_LEAK
 static void *
 vips_operation_copy_argument(VipsObject *object,
 	GParamSpec *pspec,
@@ -574,7 +585,6 @@ vips_operation_copy(VipsOperation *operation)
 
 	return new;
 }
-#endif /*DEBUG_LEAK*/
 
 static void *
 vips_object_unref_arg(VipsObject *object,
@@ -896,6 +906,18 @@ vips_cache_get_lru(void)
 	return NULL;
 }
 
+/* Tracked memory, less idle memory in the buffer pool. Dropping operations
+ * won't free pooled memory, the pool trims that itself.
+ */
+static size_t
+vips_cache_get_mem(void)
+{
+	size_t mem = vips_tracked_get_mem();
+	size_t idle = vips__buffer_pool_get_idle();
+
+	return mem > idle ? mem - idle : 0;
+}
+
 /* Is the cache full? Drop until it's not.
  */
 static void
@@ -908,7 +930,7 @@ vips_cache_trim(void)
 	while (vips_cache_table &&
 		(g_hash_table_size(vips_cache_table) > vips_cache_max ||
 			vips_tracked_get_files() > vips_cache_max_files ||
-			vips_tracked_get_mem() > vips_cache_max_mem) &&
+			vips_cache_get_mem() > vips_cache_max_mem) &&
 		(operation = vips_cache_get_lru())) {
 #ifdef DEBUG
 		printf("vips_cache_trim: trimming ");
@@ -964,6 +986,656 @@ vips_cache_find_differences(VipsObject *object,
 }
 #endif /*DEBUG_LEAK*/
 
+/* Add a string to a checksum, with the terminating zero so that adjacent
+ * strings can't run together.
+ */
+static void
+vips_cache_disc_update_string(GChecksum *checksum, const char *str)
+{
+	g_checksum_update(checksum, (const guchar *) str, strlen(str) + 1);
+}
+
+static void
+vips_cache_disc_update_data(GChecksum *checksum,
+	const void *data, size_t length)
+{
+	guint64 n = length;
+
+	g_checksum_update(checksum, (const guchar *) &n, sizeof(n));
+	if (data)
+		g_checksum_update(checksum, (const guchar *) data, length);
+}
+
+/* Add an input arg to the key. A string arg which names a file, like
+ * "filename" or a profile path, adds the contents of the file, not its name,
+ * so a changed file gets a new key.
+ *
+ * Return -1 for args we can't make a key from, like images and sources.
+ */
+static int
+vips_cache_disc_hash_value(GChecksum *checksum,
+	const char *name, const GValue *value, int *n_files)
+{
+	GType type = G_VALUE_TYPE(value);
+	GType fundamental = G_TYPE_FUNDAMENTAL(type);
+
+	vips_cache_disc_update_string(checksum, name);
+
+	if (type == G_TYPE_STRING) {
+		const char *str = g_value_get_string(value);
+		char filename[VIPS_PATH_MAX];
+		char option_string[VIPS_PATH_MAX];
+
+		if (str)
+			vips__filename_split8(str, filename, option_string);
+
+		if (str &&
+			g_file_test(filename, G_FILE_TEST_IS_REGULAR)) {
+			GMappedFile *file;
+
+			if (!(file = g_mapped_file_new(filename, FALSE, NULL)))
+				return -1;
+			vips_cache_disc_update_data(checksum,
+				g_mapped_file_get_contents(file),
+				g_mapped_file_get_length(file));
+			g_mapped_file_unref(file);
+			vips_cache_disc_update_string(checksum, option_string);
+
+			*n_files += 1;
+		}
+		else if (str &&
+			strcmp(name, "filename") == 0)
+			/* A file we can't read, so we can't make a key.
+			 */
+			return -1;
+		else if (str)
+			vips_cache_disc_update_string(checksum, str);
+	}
+	else if (type == VIPS_TYPE_BLOB) {
+		VipsBlob *blob = (VipsBlob *) g_value_get_boxed(value);
+
+		const void *data;
+		size_t length;
+
+		if (!blob)
+			return -1;
+		data = vips_blob_get(blob, &length);
+		vips_cache_disc_update_data(checksum, data, length);
+
+		*n_files += 1;
+	}
+	else if (type == VIPS_TYPE_ARRAY_INT ||
+		type == VIPS_TYPE_ARRAY_DOUBLE) {
+		VipsArea *area = (VipsArea *) g_value_get_boxed(value);
+
+		if (area)
+			vips_cache_disc_update_data(checksum,
+				area->data, (size_t) area->n * area->sizeof_type);
+	}
+	else if (fundamental != G_TYPE_OBJECT &&
+		fundamental != G_TYPE_BOXED &&
+		fundamental != G_TYPE_POINTER) {
+		char *str;
+
+		str = g_strdup_value_contents(value);
+		vips_cache_disc_update_string(checksum, str);
+		g_free(str);
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+static void *
+vips_cache_disc_hash_arg(VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b)
+{
+	GChecksum *checksum = (GChecksum *) a;
+	int *n_files = (int *) b;
+	const char *name = g_param_spec_get_name(pspec);
+	GType type = G_PARAM_SPEC_VALUE_TYPE(pspec);
+
+	/* We can only restore a single output image called "out".
+	 */
+	if (argument_class->flags & VIPS_ARGUMENT_OUTPUT)
+		return strcmp(name, "out") != 0 || type != VIPS_TYPE_IMAGE ?
+			pspec : NULL;
+
+	if ((argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) &&
+		(argument_class->flags & VIPS_ARGUMENT_INPUT) &&
+		argument_instance->assigned) {
+		GValue value = G_VALUE_INIT;
+		int result;
+
+		g_value_init(&value, type);
+		g_object_get_property(G_OBJECT(object), name, &value);
+		result = vips_cache_disc_hash_value(checksum,
+			name, &value, n_files);
+		g_value_unset(&value);
+
+		if (result)
+			return pspec;
+	}
+
+	return NULL;
+}
+
+/* Make the persistent key for an operation, or NULL if it can't go in the
+ * persistent tier. Only operations which read at least one file or blob and
+ * make a single image qualify.
+ */
+static char *
+vips_cache_disc_key(VipsOperation *operation)
+{
+	VipsOperationFlags flags = vips_operation_get_flags(operation);
+
+	GChecksum *checksum;
+	int n_files;
+	char *key;
+
+	if (flags & (VIPS_OPERATION_NOCACHE |
+					VIPS_OPERATION_BLOCKED |
+					VIPS_OPERATION_REVALIDATE))
+		return NULL;
+
+	checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	vips_cache_disc_update_string(checksum, vips_version_string());
+	vips_cache_disc_update_string(checksum,
+		VIPS_OBJECT_GET_CLASS(operation)->nickname);
+
+	n_files = 0;
+	if (vips_argument_map(VIPS_OBJECT(operation),
+			vips_cache_disc_hash_arg, checksum, &n_files) ||
+		n_files == 0) {
+		g_checksum_free(checksum);
+		return NULL;
+	}
+
+	key = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+
+	return key;
+}
+
+typedef struct _VipsCacheDiscFile {
+	char *path;
+	gint64 mtime;
+	guint64 size;
+} VipsCacheDiscFile;
+
+static void
+vips_cache_disc_file_free(VipsCacheDiscFile *file)
+{
+	g_free(file->path);
+	g_free(file);
+}
+
+static int
+vips_cache_disc_file_compare(gconstpointer a, gconstpointer b)
+{
+	const VipsCacheDiscFile *file_a = (const VipsCacheDiscFile *) a;
+	const VipsCacheDiscFile *file_b = (const VipsCacheDiscFile *) b;
+
+	return file_a->mtime < file_b->mtime
+		? -1
+		: file_a->mtime > file_b->mtime ? 1 : 0;
+}
+
+/* Delete least-recently-used files until the directory is under the size
+ * limit. Hits touch their file, so mtime is the last use. Other processes
+ * may be trimming too, so failures are fine.
+ */
+static void
+vips_cache_disc_trim(const char *dir)
+{
+	GDir *gdir;
+	const char *name;
+	GSList *files;
+	GSList *p;
+	guint64 total;
+	guint64 max_disc;
+
+	if (!(gdir = g_dir_open(dir, 0, NULL)))
+		return;
+
+	max_disc = vips_cache_get_max_disc();
+
+	files = NULL;
+	total = 0;
+	while ((name = g_dir_read_name(gdir))) {
+		char *path = g_build_filename(dir, name, NULL);
+		GStatBuf st;
+
+		if (!g_stat(path, &st) &&
+			g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+			VipsCacheDiscFile *file = g_new(VipsCacheDiscFile, 1);
+
+			file->path = path;
+			file->mtime = st.st_mtime;
+			file->size = st.st_size;
+			files = g_slist_prepend(files, file);
+			total += file->size;
+		}
+		else
+			g_free(path);
+	}
+	g_dir_close(gdir);
+
+	files = g_slist_sort(files, vips_cache_disc_file_compare);
+	for (p = files; p && total > max_disc; p = p->next) {
+		VipsCacheDiscFile *file = (VipsCacheDiscFile *) p->data;
+
+		if (!g_unlink(file->path))
+			total -= file->size;
+	}
+
+	g_slist_free_full(files, (GDestroyNotify) vips_cache_disc_file_free);
+}
+
+/* Results are saved as they are computed, in cells of this size. A cell is
+ * written once a request covers all of it.
+ */
+#define VIPS_CACHE_DISC_CELL (16)
+
+/* A result being written to the persistent tier. We sit between the
+ * operation and its output and copy the pixels the caller computes into a
+ * temporary file. Once every cell has been written, the file is renamed
+ * into place, so other processes never see a partial file.
+ */
+typedef struct _VipsCacheDiscTee {
+	GMutex lock;
+	GCond writers_done;
+
+	VipsImage *disc; /* Open for write on tmp */
+	char *dir;
+	char *tmp;
+	char *path;
+
+	/* From disc, since disc is closed once we finish.
+	 */
+	int width;
+	int height;
+	size_t sizeof_pel;
+	size_t sizeof_line;
+	gint64 sizeof_header;
+
+	int cells_across;
+	int n_cells;
+	int n_done;
+	guint8 *done; /* A bit per cell */
+
+	/* Threads writing pixels. We can only close once these are done.
+	 */
+	int writers;
+
+	/* Set once all cells are written, or on a write error. No more
+	 * writes after this.
+	 */
+	gboolean finished;
+} VipsCacheDiscTee;
+
+static void
+vips_cache_disc_tee_free(VipsImage *image, VipsCacheDiscTee *tee)
+{
+	/* The file is only complete if it was renamed. Partial files are
+	 * removed.
+	 */
+	VIPS_UNREF(tee->disc);
+	if (tee->tmp)
+		(void) g_unlink(tee->tmp);
+
+	VIPS_FREE(tee->dir);
+	VIPS_FREE(tee->tmp);
+	VIPS_FREE(tee->path);
+	VIPS_FREE(tee->done);
+	g_mutex_clear(&tee->lock);
+	g_cond_clear(&tee->writers_done);
+	g_free(tee);
+}
+
+/* Make a tee for @in, with @tmp open for write. NULL on error, and the
+ * caller just skips the persistent tier.
+ */
+static VipsCacheDiscTee *
+vips_cache_disc_tee_new(VipsImage *in,
+	const char *dir, const char *key, const char *path)
+{
+	const int C = VIPS_CACHE_DISC_CELL;
+
+	VipsCacheDiscTee *tee;
+	VipsImage *array[2] = { in, NULL };
+	char *name;
+	int cells_down;
+
+	tee = g_new0(VipsCacheDiscTee, 1);
+	g_mutex_init(&tee->lock);
+	g_cond_init(&tee->writers_done);
+	tee->dir = g_strdup(dir);
+	tee->path = g_strdup(path);
+
+	tee->cells_across = VIPS_ROUND_UP(in->Xsize, C) / C;
+	cells_down = VIPS_ROUND_UP(in->Ysize, C) / C;
+	tee->n_cells = tee->cells_across * cells_down;
+	tee->done = g_malloc0(VIPS_ROUND_UP(tee->n_cells, 8) / 8);
+
+	/* A name the vips saver will handle, so we get a plain .v file.
+	 */
+	name = g_strdup_printf("%s.%08x.tmp.v", key, g_random_int());
+	tee->tmp = g_build_filename(dir, name, NULL);
+	g_free(name);
+
+	tee->disc = VIPS_IMAGE(g_object_new(VIPS_TYPE_IMAGE, NULL));
+	g_object_set(tee->disc,
+		"filename", tee->tmp,
+		"mode", "w",
+		NULL);
+	if (vips_object_build(VIPS_OBJECT(tee->disc)) ||
+		vips__image_copy_fields_array(tee->disc, array) ||
+		vips_image_write_prepare(tee->disc)) {
+		vips_cache_disc_tee_free(NULL, tee);
+		return NULL;
+	}
+
+	tee->width = tee->disc->Xsize;
+	tee->height = tee->disc->Ysize;
+	tee->sizeof_pel = VIPS_IMAGE_SIZEOF_PEL(tee->disc);
+	tee->sizeof_line = VIPS_IMAGE_SIZEOF_LINE(tee->disc);
+	tee->sizeof_header = tee->disc->sizeof_header;
+
+	return tee;
+}
+
+static int
+vips_cache_disc_pwrite(VipsCacheDiscTee *tee,
+	const VipsPel *buf, size_t length, gint64 offset)
+{
+	int fd = tee->disc->fd;
+
+#ifdef HAVE_PWRITE
+	while (length > 0) {
+		gint64 bytes_written = pwrite(fd, buf, length, offset);
+
+		if (bytes_written < 0 &&
+			errno == EINTR)
+			continue;
+		if (bytes_written <= 0)
+			return -1;
+
+		buf += bytes_written;
+		offset += bytes_written;
+		length -= bytes_written;
+	}
+
+	return 0;
+#else  /*!HAVE_PWRITE*/
+	int result;
+
+	/* No pwrite(), so the seek and write must be atomic.
+	 */
+	g_mutex_lock(&tee->lock);
+	result = vips__seek(fd, offset, SEEK_SET) == -1 ||
+		vips__write(fd, buf, length);
+	g_mutex_unlock(&tee->lock);
+
+	return result ? -1 : 0;
+#endif /*HAVE_PWRITE*/
+}
+
+/* Every cell is in the file. Add the metadata, close, and move into place.
+ */
+static void
+vips_cache_disc_tee_finish(VipsCacheDiscTee *tee)
+{
+	vips_error_freeze();
+
+	if (!vips__writehist(tee->disc)) {
+		/* Close before rename, for Windows.
+		 */
+		VIPS_UNREF(tee->disc);
+		if (!g_rename(tee->tmp, tee->path))
+			VIPS_FREE(tee->tmp);
+	}
+
+	vips_error_thaw();
+
+	vips_cache_disc_trim(tee->dir);
+}
+
+/* Write the cells inside @r from @region.
+ */
+static void
+vips_cache_disc_tee_write(VipsCacheDiscTee *tee,
+	VipsRegion *region, VipsRect *r)
+{
+	const int C = VIPS_CACHE_DISC_CELL;
+	const size_t ps = tee->sizeof_pel;
+	const size_t ls = tee->sizeof_line;
+
+	VipsRect cells;
+	int left, top, right, bottom;
+	int x, y;
+	int result;
+	gboolean complete;
+
+	/* The cells that @r covers completely. Cells on the right and bottom
+	 * edges of the image can be partial.
+	 */
+	cells.left = VIPS_ROUND_UP(r->left, C) / C;
+	cells.top = VIPS_ROUND_UP(r->top, C) / C;
+	right = VIPS_RECT_RIGHT(r) == tee->width
+		? VIPS_ROUND_UP(tee->width, C) / C
+		: VIPS_RECT_RIGHT(r) / C;
+	bottom = VIPS_RECT_BOTTOM(r) == tee->height
+		? VIPS_ROUND_UP(tee->height, C) / C
+		: VIPS_RECT_BOTTOM(r) / C;
+	cells.width = right - cells.left;
+	cells.height = bottom - cells.top;
+	if (vips_rect_isempty(&cells))
+		return;
+
+	g_mutex_lock(&tee->lock);
+	if (tee->finished) {
+		g_mutex_unlock(&tee->lock);
+		return;
+	}
+	tee->writers += 1;
+	g_mutex_unlock(&tee->lock);
+
+	/* The pixels for those cells.
+	 */
+	left = cells.left * C;
+	top = cells.top * C;
+	right = VIPS_MIN(tee->width, right * C);
+	bottom = VIPS_MIN(tee->height, bottom * C);
+
+	result = 0;
+	for (y = top; y < bottom && !result; y++)
+		result = vips_cache_disc_pwrite(tee,
+			VIPS_REGION_ADDR(region, left, y),
+			(right - left) * ps,
+			tee->sizeof_header + y * ls + left * ps);
+
+	complete = FALSE;
+
+	g_mutex_lock(&tee->lock);
+
+	tee->writers -= 1;
+
+	if (result)
+		/* Give up, and leave the partial file to be removed.
+		 */
+		tee->finished = TRUE;
+	else
+		for (y = cells.top; y < VIPS_RECT_BOTTOM(&cells); y++)
+			for (x = cells.left; x < VIPS_RECT_RIGHT(&cells); x++) {
+				int i = y * tee->cells_across + x;
+
+				if (!(tee->done[i / 8] & (1 << (i % 8)))) {
+					tee->done[i / 8] |= 1 << (i % 8);
+					tee->n_done += 1;
+				}
+			}
+
+	if (!tee->finished &&
+		tee->n_done == tee->n_cells) {
+		tee->finished = TRUE;
+		complete = TRUE;
+	}
+
+	if (!tee->writers)
+		g_cond_broadcast(&tee->writers_done);
+
+	/* We can only close once any other writes have finished. They are
+	 * just pwrite()s, so this is never a long wait.
+	 */
+	if (complete)
+		while (tee->writers)
+			g_cond_wait(&tee->writers_done, &tee->lock);
+
+	g_mutex_unlock(&tee->lock);
+
+	if (complete)
+		vips_cache_disc_tee_finish(tee);
+}
+
+static int
+vips_cache_disc_tee_gen(VipsRegion *out_region,
+	void *seq, void *a, void *b, gboolean *stop)
+{
+	VipsRegion *ir = (VipsRegion *) seq;
+	VipsCacheDiscTee *tee = (VipsCacheDiscTee *) b;
+	VipsRect *r = &out_region->valid;
+
+	if (vips_region_prepare(ir, r) ||
+		vips_region_region(out_region, ir, r, r->left, r->top))
+		return -1;
+
+	vips_cache_disc_tee_write(tee, ir, r);
+
+	return 0;
+}
+
+/* Put a tee between @operation and its output, so the output is saved as
+ * the caller computes it.
+ */
+static void
+vips_cache_disc_tee_attach(VipsOperation *operation,
+	const char *dir, const char *key, const char *path)
+{
+	VipsImage *in;
+	VipsImage *out;
+	VipsCacheDiscTee *tee;
+
+	g_object_get(operation, "out", &in, NULL);
+
+	vips_error_freeze();
+	tee = vips_cache_disc_tee_new(in, dir, key, path);
+	vips_error_thaw();
+	if (!tee) {
+		g_object_unref(in);
+		return;
+	}
+
+	out = vips_image_new();
+	g_signal_connect(out, "close",
+		G_CALLBACK(vips_cache_disc_tee_free), tee);
+	if (vips_image_pipelinev(out, in->dhint, in, NULL) ||
+		vips_image_generate(out,
+			vips_start_one, vips_cache_disc_tee_gen, vips_stop_one,
+			in, tee)) {
+		g_object_unref(out);
+		g_object_unref(in);
+		return;
+	}
+
+	/* The operation owned a ref to the old output, which now belongs to
+	 * the new output. Drop the ref we got.
+	 */
+	vips_object_local(out, in);
+	g_object_unref(in);
+	g_object_set(operation, "out", out, NULL);
+}
+
+/* Build @operation, using the persistent tier if we can.
+ *
+ * On a hit, the output is the saved file. On a miss, the operation is built
+ * in the usual way, so it stays lazy, and the pixels are written to the
+ * persistent tier as the caller computes them.
+ */
+static int
+vips_cache_disc_build(VipsOperation *operation)
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(operation);
+
+	char *dir;
+	char *key;
+	char *name;
+	char *path;
+	VipsImage *out;
+
+	g_mutex_lock(&vips_cache_lock);
+	dir = g_strdup(vips_cache_dir);
+	g_mutex_unlock(&vips_cache_lock);
+
+	if (!dir)
+		return vips_object_build(VIPS_OBJECT(operation));
+	if (!(key = vips_cache_disc_key(operation))) {
+		g_free(dir);
+		return vips_object_build(VIPS_OBJECT(operation));
+	}
+
+	name = g_strdup_printf("%s.v", key);
+	path = g_build_filename(dir, name, NULL);
+	g_free(name);
+
+	/* Any errors here just mean we fall back to a normal build.
+	 */
+	vips_error_freeze();
+	out = g_file_test(path, G_FILE_TEST_IS_REGULAR)
+		? vips_image_new_from_file(path, NULL)
+		: NULL;
+	vips_error_thaw();
+
+	if (out) {
+		/* Touch for LRU.
+		 */
+		(void) g_utime(path, NULL);
+
+		/* The output arg takes our ref.
+		 */
+		g_object_set(operation, "out", out, NULL);
+
+		if (vips__cache_trace) {
+			printf("vips cache#: ");
+			vips_object_print_summary(VIPS_OBJECT(operation));
+		}
+	}
+	else {
+		/* Run the build, but attach the tee before we finish, so
+		 * postbuild sees the final output.
+		 */
+		if (class->build(VIPS_OBJECT(operation))) {
+			g_free(path);
+			g_free(key);
+			g_free(dir);
+
+			return -1;
+		}
+
+		vips_cache_disc_tee_attach(operation, dir, key, path);
+	}
+
+	g_free(path);
+	g_free(key);
+	g_free(dir);
+
+	return vips__object_build_finish(VIPS_OBJECT(operation));
+}
+
 /**
  * vips_cache_operation_buildp: (skip)
  * @operation: pointer to operation to lookup
@@ -984,6 +1656,12 @@ vips_cache_find_differences(VipsObject *object,
  *
  * Operators with the [flags@Vips.OperationFlags.NOCACHE] flag are never cached.
  *
+ * If a cache directory has been set with [func@cache_set_dir], misses are
+ * then looked up in the persistent tier.
+ *
+ * Misses are built with the operation's cancellable, if any, see
+ * [method@Operation.set_cancellable].
+ *
  * Returns: 0 on success, or -1 on error.
  */
 int
@@ -994,6 +1672,9 @@ vips_cache_operation_buildp(VipsOperation **operation)
 	VipsOperationFlags flags = vips_operation_get_flags(*operation);
 
 	VipsOperationCacheEntry *hit;
+	VipsCancellable *cancellable;
+	VipsCancellable *previous;
+	int result;
 
 	g_assert(VIPS_IS_OPERATION(*operation));
 
@@ -1037,6 +1718,8 @@ vips_cache_operation_buildp(VipsOperation **operation)
 
 	g_mutex_unlock(&vips_cache_lock);
 
+	vips__metrics_cache(*operation, hit != NULL);
+
 	/* If there was a miss, we need to build this operation and add
 	 * it to the cache, if appropriate.
 	 */
@@ -1059,7 +1742,20 @@ vips_cache_operation_buildp(VipsOperation **operation)
 		}
 #endif /*DEBUG_LEAK*/
 
-		if (vips_object_build(VIPS_OBJECT(*operation)))
+		/* Build with the operation's cancellable, if it has one.
+		 */
+		cancellable = vips_operation_get_cancellable(*operation);
+		if (cancellable) {
+			previous = vips_cancellable_get_current();
+			vips_cancellable_set_current(cancellable);
+		}
+
+		result = vips_cache_disc_build(*operation);
+
+		if (cancellable)
+			vips_cancellable_set_current(previous);
+
+		if (result)
 			return -1;
 
 #ifdef DEBUG_LEAK
@@ -1161,7 +1857,8 @@ vips_cache_set_max(int max)
  * @max_mem: maximum amount of tracked memory we use
  *
  * Set the maximum amount of tracked memory we allow before we start dropping
- * cached operations. See [func@tracked_get_mem].
+ * cached operations. See [func@tracked_get_mem]. Idle pixel buffers kept
+ * for reuse are not counted, since dropping operations won't free them.
  *
  * libvips only tracks memory it allocates, it can't track memory allocated by
  * external libraries. If you use an operation like [ctor@Image.magickload],
@@ -1300,3 +1997,111 @@ vips_cache_set_trace(gboolean trace)
 {
 	vips__cache_trace = trace;
 }
+
+/**
+ * vips_cache_set_dir:
+ * @dir: (nullable): directory for the persistent tier, or `NULL`
+ *
+ * Keep the results of some operations in @dir, as well as in memory. Any
+ * process with the same @dir can then reuse them.
+ *
+ * Only operations which read at least one file or blob, have no image or
+ * source inputs, and make a single output image go in this tier, for
+ * example [ctor@Image.thumbnail]. They are keyed by a hash of the libvips
+ * version, the operation and its arguments, with files and blobs hashed by
+ * their contents. Results are stored as `.v` files and are read back with
+ * [ctor@Image.new_from_file].
+ *
+ * A miss builds the operation in the usual way. As the caller computes the
+ * output, the pixels are also written to @dir, and once every pixel has
+ * been computed the file is moved into place. A miss therefore costs one
+ * extra write, and a result which is only partly computed is not saved.
+ * Set @dir to `NULL` to turn the persistent tier off, which is the default.
+ *
+ * You can set the environment variable `VIPS_CACHE_DIR` to set this.
+ *
+ * ::: seealso
+ *     [func@cache_set_max_disc].
+ *
+ * Returns: 0 on success, -1 if @dir could not be made.
+ */
+int
+vips_cache_set_dir(const char *dir)
+{
+	if (dir &&
+		g_mkdir_with_parents(dir, 0700)) {
+		vips_error_system(errno, "vips_cache_set_dir",
+			_("unable to make cache directory \"%s\""), dir);
+		return -1;
+	}
+
+	g_mutex_lock(&vips_cache_lock);
+	VIPS_SETSTR(vips_cache_dir, dir);
+	g_mutex_unlock(&vips_cache_lock);
+
+	return 0;
+}
+
+/**
+ * vips_cache_get_dir:
+ *
+ * Get the directory used for the persistent tier.
+ *
+ * ::: seealso
+ *     [func@cache_set_dir].
+ *
+ * Returns: (nullable): the cache directory, or `NULL` if there is no
+ * persistent tier. Free with [func@GLib.free].
+ */
+char *
+vips_cache_get_dir(void)
+{
+	char *dir;
+
+	g_mutex_lock(&vips_cache_lock);
+	dir = g_strdup(vips_cache_dir);
+	g_mutex_unlock(&vips_cache_lock);
+
+	return dir;
+}
+
+/**
+ * vips_cache_set_max_disc:
+ * @max_disc: maximum number of bytes in the persistent tier
+ *
+ * Set the maximum size of the persistent tier. Least-recently-used results
+ * are deleted after each write until the directory is below this size.
+ * The default is 1gb.
+ *
+ * ::: seealso
+ *     [func@cache_set_dir].
+ */
+void
+vips_cache_set_max_disc(guint64 max_disc)
+{
+	g_mutex_lock(&vips_cache_lock);
+	vips_cache_max_disc = max_disc;
+	g_mutex_unlock(&vips_cache_lock);
+}
+
+/**
+ * vips_cache_get_max_disc:
+ *
+ * Get the maximum size of the persistent tier.
+ *
+ * ::: seealso
+ *     [func@cache_set_max_disc].
+ *
+ * Returns: the maximum number of bytes in the persistent tier
+ */
+guint64
+vips_cache_get_max_disc(void)
+{
+	guint64 max_disc;
+
+	g_mutex_lock(&vips_cache_lock);
+	max_disc = vips_cache_max_disc;
+	g_mutex_unlock(&vips_cache_lock);
+
+	return max_disc;
+}
@@ -0,0 +1,268 @@
+/* Cancel running pipelines, or give them a deadline.
+ *
+ * 19/10/26
+ * 	- from threadpool.c
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define VIPS_DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+#include <vips/debug.h>
+
+/**
+ * VipsCancellable:
+ *
+ * A [class@Cancellable] stops work on a set of pipelines early, either
+ * when [method@Cancellable.cancel] is called or when a deadline passes.
+ *
+ * Cancellables follow threads. Make one the current cancellable for a
+ * thread with [func@cancellable_set_current] and any work that thread
+ * starts will check it: threadpools and the sinks built on them, region
+ * prepare, [class@Source] reads, [class@Target] writes, and any loop that
+ * calls [method@Image.iskilled], such as the webp and gif savers. Worker
+ * threads inherit the cancellable of the thread that started them.
+ *
+ * Once cancelled, work stops at the next check with an error, and the
+ * threads and buffers it was using are released. Calls into external
+ * libraries which don't read or write through libvips can't be
+ * interrupted and will run to completion first.
+ *
+ * ::: seealso
+ *     [method@Operation.set_cancellable], [method@Image.set_kill].
+ */
+
+G_DEFINE_TYPE(VipsCancellable, vips_cancellable, VIPS_TYPE_OBJECT);
+
+/* The cancellable for the work this thread is doing, if any. We don't hold
+ * a ref, whoever set it must keep it alive until they unset it.
+ */
+static GPrivate vips_cancellable_key;
+
+static void
+vips_cancellable_finalize(GObject *gobject)
+{
+	VipsCancellable *cancellable = (VipsCancellable *) gobject;
+
+	g_mutex_clear(&cancellable->lock);
+
+	G_OBJECT_CLASS(vips_cancellable_parent_class)->finalize(gobject);
+}
+
+static void
+vips_cancellable_class_init(VipsCancellableClass *class)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(class);
+	VipsObjectClass *object_class = VIPS_OBJECT_CLASS(class);
+
+	gobject_class->finalize = vips_cancellable_finalize;
+
+	object_class->nickname = "cancellable";
+	object_class->description = _("cancel pipelines");
+}
+
+static void
+vips_cancellable_init(VipsCancellable *cancellable)
+{
+	g_mutex_init(&cancellable->lock);
+	cancellable->cancelled = FALSE;
+	cancellable->deadline = 0;
+}
+
+/**
+ * vips_cancellable_new:
+ *
+ * Make a new [class@Cancellable], not cancelled and with no deadline.
+ *
+ * Returns: (transfer full): a new [class@Cancellable]
+ */
+VipsCancellable *
+vips_cancellable_new(void)
+{
+	VipsCancellable *cancellable;
+
+	cancellable = VIPS_CANCELLABLE(g_object_new(VIPS_TYPE_CANCELLABLE,
+		NULL));
+
+	if (vips_object_build(VIPS_OBJECT(cancellable))) {
+		VIPS_UNREF(cancellable);
+		return NULL;
+	}
+
+	return cancellable;
+}
+
+/**
+ * vips_cancellable_cancel:
+ * @cancellable: cancellable to cancel
+ *
+ * Cancel all work checking @cancellable. This can be called from any
+ * thread.
+ */
+void
+vips_cancellable_cancel(VipsCancellable *cancellable)
+{
+	VIPS_DEBUG_MSG("vips_cancellable_cancel: %p\n", cancellable);
+
+	g_atomic_int_set(&cancellable->cancelled, TRUE);
+}
+
+/**
+ * vips_cancellable_set_deadline:
+ * @cancellable: cancellable to set
+ * @deadline: monotonic time in microseconds, or 0 for no deadline
+ *
+ * Cancel @cancellable automatically once [func@GLib.get_monotonic_time]
+ * passes @deadline.
+ *
+ * ::: seealso
+ *     [method@Cancellable.set_timeout].
+ */
+void
+vips_cancellable_set_deadline(VipsCancellable *cancellable, gint64 deadline)
+{
+	g_mutex_lock(&cancellable->lock);
+	cancellable->deadline = deadline;
+	g_mutex_unlock(&cancellable->lock);
+}
+
+/**
+ * vips_cancellable_set_timeout:
+ * @cancellable: cancellable to set
+ * @timeout: seconds from now
+ *
+ * Set the deadline for @cancellable to @timeout seconds from now.
+ *
+ * ::: seealso
+ *     [method@Cancellable.set_deadline].
+ */
+void
+vips_cancellable_set_timeout(VipsCancellable *cancellable, double timeout)
+{
+	vips_cancellable_set_deadline(cancellable,
+		g_get_monotonic_time() + timeout * G_USEC_PER_SEC);
+}
+
+/**
+ * vips_cancellable_is_cancelled:
+ * @cancellable: cancellable to test
+ *
+ * Test whether @cancellable has been cancelled, or its deadline has passed.
+ *
+ * Returns: `TRUE` if work should stop
+ */
+gboolean
+vips_cancellable_is_cancelled(VipsCancellable *cancellable)
+{
+	gint64 deadline;
+
+	if (g_atomic_int_get(&cancellable->cancelled))
+		return TRUE;
+
+	g_mutex_lock(&cancellable->lock);
+	deadline = cancellable->deadline;
+	g_mutex_unlock(&cancellable->lock);
+
+	if (deadline &&
+		g_get_monotonic_time() >= deadline) {
+		g_atomic_int_set(&cancellable->cancelled, TRUE);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* As vips_cancellable_is_cancelled(), but set an error message too.
+ */
+gboolean
+vips__cancellable_check(VipsCancellable *cancellable)
+{
+	if (cancellable &&
+		vips_cancellable_is_cancelled(cancellable)) {
+		vips_error("VipsCancellable", "%s", _("cancelled"));
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Check the current cancellable for this thread, if any.
+ */
+gboolean
+vips__cancellable_check_current(void)
+{
+	return vips__cancellable_check(g_private_get(&vips_cancellable_key));
+}
+
+/**
+ * vips_cancellable_set_current:
+ * @cancellable: (nullable): cancellable for this thread, or `NULL`
+ *
+ * Make @cancellable the current cancellable for the calling thread. Work
+ * this thread starts from now on will stop early if @cancellable is
+ * cancelled.
+ *
+ * libvips does not take a ref to @cancellable, so you must keep it alive
+ * until you set the current cancellable back to `NULL`.
+ *
+ * ::: seealso
+ *     [func@cancellable_get_current].
+ */
+void
+vips_cancellable_set_current(VipsCancellable *cancellable)
+{
+	g_private_set(&vips_cancellable_key, cancellable);
+}
+
+/**
+ * vips_cancellable_get_current:
+ *
+ * Get the current cancellable for the calling thread, if any.
+ *
+ * ::: seealso
+ *     [func@cancellable_set_current].
+ *
+ * Returns: (transfer none) (nullable): the current cancellable, or `NULL`
+ */
+VipsCancellable *
+vips_cancellable_get_current(void)
+{
+	return (VipsCancellable *) g_private_get(&vips_cancellable_key);
+}
@@ -0,0 +1,371 @@
+/* Hold an image in memory as a set of compressed strips.
+ *
+ * 19/10/26
+ * 	- from sinkmemory.c
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define VIPS_DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+#include <vips/debug.h>
+
+/* Aim for strips of about this many bytes. Big enough to compress well,
+ * small enough to decompress quickly for a small request.
+ */
+#define VIPS_COMPRESSED_STRIP_SIZE (64 * 1024)
+
+/* A strip of image, after prediction and compression.
+ */
+typedef struct _VipsCompressedStrip {
+	VipsPel *data;
+	size_t length;
+} VipsCompressedStrip;
+
+typedef struct _VipsCompressed {
+	/* Geometry, copied from the source image.
+	 */
+	int width;
+	int height;
+	int sizeof_pel;
+	size_t sizeof_line;
+
+	int strip_height;
+	int n_strips;
+	VipsCompressedStrip *strips;
+
+	/* The next strip to compress.
+	 */
+	int strip;
+} VipsCompressed;
+
+/* Each sequence keeps the last strip it decompressed, so a run of small
+ * requests from the same strip only decompresses it once.
+ */
+typedef struct _VipsCompressedSeq {
+	int strip;
+	VipsPel *buf;
+} VipsCompressedSeq;
+
+static void
+vips_compressed_free(VipsCompressed *compressed)
+{
+	int i;
+
+	if (compressed->strips)
+		for (i = 0; i < compressed->n_strips; i++)
+			VIPS_FREE(compressed->strips[i].data);
+	VIPS_FREE(compressed->strips);
+	g_free(compressed);
+}
+
+static void
+vips_compressed_close_cb(VipsImage *image, VipsCompressed *compressed)
+{
+	vips_compressed_free(compressed);
+}
+
+static int
+vips_compressed_allocate(VipsThreadState *state, void *a, gboolean *stop)
+{
+	VipsCompressed *compressed = (VipsCompressed *) a;
+
+	int top;
+
+	if (compressed->strip >= compressed->n_strips) {
+		*stop = TRUE;
+		return 0;
+	}
+
+	state->x = compressed->strip++;
+
+	top = state->x * compressed->strip_height;
+	state->pos.left = 0;
+	state->pos.top = top;
+	state->pos.width = compressed->width;
+	state->pos.height =
+		VIPS_MIN(compressed->strip_height, compressed->height - top);
+
+	return 0;
+}
+
+static int
+vips_compressed_work(VipsThreadState *state, void *a)
+{
+	VipsCompressed *compressed = (VipsCompressed *) a;
+	VipsCompressedStrip *strip = &compressed->strips[state->x];
+	const int ps = compressed->sizeof_pel;
+	const size_t ls = compressed->sizeof_line;
+	const size_t length = ls * state->pos.height;
+
+	VipsPel *buf;
+	size_t x;
+	int y;
+
+	if (vips_region_prepare(state->reg, &state->pos))
+		return -1;
+
+	/* Predict each byte from the one a pixel to the left. Smooth areas
+	 * become runs of small values, which compress well.
+	 */
+	if (!(buf = VIPS_ARRAY(NULL, length, VipsPel)))
+		return -1;
+	for (y = 0; y < state->pos.height; y++) {
+		VipsPel *p = VIPS_REGION_ADDR(state->reg, 0, state->pos.top + y);
+		VipsPel *q = buf + y * ls;
+
+		for (x = 0; x < ps; x++)
+			q[x] = p[x];
+		for (x = ps; x < ls; x++)
+			q[x] = p[x] - p[x - ps];
+	}
+
+#ifdef HAVE_ZLIB
+	{
+		uLongf compressed_length = compressBound(length);
+
+		if (!(strip->data = VIPS_ARRAY(NULL, compressed_length, VipsPel))) {
+			g_free(buf);
+			return -1;
+		}
+		if (compress2(strip->data, &compressed_length,
+				buf, length, Z_BEST_SPEED) != Z_OK) {
+			vips_error("vips_image_copy_memory_compressed",
+				"%s", _("compression failed"));
+			g_free(buf);
+			return -1;
+		}
+		g_free(buf);
+
+		strip->data = g_realloc(strip->data, compressed_length);
+		strip->length = compressed_length;
+	}
+#else  /*!HAVE_ZLIB*/
+	/* No codec, keep the predicted bytes.
+	 */
+	strip->data = buf;
+	strip->length = length;
+#endif /*HAVE_ZLIB*/
+
+	return 0;
+}
+
+/* Decompress a strip to buf and undo the prediction.
+ */
+static int
+vips_compressed_unpack(VipsCompressed *compressed, int i, VipsPel *buf)
+{
+	VipsCompressedStrip *strip = &compressed->strips[i];
+	const int ps = compressed->sizeof_pel;
+	const size_t ls = compressed->sizeof_line;
+	const int height =
+		VIPS_MIN(compressed->strip_height,
+			compressed->height - i * compressed->strip_height);
+
+	size_t x;
+	int y;
+
+#ifdef HAVE_ZLIB
+	{
+		uLongf length = ls * height;
+
+		if (uncompress(buf, &length, strip->data, strip->length) != Z_OK ||
+			length != ls * height) {
+			vips_error("vips_image_copy_memory_compressed",
+				"%s", _("decompression failed"));
+			return -1;
+		}
+	}
+#else  /*!HAVE_ZLIB*/
+	memcpy(buf, strip->data, strip->length);
+#endif /*HAVE_ZLIB*/
+
+	for (y = 0; y < height; y++) {
+		VipsPel *q = buf + y * ls;
+
+		for (x = ps; x < ls; x++)
+			q[x] += q[x - ps];
+	}
+
+	return 0;
+}
+
+static int
+vips_compressed_stop(void *vseq, void *a, void *b)
+{
+	VipsCompressedSeq *seq = (VipsCompressedSeq *) vseq;
+
+	VIPS_FREE(seq->buf);
+	g_free(seq);
+
+	return 0;
+}
+
+static void *
+vips_compressed_start(VipsImage *out, void *a, void *b)
+{
+	VipsCompressed *compressed = (VipsCompressed *) a;
+
+	VipsCompressedSeq *seq;
+
+	seq = g_new(VipsCompressedSeq, 1);
+	seq->strip = -1;
+	if (!(seq->buf = VIPS_ARRAY(NULL,
+			  compressed->sizeof_line * compressed->strip_height,
+			  VipsPel))) {
+		vips_compressed_stop(seq, a, b);
+		return NULL;
+	}
+
+	return seq;
+}
+
+static int
+vips_compressed_gen(VipsRegion *out_region,
+	void *vseq, void *a, void *b, gboolean *stop)
+{
+	VipsCompressedSeq *seq = (VipsCompressedSeq *) vseq;
+	VipsCompressed *compressed = (VipsCompressed *) a;
+	VipsRect *r = &out_region->valid;
+	const int ps = compressed->sizeof_pel;
+	const size_t ls = compressed->sizeof_line;
+
+	int y;
+
+	for (y = r->top; y < VIPS_RECT_BOTTOM(r); y++) {
+		int i = y / compressed->strip_height;
+
+		if (seq->strip != i) {
+			if (vips_compressed_unpack(compressed, i, seq->buf)) {
+				seq->strip = -1;
+				return -1;
+			}
+			seq->strip = i;
+		}
+
+		memcpy(VIPS_REGION_ADDR(out_region, r->left, y),
+			seq->buf +
+				(y - i * compressed->strip_height) * ls + r->left * ps,
+			r->width * ps);
+	}
+
+	return 0;
+}
+
+/**
+ * vips_image_copy_memory_compressed: (method)
+ * @image: image to copy to a compressed memory buffer
+ *
+ * Make an image which holds the pixels of @image in memory, as
+ * [method@Image.copy_memory] does, but compressed.
+ *
+ * @image is computed once, in parallel, as a set of strips. Each strip is
+ * run through a simple predictor and compressed with deflate, if libvips
+ * was built with zlib. Strips are decompressed again as the result is
+ * read, and each thread keeps its most recent strip, so sequential reads
+ * only decompress each strip once.
+ *
+ * This is useful for large intermediates that must be read several times.
+ * The result is smaller than a [method@Image.copy_memory] copy, but is a
+ * partial image, so you can't use [func@IMAGE_ADDR] on it.
+ *
+ * ::: seealso
+ *     [method@Image.copy_memory], [func@get_disc_threshold].
+ *
+ * Returns: (transfer full): the new [class@Image], or `NULL` on error.
+ */
+VipsImage *
+vips_image_copy_memory_compressed(VipsImage *image)
+{
+	VipsCompressed *compressed;
+	VipsImage *out;
+	int result;
+
+	compressed = g_new0(VipsCompressed, 1);
+	compressed->width = image->Xsize;
+	compressed->height = image->Ysize;
+	compressed->sizeof_pel = VIPS_IMAGE_SIZEOF_PEL(image);
+	compressed->sizeof_line = VIPS_IMAGE_SIZEOF_LINE(image);
+	compressed->strip_height = VIPS_CLIP(1,
+		VIPS_COMPRESSED_STRIP_SIZE / compressed->sizeof_line,
+		image->Ysize);
+	compressed->n_strips =
+		VIPS_ROUND_UP(image->Ysize, compressed->strip_height) /
+		compressed->strip_height;
+	compressed->strips = g_new0(VipsCompressedStrip, compressed->n_strips);
+
+	vips_image_preeval(image);
+
+	result = vips_threadpool_run(image,
+		vips_thread_state_new,
+		vips_compressed_allocate,
+		vips_compressed_work,
+		NULL,
+		compressed);
+
+	vips_image_posteval(image);
+
+	vips_image_minimise_all(image);
+
+	if (result) {
+		vips_compressed_free(compressed);
+		return NULL;
+	}
+
+	out = vips_image_new();
+	g_signal_connect(out, "postclose",
+		G_CALLBACK(vips_compressed_close_cb), compressed);
+
+	if (vips_image_pipelinev(out,
+			VIPS_DEMAND_STYLE_THINSTRIP, image, NULL) ||
+		vips_image_generate(out,
+			vips_compressed_start, vips_compressed_gen,
+			vips_compressed_stop, compressed, NULL)) {
+		g_object_unref(out);
+		return NULL;
+	}
+
+	return out;
+}
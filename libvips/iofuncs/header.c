@@ -933,6 +933,29 @@ vips_image_get_concurrency(VipsImage *image, int default_concurrency)
 	return default_concurrency;
 }
 
+/**
+ * vips_image_get_priority:
+ * @image: image to get from
+ *
+ * Fetch and sanity-check [const@META_PRIORITY]. Default to 1 if not
+ * present or crazy.
+ *
+ * Returns: the scheduling weight for this image
+ */
+int
+vips_image_get_priority(VipsImage *image)
+{
+	int priority;
+
+	if (vips_image_get_typeof(image, VIPS_META_PRIORITY) &&
+		!vips_image_get_int(image, VIPS_META_PRIORITY, &priority) &&
+		priority >= 1 &&
+		priority <= 100)
+		return priority;
+
+	return 1;
+}
+
 /**
  * vips_image_get_n_subifds:
  * @image: image to get from
@@ -1608,8 +1608,9 @@ vips_image_set_progress(VipsImage *image, gboolean progress)
  * @image: image to test
  *
  * If @image has been killed (see [method@Image.set_kill]), set an error
- * message, clear the [class@Image].kill flag and return `TRUE`. Otherwise
- * return `FALSE`.
+ * message, clear the [class@Image].kill flag and return `TRUE`. Also
+ * return `TRUE` if the current [class@Cancellable] for this thread has been
+ * cancelled. Otherwise return `FALSE`.
  *
  * Handy for loops which need to run sets of threads which can fail.
  *
@@ -1642,6 +1643,8 @@ vips_image_iskilled(VipsImage *image)
 		 */
 		vips_image_set_kill(image, FALSE);
 	}
+	else if (vips__cancellable_check_current())
+		kill = TRUE;
 
 	return kill;
 }
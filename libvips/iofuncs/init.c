@@ -502,6 +502,9 @@ vips_init(const char *argv0)
 		vips_leak_set(TRUE);
 	if (g_getenv("VIPS_TRACE"))
 		vips_cache_set_trace(TRUE);
+	const char *cache_dir;
+	if ((cache_dir = g_getenv("VIPS_CACHE_DIR")))
+		(void) vips_cache_set_dir(cache_dir);
 
 	const char *pipe_read_limit;
 	if ((pipe_read_limit = g_getenv("VIPS_PIPE_READ_LIMIT")))
@@ -643,6 +646,8 @@ vips_init(const char *argv0)
 	 */
 	vips__vector_init();
 
+	vips__metrics_init();
+
 #ifdef DEBUG_LEAK
 	vips__image_pixels_quark =
 		g_quark_from_static_string("vips-image-pixels");
@@ -736,6 +741,7 @@ vips_shutdown(void)
 #endif /*DEBUG*/
 
 	vips_cache_drop_all();
+	vips__convfft_shutdown();
 
 #ifdef ENABLE_DEPRECATED
 	im_close_plugins();
@@ -755,6 +761,7 @@ vips_shutdown(void)
 	vips_thread_shutdown();
 	vips__thread_profile_stop();
 	vips__threadpool_shutdown();
+	vips__buffer_pool_shutdown();
 
 	VIPS_FREE(vips__argv0);
 	VIPS_FREE(vips__prgname);
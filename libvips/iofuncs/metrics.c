@@ -0,0 +1,570 @@
+/* Counters and histograms for running operations.
+ *
+ * 19/10/26
+ * 	- first version
+ * 	- count queue wait with atomic adds, not a lock
+ */
+
+/*
+
+	This file is part of VIPS.
+
+	VIPS is free software; you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+	02110-1301  USA
+
+ */
+
+/*
+
+	These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define VIPS_DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <glib/gi18n-lib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+#include <vips/debug.h>
+
+/* Upper bounds of the histogram buckets, in microseconds. There's an extra
+ * +Inf bucket after these.
+ */
+static const gint64 vips_metrics_bounds[] = {
+	50, 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+#define VIPS_METRICS_N_BUCKETS (VIPS_NUMBER(vips_metrics_bounds) + 1)
+
+typedef struct _VipsMetricsHistogram {
+	gint64 buckets[VIPS_METRICS_N_BUCKETS];
+	gint64 count;
+	gint64 sum; /* In microseconds */
+} VipsMetricsHistogram;
+
+/* Everything we count for one operation nickname.
+ */
+struct _VipsMetricsOperation {
+	char *nickname;
+
+	/* Protects the counters below.
+	 */
+	GMutex lock;
+
+	gint64 builds;
+	gint64 hits;
+	gint64 misses;
+	gint64 pixels;
+	VipsMetricsHistogram generate;
+};
+
+/* Operation nickname -> VipsMetricsOperation. Entries are never freed,
+ * since images hold pointers to them.
+ */
+static GMutex vips_metrics_lock;
+static GHashTable *vips_metrics_operations = NULL;
+
+/* How long workers wait to get their next work unit. This is updated for
+ * every work unit, so it uses atomic adds rather than a lock, and the count
+ * is found from the buckets when we write.
+ */
+static gsize vips_metrics_queue_buckets[VIPS_METRICS_N_BUCKETS];
+static gsize vips_metrics_queue_sum = 0; /* In microseconds */
+
+/* Output images are tagged with the entry for the operation that made them.
+ */
+static GQuark vips_metrics_quark = 0;
+
+/* Total generate time so far for the current thread. We use this to find
+ * the time for each generate, less the time spent generating its inputs.
+ */
+static GPrivate vips_metrics_time_key = G_PRIVATE_INIT(g_free);
+
+void
+vips__metrics_init(void)
+{
+	vips_metrics_quark = g_quark_from_static_string("vips-metrics");
+	vips_metrics_operations = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+/* The bucket for a time in microseconds.
+ */
+static int
+vips_metrics_bucket(gint64 usec)
+{
+	int i;
+
+	for (i = 0; i < VIPS_NUMBER(vips_metrics_bounds); i++)
+		if (usec <= vips_metrics_bounds[i])
+			break;
+
+	return i;
+}
+
+static void
+vips_metrics_histogram_add(VipsMetricsHistogram *histogram, gint64 usec)
+{
+	histogram->buckets[vips_metrics_bucket(usec)] += 1;
+	histogram->count += 1;
+	histogram->sum += usec;
+}
+
+static VipsMetricsOperation *
+vips_metrics_operation_get(VipsOperation *operation)
+{
+	const char *nickname = VIPS_OBJECT_GET_CLASS(operation)->nickname;
+
+	VipsMetricsOperation *entry;
+
+	g_mutex_lock(&vips_metrics_lock);
+
+	if (!(entry = g_hash_table_lookup(vips_metrics_operations, nickname))) {
+		entry = g_new0(VipsMetricsOperation, 1);
+		entry->nickname = g_strdup(nickname);
+		g_mutex_init(&entry->lock);
+		g_hash_table_insert(vips_metrics_operations,
+			entry->nickname, entry);
+	}
+
+	g_mutex_unlock(&vips_metrics_lock);
+
+	return entry;
+}
+
+static void *
+vips_metrics_tag_output(VipsObject *object,
+	GParamSpec *pspec,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	void *a, void *b)
+{
+	VipsMetricsOperation *entry = (VipsMetricsOperation *) a;
+
+	if ((argument_class->flags & VIPS_ARGUMENT_OUTPUT) &&
+		argument_instance->assigned &&
+		G_PARAM_SPEC_VALUE_TYPE(pspec) == VIPS_TYPE_IMAGE) {
+		VipsImage *image;
+
+		g_object_get(object, g_param_spec_get_name(pspec), &image, NULL);
+
+		/* Operations often pass out the output of a sub-operation.
+		 * Keep the innermost tag, it's the one doing the work.
+		 */
+		if (image &&
+			!g_object_get_qdata(G_OBJECT(image), vips_metrics_quark))
+			g_object_set_qdata(G_OBJECT(image), vips_metrics_quark, entry);
+
+		VIPS_UNREF(image);
+	}
+
+	return NULL;
+}
+
+/* An operation has been built: count it, and tag its output images so we
+ * can count the pixels they generate.
+ */
+void
+vips__metrics_build(VipsOperation *operation)
+{
+	VipsMetricsOperation *entry = vips_metrics_operation_get(operation);
+
+	g_mutex_lock(&entry->lock);
+	entry->builds += 1;
+	g_mutex_unlock(&entry->lock);
+
+	(void) vips_argument_map(VIPS_OBJECT(operation),
+		vips_metrics_tag_output, entry, NULL);
+}
+
+void
+vips__metrics_cache(VipsOperation *operation, gboolean hit)
+{
+	VipsMetricsOperation *entry = vips_metrics_operation_get(operation);
+
+	g_mutex_lock(&entry->lock);
+	if (hit)
+		entry->hits += 1;
+	else
+		entry->misses += 1;
+	g_mutex_unlock(&entry->lock);
+}
+
+void
+vips__metrics_generate_start(VipsMetricsFrame *frame)
+{
+	gint64 *total;
+
+	if (!(total = g_private_get(&vips_metrics_time_key))) {
+		total = g_new0(gint64, 1);
+		g_private_set(&vips_metrics_time_key, total);
+	}
+
+	frame->total = total;
+	frame->before = *total;
+	frame->start = g_get_monotonic_time();
+}
+
+/* Regions on images we didn't tag (made outside an operation) still add to
+ * the thread total, so their time isn't billed to whatever reads them.
+ */
+void
+vips__metrics_generate_stop(VipsMetricsFrame *frame,
+	VipsRegion *region, int result)
+{
+	gint64 elapsed = g_get_monotonic_time() - frame->start;
+	gint64 self = elapsed - (*frame->total - frame->before);
+
+	VipsMetricsOperation *entry;
+
+	*frame->total = frame->before + elapsed;
+
+	if ((entry = g_object_get_qdata(G_OBJECT(region->im),
+			 vips_metrics_quark))) {
+		g_mutex_lock(&entry->lock);
+		vips_metrics_histogram_add(&entry->generate, VIPS_MAX(0, self));
+		if (!result)
+			entry->pixels +=
+				(gint64) region->valid.width * region->valid.height;
+		g_mutex_unlock(&entry->lock);
+	}
+}
+
+void
+vips__metrics_queue_wait(gint64 usec)
+{
+	int i;
+
+	usec = VIPS_MAX(0, usec);
+	i = vips_metrics_bucket(usec);
+
+	g_atomic_pointer_add(&vips_metrics_queue_buckets[i], 1);
+	g_atomic_pointer_add(&vips_metrics_queue_sum, usec);
+}
+
+/* Copy the queue wait histogram out. Buckets can be a few units ahead of
+ * each other, but the count always matches them.
+ */
+static void
+vips_metrics_queue_snapshot(VipsMetricsHistogram *histogram)
+{
+	int i;
+
+	histogram->count = 0;
+	for (i = 0; i < VIPS_METRICS_N_BUCKETS; i++) {
+		histogram->buckets[i] = (gsize)
+			g_atomic_pointer_get(&vips_metrics_queue_buckets[i]);
+		histogram->count += histogram->buckets[i];
+	}
+	histogram->sum = (gsize) g_atomic_pointer_get(&vips_metrics_queue_sum);
+}
+
+static int
+vips_metrics_compare(const void *a, const void *b)
+{
+	const VipsMetricsOperation *p = (const VipsMetricsOperation *) a;
+	const VipsMetricsOperation *q = (const VipsMetricsOperation *) b;
+
+	return strcmp(p->nickname, q->nickname);
+}
+
+/* Take a sorted copy of all the entries, so we can write them out without
+ * holding any locks. The nicknames are shared with the registry.
+ */
+static VipsMetricsOperation *
+vips_metrics_snapshot(int *n)
+{
+	VipsMetricsOperation *snapshot;
+	GHashTableIter iter;
+	VipsMetricsOperation *entry;
+	int i;
+
+	g_mutex_lock(&vips_metrics_lock);
+
+	*n = g_hash_table_size(vips_metrics_operations);
+	snapshot = g_new0(VipsMetricsOperation, VIPS_MAX(1, *n));
+
+	i = 0;
+	g_hash_table_iter_init(&iter, vips_metrics_operations);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+		VipsMetricsOperation *copy = &snapshot[i++];
+
+		g_mutex_lock(&entry->lock);
+		copy->nickname = entry->nickname;
+		copy->builds = entry->builds;
+		copy->hits = entry->hits;
+		copy->misses = entry->misses;
+		copy->pixels = entry->pixels;
+		copy->generate = entry->generate;
+		g_mutex_unlock(&entry->lock);
+	}
+
+	g_mutex_unlock(&vips_metrics_lock);
+
+	qsort(snapshot, *n, sizeof(VipsMetricsOperation), vips_metrics_compare);
+
+	return snapshot;
+}
+
+static int
+vips_metrics_header(VipsTarget *target,
+	const char *name, const char *type, const char *help)
+{
+	return vips_target_writef(target, "# HELP %s %s\n# TYPE %s %s\n",
+		name, help, name, type);
+}
+
+static int
+vips_metrics_gauge(VipsTarget *target,
+	const char *name, const char *help, gint64 value)
+{
+	if (vips_metrics_header(target, name, "gauge", help) ||
+		vips_target_writef(target,
+			"%s %" G_GINT64_FORMAT "\n", name, value))
+		return -1;
+
+	return 0;
+}
+
+/* Counters which have the operation nickname as a label.
+ */
+static int
+vips_metrics_counter(VipsTarget *target,
+	const char *name, const char *help,
+	VipsMetricsOperation *snapshot, int n, size_t offset)
+{
+	int i;
+
+	if (vips_metrics_header(target, name, "counter", help))
+		return -1;
+
+	for (i = 0; i < n; i++)
+		if (vips_target_writef(target,
+				"%s{operation=\"%s\"} %" G_GINT64_FORMAT "\n",
+				name, snapshot[i].nickname,
+				G_STRUCT_MEMBER(gint64, &snapshot[i], offset)))
+			return -1;
+
+	return 0;
+}
+
+/* Prometheus wants "." as the decimal point, whatever the locale.
+ */
+static const char *
+vips_metrics_seconds(char *buf, gint64 usec)
+{
+	return g_ascii_formatd(buf, G_ASCII_DTOSTR_BUF_SIZE, "%g", usec / 1e6);
+}
+
+/* Write one histogram. @labels is something like `operation="add"`, or "".
+ */
+static int
+vips_metrics_histogram(VipsTarget *target, const char *name,
+	const char *labels, VipsMetricsHistogram *histogram)
+{
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+	gint64 cumulative;
+	int i;
+
+	cumulative = 0;
+	for (i = 0; i < VIPS_METRICS_N_BUCKETS; i++) {
+		cumulative += histogram->buckets[i];
+
+		if (vips_target_writef(target,
+				"%s_bucket{%s%sle=\"%s\"} %" G_GINT64_FORMAT "\n",
+				name, labels, labels[0] ? "," : "",
+				i < VIPS_NUMBER(vips_metrics_bounds)
+					? vips_metrics_seconds(buf, vips_metrics_bounds[i])
+					: "+Inf",
+				cumulative))
+			return -1;
+	}
+
+	if (vips_target_writef(target, "%s_sum%s%s%s %s\n",
+			name,
+			labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+			vips_metrics_seconds(buf, histogram->sum)) ||
+		vips_target_writef(target, "%s_count%s%s%s %" G_GINT64_FORMAT "\n",
+			name,
+			labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+			histogram->count))
+		return -1;
+
+	return 0;
+}
+
+static int
+vips_metrics_write_operations(VipsTarget *target,
+	VipsMetricsOperation *snapshot, int n)
+{
+	int i;
+
+	if (vips_metrics_counter(target, "vips_operation_builds_total",
+			"Operations built.",
+			snapshot, n,
+			G_STRUCT_OFFSET(VipsMetricsOperation, builds)) ||
+		vips_metrics_counter(target, "vips_operation_cache_hits_total",
+			"Operations found in the operation cache.",
+			snapshot, n,
+			G_STRUCT_OFFSET(VipsMetricsOperation, hits)) ||
+		vips_metrics_counter(target, "vips_operation_cache_misses_total",
+			"Operations not found in the operation cache.",
+			snapshot, n,
+			G_STRUCT_OFFSET(VipsMetricsOperation, misses)) ||
+		vips_metrics_counter(target, "vips_operation_pixels_total",
+			"Pixels generated.",
+			snapshot, n,
+			G_STRUCT_OFFSET(VipsMetricsOperation, pixels)))
+		return -1;
+
+	if (vips_metrics_header(target, "vips_operation_generate_seconds",
+			"histogram",
+			"Time per generate call, not including time spent "
+			"computing inputs."))
+		return -1;
+	for (i = 0; i < n; i++) {
+		char labels[256];
+
+		g_snprintf(labels, 256, "operation=\"%s\"", snapshot[i].nickname);
+		if (vips_metrics_histogram(target,
+				"vips_operation_generate_seconds", labels,
+				&snapshot[i].generate))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * vips_metrics_write:
+ * @target: write metrics here
+ *
+ * Write all the metrics libvips has collected to @target, in Prometheus
+ * text format. Write this from an HTTP handler to let Prometheus scrape a
+ * service built on libvips.
+ *
+ * These are always collected, and the overhead is small. For each operation
+ * nickname there are counters for builds, operation cache hits and misses,
+ * and pixels generated, and a histogram of time per generate call. This
+ * time does not include time spent computing inputs, so it shows which
+ * operations are expensive.
+ *
+ * There's also a histogram of the time threadpool workers spend waiting
+ * for work, and gauges for tracked memory and its high-water mark, idle
+ * pixel buffers kept for reuse, tracked allocations and open files, the
+ * size of the operation cache, and threadpool memory reserved.
+ *
+ * Counters start at zero when libvips starts, or when
+ * [func@metrics_reset] is called.
+ *
+ * ::: seealso
+ *     [func@metrics_reset], [func@tracked_get_mem_highwater],
+ *     [func@cache_print].
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_metrics_write(VipsTarget *target)
+{
+	VipsMetricsOperation *snapshot;
+	VipsMetricsHistogram queue_wait;
+	size_t idle;
+	int n;
+	int result;
+
+	snapshot = vips_metrics_snapshot(&n);
+	idle = VIPS_MIN(vips__buffer_pool_get_idle(), vips_tracked_get_mem());
+
+	vips_metrics_queue_snapshot(&queue_wait);
+
+	result = vips_metrics_write_operations(target, snapshot, n) ||
+		vips_metrics_header(target, "vips_threadpool_queue_wait_seconds",
+			"histogram",
+			"Time threadpool workers wait for their next work unit.") ||
+		vips_metrics_histogram(target,
+			"vips_threadpool_queue_wait_seconds", "", &queue_wait) ||
+		vips_metrics_gauge(target, "vips_tracked_memory_bytes",
+			"Memory allocated by libvips, less idle pixel buffers.",
+			vips_tracked_get_mem() - (gint64) idle) ||
+		vips_metrics_gauge(target, "vips_buffer_pool_bytes",
+			"Idle pixel buffers kept for reuse.",
+			idle) ||
+		vips_metrics_gauge(target, "vips_tracked_memory_highwater_bytes",
+			"Most memory allocated by libvips at any one time.",
+			vips_tracked_get_mem_highwater()) ||
+		vips_metrics_gauge(target, "vips_tracked_allocations",
+			"Memory areas allocated by libvips.",
+			vips_tracked_get_allocs()) ||
+		vips_metrics_gauge(target, "vips_tracked_files",
+			"Files open in libvips.",
+			vips_tracked_get_files()) ||
+		vips_metrics_gauge(target, "vips_cache_operations",
+			"Operations in the operation cache.",
+			vips_cache_get_size()) ||
+		vips_metrics_gauge(target, "vips_threadpool_reserved_memory_bytes",
+			"Memory reserved by running threadpools.",
+			vips_threadpool_get_reserved_mem());
+
+	g_free(snapshot);
+
+	return result ? -1 : 0;
+}
+
+/**
+ * vips_metrics_reset:
+ *
+ * Set all counters and histograms back to zero. Gauges, such as tracked
+ * memory, are not changed.
+ *
+ * ::: seealso
+ *     [func@metrics_write].
+ */
+void
+vips_metrics_reset(void)
+{
+	GHashTableIter iter;
+	VipsMetricsOperation *entry;
+	int i;
+
+	g_mutex_lock(&vips_metrics_lock);
+
+	g_hash_table_iter_init(&iter, vips_metrics_operations);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+		g_mutex_lock(&entry->lock);
+		entry->builds = 0;
+		entry->hits = 0;
+		entry->misses = 0;
+		entry->pixels = 0;
+		memset(&entry->generate, 0, sizeof(VipsMetricsHistogram));
+		g_mutex_unlock(&entry->lock);
+	}
+
+	g_mutex_unlock(&vips_metrics_lock);
+
+	for (i = 0; i < VIPS_METRICS_N_BUCKETS; i++)
+		g_atomic_pointer_set(&vips_metrics_queue_buckets[i], 0);
+	g_atomic_pointer_set(&vips_metrics_queue_sum, 0);
+}
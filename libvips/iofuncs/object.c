@@ -352,26 +352,19 @@ vips_object_check_required(VipsObject *object, GParamSpec *pspec,
 	return NULL;
 }
 
+/* The second half of vips_object_build(): check args, mark as constructed,
+ * and run postbuild. The operation cache uses this to finish an operation
+ * whose outputs it has set itself.
+ */
 int
-vips_object_build(VipsObject *object)
+vips__object_build_finish(VipsObject *object)
 {
-	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(object);
-
 	/* Input and output args must both be set.
 	 */
 	VipsArgumentFlags iomask = VIPS_ARGUMENT_INPUT | VIPS_ARGUMENT_OUTPUT;
 
 	int result;
 
-#ifdef DEBUG
-	printf("vips_object_build: ");
-	vips_object_print_name(object);
-	printf("\n");
-#endif /*DEBUG*/
-
-	if (class->build(object))
-		return -1;
-
 	/* Check all required arguments have been supplied, don't stop on 1st
 	 * error.
 	 */
@@ -391,6 +384,23 @@ vips_object_build(VipsObject *object)
 	return result;
 }
 
+int
+vips_object_build(VipsObject *object)
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(object);
+
+#ifdef DEBUG
+	printf("vips_object_build: ");
+	vips_object_print_name(object);
+	printf("\n");
+#endif /*DEBUG*/
+
+	if (class->build(object))
+		return -1;
+
+	return vips__object_build_finish(object);
+}
+
 /**
  * vips_object_summary_class: (skip)
  * @klass: class to summarise
@@ -2,6 +2,10 @@
  *
  * 30/12/14
  * 	- display default/min/max for pspec in usage
+ * 19/10/26
+ * 	- add vips_operation_set_cancellable()
+ * 	- count builds for vips_metrics_write() in postbuild, once outputs
+ * 	  are set
  */
 
 /*
@@ -607,6 +611,21 @@ vips_operation_build(VipsObject *object)
 	return 0;
 }
 
+/* Subclasses set their outputs after chaining up to build, so we can only
+ * tag them once the whole build has finished.
+ */
+static int
+vips_operation_postbuild(VipsObject *object, void *data)
+{
+	if (VIPS_OBJECT_CLASS(vips_operation_parent_class)
+			->postbuild(object, data))
+		return -1;
+
+	vips__metrics_build(VIPS_OPERATION(object));
+
+	return 0;
+}
+
 static void
 vips_operation_summary_class(VipsObjectClass *object_class, VipsBuf *buf)
 {
@@ -654,6 +673,7 @@ vips_operation_class_init(VipsOperationClass *class)
 	gobject_class->dispose = vips_operation_dispose;
 
 	vobject_class->build = vips_operation_build;
+	vobject_class->postbuild = vips_operation_postbuild;
 	vobject_class->summary_class = vips_operation_summary_class;
 	vobject_class->summary = vips_operation_summary;
 	vobject_class->dump = vips_operation_dump;
@@ -693,6 +713,48 @@ vips_operation_get_flags(VipsOperation *operation)
 	return class->get_flags(operation);
 }
 
+/**
+ * vips_operation_set_cancellable:
+ * @operation: operation to attach to
+ * @cancellable: (nullable): cancellable for this operation, or `NULL`
+ *
+ * Build @operation with @cancellable as the current cancellable, so any
+ * work it does while building, including whole saves, stops early if
+ * @cancellable is cancelled. @operation holds a ref to @cancellable.
+ *
+ * This only covers work done during build. Pixels computed later from the
+ * output of a lazy operation are checked against the current cancellable
+ * of the thread that computes them.
+ *
+ * ::: seealso
+ *     [func@cancellable_set_current], [func@cache_operation_buildp].
+ */
+void
+vips_operation_set_cancellable(VipsOperation *operation,
+	VipsCancellable *cancellable)
+{
+	if (cancellable)
+		g_object_ref(cancellable);
+	g_object_set_data_full(G_OBJECT(operation), "libvips-cancellable",
+		cancellable, (GDestroyNotify) g_object_unref);
+}
+
+/**
+ * vips_operation_get_cancellable:
+ * @operation: operation to get from
+ *
+ * ::: seealso
+ *     [method@Operation.set_cancellable].
+ *
+ * Returns: (transfer none) (nullable): the cancellable for @operation
+ */
+VipsCancellable *
+vips_operation_get_cancellable(VipsOperation *operation)
+{
+	return (VipsCancellable *) g_object_get_data(G_OBJECT(operation),
+		"libvips-cancellable");
+}
+
 /**
  * vips_operation_class_print_usage: (skip)
  * @operation_class: class to print usage for
@@ -6,6 +6,8 @@
  * 17/3/11
  * 	- move to vips_ prefix
  * 	- gtk-doc comments
+ * 19/10/26
+ * 	- add VipsRectIndex
  */
 
 /*
@@ -41,6 +43,8 @@
 #include <glib/gi18n-lib.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include <vips/vips.h>
 
@@ -252,3 +256,303 @@ vips_rect_normalise(VipsRect *r)
 		r->height *= -1;
 	}
 }
+
+/* Rects which touch more than this many grid cells go on a separate list,
+ * so one huge rect can't fill every cell.
+ */
+#define VIPS_RECT_INDEX_LARGE (64)
+
+/* A uniform grid over the bounding box of the rects. Each cell has the
+ * indexes of the rects which touch it, in increasing order.
+ */
+struct _VipsRectIndex {
+	VipsRect *rects;
+	int n;
+
+	VipsRect bounds;
+	int cell_width;
+	int cell_height;
+	int across;
+	int down;
+
+	/* The rects touching cell c are item[start[c]] .. item[start[c + 1] - 1].
+	 */
+	int *start;
+	int *item;
+
+	/* Rects which touch too many cells.
+	 */
+	int *large;
+	int n_large;
+};
+
+/* The range of cells rect i touches. FALSE for empty rects.
+ */
+static gboolean
+vips_rect_index_cells(const VipsRectIndex *index, const VipsRect *r,
+	int *x0, int *y0, int *x1, int *y1)
+{
+	VipsRect clip;
+
+	vips_rect_intersectrect(r, &index->bounds, &clip);
+	if (vips_rect_isempty(&clip))
+		return FALSE;
+
+	*x0 = (clip.left - index->bounds.left) / index->cell_width;
+	*y0 = (clip.top - index->bounds.top) / index->cell_height;
+	*x1 = (VIPS_RECT_RIGHT(&clip) - 1 - index->bounds.left) /
+		index->cell_width;
+	*y1 = (VIPS_RECT_BOTTOM(&clip) - 1 - index->bounds.top) /
+		index->cell_height;
+
+	return TRUE;
+}
+
+/**
+ * VipsRectIndex:
+ *
+ * An index over a set of [struct@Rect] for quickly finding the rects which
+ * overlap an area.
+ */
+
+/**
+ * vips_rect_index_new: (skip)
+ * @rects: (array length=n): rects to index
+ * @n: number of rects
+ *
+ * Build an index over @rects. The rects are copied, so you can free @rects
+ * once this returns. Empty rects are never found.
+ *
+ * Use [func@Rect.index_query] to find the rects which overlap an area, and
+ * free the index with [func@Rect.index_free].
+ *
+ * ::: seealso
+ *     [func@Rect.index_query].
+ *
+ * Returns: the new index, or `NULL` on error.
+ */
+VipsRectIndex *
+vips_rect_index_new(const VipsRect *rects, int n)
+{
+	VipsRectIndex *index;
+	double total_width;
+	double total_height;
+	int n_nonempty;
+	int n_cells;
+	int *fill;
+	int i, x, y;
+
+	if (!(index = VIPS_NEW(NULL, VipsRectIndex)))
+		return NULL;
+	index->n = n;
+	index->start = NULL;
+	index->item = NULL;
+	index->large = NULL;
+	index->n_large = 0;
+	if (!(index->rects = VIPS_ARRAY(NULL, VIPS_MAX(1, n), VipsRect))) {
+		vips_rect_index_free(index);
+		return NULL;
+	}
+
+	index->bounds.left = 0;
+	index->bounds.top = 0;
+	index->bounds.width = 0;
+	index->bounds.height = 0;
+	total_width = 0.0;
+	total_height = 0.0;
+	n_nonempty = 0;
+	for (i = 0; i < n; i++) {
+		index->rects[i] = rects[i];
+		if (!vips_rect_isempty(&rects[i])) {
+			vips_rect_unionrect(&index->bounds, &rects[i],
+				&index->bounds);
+			total_width += rects[i].width;
+			total_height += rects[i].height;
+			n_nonempty += 1;
+		}
+	}
+
+	/* Size cells to the average rect, but have no more than a few cells
+	 * per rect.
+	 */
+	index->across = 1;
+	index->down = 1;
+	if (n_nonempty > 0) {
+		double limit = 4.0 * n_nonempty + 16;
+		double across = index->bounds.width /
+			(total_width / n_nonempty);
+		double down = index->bounds.height /
+			(total_height / n_nonempty);
+
+		if (across * down > limit) {
+			double scale = sqrt(limit / (across * down));
+
+			across *= scale;
+			down *= scale;
+		}
+
+		index->across = VIPS_CLIP(1, (int) across, index->bounds.width);
+		index->down = VIPS_CLIP(1, (int) down, index->bounds.height);
+	}
+	index->cell_width = VIPS_MAX(1,
+		VIPS_ROUND_UP(index->bounds.width, index->across) /
+			index->across);
+	index->cell_height = VIPS_MAX(1,
+		VIPS_ROUND_UP(index->bounds.height, index->down) /
+			index->down);
+	index->across = VIPS_MAX(1,
+		VIPS_ROUND_UP(index->bounds.width, index->cell_width) /
+			index->cell_width);
+	index->down = VIPS_MAX(1,
+		VIPS_ROUND_UP(index->bounds.height, index->cell_height) /
+			index->cell_height);
+	n_cells = index->across * index->down;
+
+	if (!(index->start = VIPS_ARRAY(NULL, n_cells + 1, int)) ||
+		!(fill = VIPS_ARRAY(NULL, n_cells, int))) {
+		vips_rect_index_free(index);
+		return NULL;
+	}
+
+	/* Count, then fill in increasing rect order.
+	 */
+	for (i = 0; i < n_cells + 1; i++)
+		index->start[i] = 0;
+	for (i = 0; i < n; i++) {
+		int x0, y0, x1, y1;
+
+		if (!vips_rect_index_cells(index, &rects[i], &x0, &y0, &x1, &y1))
+			continue;
+
+		if ((x1 - x0 + 1) * (y1 - y0 + 1) > VIPS_RECT_INDEX_LARGE)
+			index->n_large += 1;
+		else
+			for (y = y0; y <= y1; y++)
+				for (x = x0; x <= x1; x++)
+					index->start[y * index->across + x + 1] += 1;
+	}
+
+	for (i = 0; i < n_cells; i++) {
+		index->start[i + 1] += index->start[i];
+		fill[i] = index->start[i];
+	}
+
+	if (!(index->item =
+				VIPS_ARRAY(NULL, VIPS_MAX(1, index->start[n_cells]), int)) ||
+		!(index->large =
+				VIPS_ARRAY(NULL, VIPS_MAX(1, index->n_large), int))) {
+		g_free(fill);
+		vips_rect_index_free(index);
+		return NULL;
+	}
+
+	index->n_large = 0;
+	for (i = 0; i < n; i++) {
+		int x0, y0, x1, y1;
+
+		if (!vips_rect_index_cells(index, &rects[i], &x0, &y0, &x1, &y1))
+			continue;
+
+		if ((x1 - x0 + 1) * (y1 - y0 + 1) > VIPS_RECT_INDEX_LARGE)
+			index->large[index->n_large++] = i;
+		else
+			for (y = y0; y <= y1; y++)
+				for (x = x0; x <= x1; x++)
+					index->item[fill[y * index->across + x]++] = i;
+	}
+
+	g_free(fill);
+
+	return index;
+}
+
+/**
+ * vips_rect_index_free: (skip)
+ * @index: index to free
+ *
+ * Free an index made by [func@Rect.index_new].
+ */
+void
+vips_rect_index_free(VipsRectIndex *index)
+{
+	if (index) {
+		VIPS_FREE(index->rects);
+		VIPS_FREE(index->start);
+		VIPS_FREE(index->item);
+		VIPS_FREE(index->large);
+		g_free(index);
+	}
+}
+
+static int
+vips_rect_index_compare(const void *a, const void *b)
+{
+	return *((int *) a) - *((int *) b);
+}
+
+/**
+ * vips_rect_index_query: (skip)
+ * @index: index to search
+ * @r: area to search for
+ * @hits: (out caller-allocates): indexes of the overlapping rects
+ *
+ * Find the rects in @index which overlap @r. Their indexes are written to
+ * @hits in increasing order, so you can use them for stacking order.
+ * @hits must have room for every rect in the index.
+ *
+ * This is safe to call from many threads at once.
+ *
+ * Returns: the number of rects which overlap @r.
+ */
+int
+vips_rect_index_query(const VipsRectIndex *index, const VipsRect *r,
+	int *hits)
+{
+	int x0, y0, x1, y1;
+	int n_hits;
+	gboolean sorted;
+	int i, x, y;
+
+	if (!vips_rect_index_cells(index, r, &x0, &y0, &x1, &y1))
+		return 0;
+
+	n_hits = 0;
+	for (y = y0; y <= y1; y++)
+		for (x = x0; x <= x1; x++) {
+			int cell = y * index->across + x;
+
+			for (i = index->start[cell];
+				 i < index->start[cell + 1]; i++) {
+				int j = index->item[i];
+				const VipsRect *rect = &index->rects[j];
+				int rx0, ry0, rx1, ry1;
+
+				/* A rect can be in several cells, so only report
+				 * it from the first cell we search.
+				 */
+				vips_rect_index_cells(index, rect,
+					&rx0, &ry0, &rx1, &ry1);
+				if (VIPS_MAX(rx0, x0) == x &&
+					VIPS_MAX(ry0, y0) == y &&
+					vips_rect_overlapsrect(r, rect))
+					hits[n_hits++] = j;
+			}
+		}
+
+	for (i = 0; i < index->n_large; i++)
+		if (vips_rect_overlapsrect(r, &index->rects[index->large[i]]))
+			hits[n_hits++] = index->large[i];
+
+	/* Usually we only search one cell, so the hits are already in order.
+	 */
+	sorted = TRUE;
+	for (i = 1; i < n_hits; i++)
+		if (hits[i - 1] > hits[i]) {
+			sorted = FALSE;
+			break;
+		}
+	if (!sorted)
+		qsort(hits, n_hits, sizeof(int), vips_rect_index_compare);
+
+	return n_hits;
+}
@@ -51,6 +51,8 @@
  * 22/2/21 f1ac
  * 	- fix int overflow in vips_region_copy(), could cause crashes with
  * 	  very wide images
+ * 19/10/26
+ * 	- time generate and count pixels for vips_metrics_write()
  */
 
 /*
@@ -1601,7 +1603,9 @@ vips_region_generate(VipsRegion *reg, void *a)
 {
 	VipsImage *im = reg->im;
 
+	VipsMetricsFrame frame;
 	gboolean stop;
+	int result;
 
 	/* Start new sequence, if necessary.
 	 */
@@ -1611,7 +1615,10 @@ vips_region_generate(VipsRegion *reg, void *a)
 	/* Ask for evaluation.
 	 */
 	stop = FALSE;
-	if (im->generate_fn(reg, reg->seq, im->client1, im->client2, &stop))
+	vips__metrics_generate_start(&frame);
+	result = im->generate_fn(reg, reg->seq, im->client1, im->client2, &stop);
+	vips__metrics_generate_stop(&frame, reg, result);
+	if (result)
 		return -1;
 	if (stop) {
 		vips_error("vips_region_generate", "%s", _("stop requested"));
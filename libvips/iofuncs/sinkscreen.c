@@ -10,6 +10,12 @@
  * 1/12/15
  * 	- don't do anything to out or mask after they have closed
  * 	- only run the bg render thread when there's work to do
+ * 19/10/26
+ * 	- add vips_sink_screen_set_focus(): paint tiles nearest the focus
+ * 	  first, and drop queued tiles which have scrolled away
+ * 	- add vips_sink_screen_set_workers(): run several renders at once
+ * 	- make the reschedule flag per render, since several bg threads can
+ * 	  now reset it
  */
 
 /*
@@ -94,6 +100,11 @@ typedef struct {
 	 */
 	gboolean dirty;
 
+	/* The tile was taken off the dirty list by a focus change before it
+	 * was painted. It must be queued again if it's asked for.
+	 */
+	gboolean cancelled;
+
 	/* Time of last use, for LRU flush
 	 */
 	int ticks;
@@ -147,6 +158,10 @@ typedef struct _Render {
 	 */
 	GSList *dirty;
 
+	/* If not empty, dirty tiles nearest this area are painted first.
+	 */
+	VipsRect focus;
+
 	/* Hash of tiles with positions. Tiles can be dirty or painted.
 	 */
 	GHashTable *tiles;
@@ -155,6 +170,11 @@ typedef struct _Render {
 	 * anything to them until we shut down too.
 	 */
 	gboolean shutdown;
+
+	/* Set this to make the bg thread working on this render stop and
+	 * reschedule. Protected by lock.
+	 */
+	gboolean reschedule;
 } Render;
 
 /* Our per-thread state.
@@ -174,10 +194,12 @@ typedef struct _RenderThreadStateClass {
 
 G_DEFINE_TYPE(RenderThreadState, render_thread_state, VIPS_TYPE_THREAD_STATE);
 
-/* The BG thread which sits waiting to do some calculations, and the semaphore
- * it waits on holding the number of renders with dirty tiles.
+/* The BG threads which sit waiting to do some calculations, and the
+ * semaphore they wait on holding the number of renders with dirty tiles.
+ * Each thread runs one render at a time.
  */
-static GThread *render_thread = NULL;
+static GSList *render_threads = NULL;
+static int render_n_workers = 1;
 
 /* Set this to ask the render thread to quit.
  */
@@ -190,10 +212,6 @@ static GMutex render_dirty_lock;
 static GSList *render_dirty_all = NULL;
 static VipsSemaphore n_render_dirty_sem;
 
-/* Set this to make the bg thread stop and reschedule.
- */
-static gboolean render_reschedule = FALSE;
-
 /* Set this GPrivate to link a thread back to its Render struct.
  */
 static GPrivate render_worker_key;
@@ -327,6 +345,23 @@ render_unref(Render *render)
 	return 0;
 }
 
+/* Squared distance from the centre of a tile to the focus area, zero if the
+ * centre is inside it.
+ */
+static gint64
+tile_focus_distance(Tile *tile)
+{
+	VipsRect *focus = &tile->render->focus;
+	int cx = tile->area.left + tile->area.width / 2;
+	int cy = tile->area.top + tile->area.height / 2;
+	gint64 dx = VIPS_MAX(0,
+		VIPS_MAX(focus->left - cx, cx - VIPS_RECT_RIGHT(focus)));
+	gint64 dy = VIPS_MAX(0,
+		VIPS_MAX(focus->top - cy, cy - VIPS_RECT_BOTTOM(focus)));
+
+	return dx * dx + dy * dy;
+}
+
 /* Get the next tile to paint off the dirty list.
  */
 static Tile *
@@ -338,6 +373,25 @@ render_tile_dirty_get(Render *render)
 		tile = NULL;
 	else {
 		tile = (Tile *) render->dirty->data;
+
+		/* With a focus, take the nearest tile. The list is most recent
+		 * first, so ties go to the newest request.
+		 */
+		if (!vips_rect_isempty(&render->focus)) {
+			gint64 best = tile_focus_distance(tile);
+			GSList *p;
+
+			for (p = render->dirty->next; p && best > 0; p = p->next) {
+				Tile *this = (Tile *) p->data;
+				gint64 distance = tile_focus_distance(this);
+
+				if (distance < best) {
+					best = distance;
+					tile = this;
+				}
+			}
+		}
+
 		g_assert(tile->dirty);
 		render->dirty = g_slist_remove(render->dirty, tile);
 		tile->dirty = FALSE;
@@ -413,7 +467,9 @@ render_allocate(VipsThreadState *state, void *a, gboolean *stop)
 
 	g_mutex_lock(&render->lock);
 
-	if (render_reschedule ||
+	if (g_atomic_int_get(&render_kill) ||
+		render->reschedule ||
+		render->shutdown ||
 		!(tile = render_tile_dirty_get(render))) {
 		VIPS_DEBUG_MSG_GREEN("render_allocate: stopping\n");
 		*stop = TRUE;
@@ -471,20 +527,23 @@ vips__render_shutdown(void)
 {
 	/* We may come here without having inited.
 	 */
-	if (render_thread) {
-		g_mutex_lock(&render_dirty_lock);
+	if (render_threads) {
+		GSList *threads;
+		GSList *p;
 
-		GThread *thread;
+		g_mutex_lock(&render_dirty_lock);
 
-		thread = render_thread;
-		render_reschedule = TRUE;
-		render_kill = TRUE;
+		threads = render_threads;
+		render_threads = NULL;
+		g_atomic_int_set(&render_kill, TRUE);
 
 		g_mutex_unlock(&render_dirty_lock);
 
-		vips_semaphore_up(&n_render_dirty_sem);
+		vips_semaphore_upn(&n_render_dirty_sem, g_slist_length(threads));
 
-		(void) g_thread_join(thread);
+		for (p = threads; p; p = p->next)
+			(void) g_thread_join((GThread *) p->data);
+		g_slist_free(threads);
 
 		vips_semaphore_destroy(&n_render_dirty_sem);
 	}
@@ -558,6 +617,9 @@ render_close_cb(VipsImage *image, Render *render)
 	 */
 	render->shutdown = TRUE;
 
+	if (image == render->out)
+		g_object_set_data(G_OBJECT(image), "libvips-render", NULL);
+
 	if (render->private_threadpool) {
 		/* Nudge the bg thread (if any) for this pool.
 		 */
@@ -569,7 +631,9 @@ render_close_cb(VipsImage *image, Render *render)
 		 * make it drop it's ref and think again.
 		 */
 		VIPS_DEBUG_MSG_GREEN("render_close_cb: reschedule\n");
-		render_reschedule = TRUE;
+		g_mutex_lock(&render->lock);
+		render->reschedule = TRUE;
+		g_mutex_unlock(&render->lock);
 	}
 
 	render_unref(render);
@@ -626,7 +690,13 @@ render_new(VipsImage *in, VipsImage *out, VipsImage *mask,
 
 	render->dirty = NULL;
 
+	render->focus.left = 0;
+	render->focus.top = 0;
+	render->focus.width = 0;
+	render->focus.height = 0;
+
 	render->shutdown = FALSE;
+	render->reschedule = FALSE;
 
 	/* Both out and mask must close before we can free the render.
 	 */
@@ -670,6 +740,7 @@ tile_new(Render *render)
 	tile->region = NULL;
 	tile->painted = FALSE;
 	tile->dirty = FALSE;
+	tile->cancelled = FALSE;
 	tile->ticks = render->ticks;
 
 	if (!(tile->region = vips_region_new(render->in))) {
@@ -756,6 +827,7 @@ tile_queue(Tile *tile, VipsRegion *reg)
 		tile, tile->area.left, tile->area.top);
 
 	tile->painted = FALSE;
+	tile->cancelled = FALSE;
 	tile_touch(tile);
 
 	if (render->notify) {
@@ -793,12 +865,13 @@ tile_queue(Tile *tile, VipsRegion *reg)
 static void
 tile_test_clean_ticks(VipsRect *key, Tile *value, Tile **best)
 {
-	if (value->painted)
+	if (value->painted ||
+		value->cancelled)
 		if (!*best || value->ticks < (*best)->ticks)
 			*best = value;
 }
 
-/* Pick a painted tile to reuse. Search for LRU (slow!).
+/* Pick a painted or cancelled tile to reuse. Search for LRU (slow!).
  */
 static Tile *
 render_tile_get_painted(Render *render)
@@ -827,9 +900,10 @@ render_tile_request(Render *render, VipsRegion *reg, VipsRect *area)
 
 	if ((tile = render_tile_lookup(render, area))) {
 		/* We already have a tile at this position. If it's invalid,
-		 * ask for a repaint.
+		 * or was cancelled before it was painted, ask for a repaint.
 		 */
-		if (tile->region->invalid)
+		if (tile->region->invalid ||
+			tile->cancelled)
 			tile_queue(tile, reg);
 		else
 			tile_touch(tile);
@@ -1042,12 +1116,14 @@ render_thread_main(void *client)
 {
 	Render *render;
 
-	while (!render_kill) {
+	while (!g_atomic_int_get(&render_kill)) {
 		VIPS_DEBUG_MSG_GREEN("render_thread_main: threadpool start\n");
 
-		render_reschedule = FALSE;
-
 		if ((render = render_dirty_get())) {
+			g_mutex_lock(&render->lock);
+			render->reschedule = FALSE;
+			g_mutex_unlock(&render->lock);
+
 			if (vips_threadpool_run(render->in,
 					render_thread_state_new,
 					render_allocate,
@@ -1071,10 +1147,6 @@ render_thread_main(void *client)
 		}
 	}
 
-	/* We are exiting, so render_thread must now be NULL.
-	 */
-	render_thread = NULL;
-
 	return NULL;
 }
 
@@ -1137,17 +1209,36 @@ render_work_private(void *data, void *null)
 	VIPS_DEBUG_MSG_AMBER("render_work_private: stop\n");
 }
 
+/* Start bg threads until we have render_n_workers. Call with
+ * render_dirty_lock held.
+ */
+static void
+render_threads_start(void)
+{
+	/* Don't use vips_thread_execute(), since these threads will only be
+	 * ended by vips_shutdown, and that isn't always called.
+	 */
+	while (g_slist_length(render_threads) < render_n_workers) {
+		GThread *thread;
+
+		if (!(thread = vips_g_thread_new("sink_screen",
+				  render_thread_main, NULL)))
+			break;
+
+		render_threads = g_slist_prepend(render_threads, thread);
+	}
+}
+
 static void *
 vips__sink_screen_once(void *data)
 {
-	g_assert(!render_thread);
+	g_assert(!render_threads);
 
 	vips_semaphore_init(&n_render_dirty_sem, 0, "n_render_dirty");
 
-	/* Don't use vips_thread_execute(), since this thread will only be
-	 * ended by vips_shutdown, and that isn't always called.
-	 */
-	render_thread = vips_g_thread_new("sink_screen", render_thread_main, NULL);
+	g_mutex_lock(&render_dirty_lock);
+	render_threads_start();
+	g_mutex_unlock(&render_dirty_lock);
 
 	return NULL;
 }
@@ -1246,6 +1337,10 @@ vips_sink_screen(VipsImage *in, VipsImage *out, VipsImage *mask,
 		vips_thread_execute("private threadpool", render_work_private, render);
 	}
 
+	/* So vips_sink_screen_set_focus() can find us.
+	 */
+	g_object_set_data(G_OBJECT(out), "libvips-render", render);
+
 	if (vips_image_generate(out,
 			vips_start_one, image_fill, vips_stop_one, in, render))
 		return -1;
@@ -1256,6 +1351,106 @@ vips_sink_screen(VipsImage *in, VipsImage *out, VipsImage *mask,
 	return 0;
 }
 
+/**
+ * vips_sink_screen_set_focus:
+ * @out: output image from [method@Image.sink_screen]
+ * @focus: the area the user is looking at
+ *
+ * Tell a background render which part of the image is most important,
+ * usually the viewport.
+ *
+ * Queued tiles are painted in order of distance from @focus, nearest first.
+ * Queued tiles which are more than a tile away from @focus are dropped: if
+ * they are asked for again, they are queued again.
+ *
+ * Call this as the view scrolls, before asking for the new pixels. Set an
+ * empty @focus to go back to painting the most recently requested tile
+ * first.
+ *
+ * ::: seealso
+ *     [method@Image.sink_screen].
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_sink_screen_set_focus(VipsImage *out, VipsRect *focus)
+{
+	Render *render;
+
+	if (!(render = (Render *)
+				g_object_get_data(G_OBJECT(out), "libvips-render"))) {
+		vips_error("vips_sink_screen_set_focus",
+			"%s", _("not a sink_screen image"));
+		return -1;
+	}
+
+	g_mutex_lock(&render->lock);
+
+	render->focus = *focus;
+
+	if (!vips_rect_isempty(focus)) {
+		VipsRect near;
+		GSList *p;
+		GSList *next;
+
+		near.left = focus->left - render->tile_width;
+		near.top = focus->top - render->tile_height;
+		near.width = focus->width + 2 * render->tile_width;
+		near.height = focus->height + 2 * render->tile_height;
+
+		for (p = render->dirty; p; p = next) {
+			Tile *tile = (Tile *) p->data;
+
+			next = p->next;
+
+			if (!vips_rect_overlapsrect(&tile->area, &near)) {
+				VIPS_DEBUG_MSG("vips_sink_screen_set_focus: "
+							   "cancelling %p %dx%d\n",
+					tile, tile->area.left, tile->area.top);
+
+				render->dirty = g_slist_delete_link(render->dirty, p);
+				tile->dirty = FALSE;
+				tile->cancelled = TRUE;
+			}
+		}
+	}
+
+	g_mutex_unlock(&render->lock);
+
+	return 0;
+}
+
+/**
+ * vips_sink_screen_set_workers:
+ * @n_workers: number of background renders to run at once
+ *
+ * Background renders with a positive priority are run by a set of
+ * background threads, each running one render at a time. By default there
+ * is one, so only the highest priority render is computed. Set more to
+ * compute several renders at once, for example to serve several views.
+ *
+ * Each render still uses a threadpool of [func@concurrency_get] threads.
+ * Threads which have started are not stopped if @n_workers goes down.
+ *
+ * ::: seealso
+ *     [method@Image.sink_screen].
+ */
+void
+vips_sink_screen_set_workers(int n_workers)
+{
+	g_mutex_lock(&render_dirty_lock);
+
+	render_n_workers = VIPS_MAX(1, n_workers);
+
+	/* Start any extra threads now if we've already started.
+	 */
+	if (render_threads &&
+		!g_atomic_int_get(&render_kill))
+		render_threads_start();
+
+	g_mutex_unlock(&render_dirty_lock);
+}
+
 int
 vips__print_renders(void)
 {
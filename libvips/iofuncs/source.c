@@ -794,7 +794,8 @@ vips_source_read(VipsSource *source, void *buffer, size_t length)
 
 	SANITY(source);
 
-	if (vips_source_unminimise(source) ||
+	if (vips__cancellable_check_current() ||
+		vips_source_unminimise(source) ||
 		vips_source_test_features(source))
 		return -1;
 
@@ -483,6 +483,9 @@ vips_target_write_unbuffered(VipsTarget *target,
 	if (target->ended)
 		return 0;
 
+	if (vips__cancellable_check_current())
+		return -1;
+
 	while (length > 0) {
 		// write() uses int not size_t on windows, so we need to chunk
 		// ... max 1gb, why not
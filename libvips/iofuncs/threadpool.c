@@ -23,6 +23,14 @@
  * 	- don't depend on image width when setting n_lines
  * 27/2/19 jtorresfabra
  * 	- free threadpool earlier
+ * 19/10/26
+ * 	- add a memory budget, see vips_threadpool_set_max_mem()
+ * 	- add shared workers, see vips_threadpool_set_shared_workers()
+ * 	- check the current VipsCancellable
+ * 	- time queue wait for vips_metrics_write()
+ * 	- only hold a shared slot during work, and drop it while waiting for
+ * 	  another thread
+ * 	- hand pooled pixel buffers back while waiting for a shared slot
  */
 
 /*
@@ -106,6 +114,37 @@ static GPrivate worker_key;
  */
 #define MAX_THREADS (1024)
 
+/* How often the main thread checks for cancellation, in microseconds.
+ */
+#define VIPS_THREADPOOL_CANCEL_POLL (100000)
+
+/* The memory budget for running threadpools, or 0 for no limit. Pools
+ * reserve an estimate of their peak use before they start, and wait or run
+ * with fewer workers if that would go over budget.
+ */
+static GMutex vips__budget_lock;
+static GCond vips__budget_cond;
+static size_t vips__budget_max_mem = 0;
+static size_t vips__budget_reserved = 0;
+
+/* Count budget decisions.
+ */
+static int vips__budget_admitted = 0;
+static int vips__budget_waited = 0;
+static int vips__budget_shrunk = 0;
+
+/* With shared workers, a worker must hold one of a fixed number of slots
+ * while it works on a unit, whatever pool it is in. 0 means no sharing.
+ */
+static GMutex vips__shared_lock;
+static GCond vips__shared_cond;
+static int vips__shared_workers = 0;
+static int vips__shared_held = 0;
+
+/* All the pools competing for slots.
+ */
+static GSList *vips__shared_pools = NULL;
+
 /* Start up threadpools. This is called during vips_init.
  */
 void
@@ -121,6 +160,14 @@ vips__threadpool_init(void)
 	if (g_getenv("VIPS_STALL"))
 		vips__stall = TRUE;
 
+	const char *max_mem_env;
+	if ((max_mem_env = g_getenv("VIPS_THREADPOOL_MAX_MEM")))
+		vips_threadpool_set_max_mem(vips__parse_size(max_mem_env));
+
+	const char *shared_workers_env;
+	if ((shared_workers_env = g_getenv("VIPS_SHARED_WORKERS")))
+		vips_threadpool_set_shared_workers(atoi(shared_workers_env));
+
 	/* max_threads > 0 will create a set of threads on startup. This is
 	 * necessary for wasm, but may break on systems that try to fork()
 	 * after init.
@@ -232,6 +279,14 @@ typedef struct _VipsWorker {
 
 	gboolean stop;
 
+	/* When we started waiting for our current work unit.
+	 */
+	gint64 queued;
+
+	/* Set while we hold a shared slot.
+	 */
+	gboolean holding_slot;
+
 } VipsWorker;
 
 /* What we track for a group of threads working together.
@@ -277,6 +332,24 @@ typedef struct _VipsThreadpool {
 	/* Ask threads to exit, either set by allocate, or on free.
 	 */
 	gboolean stop;
+
+	/* The bytes we have reserved from the memory budget.
+	 */
+	size_t reserved;
+
+	/* If we are sharing workers with other pools: our weight, the units
+	 * we've run divided by our weight, and how many of our workers are
+	 * waiting for a slot.
+	 */
+	gboolean shared;
+	int priority;
+	double vtime;
+	int n_slot_waiting;
+
+	/* The current cancellable of the thread which started us, if any.
+	 * Workers make this their current cancellable too.
+	 */
+	VipsCancellable *cancellable;
 } VipsThreadpool;
 
 static int
@@ -296,6 +369,134 @@ vips_worker_allocate(VipsWorker *worker)
 	return 0;
 }
 
+/* Is @pool the waiting pool which has had the least work for its weight?
+ * Call with vips__shared_lock held.
+ */
+static gboolean
+vips_worker_slot_next(VipsThreadpool *pool)
+{
+	GSList *p;
+
+	for (p = vips__shared_pools; p; p = p->next) {
+		VipsThreadpool *other = (VipsThreadpool *) p->data;
+
+		if (other != pool &&
+			other->n_slot_waiting > 0 &&
+			other->vtime < pool->vtime)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Wait for a shared slot. Units are granted in weighted-fair order, so
+ * a pool which has run fewer units for its priority goes first.
+ *
+ * Return FALSE if sharing was turned off while we waited.
+ */
+static gboolean
+vips_worker_slot_acquire(VipsThreadpool *pool)
+{
+	gboolean acquired;
+	gboolean idle;
+
+	VIPS_GATE_START("vips_worker_slot_acquire: wait");
+
+	g_mutex_lock(&vips__shared_lock);
+
+	pool->n_slot_waiting += 1;
+	idle = FALSE;
+	while (vips__shared_workers > 0 &&
+		(vips__shared_held >= vips__shared_workers ||
+			!vips_worker_slot_next(pool))) {
+		/* We could wait a while, so let the workers that are running
+		 * have any pixel buffers we're holding.
+		 */
+		if (!idle) {
+			vips__buffer_idle();
+			idle = TRUE;
+		}
+
+		g_cond_wait(&vips__shared_cond, &vips__shared_lock);
+	}
+	pool->n_slot_waiting -= 1;
+
+	acquired = vips__shared_workers > 0;
+	if (acquired) {
+		vips__shared_held += 1;
+		pool->vtime += 1.0 / pool->priority;
+	}
+
+	/* We might have been blocking a pool behind us.
+	 */
+	g_cond_broadcast(&vips__shared_cond);
+
+	g_mutex_unlock(&vips__shared_lock);
+
+	VIPS_GATE_STOP("vips_worker_slot_acquire: wait");
+
+	return acquired;
+}
+
+static void
+vips_worker_slot_release(void)
+{
+	g_mutex_lock(&vips__shared_lock);
+	vips__shared_held -= 1;
+	g_cond_broadcast(&vips__shared_cond);
+	g_mutex_unlock(&vips__shared_lock);
+}
+
+/* Join the set of pools sharing workers. New pools start level with the
+ * least-served pool, so they can't starve the pools already running.
+ */
+static void
+vips_threadpool_share(VipsThreadpool *pool)
+{
+	GSList *p;
+
+	/* Pools started from inside a worker can't wait for slots, since the
+	 * slot they'd need could be the one their parent worker holds.
+	 */
+	if (g_private_get(&worker_key))
+		return;
+
+	g_mutex_lock(&vips__shared_lock);
+
+	if (vips__shared_workers > 0) {
+		pool->shared = TRUE;
+		pool->priority = vips_image_get_priority(pool->im);
+		pool->max_workers =
+			VIPS_MIN(pool->max_workers, vips__shared_workers);
+
+		pool->vtime = 0.0;
+		for (p = vips__shared_pools; p; p = p->next) {
+			VipsThreadpool *other = (VipsThreadpool *) p->data;
+
+			if (p == vips__shared_pools ||
+				other->vtime < pool->vtime)
+				pool->vtime = other->vtime;
+		}
+
+		vips__shared_pools = g_slist_prepend(vips__shared_pools, pool);
+	}
+
+	g_mutex_unlock(&vips__shared_lock);
+}
+
+static void
+vips_threadpool_unshare(VipsThreadpool *pool)
+{
+	if (!pool->shared)
+		return;
+
+	g_mutex_lock(&vips__shared_lock);
+	vips__shared_pools = g_slist_remove(vips__shared_pools, pool);
+	pool->shared = FALSE;
+	g_cond_broadcast(&vips__shared_cond);
+	g_mutex_unlock(&vips__shared_lock);
+}
+
 /* Run this once per main loop. Get some work (single-threaded), then do it
  * (many-threaded).
  */
@@ -304,12 +505,16 @@ vips_worker_work_unit(VipsWorker *worker)
 {
 	VipsThreadpool *pool = worker->pool;
 
+	worker->queued = g_get_monotonic_time();
+
 	VIPS_GATE_START("vips_worker_work_unit: wait");
 
 	vips__worker_lock(&pool->allocate_lock);
 
 	VIPS_GATE_STOP("vips_worker_work_unit: wait");
 
+	vips__metrics_queue_wait(g_get_monotonic_time() - worker->queued);
+
 	/* Has another worker signaled stop while we've been waiting?
 	 */
 	if (pool->stop) {
@@ -363,12 +568,23 @@ vips_worker_work_unit(VipsWorker *worker)
 			worker->state->y);
 	}
 
-	/* Process a work unit.
+	/* Process a work unit. If we are sharing, we only need a slot for
+	 * this part. Allocate functions can block for a long time, for
+	 * example waiting for write-behind, and mustn't hold a slot while
+	 * they do.
 	 */
+	worker->holding_slot = pool->shared &&
+		vips_worker_slot_acquire(pool);
+
 	if (pool->work(worker->state, pool->a)) {
 		worker->stop = TRUE;
 		pool->error = TRUE;
 	}
+
+	if (worker->holding_slot) {
+		vips_worker_slot_release();
+		worker->holding_slot = FALSE;
+	}
 }
 
 /* What runs as a thread ... loop, waiting to be told to do stuff.
@@ -382,6 +598,7 @@ vips_thread_main_loop(void *a, void *b)
 	VIPS_GATE_START("vips_thread_main_loop: thread");
 
 	g_private_set(&worker_key, worker);
+	vips_cancellable_set_current(pool->cancellable);
 
 	/* Process work units! Always tick, even if we are stopping, so the
 	 * main thread will wake up for exit.
@@ -408,6 +625,7 @@ vips_thread_main_loop(void *a, void *b)
 
 	VIPS_FREE(worker);
 	g_private_set(&worker_key, NULL);
+	vips_cancellable_set_current(NULL);
 
 	/* We are done: tell the main thread.
 	 */
@@ -425,6 +643,7 @@ vips_worker_new(VipsThreadpool *pool)
 		return -1;
 	worker->pool = pool;
 	worker->state = NULL;
+	worker->holding_slot = FALSE;
 
 	/* We can't build the state here, it has to be done by the worker
 	 * itself the first time that allocate runs so that any regions are
@@ -455,16 +674,40 @@ vips__worker_lock(GMutex *mutex)
 		g_atomic_int_dec_and_test(&worker->pool->n_waiting);
 }
 
+/* Wait on a cond, usually for another thread to finish something we need.
+ * Callers must loop and test their condition, since we can wake early.
+ */
 void
 vips__worker_cond_wait(GCond *cond, GMutex *mutex)
 {
 	VipsWorker *worker = (VipsWorker *) g_private_get(&worker_key);
 
-	if (worker)
+	if (worker &&
+		worker->holding_slot) {
+		/* Let another thread use our shared slot while we wait. The
+		 * thread we are waiting for might need it.
+		 */
+		vips_worker_slot_release();
+		worker->holding_slot = FALSE;
+
 		g_atomic_int_inc(&worker->pool->n_waiting);
-	g_cond_wait(cond, mutex);
-	if (worker)
+		g_cond_wait(cond, mutex);
 		g_atomic_int_dec_and_test(&worker->pool->n_waiting);
+
+		/* Slot holders might need @mutex, so we can't wait for a slot
+		 * with it held.
+		 */
+		g_mutex_unlock(mutex);
+		worker->holding_slot = vips_worker_slot_acquire(worker->pool);
+		g_mutex_lock(mutex);
+	}
+	else {
+		if (worker)
+			g_atomic_int_inc(&worker->pool->n_waiting);
+		g_cond_wait(cond, mutex);
+		if (worker)
+			g_atomic_int_dec_and_test(&worker->pool->n_waiting);
+	}
 }
 
 static void
@@ -476,10 +719,120 @@ vips_threadpool_wait(VipsThreadpool *pool)
 	vips_semaphore_downn(&pool->n_workers, 0);
 }
 
+static void *
+vips_threadpool_estimate_cb(VipsImage *image, void *a, void *b)
+{
+	size_t *per_tile = (size_t *) a;
+
+	*per_tile += VIPS_IMAGE_SIZEOF_PEL(image);
+
+	return NULL;
+}
+
+/* Guess how much memory each worker will need: a tile's worth of buffer
+ * for every image in the pipeline.
+ */
+static size_t
+vips_threadpool_estimate(VipsThreadpool *pool)
+{
+	int tile_width;
+	int tile_height;
+	int n_lines;
+	size_t per_pel;
+
+	vips_get_tile_size(pool->im, &tile_width, &tile_height, &n_lines);
+
+	per_pel = 0;
+	(void) vips__link_map(pool->im, TRUE,
+		(VipsSListMap2Fn) vips_threadpool_estimate_cb, &per_pel, NULL);
+
+	return VIPS_MAX(1, per_pel * tile_width * tile_height);
+}
+
+/* Reserve memory for the pool from the budget, trimming max_workers to fit.
+ * If there's not room for even one worker, wait for other pools to finish.
+ *
+ * We never wait if we are inside a worker, since the pool we are part of
+ * could be holding the memory we are waiting for. We always let a pool run
+ * with one worker if nothing else is running, so we can't deadlock.
+ */
+static void
+vips_threadpool_reserve(VipsThreadpool *pool)
+{
+	gboolean nested = g_private_get(&worker_key) != NULL;
+
+	size_t max_mem;
+	size_t per_worker;
+	gboolean waited;
+	int n_workers;
+
+	g_mutex_lock(&vips__budget_lock);
+	max_mem = vips__budget_max_mem;
+	g_mutex_unlock(&vips__budget_lock);
+	if (!max_mem)
+		return;
+
+	per_worker = vips_threadpool_estimate(pool);
+
+	g_mutex_lock(&vips__budget_lock);
+
+	waited = FALSE;
+	for (;;) {
+		size_t available = vips__budget_max_mem > vips__budget_reserved
+			? vips__budget_max_mem - vips__budget_reserved
+			: 0;
+
+		n_workers = VIPS_MIN(pool->max_workers, available / per_worker);
+		if (n_workers >= 1 ||
+			nested ||
+			vips__budget_reserved == 0 ||
+			vips__budget_max_mem == 0)
+			break;
+
+		waited = TRUE;
+		g_cond_wait(&vips__budget_cond, &vips__budget_lock);
+	}
+
+	if (vips__budget_max_mem == 0)
+		n_workers = pool->max_workers;
+	n_workers = VIPS_MAX(1, n_workers);
+
+	vips__budget_admitted += 1;
+	if (waited)
+		vips__budget_waited += 1;
+	if (n_workers < pool->max_workers) {
+		vips__budget_shrunk += 1;
+		g_info("threadpool budget: running with %d of %d workers",
+			n_workers, pool->max_workers);
+	}
+
+	pool->max_workers = n_workers;
+	pool->reserved = per_worker * n_workers;
+	vips__budget_reserved += pool->reserved;
+
+	g_mutex_unlock(&vips__budget_lock);
+}
+
+static void
+vips_threadpool_release(VipsThreadpool *pool)
+{
+	if (!pool->reserved)
+		return;
+
+	g_mutex_lock(&vips__budget_lock);
+	vips__budget_reserved -= pool->reserved;
+	pool->reserved = 0;
+	g_cond_broadcast(&vips__budget_cond);
+	g_mutex_unlock(&vips__budget_lock);
+}
+
 static void
 vips_threadpool_free(VipsThreadpool *pool)
 {
 	vips_threadpool_wait(pool);
+	vips_threadpool_release(pool);
+	vips_threadpool_unshare(pool);
+	VIPS_UNREF(pool->cancellable);
 
 	g_mutex_clear(&pool->allocate_lock);
 	vips_semaphore_destroy(&pool->n_workers);
@@ -510,6 +863,13 @@ vips_threadpool_new(VipsImage *im)
 	pool->error = FALSE;
 	pool->stop = FALSE;
 	pool->exit = 0;
+	pool->reserved = 0;
+	pool->shared = FALSE;
+	pool->priority = 1;
+	pool->vtime = 0.0;
+	pool->n_slot_waiting = 0;
+	if ((pool->cancellable = vips_cancellable_get_current()))
+		g_object_ref(pool->cancellable);
 
 	/* If this is a tiny image, we won't need all max_workers threads.
 	 * Guess how
@@ -527,6 +887,14 @@ vips_threadpool_new(VipsImage *im)
 	 */
 	pool->max_workers = vips_image_get_concurrency(im, pool->max_workers);
 
+	/* And the memory budget can shrink it again.
+	 */
+	vips_threadpool_reserve(pool);
+
+	/* And sharing workers with other pools can shrink it further.
+	 */
+	vips_threadpool_share(pool);
+
 	return pool;
 }
 
@@ -621,6 +989,11 @@ vips_threadpool_new(VipsImage *im)
  * always called by
  * the main thread (ie. the thread which called [func@threadpool_run]).
  *
+ * If a memory budget has been set with [func@threadpool_set_max_mem], this
+ * can wait for other threadpools to finish, or run with fewer threads. If
+ * workers are shared with [func@threadpool_set_shared_workers], threads
+ * take turns with the threads of other threadpools.
+ *
  * ::: seealso
  *     [func@concurrency_set].
  *
@@ -657,9 +1030,23 @@ vips_threadpool_run(VipsImage *im,
 		}
 
 	for (;;) {
-		/* Wait for a tick from a worker.
+		/* Wait for a tick from a worker. If we can be cancelled, wake
+		 * up every now and then to check, since a worker could be
+		 * busy for a long time.
 		 */
-		vips_semaphore_down(&pool->tick);
+		if (pool->cancellable) {
+			if (vips_semaphore_down_timeout(&pool->tick,
+					VIPS_THREADPOOL_CANCEL_POLL) < 0) {
+				if (vips__cancellable_check(pool->cancellable)) {
+					pool->error = TRUE;
+					break;
+				}
+
+				continue;
+			}
+		}
+		else
+			vips_semaphore_down(&pool->tick);
 
 		VIPS_DEBUG_MSG("vips_threadpool_run: tick\n");
 
@@ -717,3 +1104,166 @@ vips_threadpool_run(VipsImage *im,
 
 	return result;
 }
+
+/**
+ * vips_threadpool_set_max_mem:
+ * @max_mem: memory budget for running threadpools in bytes, or 0
+ *
+ * Set a memory budget for all running threadpools. Before a threadpool
+ * starts, it estimates how much buffer memory each thread will need from
+ * the tile size and the number of images in the pipeline, then reserves
+ * memory for as many threads as will fit.
+ *
+ * If there's no room for even one thread, [func@threadpool_run] waits for
+ * other threadpools to finish. Threadpools started from inside another
+ * threadpool never wait, and the first threadpool always gets at least one
+ * thread, so this can't deadlock.
+ *
+ * Memory used by caches and by images held in memory isn't counted, so set
+ * this somewhat below the memory you really have.
+ *
+ * The default is 0, meaning no limit. You can also set the environment
+ * variable `VIPS_THREADPOOL_MAX_MEM`, for example "500m".
+ *
+ * ::: seealso
+ *     [func@threadpool_get_admitted], [func@tracked_get_mem].
+ */
+void
+vips_threadpool_set_max_mem(size_t max_mem)
+{
+	g_mutex_lock(&vips__budget_lock);
+	vips__budget_max_mem = max_mem;
+	g_cond_broadcast(&vips__budget_cond);
+	g_mutex_unlock(&vips__budget_lock);
+}
+
+/**
+ * vips_threadpool_get_max_mem:
+ *
+ * ::: seealso
+ *     [func@threadpool_set_max_mem].
+ *
+ * Returns: the threadpool memory budget in bytes, or 0 for no limit
+ */
+size_t
+vips_threadpool_get_max_mem(void)
+{
+	size_t max_mem;
+
+	g_mutex_lock(&vips__budget_lock);
+	max_mem = vips__budget_max_mem;
+	g_mutex_unlock(&vips__budget_lock);
+
+	return max_mem;
+}
+
+/**
+ * vips_threadpool_get_reserved_mem:
+ *
+ * The number of bytes currently reserved from the memory budget by running
+ * threadpools.
+ *
+ * ::: seealso
+ *     [func@threadpool_set_max_mem].
+ *
+ * Returns: the number of bytes reserved
+ */
+size_t
+vips_threadpool_get_reserved_mem(void)
+{
+	size_t reserved;
+
+	g_mutex_lock(&vips__budget_lock);
+	reserved = vips__budget_reserved;
+	g_mutex_unlock(&vips__budget_lock);
+
+	return reserved;
+}
+
+/**
+ * vips_threadpool_get_admitted:
+ * @waited: (out) (optional): return the number of threadpools that waited
+ * @shrunk: (out) (optional): return the number of threadpools that ran with
+ *   fewer threads
+ *
+ * Get counts of the decisions made by the memory budget since startup.
+ *
+ * ::: seealso
+ *     [func@threadpool_set_max_mem].
+ *
+ * Returns: the number of threadpools admitted under a budget
+ */
+int
+vips_threadpool_get_admitted(int *waited, int *shrunk)
+{
+	int admitted;
+
+	g_mutex_lock(&vips__budget_lock);
+	admitted = vips__budget_admitted;
+	if (waited)
+		*waited = vips__budget_waited;
+	if (shrunk)
+		*shrunk = vips__budget_shrunk;
+	g_mutex_unlock(&vips__budget_lock);
+
+	return admitted;
+}
+
+/**
+ * vips_threadpool_set_shared_workers:
+ * @n_workers: total number of working threads, or 0
+ *
+ * Share a fixed number of working threads between all running threadpools.
+ *
+ * Normally, every call to [func@threadpool_run] can have up to
+ * [func@concurrency_get] threads working at once, so a server running many
+ * requests at the same time can have a very large number of runnable
+ * threads. With this set, each threadpool still starts its own threads,
+ * but a thread must hold one of @n_workers slots while it works on a unit,
+ * so at most @n_workers units are processed at once. Threads don't hold a
+ * slot while they wait for work, or while they wait for a tile that another
+ * thread is computing.
+ *
+ * Slots are handed out in weighted-fair order: the threadpool which has
+ * processed the fewest units for its priority goes next. Set
+ * [const@META_PRIORITY] on the image being computed to give a request a
+ * larger share. A single request running alone still gets all @n_workers
+ * slots.
+ *
+ * Threadpools started from inside another threadpool don't take slots.
+ *
+ * The default is 0, meaning threadpools don't share. You can also set the
+ * environment variable `VIPS_SHARED_WORKERS`.
+ *
+ * ::: seealso
+ *     [func@concurrency_set], [func@image_get_priority].
+ */
+void
+vips_threadpool_set_shared_workers(int n_workers)
+{
+	g_mutex_lock(&vips__shared_lock);
+	vips__shared_workers = VIPS_CLIP(0, n_workers, MAX_THREADS);
+	g_cond_broadcast(&vips__shared_cond);
+	g_mutex_unlock(&vips__shared_lock);
+}
+
+/**
+ * vips_threadpool_get_shared_workers:
+ *
+ * ::: seealso
+ *     [func@threadpool_set_shared_workers].
+ *
+ * Returns: the number of shared working threads, or 0 if threadpools don't
+ * share
+ */
+int
+vips_threadpool_get_shared_workers(void)
+{
+	int n_workers;
+
+	g_mutex_lock(&vips__shared_lock);
+	n_workers = vips__shared_workers;
+	g_mutex_unlock(&vips__shared_lock);
+
+	return n_workers;
+}
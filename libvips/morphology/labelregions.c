@@ -4,6 +4,10 @@
  *	- renamed from im_segment()
  * 11/2/14
  * 	- redo as a class
+ * 19/10/26
+ * 	- redo as a parallel two-pass union-find, the input no longer needs
+ * 	  to be in memory
+ * 	- add "areas" and "bounds" outputs
  */
 
 /*
@@ -39,70 +43,365 @@
 #include <glib/gi18n-lib.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
 
 #include "pmorphology.h"
 
+/* Label in strips this many lines high.
+ */
+#define VIPS_LABELREGIONS_STRIP (128)
+
 typedef struct _VipsLabelregions {
 	VipsMorphology parent_instance;
 
 	VipsImage *mask;
 	int segments;
+	VipsImage *areas;
+	VipsImage *bounds;
+
+	/* The size of a pixel in the input.
+	 */
+	int ps;
+
+	/* The first and last line of every strip, so we can join labels
+	 * across strip boundaries.
+	 */
+	VipsPel *edges;
 } VipsLabelregions;
 
 typedef VipsMorphologyClass VipsLabelregionsClass;
 
 G_DEFINE_TYPE(VipsLabelregions, vips_labelregions, VIPS_TYPE_MORPHOLOGY);
 
+/* Compare two pixels for equality.
+ */
+static inline gboolean
+vips_labelregions_equal(VipsPel *p1, VipsPel *p2, int ps)
+{
+	for (int i = 0; i < ps; i++)
+		if (p1[i] != p2[i])
+			return FALSE;
+
+	return TRUE;
+}
+
+/* While we are labelling, each element of the mask is the index of its
+ * parent pixel, and roots point to themselves. Parents always have a
+ * smaller index than their children, so the root of a region is its first
+ * pixel in raster order.
+ */
+static inline int
+vips_labelregions_find(int *m, int i)
+{
+	while (m[i] != i) {
+		/* Path halving.
+		 */
+		m[i] = m[m[i]];
+		i = m[i];
+	}
+
+	return i;
+}
+
+/* Label a strip of the image. Strips are independent, so we can run them
+ * in parallel.
+ */
+static int
+vips_labelregions_strip(VipsRegion *region,
+	void *seq, void *a, void *b, gboolean *stop)
+{
+	VipsLabelregions *labelregions = (VipsLabelregions *) a;
+	VipsImage *mask = labelregions->mask;
+	VipsRect *r = &region->valid;
+	const int ps = labelregions->ps;
+	const int lsk = VIPS_REGION_LSKIP(region);
+	const int width = mask->Xsize;
+	const int strip = r->top / VIPS_LABELREGIONS_STRIP;
+	int *m = (int *) mask->data;
+
+	int x, y, i;
+
+	g_assert(r->left == 0);
+	g_assert(r->width == width);
+
+	for (y = 0; y < r->height; y++) {
+		VipsPel *p = VIPS_REGION_ADDR(region, 0, r->top + y);
+
+		i = (r->top + y) * width;
+		for (x = 0; x < width; x++) {
+			gboolean left = x > 0 &&
+				vips_labelregions_equal(p, p - ps, ps);
+			gboolean up = y > 0 &&
+				vips_labelregions_equal(p, p - lsk, ps);
+
+			if (left &&
+				up) {
+				int r1 = vips_labelregions_find(m, i - 1);
+				int r2 = vips_labelregions_find(m, i - width);
+
+				if (r1 < r2) {
+					m[r2] = r1;
+					m[i] = r1;
+				}
+				else {
+					m[r1] = r2;
+					m[i] = r2;
+				}
+			}
+			else if (left)
+				m[i] = m[i - 1];
+			else if (up)
+				m[i] = m[i - width];
+			else
+				m[i] = i;
+
+			p += ps;
+			i += 1;
+		}
+	}
+
+	/* Point every pixel directly at its root. Parents come first, so
+	 * they are already done.
+	 */
+	for (i = r->top * width; i < VIPS_RECT_BOTTOM(r) * width; i++)
+		m[i] = m[m[i]];
+
+	/* Save the first and last lines for the join.
+	 */
+	memcpy(labelregions->edges + strip * 2 * width * ps,
+		VIPS_REGION_ADDR(region, 0, r->top),
+		width * ps);
+	memcpy(labelregions->edges + (strip * 2 + 1) * width * ps,
+		VIPS_REGION_ADDR(region, 0, VIPS_RECT_BOTTOM(r) - 1),
+		width * ps);
+
+	return 0;
+}
+
+/* Join regions across strip boundaries.
+ */
+static void
+vips_labelregions_join(VipsLabelregions *labelregions)
+{
+	VipsImage *mask = labelregions->mask;
+	const int ps = labelregions->ps;
+	const int width = mask->Xsize;
+	const int n_strips =
+		VIPS_ROUND_UP(mask->Ysize, VIPS_LABELREGIONS_STRIP) /
+		VIPS_LABELREGIONS_STRIP;
+	int *m = (int *) mask->data;
+
+	for (int strip = 1; strip < n_strips; strip++) {
+		VipsPel *p1 =
+			labelregions->edges + ((strip - 1) * 2 + 1) * width * ps;
+		VipsPel *p2 = labelregions->edges + strip * 2 * width * ps;
+		int i2 = strip * VIPS_LABELREGIONS_STRIP * width;
+		int i1 = i2 - width;
+
+		for (int x = 0; x < width; x++)
+			if (vips_labelregions_equal(p1 + x * ps, p2 + x * ps, ps)) {
+				int r1 = vips_labelregions_find(m, i1 + x);
+				int r2 = vips_labelregions_find(m, i2 + x);
+
+				if (r1 < r2)
+					m[r2] = r1;
+				else if (r2 < r1)
+					m[r1] = r2;
+			}
+	}
+}
+
+/* Number the regions in raster order of their first pixel, and find area
+ * and bounding box for each one.
+ *
+ * Every pixel before the current one has been numbered, and every pixel's
+ * parent is before it, so a single lookup is enough.
+ */
+static int
+vips_labelregions_number(VipsLabelregions *labelregions,
+	int **areas, int **bounds)
+{
+	VipsImage *mask = labelregions->mask;
+	int *m = (int *) mask->data;
+
+	int segments;
+	int size;
+	int x, y, i;
+
+	segments = 1;
+	size = 1024;
+	if (!(*areas = VIPS_ARRAY(NULL, size, int)) ||
+		!(*bounds = VIPS_ARRAY(NULL, size * 4, int)))
+		return -1;
+	(*areas)[0] = 0;
+	memset(*bounds, 0, 4 * sizeof(int));
+
+	i = 0;
+	for (y = 0; y < mask->Ysize; y++)
+		for (x = 0; x < mask->Xsize; x++) {
+			int label;
+			int *box;
+
+			if (m[i] == i) {
+				if (segments >= size) {
+					int *new_areas;
+					int *new_bounds;
+
+					size *= 2;
+					if (!(new_areas = g_try_realloc(*areas,
+							  size * sizeof(int)))) {
+						vips_error("labelregions",
+							"%s", _("out of memory"));
+						return -1;
+					}
+					*areas = new_areas;
+
+					if (!(new_bounds = g_try_realloc(*bounds,
+							  4 * size * sizeof(int)))) {
+						vips_error("labelregions",
+							"%s", _("out of memory"));
+						return -1;
+					}
+					*bounds = new_bounds;
+				}
+
+				label = segments++;
+				(*areas)[label] = 0;
+				box = *bounds + 4 * label;
+				box[0] = x;
+				box[1] = y;
+				box[2] = x;
+			}
+			else
+				label = m[m[i]];
+
+			m[i] = label;
+
+			/* Right and bottom for now, we make width and height
+			 * at the end.
+			 */
+			(*areas)[label] += 1;
+			box = *bounds + 4 * label;
+			box[0] = VIPS_MIN(box[0], x);
+			box[2] = VIPS_MAX(box[2], x);
+			box[3] = y;
+
+			i += 1;
+		}
+
+	for (i = 1; i < segments; i++) {
+		int *box = *bounds + 4 * i;
+
+		box[2] = box[2] - box[0] + 1;
+		box[3] = box[3] - box[1] + 1;
+	}
+
+	return segments;
+}
+
+/* Make a one-line int image from an array.
+ */
+static VipsImage *
+vips_labelregions_vector(int *data, int width, int bands)
+{
+	VipsImage *image;
+
+	image = vips_image_new_memory();
+	vips_image_init_fields(image,
+		width, 1, bands,
+		VIPS_FORMAT_INT, VIPS_CODING_NONE,
+		VIPS_INTERPRETATION_MULTIBAND,
+		1.0, 1.0);
+	if (vips_image_write_prepare(image)) {
+		VIPS_UNREF(image);
+		return NULL;
+	}
+	memcpy(image->data, data, width * bands * sizeof(int));
+
+	return image;
+}
+
 static int
 vips_labelregions_build(VipsObject *object)
 {
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS(object);
 	VipsMorphology *morphology = VIPS_MORPHOLOGY(object);
+	VipsLabelregions *labelregions = (VipsLabelregions *) object;
 	VipsImage *in = morphology->in;
-	VipsImage **t = (VipsImage **) vips_object_local_array(object, 2);
-	VipsImage *mask;
+	VipsImage **t = (VipsImage **) vips_object_local_array(object, 3);
+	const int n_strips =
+		VIPS_ROUND_UP(in->Ysize, VIPS_LABELREGIONS_STRIP) /
+		VIPS_LABELREGIONS_STRIP;
 
+	int *areas;
+	int *bounds;
 	int segments;
-	int *m;
-	int x, y;
 
 	if (VIPS_OBJECT_CLASS(vips_labelregions_parent_class)->build(object))
 		return -1;
 
-	/* Create the zero mask image in memory.
+	if (vips_check_coding_known(class->nickname, in))
+		return -1;
+
+	/* Labels are the index of the first pixel in a region while we work,
+	 * so they must fit in an int.
 	 */
-	if (vips_black(&t[0], in->Xsize, in->Ysize, NULL) ||
-		vips_cast(t[0], &t[1], VIPS_FORMAT_INT, NULL) ||
-		!(t[2] = vips_image_copy_memory(t[1])))
+	if ((gint64) in->Xsize * in->Ysize >= INT_MAX) {
+		vips_error(class->nickname, "%s", _("image too large"));
+		return -1;
+	}
+
+	/* Create the mask image in memory. Every pixel is written by the
+	 * first pass, so we don't need to clear it.
+	 */
+	t[0] = vips_image_new_memory();
+	vips_image_init_fields(t[0],
+		in->Xsize, in->Ysize, 1,
+		VIPS_FORMAT_INT, VIPS_CODING_NONE,
+		VIPS_INTERPRETATION_MULTIBAND,
+		1.0, 1.0);
+	if (vips_image_write_prepare(t[0]))
 		return -1;
 
-	mask = t[2];
 	g_object_set(object,
-		"mask", mask,
+		"mask", t[0],
 		NULL);
 
-	segments = 1;
-	m = (int *) mask->data;
-	for (y = 0; y < mask->Ysize; y++) {
-		for (x = 0; x < mask->Xsize; x++) {
-			if (!m[x]) {
-				/* Use a direct path for speed.
-				 */
-				if (vips__draw_flood_direct(mask, in,
-						segments, x, y))
-					return -1;
-
-				segments += 1;
-			}
-		}
+	labelregions->ps = VIPS_IMAGE_SIZEOF_PEL(in);
+	if (!(labelregions->edges = VIPS_ARRAY(object,
+			  (size_t) n_strips * 2 * in->Xsize * labelregions->ps,
+			  VipsPel)))
+		return -1;
 
-		m += mask->Xsize;
+	/* Label strips in parallel, then join the strips together.
+	 */
+	if (vips_sink_tile(in, in->Xsize, VIPS_LABELREGIONS_STRIP,
+			NULL, vips_labelregions_strip, NULL,
+			labelregions, NULL))
+		return -1;
+	vips_labelregions_join(labelregions);
+
+	areas = NULL;
+	bounds = NULL;
+	if ((segments = vips_labelregions_number(labelregions,
+			 &areas, &bounds)) < 0 ||
+		!(t[1] = vips_labelregions_vector(areas, segments, 1)) ||
+		!(t[2] = vips_labelregions_vector(bounds, segments, 4))) {
+		VIPS_FREE(areas);
+		VIPS_FREE(bounds);
+		return -1;
 	}
+	VIPS_FREE(areas);
+	VIPS_FREE(bounds);
 
 	g_object_set(object,
 		"segments", segments,
+		"areas", t[1],
+		"bounds", t[2],
 		NULL);
 
 	return 0;
@@ -133,6 +432,18 @@ vips_labelregions_class_init(VipsLabelregionsClass *class)
 		VIPS_ARGUMENT_OPTIONAL_OUTPUT,
 		G_STRUCT_OFFSET(VipsLabelregions, segments),
 		0, 1000000000, 0);
+
+	VIPS_ARG_IMAGE(class, "areas", 4,
+		_("Areas"),
+		_("Number of pixels in each region"),
+		VIPS_ARGUMENT_OPTIONAL_OUTPUT,
+		G_STRUCT_OFFSET(VipsLabelregions, areas));
+
+	VIPS_ARG_IMAGE(class, "bounds", 5,
+		_("Bounds"),
+		_("Bounding box of each region"),
+		VIPS_ARGUMENT_OPTIONAL_OUTPUT,
+		G_STRUCT_OFFSET(VipsLabelregions, bounds));
 }
 
 static void
@@ -148,15 +459,24 @@ vips_labelregions_init(VipsLabelregions *labelregions)
  *
  * Label regions of equal pixels in an image.
  *
- * Repeatedly scans @in for regions of 4-connected pixels
- * with the same pixel value. Every time a region is discovered, those
- * pixels are marked in @mask with a unique serial number. Once all pixels
- * have been labelled, the operation returns, setting @segments to the number
- * of discrete regions which were detected.
+ * Scans @in for regions of 4-connected pixels
+ * with the same pixel value. Each region is marked in @mask with a unique
+ * serial number, counting up from 1 in the order the regions are first
+ * found in a top-to-bottom, left-to-right scan. @segments is set to
+ * one more than the number of discrete regions which were detected.
  *
  * @mask is always a 1-band [enum@Vips.BandFormat.INT] image of the same
  * dimensions as @in.
  *
+ * @areas is a one-line, 1-band [enum@Vips.BandFormat.INT] image
+ * @segments pixels across, where pixel n is the number of pixels in region n.
+ * @bounds is a one-line, 4-band [enum@Vips.BandFormat.INT] image
+ * @segments pixels across, where pixel n is the left, top, width and height
+ * of the bounding box of region n.
+ *
+ * The image is labelled in strips in parallel, and the strips are then
+ * joined, so @in does not need to be in memory.
+ *
  * This operation is useful for, for example, blob counting. You can use the
  * morphological operators to detect and isolate a series of objects, then use
  * [method@Image.labelregions] to number them all.
@@ -165,6 +485,8 @@ vips_labelregions_init(VipsLabelregions *labelregions)
  *
  * ::: tip "Optional arguments"
  *     * @segments: `gint`, output, number of regions found
+ *     * @areas: [class@Image], output, area of each region
+ *     * @bounds: [class@Image], output, bounding box of each region
  *
  * ::: seealso
  *     [method@Image.hist_find_indexed].
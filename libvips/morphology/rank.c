@@ -28,6 +28,11 @@
  * 	- oop, allow index == 0, thanks Rob
  * 12/1/21
  * 	- add hist path for large windows on uchar images
+ * 19/10/26
+ * 	- hist path is now Perreault-Hebert with column histograms, and works
+ * 	  for char too
+ * 	- add a two-level hist path for ushort and short
+ * 	- add a sorted window path for int, uint, float and double
  */
 
 /*
@@ -83,15 +88,26 @@ typedef struct _VipsRank {
 
 	int n;
 
+	/* Histogram path for 8 and 16-bit images.
+	 */
 	gboolean hist_path;
 
+	/* Sorted window path for everything else.
+	 */
+	gboolean sort_path;
+
 } VipsRank;
 
 typedef VipsMorphologyClass VipsRankClass;
 
 G_DEFINE_TYPE(VipsRank, vips_rank, VIPS_TYPE_MORPHOLOGY);
 
-/* Sequence value: just the array we sort in.
+/* The 8-bit hist path works on vertical stripes of the output this many
+ * pixels across, to bound the size of the column histograms.
+ */
+#define VIPS_RANK_STRIPE (128)
+
+/* Sequence value.
  */
 typedef struct {
 	VipsRegion *ir;
@@ -100,25 +116,45 @@ typedef struct {
 	 */
 	VipsPel *sort;
 
-	/* For large uchar images, the sort histogram.
+	/* For the hist path, the window histogram with fine and coarse bins,
+	 * and for 8-bit images, the window position each segment of the fine
+	 * histogram was last brought up to date for.
+	 */
+	unsigned int *fine;
+	unsigned int *coarse;
+	int *valid;
+
+	/* For the 8-bit hist path, a fine and coarse histogram for every
+	 * input column in a stripe.
+	 */
+	unsigned int *column;
+	unsigned int *column_coarse;
+
+	/* For the sort path, the sorted window, a buffer we merge into, and
+	 * the columns of pixels leaving and entering the window.
 	 */
-	unsigned int **hist;
+	VipsPel *window;
+	VipsPel *next;
+	VipsPel *leave;
+	VipsPel *enter;
 } VipsRankSequence;
 
 static int
 vips_rank_stop(void *vseq, void *a, void *b)
 {
 	VipsRankSequence *seq = (VipsRankSequence *) vseq;
-	VipsImage *in = (VipsImage *) a;
 
 	VIPS_UNREF(seq->ir);
 	VIPS_FREE(seq->sort);
-
-	if (seq->hist &&
-		in)
-		for (int i = 0; i < in->Bands; i++)
-			VIPS_FREE(seq->hist[i]);
-	VIPS_FREE(seq->hist);
+	VIPS_FREE(seq->fine);
+	VIPS_FREE(seq->coarse);
+	VIPS_FREE(seq->valid);
+	VIPS_FREE(seq->column);
+	VIPS_FREE(seq->column_coarse);
+	VIPS_FREE(seq->window);
+	VIPS_FREE(seq->next);
+	VIPS_FREE(seq->leave);
+	VIPS_FREE(seq->enter);
 
 	return 0;
 }
@@ -132,9 +168,7 @@ vips_rank_start(VipsImage *out, void *a, void *b)
 
 	if (!(seq = VIPS_NEW(out, VipsRankSequence)))
 		return NULL;
-	seq->ir = NULL;
-	seq->sort = NULL;
-	seq->hist = NULL;
+	memset(seq, 0, sizeof(VipsRankSequence));
 
 	seq->ir = vips_region_new(in);
 	if (!(seq->sort = VIPS_ARRAY(NULL,
@@ -143,90 +177,456 @@ vips_rank_start(VipsImage *out, void *a, void *b)
 		return NULL;
 	}
 
-	if (rank->hist_path) {
-		if (!(seq->hist = VIPS_ARRAY(NULL, in->Bands, unsigned int *))) {
+	if (rank->hist_path &&
+		VIPS_IMAGE_SIZEOF_ELEMENT(in) == 1) {
+		/* 16 coarse bins of 16 fine bins each.
+		 */
+		const int n_columns =
+			(VIPS_RANK_STRIPE + rank->width - 1) * in->Bands;
+
+		if (!(seq->fine = VIPS_ARRAY(NULL, 256, unsigned int)) ||
+			!(seq->coarse = VIPS_ARRAY(NULL, 16, unsigned int)) ||
+			!(seq->valid = VIPS_ARRAY(NULL, 16, int)) ||
+			!(seq->column = VIPS_ARRAY(NULL,
+				  n_columns * 256, unsigned int)) ||
+			!(seq->column_coarse = VIPS_ARRAY(NULL,
+				  n_columns * 16, unsigned int))) {
+			vips_rank_stop(seq, in, rank);
+			return NULL;
+		}
+	}
+	else if (rank->hist_path) {
+		/* 256 coarse bins of 256 fine bins each. The histogram is
+		 * emptied after each line, so we only need to zero it once.
+		 */
+		if (!(seq->fine = VIPS_ARRAY(NULL, 65536, unsigned int)) ||
+			!(seq->coarse = VIPS_ARRAY(NULL, 256, unsigned int))) {
 			vips_rank_stop(seq, in, rank);
 			return NULL;
 		}
+		memset(seq->fine, 0, 65536 * sizeof(unsigned int));
+		memset(seq->coarse, 0, 256 * sizeof(unsigned int));
+	}
 
-		for (int i = 0; i < in->Bands; i++)
-			if (!(seq->hist[i] = VIPS_ARRAY(NULL, 256, unsigned int))) {
-				vips_rank_stop(seq, in, rank);
-				return NULL;
-			}
+	if (rank->sort_path) {
+		const int sizeof_element = VIPS_IMAGE_SIZEOF_ELEMENT(in);
+
+		/* The merge can overrun by a column if it fails to find a
+		 * leaving pixel, for example on a NaN.
+		 */
+		if (!(seq->window = VIPS_ARRAY(NULL,
+				  (rank->n + rank->height) * sizeof_element, VipsPel)) ||
+			!(seq->next = VIPS_ARRAY(NULL,
+				  (rank->n + rank->height) * sizeof_element, VipsPel)) ||
+			!(seq->leave = VIPS_ARRAY(NULL,
+				  rank->height * sizeof_element, VipsPel)) ||
+			!(seq->enter = VIPS_ARRAY(NULL,
+				  rank->height * sizeof_element, VipsPel))) {
+			vips_rank_stop(seq, in, rank);
+			return NULL;
+		}
 	}
 
 	return (void *) seq;
 }
 
-/* Histogram path for large uchar ranks.
+/* Find the output for one band of one line of a stripe with the 8-bit hist
+ * path.
+ *
+ * This is Perreault and Hebert, "Median Filtering in Constant Time". The
+ * window histogram is the sum of the column histograms under it, so moving
+ * right one pixel is a single add and subtract of column histograms. We only
+ * keep the coarse window histogram up to date as we move, and bring a
+ * segment of the fine histogram up to date when the search needs it.
  */
 static void
-vips_rank_generate_uchar(VipsRegion *out_region,
-	VipsRankSequence *seq, VipsRank *rank, int y)
+vips_rank_hist8_line(VipsRankSequence *seq, VipsRank *rank,
+	VipsPel *restrict q, int b, int bands, int sw, int flip)
 {
-	VipsImage *in = seq->ir->im;
-	VipsRect *r = &out_region->valid;
-	const int bands = in->Bands;
-	const int lsk = VIPS_REGION_LSKIP(seq->ir);
+	const int width = rank->width;
+	const unsigned int index = rank->index;
+	unsigned int *restrict fine = seq->fine;
+	unsigned int *restrict coarse = seq->coarse;
+	int *restrict valid = seq->valid;
 
-	/* Get input and output pointers for this line.
-	 */
-	VipsPel *restrict p = VIPS_REGION_ADDR(seq->ir, r->left, r->top + y);
-	VipsPel *restrict q = VIPS_REGION_ADDR(out_region, r->left, r->top + y);
+#define COLUMN(X) (seq->column + ((X) * bands + b) * 256)
+#define COLUMN_COARSE(X) (seq->column_coarse + ((X) * bands + b) * 16)
 
-	VipsPel *restrict p1;
+	memset(coarse, 0, 16 * sizeof(unsigned int));
+	for (int x = 0; x < width; x++) {
+		unsigned int *restrict c = COLUMN_COARSE(x);
 
-	/* Find histogram for the first output pixel.
-	 */
-	for (int b = 0; b < bands; b++)
-		memset(seq->hist[b], 0, 256 * sizeof(unsigned int));
-	p1 = p;
-	for (int j = 0; j < rank->height; j++) {
-		int i;
-
-		i = 0;
-		for (int x = 0; x < rank->width; x++)
-			for (int b = 0; b < bands; b++, i++)
-				seq->hist[b][p1[i]] += 1;
-
-		p1 += lsk;
+		for (int k = 0; k < 16; k++)
+			coarse[k] += c[k];
 	}
 
-	/* Loop for output pels.
-	 */
-	for (int x = 0; x < r->width; x++) {
-		for (int b = 0; b < bands; b++) {
-			/* Calculate cumulative histogram -- the value is the
-			 * index at which we pass the rank.
-			 */
-			unsigned int *restrict hist = seq->hist[b];
-
-			int sum;
-			int value;
-			sum = 0;
-			for (value = 0; value < 256; value++) {
-				sum += hist[value];
-				if (sum > rank->index)
-					break;
+	for (int k = 0; k < 16; k++)
+		valid[k] = -1;
+
+	for (int x = 0; x < sw; x++) {
+		unsigned int sum;
+		int k, v;
+
+		/* Find the coarse bin holding the rank.
+		 */
+		sum = 0;
+		for (k = 0; k < 15; k++) {
+			if (sum + coarse[k] > index)
+				break;
+			sum += coarse[k];
+		}
+
+		/* Bring that segment of the fine histogram up to date, either
+		 * by sliding it along, or by rebuilding it if that's quicker.
+		 */
+		unsigned int *restrict segment = fine + k * 16;
+		if (valid[k] < 0 ||
+			x - valid[k] >= width) {
+			memset(segment, 0, 16 * sizeof(unsigned int));
+			for (int i = x; i < x + width; i++) {
+				unsigned int *restrict c = COLUMN(i) + k * 16;
+
+				for (int j = 0; j < 16; j++)
+					segment[j] += c[j];
 			}
-			q[b] = value;
+		}
+		else
+			for (int i = valid[k]; i < x; i++) {
+				unsigned int *restrict c1 = COLUMN(i) + k * 16;
+				unsigned int *restrict c2 = COLUMN(i + width) + k * 16;
+
+				for (int j = 0; j < 16; j++)
+					segment[j] += c2[j] - c1[j];
+			}
+		valid[k] = x;
+
+		for (v = 0; v < 15; v++) {
+			sum += segment[v];
+			if (sum > index)
+				break;
+		}
+
+		q[x * bands] = (k * 16 + v) ^ flip;
+
+		/* Move the coarse histogram right.
+		 */
+		if (x + 1 < sw) {
+			unsigned int *restrict c1 = COLUMN_COARSE(x);
+			unsigned int *restrict c2 = COLUMN_COARSE(x + width);
+
+			for (int j = 0; j < 16; j++)
+				coarse[j] += c2[j] - c1[j];
+		}
+	}
+
+#undef COLUMN
+#undef COLUMN_COARSE
+}
 
-			/* Adapt histogram -- remove the pels from the left hand column,
-			 * add in pels for a new right-hand column.
+/* Hist path for uchar and char images. Signed values have the top bit
+ * flipped, which maps them to unsigned in the same order.
+ */
+static void
+vips_rank_generate_hist8(VipsRegion *out_region,
+	VipsRankSequence *seq, VipsRank *rank)
+{
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &out_region->valid;
+	const int bands = ir->im->Bands;
+	const int lsk = VIPS_REGION_LSKIP(ir);
+	const int flip = ir->im->BandFmt == VIPS_FORMAT_CHAR ? 0x80 : 0;
+
+	for (int sx = 0; sx < r->width; sx += VIPS_RANK_STRIPE) {
+		const int sw = VIPS_MIN(VIPS_RANK_STRIPE, r->width - sx);
+		const int ne = (sw + rank->width - 1) * bands;
+		VipsPel *p = VIPS_REGION_ADDR(ir, r->left + sx, r->top);
+
+		/* Histograms for all the columns of the stripe for the first
+		 * line. Columns are indexed by element, so bands interleave.
+		 */
+		memset(seq->column, 0, ne * 256 * sizeof(unsigned int));
+		memset(seq->column_coarse, 0, ne * 16 * sizeof(unsigned int));
+		for (int y = 0; y < rank->height; y++) {
+			VipsPel *restrict p1 = p + y * lsk;
+
+			for (int i = 0; i < ne; i++) {
+				int v = p1[i] ^ flip;
+
+				seq->column[i * 256 + v] += 1;
+				seq->column_coarse[i * 16 + (v >> 4)] += 1;
+			}
+		}
+
+		for (int y = 0; y < r->height; y++) {
+			VipsPel *q = VIPS_REGION_ADDR(out_region,
+				r->left + sx, r->top + y);
+
+			/* Move the column histograms down a line.
 			 */
-			const int next = bands * rank->width;
-			p1 = p + b;
-			for (int j = 0; j < rank->height; j++) {
-				hist[p1[0]] -= 1;
-				hist[p1[next]] += 1;
+			if (y > 0) {
+				VipsPel *restrict p1 = p + (y - 1) * lsk;
+				VipsPel *restrict p2 = p + (y + rank->height - 1) * lsk;
+
+				for (int i = 0; i < ne; i++) {
+					int v1 = p1[i] ^ flip;
+					int v2 = p2[i] ^ flip;
+
+					seq->column[i * 256 + v1] -= 1;
+					seq->column_coarse[i * 16 + (v1 >> 4)] -= 1;
+					seq->column[i * 256 + v2] += 1;
+					seq->column_coarse[i * 16 + (v2 >> 4)] += 1;
+				}
+			}
+
+			for (int b = 0; b < bands; b++)
+				vips_rank_hist8_line(seq, rank, q + b, b, bands, sw, flip);
+		}
+	}
+}
+
+/* Hist path for ushort and short images.
+ *
+ * A fine histogram per column would be far too large, so we slide a
+ * two-level window histogram along each line instead, and track the value
+ * at the rank as the window moves. It usually only moves a few bins, and
+ * the coarse bins let it skip empty parts of the histogram quickly.
+ */
+static void
+vips_rank_generate_hist16(VipsRegion *out_region,
+	VipsRankSequence *seq, VipsRank *rank)
+{
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &out_region->valid;
+	const int bands = ir->im->Bands;
+	const int ls = VIPS_REGION_LSKIP(ir) / sizeof(unsigned short);
+	const int eaw = rank->width * bands;
+	const int flip = ir->im->BandFmt == VIPS_FORMAT_SHORT ? 0x8000 : 0;
+	const int index = rank->index;
+	unsigned int *restrict fine = seq->fine;
+	unsigned int *restrict coarse = seq->coarse;
 
-				p1 += lsk;
+	for (int y = 0; y < r->height; y++) {
+		unsigned short *p = (unsigned short *)
+			VIPS_REGION_ADDR(ir, r->left, r->top + y);
+		unsigned short *q = (unsigned short *)
+			VIPS_REGION_ADDR(out_region, r->left, r->top + y);
+
+		for (int b = 0; b < bands; b++) {
+			/* The value at the rank, and the number of pixels in the
+			 * window less than it.
+			 */
+			int m;
+			int lt;
+
+			m = 0;
+			lt = 0;
+
+			for (int j = 0; j < rank->height; j++)
+				for (int i = 0; i < eaw; i += bands) {
+					int v = p[j * ls + i + b] ^ flip;
+
+					fine[v] += 1;
+					coarse[v >> 8] += 1;
+				}
+
+			for (int x = 0; x < r->width; x++) {
+				unsigned short *restrict d = p + x * bands + b;
+
+				/* Move m down, a whole coarse bin at a time if we
+				 * can.
+				 */
+				while (lt > index)
+					if ((m & 0xff) == 0 &&
+						lt - (int) coarse[(m >> 8) - 1] > index) {
+						m -= 256;
+						lt -= coarse[m >> 8];
+					}
+					else {
+						m -= 1;
+						lt -= fine[m];
+					}
+
+				/* And up.
+				 */
+				while (lt + (int) fine[m] <= index)
+					if ((m & 0xff) == 0 &&
+						lt + (int) coarse[m >> 8] <= index) {
+						lt += coarse[m >> 8];
+						m += 256;
+					}
+					else {
+						lt += fine[m];
+						m += 1;
+					}
+
+				q[x * bands + b] = m ^ flip;
+
+				/* Remove the left column and add a new right one,
+				 * or empty the histogram at the end of the line.
+				 */
+				for (int j = 0; j < rank->height; j++) {
+					int v = d[j * ls] ^ flip;
+
+					fine[v] -= 1;
+					coarse[v >> 8] -= 1;
+					if (v < m)
+						lt -= 1;
+				}
+
+				if (x + 1 < r->width)
+					for (int j = 0; j < rank->height; j++) {
+						int v = d[j * ls + eaw] ^ flip;
+
+						fine[v] += 1;
+						coarse[v >> 8] += 1;
+						if (v < m)
+							lt += 1;
+					}
+				else
+					for (int j = 0; j < rank->height; j++)
+						for (int i = bands; i < eaw; i += bands) {
+							int v = d[j * ls + i] ^ flip;
+
+							fine[v] -= 1;
+							coarse[v >> 8] -= 1;
+						}
 			}
 		}
+	}
+}
+
+/* Sort path. Keep the window sorted, and as we move right, merge the sorted
+ * entering column in and drop the sorted leaving column out in a single
+ * pass. If we fail to find a leaving pixel (NaN, perhaps), sort the
+ * whole window again.
+ */
+#define SORT_SMALL(TYPE, A, N) \
+	{ \
+		for (i = 1; i < (N); i++) { \
+			TYPE t = (A)[i]; \
+\
+			for (k = i - 1; k >= 0 && (A)[k] > t; k--) \
+				(A)[k + 1] = (A)[k]; \
+			(A)[k + 1] = t; \
+		} \
+	}
+
+#define SORT_COLUMN(TYPE, A, COMPARE) \
+	{ \
+		if (rank->height < 32) \
+			SORT_SMALL(TYPE, A, rank->height) \
+		else \
+			qsort((A), rank->height, sizeof(TYPE), COMPARE); \
+	}
+
+#define LOOP_SORTED(TYPE, COMPARE) \
+	{ \
+		TYPE *q = (TYPE *) VIPS_REGION_ADDR(out_region, r->left, r->top + y); \
+		TYPE *p = (TYPE *) VIPS_REGION_ADDR(ir, r->left, r->top + y); \
+		TYPE *window = (TYPE *) seq->window; \
+		TYPE *next = (TYPE *) seq->next; \
+		TYPE *leave = (TYPE *) seq->leave; \
+		TYPE *enter = (TYPE *) seq->enter; \
+\
+		for (int b = 0; b < bands; b++) \
+			for (x = 0; x < r->width; x++) { \
+				TYPE *d = p + x * bands + b; \
+\
+				if (x > 0) { \
+					for (j = 0; j < rank->height; j++) { \
+						leave[j] = d[j * ls - bands]; \
+						enter[j] = d[j * ls + eaw - bands]; \
+					} \
+					SORT_COLUMN(TYPE, leave, COMPARE); \
+					SORT_COLUMN(TYPE, enter, COMPARE); \
+\
+					i = 0; \
+					j = 0; \
+					k = 0; \
+					o = 0; \
+					while (i < rank->n) \
+						if (j < rank->height && \
+							window[i] == leave[j]) { \
+							i += 1; \
+							j += 1; \
+						} \
+						else if (k < rank->height && \
+							enter[k] < window[i]) \
+							next[o++] = enter[k++]; \
+						else \
+							next[o++] = window[i++]; \
+					while (k < rank->height) \
+						next[o++] = enter[k++]; \
+\
+					VIPS_SWAP(TYPE *, window, next); \
+				} \
+\
+				if (x == 0 || \
+					j != rank->height) { \
+					for (o = 0, j = 0; j < rank->height; j++) \
+						for (i = 0; i < eaw; i += bands) \
+							window[o++] = d[j * ls + i]; \
+					qsort(window, rank->n, sizeof(TYPE), COMPARE); \
+				} \
+\
+				q[x * bands + b] = window[rank->index]; \
+			} \
+\
+		seq->window = (VipsPel *) window; \
+		seq->next = (VipsPel *) next; \
+	}
 
-		p += bands;
-		q += bands;
+#define COMPARE(NAME, TYPE) \
+	static int \
+	vips_rank_compare_##NAME(const void *a, const void *b) \
+	{ \
+		TYPE f = *((TYPE *) a); \
+		TYPE g = *((TYPE *) b); \
+\
+		return f < g ? -1 : f > g ? 1 : 0; \
+	}
+
+COMPARE(uint, unsigned int)
+COMPARE(int, signed int)
+COMPARE(float, float)
+COMPARE(double, double)
+
+static void
+vips_rank_generate_sorted(VipsRegion *out_region,
+	VipsRankSequence *seq, VipsRank *rank, int y)
+{
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &out_region->valid;
+	const int bands = ir->im->Bands;
+	const int eaw = rank->width * bands;
+	const int ls = VIPS_REGION_LSKIP(ir) / VIPS_IMAGE_SIZEOF_ELEMENT(ir->im);
+
+	int x;
+	int i, j, k, o;
+
+	/* Quiet a spurious uninitialized warning.
+	 */
+	j = 0;
+
+	switch (ir->im->BandFmt) {
+	case VIPS_FORMAT_UINT:
+		LOOP_SORTED(unsigned int, vips_rank_compare_uint);
+		break;
+
+	case VIPS_FORMAT_INT:
+		LOOP_SORTED(signed int, vips_rank_compare_int);
+		break;
+
+	case VIPS_FORMAT_FLOAT:
+		LOOP_SORTED(float, vips_rank_compare_float);
+		break;
+
+	case VIPS_FORMAT_DOUBLE:
+		LOOP_SORTED(double, vips_rank_compare_double);
+		break;
+
+	default:
+		g_assert_not_reached();
 	}
 }
 
@@ -440,9 +840,20 @@ vips_rank_generate(VipsRegion *out_region,
 		return -1;
 	ls = VIPS_REGION_LSKIP(ir) / VIPS_IMAGE_SIZEOF_ELEMENT(in);
 
+	/* The hist paths work down columns, so they need the whole region.
+	 */
+	if (rank->hist_path) {
+		if (VIPS_IMAGE_SIZEOF_ELEMENT(in) == 1)
+			vips_rank_generate_hist8(out_region, seq, rank);
+		else
+			vips_rank_generate_hist16(out_region, seq, rank);
+
+		return 0;
+	}
+
 	for (int y = 0; y < r->height; y++) {
-		if (rank->hist_path)
-			vips_rank_generate_uchar(out_region, seq, rank, y);
+		if (rank->sort_path)
+			vips_rank_generate_sorted(out_region, seq, rank, y);
 		else if (rank->index == 0)
 			SWITCH(LOOP_MIN)
 		else if (rank->index == rank->n - 1)
@@ -489,7 +900,11 @@ vips_rank_build(VipsObject *object)
 
 	/* Enable the hist path if it'll probably help.
 	 */
-	if (in->BandFmt == VIPS_FORMAT_UCHAR) {
+	switch (in->BandFmt) {
+	case VIPS_FORMAT_UCHAR:
+	case VIPS_FORMAT_CHAR:
+	case VIPS_FORMAT_USHORT:
+	case VIPS_FORMAT_SHORT:
 		/* The hist path is always faster for windows larger than about
 		 * 10x10, and faster for >3x3 on the non-max/min case.
 		 */
@@ -499,6 +914,17 @@ vips_rank_build(VipsObject *object)
 			rank->index != 0 &&
 			rank->index != rank->n - 1)
 			rank->hist_path = TRUE;
+		break;
+
+	default:
+		/* Max and min are a simple scan, but the sort path wins for
+		 * anything else larger than 3x3.
+		 */
+		if (rank->n > 10 &&
+			rank->index != 0 &&
+			rank->index != rank->n - 1)
+			rank->sort_path = TRUE;
+		break;
 	}
 
 	/* Expand the input.
@@ -605,6 +1031,12 @@ vips_rank_init(VipsRank *rank)
  * operation so that the output image has the same size as the input.
  * Edge pixels in the output image are therefore only approximate.
  *
+ * For 8-bit images, the cost per pixel does not depend on the window size.
+ * 16-bit images slide a histogram along each line, so the cost per pixel
+ * grows with the window height, but not its width. Other formats keep the
+ * window sorted as it moves, so the cost grows with the number of pixels
+ * in the window.
+ *
  * For a median filter with mask size m (3 for 3x3, 5 for 5x5, etc.) use
  *
  * ```c
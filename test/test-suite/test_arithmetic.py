@@ -351,6 +351,18 @@ class TestArithmetic:
             assert_almost_equal_objects(hist(20, 0), [5000])
             assert_almost_equal_objects(hist(5, 0), [0])
 
+    def test_histfind_copies(self):
+        # odd sizes, so we have a tail after each group of pixels
+        im = (self.colour * 50).cast("uchar").crop(0, 0, 97, 93)
+
+        hist = im.hist_find()
+        assert hist.width == 256
+        for b in range(3):
+            band = hist.extract_band(b)
+            assert band.avg() * 256 == 97 * 93
+            assert (band - im.hist_find(band=b)
+                    .embed(0, 0, 256, 1)).abs().max() == 0
+
     def test_histfind_indexed(self):
         im = pyvips.Image.black(50, 100)
         test = im.insert(im + 10, 50, 0, expand=True)
@@ -381,6 +393,20 @@ class TestArithmetic:
             assert hist.height == 1
             assert hist.bands == 1
 
+    def test_histfind_ndim_sparse(self):
+        # 128 ** 3 bins is large enough for sparse per-thread histograms
+        im = pyvips.Image.black(100, 100) + [10, 20, 30]
+        im = im.insert(pyvips.Image.black(50, 100) + [200, 100, 0], 50, 0)
+        im = im.cast("uchar")
+
+        hist = im.hist_find_ndim(bins=128)
+        assert hist.width == 128
+        assert hist.height == 128
+        assert hist.bands == 128
+        assert hist(4, 9)[14] == 5000
+        assert hist(99, 49)[0] == 5000
+        assert hist.avg() * 128 ** 3 == 10000
+
     def test_hough_circle(self):
         test = pyvips.Image.black(100, 100).draw_circle(100, 50, 50, 40)
 
@@ -412,6 +438,32 @@ class TestArithmetic:
             assert pytest.approx(angle) == 45
             assert pytest.approx(distance) == 75
 
+    def test_hough_sparse(self):
+        # large enough parameter spaces for sparse accumulators
+        test = pyvips.Image.black(600, 600).draw_circle(100, 300, 300, 40)
+        hough = test.hough_circle(min_radius=35, max_radius=45)
+
+        v, x, y = hough.maxpos()
+        vec = hough(x, y)
+        r = vec.index(v) + 35
+
+        assert pytest.approx(x) == 300
+        assert pytest.approx(y) == 300
+        assert pytest.approx(r) == 40
+
+        test = pyvips.Image.black(100, 100).draw_line(100, 10, 90, 90, 10)
+        hough = test.hough_line(width=2048, height=2048)
+        dense = test.hough_line(width=1024, height=1024)
+        assert hough.avg() * 2 == pytest.approx(dense.avg())
+
+        v, x, y = hough.maxpos()
+
+        angle = 180.0 * x // hough.width
+        distance = test.height * y // hough.height
+
+        assert pytest.approx(angle) == 45
+        assert pytest.approx(distance) == 75
+
     def test_sin(self):
         def my_sin(x):
             if isinstance(x, pyvips.Image):
@@ -672,6 +724,54 @@ class TestArithmetic:
         assert width == 50
         assert height == 60
 
+    def test_find_trim_margins(self):
+        # margins wider than the probe strips, and a sequential source
+        im = pyvips.Image.black(40, 30) + 100
+        test = im.embed(300, 500, 900, 1000, extend="white").cast("uchar")
+        seq = pyvips.Image.new_from_buffer(test.write_to_buffer(".png"), "",
+                                           access="sequential")
+
+        for a in [test, seq]:
+            left, top, width, height = a.find_trim()
+
+            assert left == 300
+            assert top == 500
+            assert width == 40
+            assert height == 30
+
+        white = pyvips.Image.black(100, 80) + 255
+        left, top, width, height = white.find_trim()
+        assert left == 100
+        assert top == 80
+        assert width == 0
+        assert height == 0
+
+    def test_getpoints(self):
+        # a grid of points in reverse order, plus one outside the image
+        points = (pyvips.Image.xyz(20, 10) * [5, 11]).flip("horizontal")
+        points = points.draw_rect([500, 3], 0, 0, 1, 1)
+
+        for x in noncomplex_formats:
+            a = self.colour.cast(x)
+            values = a.getpoints(points)
+
+            assert values.width == 20
+            assert values.height == 10
+            assert values.bands == 3
+            assert values(0, 0) == [0, 0, 0]
+            for px, py in [(3, 4), (19, 9), (7, 1)]:
+                [x1, y1] = points(px, py)
+                assert pytest.approx(values(px, py)) == \
+                    a.getpoint(int(x1), int(y1))
+
+        # fractional points match mapim
+        points = pyvips.Image.xyz(30, 30) * 2.7 + 10.3
+        a = self.colour.cast("double")
+        interp = pyvips.Interpolate.new("bilinear")
+        values = a.getpoints(points, interpolate=interp)
+        mapped = a.mapim(points, interpolate=interp)
+        assert (values - mapped).abs().max() < 0.001
+
     def test_profile(self):
         test = pyvips.Image.black(100, 100).draw_rect(100, 40, 50, 1, 1)
 
@@ -722,6 +822,43 @@ class TestArithmetic:
             assert_almost_equal_objects(matrix(4, 1), [a.avg()])
             assert_almost_equal_objects(matrix(5, 1), [a.deviate()])
 
+    def test_stats_histogram(self):
+        for x in noncomplex_formats:
+            for im in self.all_images:
+                a = (im * 40 - 30).cast(x)
+                matrix, opts = a.stats(histogram=True, hist=True)
+                hist = opts["hist"]
+
+                assert_almost_equal_objects(matrix(0, 0), [a.min()])
+                assert_almost_equal_objects(matrix(1, 0), [a.max()])
+                assert_almost_equal_objects(matrix(4, 0), [a.avg()])
+                assert_almost_equal_objects(matrix(5, 0), [a.deviate()])
+
+                hist2 = a.hist_find()
+                assert hist.width == hist2.width
+                assert hist.bands == hist2.bands
+                assert hist.format == hist2.format
+                assert (hist - hist2).abs().max() == 0
+
+    def test_stats_cache(self):
+        for x in noncomplex_formats:
+            a = (self.colour * 40 - 30).cast(x)
+            matrix = a.stats()
+
+            # a copy, so we don't share the operation cache
+            b = a.copy()
+            b.stats(histogram=True, cache=True)
+            assert_almost_equal_objects([b.min()], matrix(0, 0))
+            assert_almost_equal_objects([b.max()], matrix(1, 0))
+            assert_almost_equal_objects([b.avg()], matrix(4, 0))
+            assert_almost_equal_objects([b.deviate()], matrix(5, 0))
+            assert (b.hist_find() - a.hist_find()).abs().max() == 0
+
+            matrix2 = b.stats()
+            for i in range(6):
+                for y in range(4):
+                    assert_almost_equal_objects(matrix2(i, y), matrix(i, y))
+
     def test_sum(self):
         for fmt in all_formats:
             im = pyvips.Image.black(50, 50)
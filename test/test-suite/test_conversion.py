@@ -135,6 +135,39 @@ class TestConversion:
 
         self.run_unary(self.all_images, bandmean, fmt=noncomplex_formats)
 
+    def test_band_shuffle(self):
+        # 8 and 16-bit images with up to 4 bands have a fast path ... check
+        # whole images against the int and float paths, with a width that's
+        # not a multiple of any vector size
+        noise = pyvips.Image.gaussnoise(101, 37, sigma=60000).abs()
+        rgba = noise.bandjoin([noise.rot180(), noise.flip("horizontal"),
+                               noise.flip("vertical")])
+        for fmt, mx in [("uchar", 256), ("ushort", 65536)]:
+            im = (rgba % mx).cast(fmt)
+            ref = im.cast("float")
+
+            for a, b in [(im[0:3], im[3]), (im[0], im[1:3]),
+                         (im[0], im[1]), (im[0:2], im[2:4])]:
+                result = a.bandjoin(b)
+                assert result.format == fmt
+                reference = a.cast("float").bandjoin(b.cast("float"))
+                assert (result - reference).abs().max() == 0
+
+            result = im[0].bandjoin([im[1], im[2]])
+            assert (result - ref[0:3]).abs().max() == 0
+
+            for band, n in [(0, 3), (3, 1), (1, 2), (2, 2)]:
+                result = im.extract_band(band, n=n)
+                reference = ref.extract_band(band, n=n)
+                assert result.format == fmt
+                assert (result - reference).abs().max() == 0
+
+            for bands in [2, 3, 4]:
+                result = im[0:bands].bandmean()
+                reference = im[0:bands].cast("int").bandmean()
+                assert result.format == fmt
+                assert (result - reference).abs().max() == 0
+
     def test_bandrank(self):
         def median(x, y):
             joined = [[a, b] for a, b in zip(x, y)]
@@ -440,6 +473,111 @@ class TestConversion:
         assert_almost_equal_objects(comp(0, 0), [51.8, 52.8, 53.8, 255],
                                     threshold=0.1)
 
+    def test_composite_formats(self):
+        # 8 and 16-bit GA and RGBA have a fast path for these modes ... it
+        # should match the float path to within rounding
+        rgb = self.image
+        mono = self.image.colourspace("b-w")
+        rgb16 = self.image.colourspace("rgb16")
+        for im in [rgb, mono, rgb16]:
+            base = im.bandjoin(im[0])
+            overlay = im.fliphor().bandjoin(im[0].flipver())
+            for mode in ["over", "source", "dest-over", "add"]:
+                for premultiplied in [False, True]:
+                    result = base.composite(overlay, mode,
+                                            premultiplied=premultiplied)
+                    reference = base.cast("float").composite(
+                        overlay.cast("float"), mode,
+                        premultiplied=premultiplied).cast(im.format)
+
+                    assert result.format == im.format
+                    assert (result - reference).abs().max() <= 1
+
+    def test_composite_sparse(self):
+        # an overlay with transparent, opaque and partially transparent
+        # areas
+        base = self.image.bandjoin(255)
+        alpha = pyvips.Image.black(150, 100)
+        alpha = alpha.draw_rect(255, 50, 0, 50, 100, fill=True)
+        alpha = alpha.draw_rect(128, 100, 0, 50, 100, fill=True)
+        overlay = (pyvips.Image.black(150, 100, bands=3) + [10, 20, 30]) \
+            .bandjoin(alpha).cast("uchar")
+        comp = base.composite(overlay, "over", x=30, y=20)
+
+        # transparent areas and areas outside the overlay are just the base
+        assert_almost_equal_objects(comp(40, 30), base(40, 30))
+        assert_almost_equal_objects(comp(200, 200), base(200, 200))
+
+        # opaque areas are just the overlay
+        assert_almost_equal_objects(comp(100, 30), [10, 20, 30, 255])
+
+        # and partial areas are blended
+        b = base(150, 30)
+        predict = [(x * 128 + y * 127) / 255 for x, y in zip([10, 20, 30], b)]
+        assert_almost_equal_objects(comp(150, 30)[:3], predict, threshold=1)
+
+        reference = base.cast("float").composite(overlay.cast("float"),
+                                                 "over", x=30, y=20)
+        assert (comp - reference).abs().max() <= 1
+
+        # a second pass skips the parts found to be transparent, and must
+        # give the same result
+        assert (comp - reference).abs().max() <= 1
+
+    def test_composite_zero_alpha(self):
+        # a base with zero alpha but non-zero colour ... where the overlay
+        # is transparent, the result must match blending, which zeros the
+        # colour
+        base = (pyvips.Image.black(200, 100, bands=3) + [10, 20, 30]) \
+            .bandjoin(0).cast("uchar")
+        alpha = pyvips.Image.black(100, 100)
+        alpha = alpha.draw_rect(255, 0, 0, 50, 100, fill=True)
+        overlay = (pyvips.Image.black(100, 100, bands=3) + [50, 60, 70]) \
+            .bandjoin(alpha).cast("uchar")
+        comp = base.composite(overlay, "over", x=50)
+
+        assert_almost_equal_objects(comp(60, 50), [50, 60, 70, 255])
+        assert_almost_equal_objects(comp(120, 50), [0, 0, 0, 0])
+
+        reference = base.cast("float").composite(overlay.cast("float"),
+                                                 "over", x=50)
+        assert (comp[:3] - reference[:3]).crop(50, 0, 100, 100) \
+            .abs().max() == 0
+
+    def test_composite_dense(self):
+        # a large overlay which is partially transparent everywhere, so we
+        # give up classifying it part way through
+        base = (pyvips.Image.black(1200, 1000, bands=3) + 40).bandjoin(255)
+        alpha = pyvips.Image.xyz(1100, 900)[0] % 200 + 20
+        overlay = (pyvips.Image.black(1100, 900, bands=3) + [200, 100, 50]) \
+            .bandjoin(alpha).cast("uchar")
+        comp = base.composite(overlay, "over", x=50, y=40)
+
+        reference = base.cast("float").composite(overlay.cast("float"),
+                                                 "over", x=50, y=40)
+        assert (comp - reference).abs().max() <= 1
+
+    def test_composite_many(self):
+        # lots of small overlapping overlays, stacking order must be kept
+        base = (pyvips.Image.black(300, 200, bands=3) + 40).bandjoin(255)
+        overlays = []
+        xs = []
+        ys = []
+        for i in range(400):
+            colour = [(i * 7) % 256, (i * 13) % 256, (i * 29) % 256, 200]
+            overlays.append(pyvips.Image.black(24, 24, bands=4) + colour)
+            xs.append((i * 37) % 290 - 10)
+            ys.append((i * 53) % 190 - 10)
+        overlays = [x.cast("uchar") for x in overlays]
+
+        comp = base.cast("uchar").composite(overlays, "over", x=xs, y=ys)
+
+        reference = base.cast("float")
+        for i in range(400):
+            reference = reference.composite2(overlays[i].cast("float"),
+                                             "over", x=xs[i], y=ys[i])
+        assert (comp - reference).abs().max() <= 1
+
     def test_unpremultiply(self):
         for fmt in unsigned_formats + [pyvips.BandFormat.SHORT,
                                        pyvips.BandFormat.INT] + float_formats:
@@ -686,6 +824,48 @@ class TestConversion:
         assert im.height == max_height
         assert im.bands == max_bands
 
+    def test_arrayjoin_many(self):
+        # enough tiles that requests fall inside a single input, and a
+        # short final row
+        tiles = [pyvips.Image.black(200, 150) + i for i in range(23)]
+        im = pyvips.Image.arrayjoin(tiles, across=5, shim=7,
+                                    background=255)
+        assert im.width == 5 * 200 + 4 * 7
+        assert im.height == 5 * 150 + 4 * 7
+
+        for i in range(23):
+            x = (i % 5) * 207
+            y = (i // 5) * 157
+            assert im(x + 100, y + 75) == [i]
+            assert im(x + 199, y + 149) == [i]
+        assert im(203, 10) == [255]
+        assert im(4 * 207 + 100, 4 * 157 + 75) == [255]
+
+        # copy to memory exercises whole-tile requests, compare to an
+        # insert-built version
+        ref = pyvips.Image.black(im.width, im.height) + 255
+        for i in range(23):
+            ref = ref.insert(tiles[i], (i % 5) * 207, (i // 5) * 157)
+        assert (im.copy_memory() - ref).abs().max() == 0
+
+    def test_arrayjoin_sequential(self):
+        # a short and a tall image in one row: the tall one must not be
+        # minimised while we're still reading it
+        short = pyvips.Image.black(100, 50) + 40
+        tall = pyvips.Image.xyz(100, 3000)[1].cast("uchar")
+        filenames = []
+        for im in [short, tall]:
+            filename = temp_filename(self.tempdir, '.png')
+            im.write_to_file(filename)
+            filenames.append(filename)
+
+        ref = pyvips.Image.arrayjoin([short, tall])
+        seq = pyvips.Image.arrayjoin([pyvips.Image.new_from_file(x,
+                                      access="sequential")
+                                      for x in filenames])
+
+        assert (seq.copy_memory() - ref).abs().max() == 0
+
     def test_msb(self):
         for fmt in unsigned_formats:
             mx = max_value[fmt]
@@ -855,6 +1035,31 @@ class TestConversion:
             after = im(20, 20)
             assert_almost_equal_objects(before, after)
 
+    def test_tilecache(self):
+        # small tiles so the cache fills and is split into several shards
+        test = self.colour.rot90()
+        for max_tiles in [-1, 4, 200]:
+            for threaded in [False, True]:
+                im = test.tilecache(tile_width=16, tile_height=16,
+                                    max_tiles=max_tiles,
+                                    threaded=threaded)
+                assert (im - test).abs().max() == 0
+                assert im(10, 70) == test(10, 70)
+
+        im = test.linecache(tile_height=8, threaded=True)
+        assert (im - test).abs().max() == 0
+
+        # a tiny cache with a spill file, read twice so tiles come back
+        # from disk ... a small spill file recycles its slots
+        for max_spill in [1000000, 10000]:
+            for threaded in [False, True]:
+                im = test.tilecache(tile_width=16, tile_height=16,
+                                    max_tiles=4, max_spill=max_spill,
+                                    threaded=threaded, persistent=True)
+                for i in range(2):
+                    assert (im - test).abs().max() == 0
+                    assert im(10, 70) == test(10, 70)
+
     def test_zoom(self):
         for fmt in all_formats:
             test = self.colour.cast(fmt)
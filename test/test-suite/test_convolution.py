@@ -100,6 +100,42 @@ class TestConvolution:
                 print("result = %s, true = %s" % (result, true))
                 assert_less_threshold(result, true, 5)
 
+    # uchar images take the vector path in conva, if there is one. ushort
+    # images always take the C path and use the same integer arithmetic,
+    # so the results should match exactly
+    def test_conva_vector(self):
+        # an odd width, so there are partial vectors
+        noise = pyvips.Image.gaussnoise(137, 91, mean=128, sigma=60)
+        im = noise.bandjoin([noise.rot180(), noise.fliphor()]).cast("uchar")
+        # and a mask large enough for several lines in each direction
+        big_blur = pyvips.Image.gaussmat(5, 0.1, precision="integer")
+        for msk in self.all_masks + [big_blur]:
+            for image in [im, im[1]]:
+                a = image.conv(msk, precision=pyvips.Precision.APPROXIMATE)
+                b = image.cast("ushort") \
+                    .conv(msk, precision=pyvips.Precision.APPROXIMATE) \
+                    .cast("uchar")
+
+                assert a.format == "uchar"
+                assert (a - b).abs().max() == 0
+
+    def test_convasep_vector(self):
+        noise = pyvips.Image.gaussnoise(137, 91, mean=128, sigma=60)
+        im = noise.bandjoin([noise.rot180(), noise.fliphor()]).cast("uchar")
+        for sigma in [0.5, 2, 7]:
+            gmask_sep = pyvips.Image.gaussmat(sigma, 0.1, separable=True,
+                                              precision="integer")
+            for image in [im, im[1]]:
+                a = image.convsep(gmask_sep,
+                                  precision=pyvips.Precision.APPROXIMATE)
+                b = image.cast("ushort") \
+                    .convsep(gmask_sep,
+                             precision=pyvips.Precision.APPROXIMATE) \
+                    .cast("uchar")
+
+                assert a.format == "uchar"
+                assert (a - b).abs().max() == 0
+
     def test_compass(self):
         for im in self.all_images:
             for msk in self.all_masks:
@@ -150,6 +186,42 @@ class TestConvolution:
 
                 assert_almost_equal_objects(a_point, b_point, threshold=0.1)
 
+    @skip_if_no("convfft")
+    def test_convfft(self):
+        for im in self.all_images:
+            gmask = pyvips.Image.gaussmat(5, 0.01,
+                                          precision=pyvips.Precision.FLOAT)
+
+            a = im.convf(gmask)
+            b = im.convfft(gmask)
+
+            for x, y in [(25, 50), (50, 50), (0, 0), (99, 99)]:
+                assert_almost_equal_objects(a(x, y), b(x, y), threshold=0.01)
+
+    # conv with a large float mask should switch to convfft and give the
+    # same result as the direct path
+    @skip_if_no("convfft")
+    def test_conv_fft_dispatch(self):
+        # 39 x 39, over the size threshold, and no zero elements
+        gmask = pyvips.Image.gaussmat(5, 0.001,
+                                      precision=pyvips.Precision.FLOAT)
+        assert gmask.width * gmask.height >= 1024
+
+        # with convfft blocked, conv must fail if it takes the FFT path ...
+        # do this first, so there's no cached result
+        pyvips.operation_block_set("convfft", True)
+        try:
+            with pytest.raises(pyvips.Error):
+                self.mono.conv(gmask, precision=pyvips.Precision.FLOAT)
+        finally:
+            pyvips.operation_block_set("convfft", False)
+
+        for im in self.all_images:
+            a = im.conv(gmask, precision=pyvips.Precision.FLOAT)
+            b = im.convf(gmask)
+
+            assert (a - b).abs().max() < 0.01
+
     def test_fastcor(self):
         for im in self.all_images:
             for fmt in noncomplex_formats:
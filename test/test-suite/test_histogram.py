@@ -97,6 +97,44 @@ class TestHistogram:
 
         assert pytest.approx(ent, 0.01) == 6.67
 
+    # compare against a direct implementation of the windowed cumulative
+    # histogram, including the contrast-limited case
+    def test_hist_local_reference(self):
+        im = pyvips.Image.new_from_file(JPEG_FILE).crop(100, 100, 37, 29)
+        bands = im.bands
+
+        for width, height, max_slope in [(5, 7, 0), (10, 10, 0), (6, 3, 2)]:
+            out = im.hist_local(width, height, max_slope=max_slope)
+
+            expanded = im.embed(width // 2, height // 2,
+                                im.width + width - 1, im.height + height - 1,
+                                extend="mirror")
+            ew = expanded.width
+            p = expanded.write_to_memory()
+            q = out.write_to_memory()
+
+            for y in range(im.height):
+                for x in range(im.width):
+                    for b in range(bands):
+                        hist = [0] * 256
+                        for j in range(height):
+                            row = ((y + j) * ew + x) * bands + b
+                            for i in range(width):
+                                hist[p[row + i * bands]] += 1
+                        target = p[((y + height // 2) * ew +
+                                    x + width // 2) * bands + b]
+
+                        if max_slope > 0:
+                            over = sum(max(0, v - max_slope) for v in hist)
+                            total = sum(min(v, max_slope)
+                                        for v in hist[:target + 1])
+                            total += (target + 1) * over // 256
+                        else:
+                            total = sum(hist[:target + 1])
+
+                        true = 255 * total // (width * height)
+                        assert q[(y * im.width + x) * bands + b] == true
+
     def test_stdif(self):
         im = pyvips.Image.new_from_file(JPEG_FILE)
 
@@ -108,6 +146,12 @@ class TestHistogram:
         # new mean should be closer to target mean
         assert abs(im.avg() - 128) > abs(im2.avg() - 128)
 
+        # bands are independent, and windows needn't be square
+        im2 = im.stdif(11, 5)
+        im3 = pyvips.Image.bandjoin([x.stdif(11, 5) for x in im.bandsplit()])
+
+        assert (im2 - im3).abs().max() == 0
+
     def test_case(self):
         # slice into two at 128, we should get 50% of pixels in each half
         x = pyvips.Image.grey(256, 256, uchar=True)
@@ -2,6 +2,7 @@
 import pytest
 
 import pyvips
+from helpers import *
 
 
 class TestMorphology:
@@ -19,6 +20,21 @@ class TestMorphology:
         assert opts['segments'] == 3
         assert mask.max() == 2
 
+        mask, opts = im.labelregions(areas=True, bounds=True)
+        areas = opts['areas']
+        bounds = opts['bounds']
+
+        # count pixels in each region with a histogram, so we can compare
+        # integers
+        hist = mask.cast("ushort").hist_find()
+
+        assert areas.width == 3
+        assert int(areas(1, 0)[0]) + int(areas(2, 0)[0]) == 100 * 100
+        assert int(areas(1, 0)[0]) == int(hist(1, 0)[0])
+        assert int(areas(2, 0)[0]) == int(hist(2, 0)[0])
+        assert bounds.bands == 4
+        assert bounds(1, 0) == [0, 0, 100, 100]
+
     def test_erode(self):
         im = pyvips.Image.black(100, 100)
         im = im.draw_circle(255, 50, 50, 25, fill=True)
@@ -50,6 +66,34 @@ class TestMorphology:
         assert im.bands == im2.bands
         assert im2.avg() > im.avg()
 
+    def test_rank_formats(self):
+        # the hist, sort and select paths must all agree with a plain sort
+        # of the window
+        base = pyvips.Image.gaussnoise(64, 64, mean=128, sigma=60)
+        base = base.bandjoin(base.flipver()).cast("uchar").copy_memory()
+        pixels = base.write_to_memory()
+
+        for fmt in noncomplex_formats:
+            scale = 1 if fmt in ["uchar", "char"] else 251
+            offset = -128 * scale if fmt in signed_formats else 0
+            im = (base * scale + offset).cast(fmt)
+
+            for width, height, index in [(3, 3, 4), (11, 11, 60),
+                                         (11, 11, 0), (15, 5, 70),
+                                         (5, 21, 104)]:
+                result = im.rank(width, height, index)
+
+                for x, y in [(20, 20), (31, 40), (50, 11)]:
+                    for b in range(2):
+                        window = [pixels[((y + j - height // 2) * 64 +
+                                          x + i - width // 2) * 2 + b]
+                                  for j in range(height)
+                                  for i in range(width)]
+                        window.sort()
+                        true = window[index] * scale + offset
+
+                        assert result(x, y)[b] == true
+
 
 if __name__ == '__main__':
     pytest.main()
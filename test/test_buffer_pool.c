@@ -0,0 +1,136 @@
+/* Check that region pixel buffers are reused from the pool, and that idle
+ * buffers are trimmed in the background, with nothing else allocated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+/* Get a gauge from vips_metrics_write(), or -1.
+ */
+static gint64
+gauge(const char *name)
+{
+	VipsTarget *target;
+	VipsBlob *blob;
+	const void *data;
+	size_t length;
+	char *str;
+	char *line;
+	char *p;
+	gint64 value;
+
+	if (!(target = vips_target_new_to_memory()))
+		return -1;
+	if (vips_metrics_write(target) ||
+		vips_target_end(target)) {
+		g_object_unref(target);
+		return -1;
+	}
+	g_object_get(target, "blob", &blob, NULL);
+	data = vips_blob_get(blob, &length);
+	str = g_strndup(data, length);
+	vips_area_unref(VIPS_AREA(blob));
+	g_object_unref(target);
+
+	line = g_strdup_printf("\n%s ", name);
+	value = (p = strstr(str, line))
+		? g_ascii_strtoll(p + strlen(line), NULL, 10)
+		: -1;
+	g_free(line);
+	g_free(str);
+
+	return value;
+}
+
+/* Make a region and fill it. The caller unrefs it to return the pixel
+ * buffer to the pool.
+ */
+static VipsRegion *
+fill(VipsImage *image, int width, int height)
+{
+	VipsRegion *region;
+	VipsRect rect = { 0, 0, width, height };
+
+	if (!(region = vips_region_new(image)) ||
+		vips_region_prepare(region, &rect))
+		vips_error_exit(NULL);
+
+	return region;
+}
+
+int
+main(int argc, char **argv)
+{
+	VipsImage *image;
+	VipsRegion *region;
+	gint64 idle;
+	gint64 mem;
+	gint64 deadline;
+
+	/* Trim after 0.2s, not the default 2s.
+	 */
+	g_setenv("VIPS_BUFFER_POOL_IDLE", "0.2", TRUE);
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* Large enough that the buffer goes to the shared depot, not a
+	 * thread's magazine.
+	 */
+	if (vips_black(&image, 2000, 2000, NULL))
+		vips_error_exit(NULL);
+
+	region = fill(image, 2000, 2000);
+	g_object_unref(region);
+
+	/* The buffer is idle in the pool. It's still tracked memory, but
+	 * it's not reported as in use.
+	 */
+	idle = gauge("vips_buffer_pool_bytes");
+	if (idle < 2000 * 2000) {
+		printf("expected a pooled buffer, %" G_GINT64_FORMAT " idle\n",
+			idle);
+		return 1;
+	}
+	if ((gint64) vips_tracked_get_mem() < idle) {
+		printf("pooled buffer not tracked\n");
+		return 1;
+	}
+	if (gauge("vips_tracked_memory_bytes") >
+		(gint64) vips_tracked_get_mem() - 2000 * 2000) {
+		printf("idle buffers counted as in use\n");
+		return 1;
+	}
+
+	/* The same size again should take the pooled buffer.
+	 */
+	mem = vips_tracked_get_mem();
+	region = fill(image, 2000, 2000);
+	if (gauge("vips_buffer_pool_bytes") > idle - 2000 * 2000 ||
+		(gint64) vips_tracked_get_mem() > mem) {
+		printf("pooled buffer not reused\n");
+		return 1;
+	}
+	g_object_unref(region);
+
+	/* Let the buffer go idle. The pool should trim it without another
+	 * allocation to prompt it.
+	 */
+	mem = vips_tracked_get_mem();
+	deadline = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+	while ((gint64) vips_tracked_get_mem() > mem - 2000 * 2000 &&
+		g_get_monotonic_time() < deadline)
+		g_usleep(G_USEC_PER_SEC / 50);
+	if (gauge("vips_buffer_pool_bytes") >= 2000 * 2000 ||
+		(gint64) vips_tracked_get_mem() > mem - 2000 * 2000) {
+		printf("idle buffer not trimmed\n");
+		return 1;
+	}
+
+	g_object_unref(image);
+
+	return 0;
+}
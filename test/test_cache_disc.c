@@ -0,0 +1,198 @@
+/* Check the persistent cache tier: a miss is saved once computed, a partly
+ * computed result is not saved, a second run hits, and changing the input
+ * file invalidates.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+
+/* Write a flat test image.
+ */
+static void
+make_input(const char *filename, double value)
+{
+	VipsImage *t[2];
+
+	if (vips_black(&t[0], 100, 100, NULL) ||
+		vips_linear1(t[0], &t[1], 1.0, value, NULL) ||
+		vips_image_write_to_file(t[1], filename, NULL))
+		vips_error_exit(NULL);
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+}
+
+static int
+count_results(const char *dir)
+{
+	GDir *gdir;
+	const char *name;
+	int n;
+
+	if (!(gdir = g_dir_open(dir, 0, NULL)))
+		return -1;
+	n = 0;
+	while ((name = g_dir_read_name(gdir)))
+		if (g_str_has_suffix(name, ".v"))
+			n += 1;
+	g_dir_close(gdir);
+
+	return n;
+}
+
+static void
+remove_all(const char *dir)
+{
+	GDir *gdir;
+	const char *name;
+
+	if ((gdir = g_dir_open(dir, 0, NULL))) {
+		while ((name = g_dir_read_name(gdir))) {
+			char *path = g_build_filename(dir, name, NULL);
+
+			(void) g_unlink(path);
+			g_free(path);
+		}
+		g_dir_close(gdir);
+	}
+	(void) g_rmdir(dir);
+}
+
+/* Thumbnail the input, compute it, and check the result and whether it came
+ * from the cache dir.
+ */
+static int
+run(const char *filename, const char *dir,
+	double expected, gboolean expect_hit)
+{
+	VipsImage *out;
+	const char *out_filename;
+	gboolean hit;
+	double avg;
+
+	/* Make sure we don't get a hit from the memory tier.
+	 */
+	vips_cache_drop_all();
+
+	if (vips_thumbnail(filename, &out, 50, NULL))
+		vips_error_exit(NULL);
+
+	out_filename = vips_image_get_filename(out);
+	hit = out_filename &&
+		g_str_has_prefix(out_filename, dir);
+	if (hit != expect_hit) {
+		printf("expected %s, got %s\n",
+			expect_hit ? "hit" : "miss", hit ? "hit" : "miss");
+		return -1;
+	}
+
+	if (vips_avg(out, &avg, NULL))
+		vips_error_exit(NULL);
+	if (fabs(avg - expected) > 0.5) {
+		printf("expected average %g, got %g\n", expected, avg);
+		return -1;
+	}
+
+	g_object_unref(out);
+	vips_cache_drop_all();
+
+	return 0;
+}
+
+/* Compute just the top-left corner of a thumbnail.
+ */
+static int
+run_partial(const char *filename)
+{
+	VipsImage *t[2];
+	double avg;
+
+	vips_cache_drop_all();
+
+	if (vips_thumbnail(filename, &t[0], 50, NULL) ||
+		vips_crop(t[0], &t[1], 0, 0, 10, 10, NULL) ||
+		vips_avg(t[1], &avg, NULL))
+		return -1;
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+
+	vips_cache_drop_all();
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	char *dir;
+	char *src_dir;
+	char *filename;
+	int result;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (!(dir = g_dir_make_tmp("vips-cache-XXXXXX", NULL)) ||
+		!(src_dir = g_dir_make_tmp("vips-src-XXXXXX", NULL)))
+		vips_error_exit("unable to make temp dir");
+	filename = g_build_filename(src_dir, "in.v", NULL);
+
+	if (vips_cache_set_dir(dir))
+		vips_error_exit(NULL);
+
+	make_input(filename, 10);
+
+	result = 0;
+
+	/* Only part of the output was computed, so there's nothing to save.
+	 */
+	if (!result &&
+		!(result = run_partial(filename)) &&
+		count_results(dir) != 0) {
+		printf("partial result was saved\n");
+		result = -1;
+	}
+
+	/* First run misses, and saves once the output is computed.
+	 */
+	if (!result &&
+		!(result = run(filename, dir, 10, FALSE)) &&
+		count_results(dir) != 1) {
+		printf("miss was not saved\n");
+		result = -1;
+	}
+
+	/* Second run hits.
+	 */
+	if (!result)
+		result = run(filename, dir, 10, TRUE);
+
+	/* A changed file gets a new key, so we miss and save again.
+	 */
+	if (!result) {
+		make_input(filename, 20);
+
+		if (!(result = run(filename, dir, 20, FALSE)) &&
+			count_results(dir) != 2) {
+			printf("second miss was not saved\n");
+			result = -1;
+		}
+	}
+
+	vips_cache_set_dir(NULL);
+
+	remove_all(dir);
+	remove_all(src_dir);
+	g_free(filename);
+	g_free(src_dir);
+	g_free(dir);
+
+	vips_shutdown();
+
+	return result ? 1 : 0;
+}
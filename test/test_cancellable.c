@@ -0,0 +1,378 @@
+/* Check a VipsCancellable stops a slow pipeline promptly, that a deadline
+ * does too, and that an uncancelled pipeline still runs to completion. Then
+ * check that cancelling one of two pipelines sharing a tile cache doesn't
+ * spoil the cache for the other, and that jpeg save and png load stop
+ * part way through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+/* Something slow enough that it won't finish in the time we allow.
+ */
+static int
+slow_avg(double *avg)
+{
+	VipsImage *t[3];
+	int result;
+
+	if (vips_gaussnoise(&t[0], 20000, 20000, NULL))
+		return -1;
+	if (vips_gaussblur(t[0], &t[1], 20, NULL)) {
+		g_object_unref(t[0]);
+		return -1;
+	}
+	result = vips_avg(t[1], avg, NULL);
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+
+	return result;
+}
+
+static void *
+cancel_later(void *data)
+{
+	VipsCancellable *cancellable = VIPS_CANCELLABLE(data);
+
+	g_usleep(200000);
+	vips_cancellable_cancel(cancellable);
+
+	return NULL;
+}
+
+static int
+check_cancel(void)
+{
+	VipsCancellable *cancellable = vips_cancellable_new();
+	GThread *thread;
+	GTimer *timer;
+	double avg;
+	int result;
+
+	vips_cancellable_set_current(cancellable);
+	timer = g_timer_new();
+	thread = g_thread_new("cancel", cancel_later, cancellable);
+	result = slow_avg(&avg);
+	g_thread_join(thread);
+	vips_cancellable_set_current(NULL);
+
+	if (!result) {
+		printf("cancelled pipeline succeeded\n");
+		return -1;
+	}
+	if (g_timer_elapsed(timer, NULL) > 5.0) {
+		printf("cancel took %gs\n", g_timer_elapsed(timer, NULL));
+		return -1;
+	}
+	vips_error_clear();
+
+	g_timer_destroy(timer);
+	g_object_unref(cancellable);
+
+	return 0;
+}
+
+static int
+check_deadline(void)
+{
+	VipsCancellable *cancellable = vips_cancellable_new();
+	double avg;
+	int result;
+
+	vips_cancellable_set_timeout(cancellable, 0.2);
+	vips_cancellable_set_current(cancellable);
+	result = slow_avg(&avg);
+	vips_cancellable_set_current(NULL);
+
+	if (!result) {
+		printf("pipeline ran past deadline\n");
+		return -1;
+	}
+	if (!vips_cancellable_is_cancelled(cancellable)) {
+		printf("deadline not reported\n");
+		return -1;
+	}
+	vips_error_clear();
+
+	g_object_unref(cancellable);
+
+	return 0;
+}
+
+static int
+check_uncancelled(void)
+{
+	VipsCancellable *cancellable = vips_cancellable_new();
+	VipsImage *image;
+	double avg;
+	int result;
+
+	vips_cancellable_set_current(cancellable);
+	result = vips_black(&image, 1000, 1000, NULL) ||
+		vips_avg(image, &avg, NULL);
+	vips_cancellable_set_current(NULL);
+	if (result)
+		return -1;
+	g_object_unref(image);
+	g_object_unref(cancellable);
+
+	if (avg != 0.0) {
+		printf("bad average %g\n", avg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* A slow source of 255s which notices cancellation.
+ */
+static int
+slow_gen(VipsRegion *out_region, void *seq, void *a, void *b, gboolean *stop)
+{
+	VipsCancellable *cancellable = vips_cancellable_get_current();
+
+	g_usleep(20000);
+
+	if (cancellable &&
+		vips_cancellable_is_cancelled(cancellable)) {
+		vips_error("slow_gen", "%s", "cancelled");
+		return -1;
+	}
+
+	vips_region_paint(out_region, &out_region->valid, 255);
+
+	return 0;
+}
+
+typedef struct _Shared {
+	VipsImage *cached;
+	VipsCancellable *cancellable;
+	double avg;
+	int result;
+} Shared;
+
+static void *
+shared_avg(void *data)
+{
+	Shared *shared = (Shared *) data;
+
+	vips_cancellable_set_current(shared->cancellable);
+	shared->result = vips_avg(shared->cached, &shared->avg, NULL);
+	vips_cancellable_set_current(NULL);
+
+	return NULL;
+}
+
+static int
+check_shared_cache(void)
+{
+	VipsImage *slow;
+	VipsImage *cached;
+	VipsCancellable *cancellable = vips_cancellable_new();
+	Shared a = { 0 };
+	Shared b = { 0 };
+	GThread *thread_a;
+	GThread *thread_b;
+	GThread *cancel;
+	double avg;
+
+	slow = vips_image_new();
+	vips_image_init_fields(slow, 1024, 1024, 1,
+		VIPS_FORMAT_UCHAR, VIPS_CODING_NONE, VIPS_INTERPRETATION_B_W,
+		1.0, 1.0);
+	if (vips_image_pipelinev(slow, VIPS_DEMAND_STYLE_SMALLTILE, NULL) ||
+		vips_image_generate(slow, NULL, slow_gen, NULL, NULL, NULL) ||
+		vips_tilecache(slow, &cached,
+			"tile_width", 64,
+			"tile_height", 64,
+			"max_tiles", -1,
+			"threaded", TRUE,
+			NULL))
+		return -1;
+	g_object_unref(slow);
+
+	/* a is cancelled part way through, b is not. Fix the number of
+	 * threads, so the whole thing takes about 0.6s and the cancel lands in
+	 * the middle.
+	 */
+	vips_concurrency_set(4);
+	a.cached = cached;
+	a.cancellable = cancellable;
+	b.cached = cached;
+	thread_a = g_thread_new("a", shared_avg, &a);
+	thread_b = g_thread_new("b", shared_avg, &b);
+	cancel = g_thread_new("cancel", cancel_later, cancellable);
+	g_thread_join(cancel);
+	g_thread_join(thread_a);
+	g_thread_join(thread_b);
+	vips_error_clear();
+
+	if (!a.result) {
+		printf("cancelled pipeline succeeded\n");
+		return -1;
+	}
+	if (b.result ||
+		b.avg != 255.0) {
+		printf("shared pipeline got %g\n", b.avg);
+		return -1;
+	}
+
+	/* Nothing left in the cache should be blacked out either.
+	 */
+	if (vips_avg(cached, &avg, NULL))
+		return -1;
+	if (avg != 255.0) {
+		printf("shared cache holds bad tiles, average %g\n", avg);
+		return -1;
+	}
+
+	g_object_unref(cached);
+	g_object_unref(cancellable);
+
+	return 0;
+}
+
+typedef struct _Partway {
+	VipsCancellable *cancellable;
+	int percent;
+} Partway;
+
+/* Cancel once we're 10% through.
+ */
+static void
+cancel_partway(VipsImage *image, VipsProgress *progress, Partway *partway)
+{
+	partway->percent = progress->percent;
+	if (progress->percent >= 10)
+		vips_cancellable_cancel(partway->cancellable);
+}
+
+static int
+check_jpegsave(void)
+{
+	VipsImage *t[2];
+	Partway partway = { 0 };
+	void *buf;
+	size_t length;
+	int result;
+
+	if (!vips_type_find("VipsOperation", "jpegsave_buffer"))
+		return 0;
+
+	if (vips_gaussnoise(&t[0], 2000, 4000, NULL))
+		return -1;
+	if (vips_cast_uchar(t[0], &t[1], NULL)) {
+		g_object_unref(t[0]);
+		return -1;
+	}
+	g_object_unref(t[0]);
+
+	partway.cancellable = vips_cancellable_new();
+	vips_image_set_progress(t[1], TRUE);
+	g_signal_connect(t[1], "eval",
+		G_CALLBACK(cancel_partway), &partway);
+
+	vips_cancellable_set_current(partway.cancellable);
+	result = vips_jpegsave_buffer(t[1], &buf, &length, NULL);
+	vips_cancellable_set_current(NULL);
+
+	if (!result) {
+		printf("cancelled jpegsave succeeded\n");
+		return -1;
+	}
+	if (partway.percent >= 100) {
+		printf("cancelled jpegsave ran to the end\n");
+		return -1;
+	}
+	vips_error_clear();
+
+	g_object_unref(t[1]);
+	g_object_unref(partway.cancellable);
+
+	return 0;
+}
+
+static int
+check_pngload(void)
+{
+	VipsImage *t[2];
+	VipsImage *image;
+	Partway partway = { 0 };
+	void *buf;
+	size_t length;
+	double avg;
+	int result;
+
+	if (!vips_type_find("VipsOperation", "pngsave_buffer") ||
+		!vips_type_find("VipsOperation", "pngload_buffer"))
+		return 0;
+
+	if (vips_gaussnoise(&t[0], 1000, 4000, NULL))
+		return -1;
+	if (vips_cast_uchar(t[0], &t[1], NULL)) {
+		g_object_unref(t[0]);
+		return -1;
+	}
+	g_object_unref(t[0]);
+	result = vips_pngsave_buffer(t[1], &buf, &length,
+		"compression", 1,
+		NULL);
+	g_object_unref(t[1]);
+	if (result)
+		return -1;
+
+	if (!(image = vips_image_new_from_buffer(buf, length, "",
+			  "access", VIPS_ACCESS_SEQUENTIAL,
+			  NULL))) {
+		g_free(buf);
+		return -1;
+	}
+
+	partway.cancellable = vips_cancellable_new();
+	vips_image_set_progress(image, TRUE);
+	g_signal_connect(image, "eval",
+		G_CALLBACK(cancel_partway), &partway);
+
+	vips_cancellable_set_current(partway.cancellable);
+	result = vips_avg(image, &avg, NULL);
+	vips_cancellable_set_current(NULL);
+
+	if (!result) {
+		printf("cancelled pngload succeeded\n");
+		return -1;
+	}
+	if (partway.percent >= 100) {
+		printf("cancelled pngload ran to the end\n");
+		return -1;
+	}
+	vips_error_clear();
+
+	g_object_unref(image);
+	g_object_unref(partway.cancellable);
+	g_free(buf);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* The slow pipelines must not come from the operation cache.
+	 */
+	vips_cache_set_max(0);
+
+	if (check_uncancelled() ||
+		check_cancel() ||
+		check_deadline() ||
+		check_shared_cache() ||
+		check_jpegsave() ||
+		check_pngload())
+		vips_error_exit(NULL);
+
+	return 0;
+}
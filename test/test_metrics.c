@@ -0,0 +1,197 @@
+/* Run a small pipeline and check vips_metrics_write() reports it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+/* Write the metrics to a string.
+ */
+static char *
+metrics(void)
+{
+	VipsTarget *target;
+	VipsBlob *blob;
+	const void *data;
+	size_t length;
+	char *str;
+
+	if (!(target = vips_target_new_to_memory()))
+		return NULL;
+	if (vips_metrics_write(target) ||
+		vips_target_end(target)) {
+		g_object_unref(target);
+		return NULL;
+	}
+	g_object_get(target, "blob", &blob, NULL);
+	data = vips_blob_get(blob, &length);
+	str = g_strndup(data, length);
+	vips_area_unref(VIPS_AREA(blob));
+	g_object_unref(target);
+
+	return str;
+}
+
+static int
+expect(const char *str, const char *line, gboolean present)
+{
+	if ((strstr(str, line) != NULL) != present) {
+		printf("%s \"%s\"\n", present ? "missing" : "unexpected", line);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+run(void)
+{
+	VipsImage *t[2];
+	double avg;
+	int result;
+
+	if (vips_black(&t[0], 100, 100, NULL))
+		return -1;
+	if (vips_invert(t[0], &t[1], NULL)) {
+		g_object_unref(t[0]);
+		return -1;
+	}
+	result = vips_avg(t[1], &avg, NULL);
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+
+	return result;
+}
+
+/* Convolution and colour ops set out after chaining up to build, so they
+ * check we tag outputs once the whole build is done.
+ */
+static int
+run_conv(void)
+{
+	VipsImage *t[3];
+	double avg;
+	int result;
+
+	if (vips_black(&t[0], 100, 100, NULL))
+		return -1;
+	if (!(t[1] = vips_image_new_matrixv(3, 3,
+			  0.0, 0.0, 0.0,
+			  0.0, 1.0, 0.0,
+			  0.0, 0.0, 0.0))) {
+		g_object_unref(t[0]);
+		return -1;
+	}
+	if (vips_conv(t[0], &t[2], t[1],
+			"precision", VIPS_PRECISION_INTEGER,
+			NULL)) {
+		g_object_unref(t[1]);
+		g_object_unref(t[0]);
+		return -1;
+	}
+	result = vips_avg(t[2], &avg, NULL);
+	g_object_unref(t[2]);
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+
+	return result;
+}
+
+static int
+run_colour(void)
+{
+	VipsImage *t[3];
+	double avg;
+	int result;
+
+	if (vips_black(&t[0], 100, 100, "bands", 3, NULL))
+		return -1;
+	if (vips_copy(t[0], &t[1],
+			"interpretation", VIPS_INTERPRETATION_sRGB,
+			NULL)) {
+		g_object_unref(t[0]);
+		return -1;
+	}
+	if (vips_sRGB2HSV(t[1], &t[2], NULL)) {
+		g_object_unref(t[1]);
+		g_object_unref(t[0]);
+		return -1;
+	}
+	result = vips_avg(t[2], &avg, NULL);
+	g_object_unref(t[2]);
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+
+	return result;
+}
+
+int
+main(int argc, char **argv)
+{
+	char *str;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* Twice, so the second run comes from the operation cache.
+	 */
+	if (run() ||
+		run() ||
+		run_conv() ||
+		run_colour())
+		vips_error_exit(NULL);
+
+	if (!(str = metrics()))
+		vips_error_exit(NULL);
+	if (expect(str, "# TYPE vips_operation_builds_total counter", TRUE) ||
+		expect(str,
+			"vips_operation_builds_total{operation=\"invert\"} 1\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_cache_hits_total{operation=\"invert\"} 1\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_cache_misses_total{operation=\"invert\"} 1\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_pixels_total{operation=\"invert\"} 10000\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_generate_seconds_bucket"
+			"{operation=\"invert\",le=\"+Inf\"}",
+			TRUE) ||
+		expect(str,
+			"vips_operation_pixels_total{operation=\"conv\"} 10000\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_pixels_total{operation=\"convi\"} 10000\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_pixels_total{operation=\"sRGB2HSV\"} 10000\n",
+			TRUE) ||
+		expect(str,
+			"# TYPE vips_threadpool_queue_wait_seconds histogram",
+			TRUE) ||
+		expect(str, "vips_threadpool_queue_wait_seconds_count ", TRUE) ||
+		expect(str, "vips_tracked_memory_highwater_bytes ", TRUE) ||
+		expect(str, "vips_tracked_files ", TRUE))
+		vips_error_exit("bad metrics:\n%s", str);
+	g_free(str);
+
+	vips_metrics_reset();
+
+	if (!(str = metrics()))
+		vips_error_exit(NULL);
+	if (expect(str,
+			"vips_operation_builds_total{operation=\"invert\"} 0\n",
+			TRUE) ||
+		expect(str,
+			"vips_operation_pixels_total{operation=\"invert\"} 0\n",
+			TRUE))
+		vips_error_exit("bad metrics after reset:\n%s", str);
+	g_free(str);
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* Check VipsRectIndex against a linear search, and time it for grids of
+ * 10, 1000 and 10000 rects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#define N_QUERIES (100000)
+
+/* Overlapping rects of mixed sizes, some empty, some huge.
+ */
+static int
+check_random(void)
+{
+	int trial, q, i;
+
+	srand(42);
+
+	for (trial = 0; trial < 200; trial++) {
+		int n = rand() % 500;
+		VipsRect *rects = g_new(VipsRect, n + 1);
+		int *hits = g_new(int, n + 1);
+		VipsRectIndex *index;
+
+		for (i = 0; i < n; i++) {
+			rects[i].left = rand() % 2000 - 200;
+			rects[i].top = rand() % 2000 - 200;
+			rects[i].width = rand() % 10 == 0 ? 0 : rand() % 200;
+			rects[i].height = rand() % 50 == 0 ? 3000 : rand() % 200;
+		}
+
+		if (!(index = vips_rect_index_new(rects, n)))
+			return -1;
+
+		for (q = 0; q < 100; q++) {
+			VipsRect r = {
+				rand() % 2400 - 400, rand() % 2400 - 400,
+				rand() % 400, rand() % 400
+			};
+			int n_hits = vips_rect_index_query(index, &r, hits);
+			int m;
+
+			m = 0;
+			for (i = 0; i < n; i++)
+				if (vips_rect_overlapsrect(&r, &rects[i])) {
+					if (m >= n_hits ||
+						hits[m] != i) {
+						printf("rect %d missing\n", i);
+						return -1;
+					}
+					m += 1;
+				}
+
+			if (m != n_hits) {
+				printf("found %d rects, expected %d\n", n_hits, m);
+				return -1;
+			}
+		}
+
+		vips_rect_index_free(index);
+		g_free(hits);
+		g_free(rects);
+	}
+
+	return 0;
+}
+
+/* A sprite sheet: n 64 x 64 rects on a square grid, searched with 128 x 128
+ * tiles.
+ */
+static int
+bench(int n)
+{
+	int side = (int) ceil(sqrt(n));
+	VipsRect *rects = g_new(VipsRect, n);
+	int *hits = g_new(int, n);
+	VipsRectIndex *index;
+	GTimer *timer;
+	double index_time, linear_time;
+	gint64 index_hits, linear_hits;
+	int q, i;
+
+	for (i = 0; i < n; i++) {
+		rects[i].left = (i % side) * 64;
+		rects[i].top = (i / side) * 64;
+		rects[i].width = 64;
+		rects[i].height = 64;
+	}
+
+	timer = g_timer_new();
+
+	if (!(index = vips_rect_index_new(rects, n)))
+		return -1;
+	index_hits = 0;
+	for (q = 0; q < N_QUERIES; q++) {
+		VipsRect r = {
+			(q * 37) % (side * 64), (q * 91) % (side * 64), 128, 128
+		};
+
+		index_hits += vips_rect_index_query(index, &r, hits);
+	}
+	vips_rect_index_free(index);
+	index_time = g_timer_elapsed(timer, NULL);
+
+	g_timer_start(timer);
+	linear_hits = 0;
+	for (q = 0; q < N_QUERIES; q++) {
+		VipsRect r = {
+			(q * 37) % (side * 64), (q * 91) % (side * 64), 128, 128
+		};
+
+		for (i = 0; i < n; i++)
+			if (vips_rect_overlapsrect(&r, &rects[i]))
+				hits[linear_hits++ % n] = i;
+	}
+	linear_time = g_timer_elapsed(timer, NULL);
+
+	g_timer_destroy(timer);
+	g_free(hits);
+	g_free(rects);
+
+	if (index_hits != linear_hits) {
+		printf("n = %d: index found %" G_GINT64_FORMAT
+			   ", linear %" G_GINT64_FORMAT "\n",
+			n, index_hits, linear_hits);
+		return -1;
+	}
+
+	printf("n = %5d: %d queries, index %.3fs, linear %.3fs\n",
+		n, N_QUERIES, index_time, linear_time);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	if (check_random() ||
+		bench(10) ||
+		bench(1000) ||
+		bench(10000))
+		return 1;
+
+	return 0;
+}
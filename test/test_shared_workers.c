@@ -0,0 +1,183 @@
+/* Run several pipelines at once with a small set of shared workers and
+ * mixed priorities, and check they all finish with the right answer. Then
+ * check that a blocked pipeline doesn't hold on to slots it isn't using.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <vips/vips.h>
+
+#define N_THREADS (8)
+
+static void *
+run(void *data)
+{
+	int i = GPOINTER_TO_INT(data);
+
+	VipsImage *image;
+	double avg;
+
+	/* Each request is a little different, so the operation cache can't
+	 * short-circuit it.
+	 */
+	if (vips_black(&image, 2000 + i, 2000, NULL))
+		return GINT_TO_POINTER(-1);
+	vips_image_set_int(image, VIPS_META_PRIORITY, 1 + i % 3);
+	if (vips_avg(image, &avg, NULL)) {
+		g_object_unref(image);
+		return GINT_TO_POINTER(-1);
+	}
+	g_object_unref(image);
+
+	if (fabs(avg) > 0.0001) {
+		printf("thread %d: bad average %g\n", i, avg);
+		return GINT_TO_POINTER(-1);
+	}
+
+	return GINT_TO_POINTER(0);
+}
+
+/* A generate function that blocks until the gate opens.
+ */
+static GMutex gate_lock;
+static GCond gate_cond;
+static gboolean gate_open = FALSE;
+
+static int
+gate_gen(VipsRegion *out_region, void *seq, void *a, void *b, gboolean *stop)
+{
+	g_mutex_lock(&gate_lock);
+	while (!gate_open)
+		g_cond_wait(&gate_cond, &gate_lock);
+	g_mutex_unlock(&gate_lock);
+
+	vips_region_black(out_region);
+
+	return 0;
+}
+
+/* Every unit needs the same single cache tile. One worker computes it and
+ * blocks on the gate, the others wait for the tile.
+ */
+static void *
+run_blocked(void *data)
+{
+	VipsImage *gate;
+	VipsImage *cached;
+	double avg;
+
+	gate = vips_image_new();
+	vips_image_init_fields(gate, 256, 256, 1,
+		VIPS_FORMAT_UCHAR, VIPS_CODING_NONE, VIPS_INTERPRETATION_B_W,
+		1.0, 1.0);
+	if (vips_image_pipelinev(gate, VIPS_DEMAND_STYLE_ANY, NULL) ||
+		vips_image_generate(gate, NULL, gate_gen, NULL, NULL, NULL) ||
+		vips_tilecache(gate, &cached,
+			"tile_width", 256,
+			"tile_height", 256,
+			"max_tiles", 1,
+			"threaded", TRUE,
+			NULL)) {
+		g_object_unref(gate);
+		return GINT_TO_POINTER(-1);
+	}
+	g_object_unref(gate);
+
+	if (vips_avg(cached, &avg, NULL)) {
+		g_object_unref(cached);
+		return GINT_TO_POINTER(-1);
+	}
+	g_object_unref(cached);
+
+	return GINT_TO_POINTER(0);
+}
+
+/* Set when run_other() finishes.
+ */
+static gint other_done = 0;
+
+static void *
+run_other(void *data)
+{
+	void *result;
+
+	result = run(GINT_TO_POINTER(N_THREADS + 1));
+	g_atomic_int_set(&other_done, 1);
+
+	return result;
+}
+
+static int
+test_blocked(void)
+{
+	GThread *blocked;
+	GThread *other;
+	int result;
+	int i;
+
+	blocked = g_thread_new("blocked", run_blocked, NULL);
+
+	/* Give the blocked pipeline time to fill up.
+	 */
+	g_usleep(200000);
+
+	/* A second pipeline must finish while the first is stuck. If threads
+	 * waiting for the tile kept their slot, it would wait for the gate.
+	 */
+	other = g_thread_new("other", run_other, NULL);
+	for (i = 0; i < 10000 && !g_atomic_int_get(&other_done); i++)
+		g_usleep(1000);
+	result = g_atomic_int_get(&other_done) ? 0 : -1;
+	if (result)
+		printf("pipeline stuck behind a blocked pipeline\n");
+
+	g_mutex_lock(&gate_lock);
+	gate_open = TRUE;
+	g_cond_broadcast(&gate_cond);
+	g_mutex_unlock(&gate_lock);
+
+	if (g_thread_join(other) ||
+		g_thread_join(blocked))
+		result = -1;
+
+	return result;
+}
+
+int
+main(int argc, char **argv)
+{
+	GThread *threads[N_THREADS];
+	int result;
+	int i;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	vips_threadpool_set_shared_workers(2);
+
+	for (i = 0; i < N_THREADS; i++)
+		threads[i] = g_thread_new("shared", run, GINT_TO_POINTER(i));
+	result = 0;
+	for (i = 0; i < N_THREADS; i++)
+		if (g_thread_join(threads[i]))
+			result = -1;
+	if (result)
+		vips_error_exit(NULL);
+
+	/* At least two workers in the blocked pool, so one waits for the
+	 * tile the other is computing.
+	 */
+	vips_concurrency_set(4);
+	if (test_blocked())
+		vips_error_exit(NULL);
+
+	/* Turning sharing off must not strand anything.
+	 */
+	vips_threadpool_set_shared_workers(0);
+	if (run(GINT_TO_POINTER(N_THREADS)))
+		vips_error_exit(NULL);
+
+	return 0;
+}
@@ -0,0 +1,248 @@
+/* Check that sink_screen paints tiles nearest the focus first, and that
+ * with several workers a stuck render doesn't hold up the others.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+#define TILE_SIZE (64)
+
+/* Tiles painted so far, in order.
+ */
+typedef struct _Log {
+	GMutex lock;
+	int n;
+	VipsRect painted[256];
+} Log;
+
+static void
+log_notify(VipsImage *image, VipsRect *rect, void *a)
+{
+	Log *log = (Log *) a;
+
+	g_mutex_lock(&log->lock);
+	if (log->n < VIPS_NUMBER(log->painted))
+		log->painted[log->n++] = *rect;
+	g_mutex_unlock(&log->lock);
+}
+
+/* Wait up to 10s for n tiles to be painted.
+ */
+static gboolean
+log_wait(Log *log, int n)
+{
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		gboolean done;
+
+		g_mutex_lock(&log->lock);
+		done = log->n >= n;
+		g_mutex_unlock(&log->lock);
+
+		if (done)
+			return TRUE;
+
+		g_usleep(1000);
+	}
+
+	return FALSE;
+}
+
+/* Squared distance from the centre of a tile to the focus.
+ */
+static gint64
+focus_distance(VipsRect *focus, VipsRect *tile)
+{
+	int cx = tile->left + tile->width / 2;
+	int cy = tile->top + tile->height / 2;
+	gint64 dx = VIPS_MAX(0,
+		VIPS_MAX(focus->left - cx, cx - VIPS_RECT_RIGHT(focus)));
+	gint64 dy = VIPS_MAX(0,
+		VIPS_MAX(focus->top - cy, cy - VIPS_RECT_BOTTOM(focus)));
+
+	return dx * dx + dy * dy;
+}
+
+/* A generate function that blocks until the gate opens.
+ */
+static GMutex gate_lock;
+static GCond gate_cond;
+static gboolean gate_open = FALSE;
+
+static int
+gate_gen(VipsRegion *out_region, void *seq, void *a, void *b, gboolean *stop)
+{
+	g_mutex_lock(&gate_lock);
+	while (!gate_open)
+		g_cond_wait(&gate_cond, &gate_lock);
+	g_mutex_unlock(&gate_lock);
+
+	vips_region_black(out_region);
+
+	return 0;
+}
+
+static VipsImage *
+gate_new(int width, int height)
+{
+	VipsImage *image;
+
+	image = vips_image_new();
+	vips_image_init_fields(image, width, height, 1,
+		VIPS_FORMAT_UCHAR, VIPS_CODING_NONE, VIPS_INTERPRETATION_B_W,
+		1.0, 1.0);
+	if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_ANY, NULL) ||
+		vips_image_generate(image, NULL, gate_gen, NULL, NULL, NULL))
+		vips_error_exit(NULL);
+
+	return image;
+}
+
+/* Ask for all of out. This queues every tile and returns at once.
+ */
+static VipsRegion *
+request_all(VipsImage *out)
+{
+	VipsRegion *region;
+	VipsRect all = { 0, 0, out->Xsize, out->Ysize };
+
+	if (!(region = vips_region_new(out)) ||
+		vips_region_prepare(region, &all))
+		vips_error_exit(NULL);
+
+	return region;
+}
+
+static int
+test_focus(void)
+{
+	VipsImage *in;
+	VipsImage *out;
+	VipsRegion *region;
+	VipsRect focus = { 448, 448, TILE_SIZE, TILE_SIZE };
+	Log log = { 0 };
+	int i;
+
+	g_mutex_init(&log.lock);
+
+	if (vips_black(&in, 512, 512, NULL))
+		vips_error_exit(NULL);
+	out = vips_image_new();
+	if (vips_sink_screen(in, out, NULL,
+			TILE_SIZE, TILE_SIZE, -1, 0, log_notify, &log) ||
+		vips_sink_screen_set_focus(out, &focus))
+		vips_error_exit(NULL);
+
+	region = request_all(out);
+
+	if (!log_wait(&log, 64)) {
+		printf("focus: only %d tiles painted\n", log.n);
+		return 1;
+	}
+
+	/* With one thread, tiles must come out nearest the focus first.
+	 */
+	if (log.painted[0].left != focus.left ||
+		log.painted[0].top != focus.top) {
+		printf("focus: first tile painted was %d x %d\n",
+			log.painted[0].left, log.painted[0].top);
+		return 1;
+	}
+	for (i = 1; i < log.n; i++)
+		if (focus_distance(&focus, &log.painted[i]) <
+			focus_distance(&focus, &log.painted[i - 1])) {
+			printf("focus: tile %d x %d painted out of order\n",
+				log.painted[i].left, log.painted[i].top);
+			return 1;
+		}
+
+	g_object_unref(region);
+	g_object_unref(out);
+	g_object_unref(in);
+
+	return 0;
+}
+
+static int
+test_workers(void)
+{
+	VipsImage *stuck_in;
+	VipsImage *stuck_out;
+	VipsImage *in;
+	VipsImage *out;
+	VipsRegion *stuck_region;
+	VipsRegion *region;
+	Log stuck_log = { 0 };
+	Log log = { 0 };
+
+	g_mutex_init(&stuck_log.lock);
+	g_mutex_init(&log.lock);
+
+	vips_sink_screen_set_workers(2);
+
+	/* A high priority render that can't make progress until we open the
+	 * gate.
+	 */
+	stuck_in = gate_new(128, 128);
+	stuck_out = vips_image_new();
+	if (vips_sink_screen(stuck_in, stuck_out, NULL,
+			TILE_SIZE, TILE_SIZE, -1, 1, log_notify, &stuck_log))
+		vips_error_exit(NULL);
+	stuck_region = request_all(stuck_out);
+
+	/* The second worker should paint this one meanwhile.
+	 */
+	if (vips_black(&in, 256, 256, NULL))
+		vips_error_exit(NULL);
+	out = vips_image_new();
+	if (vips_sink_screen(in, out, NULL,
+			TILE_SIZE, TILE_SIZE, -1, 0, log_notify, &log))
+		vips_error_exit(NULL);
+	region = request_all(out);
+
+	if (!log_wait(&log, 16)) {
+		printf("workers: only %d tiles painted\n", log.n);
+		return 1;
+	}
+
+	g_mutex_lock(&gate_lock);
+	gate_open = TRUE;
+	g_cond_broadcast(&gate_cond);
+	g_mutex_unlock(&gate_lock);
+
+	if (!log_wait(&stuck_log, 4)) {
+		printf("workers: only %d stuck tiles painted\n", stuck_log.n);
+		return 1;
+	}
+
+	g_object_unref(region);
+	g_object_unref(out);
+	g_object_unref(in);
+	g_object_unref(stuck_region);
+	g_object_unref(stuck_out);
+	g_object_unref(stuck_in);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* One thread per render, so paint order is exact.
+	 */
+	vips_concurrency_set(1);
+
+	if (test_focus() ||
+		test_workers())
+		return 1;
+
+	vips_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/* Check that caching stats on an image many times, with invalidates in
+ * between, doesn't pile up signal handlers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+int
+main(int argc, char **argv)
+{
+	VipsImage *t[2];
+	VipsImage *image;
+	guint invalidate;
+	guint n;
+	int i;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* We want stats to run every time.
+	 */
+	vips_cache_set_max(0);
+
+	if (vips_black(&t[0], 100, 100, NULL) ||
+		!(image = vips_image_copy_memory(t[0])))
+		vips_error_exit(NULL);
+	g_object_unref(t[0]);
+
+	for (i = 0; i < 10; i++) {
+		if (vips_stats(image, &t[1], "cache", TRUE, NULL))
+			vips_error_exit(NULL);
+		g_object_unref(t[1]);
+
+		vips_image_invalidate_all(image);
+	}
+
+	invalidate = g_signal_lookup("invalidate", VIPS_TYPE_IMAGE);
+	n = g_signal_handlers_block_matched(image,
+		G_SIGNAL_MATCH_ID, invalidate, 0, NULL, NULL, NULL);
+	g_signal_handlers_unblock_matched(image,
+		G_SIGNAL_MATCH_ID, invalidate, 0, NULL, NULL, NULL);
+	if (n != 1) {
+		printf("%u invalidate handlers, expected 1\n", n);
+		return 1;
+	}
+
+	g_object_unref(image);
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+/* Check that threadpools run under a tiny memory budget, one at a time and
+ * with a single thread each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+#define N_THREADS (4)
+
+static void *
+run(void *data)
+{
+	VipsImage *image = (VipsImage *) data;
+	double avg;
+
+	if (vips_avg(image, &avg, NULL))
+		return GINT_TO_POINTER(-1);
+
+	return GINT_TO_POINTER(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	VipsImage *image;
+	GThread *threads[N_THREADS];
+	int admitted, waited, shrunk;
+	int result;
+	int i;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* No operation cache, so each thread really runs a pipeline.
+	 */
+	vips_cache_set_max(0);
+	vips_concurrency_set(4);
+	vips_threadpool_set_max_mem(1);
+
+	if (vips_gaussnoise(&image, 2000, 2000, NULL))
+		vips_error_exit(NULL);
+
+	for (i = 0; i < N_THREADS; i++)
+		threads[i] = g_thread_new("budget", run, image);
+	result = 0;
+	for (i = 0; i < N_THREADS; i++)
+		if (g_thread_join(threads[i]))
+			result = -1;
+	if (result)
+		vips_error_exit(NULL);
+
+	g_object_unref(image);
+
+	admitted = vips_threadpool_get_admitted(&waited, &shrunk);
+	printf("admitted = %d, waited = %d, shrunk = %d\n",
+		admitted, waited, shrunk);
+
+	if (admitted < N_THREADS ||
+		shrunk < N_THREADS) {
+		printf("every threadpool should have been shrunk\n");
+		return 1;
+	}
+
+	if (vips_threadpool_get_reserved_mem() != 0) {
+		printf("%zu bytes still reserved\n",
+			vips_threadpool_get_reserved_mem());
+		return 1;
+	}
+
+	return 0;
+}
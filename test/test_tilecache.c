@@ -0,0 +1,100 @@
+/* Check that a tilecache sized for two rows of tiles, as many loaders use,
+ * computes each tile only once when read in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+#define WIDTH (10000)
+#define HEIGHT (1024)
+#define TILE_SIZE (128)
+
+/* Number of tiles the source has generated.
+ */
+static int n_generated = 0;
+
+static int
+count_gen(VipsRegion *out_region, void *seq, void *a, void *b, gboolean *stop)
+{
+	g_atomic_int_inc(&n_generated);
+
+	vips_region_black(out_region);
+
+	return 0;
+}
+
+static VipsImage *
+count_new(int width, int height)
+{
+	VipsImage *image;
+
+	image = vips_image_new();
+	vips_image_init_fields(image, width, height, 1,
+		VIPS_FORMAT_UCHAR, VIPS_CODING_NONE, VIPS_INTERPRETATION_B_W,
+		1.0, 1.0);
+	if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_ANY, NULL) ||
+		vips_image_generate(image, NULL, count_gen, NULL, NULL, NULL))
+		vips_error_exit(NULL);
+
+	return image;
+}
+
+int
+main(int argc, char **argv)
+{
+	int tiles_across = VIPS_ROUND_UP(WIDTH, TILE_SIZE) / TILE_SIZE;
+	int tiles_down = VIPS_ROUND_UP(HEIGHT, TILE_SIZE) / TILE_SIZE;
+
+	VipsImage *in;
+	VipsImage *mask;
+	VipsImage *t[2];
+	double avg;
+
+	if (VIPS_INIT(argv[0]))
+		vips_error_exit(NULL);
+
+	/* One thread, so tiles are read in order.
+	 */
+	vips_concurrency_set(1);
+
+	in = count_new(WIDTH, HEIGHT);
+	if (!(mask = vips_image_new_matrixv(3, 3,
+			  1.0, 1.0, 1.0,
+			  1.0, 1.0, 1.0,
+			  1.0, 1.0, 1.0)))
+		vips_error_exit(NULL);
+
+	/* Two rows of tiles, as tiffload and pdfiumload size their caches.
+	 * Each output tile of the convolution needs input from two rows of
+	 * tiles, so the cache is exactly full.
+	 */
+	if (vips_tilecache(in, &t[0],
+			"tile_width", TILE_SIZE,
+			"tile_height", TILE_SIZE,
+			"max_tiles", 2 * (1 + WIDTH / TILE_SIZE),
+			"access", VIPS_ACCESS_SEQUENTIAL,
+			"threaded", TRUE,
+			NULL) ||
+		vips_conv(t[0], &t[1], mask,
+			"precision", VIPS_PRECISION_INTEGER,
+			NULL) ||
+		vips_avg(t[1], &avg, NULL))
+		vips_error_exit(NULL);
+
+	if (n_generated != tiles_across * tiles_down) {
+		printf("%d tiles generated, expected %d\n",
+			n_generated, tiles_across * tiles_down);
+		return 1;
+	}
+
+	g_object_unref(t[1]);
+	g_object_unref(t[0]);
+	g_object_unref(mask);
+	g_object_unref(in);
+
+	vips_shutdown();
+
+	return 0;
+}